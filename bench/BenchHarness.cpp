@@ -0,0 +1,166 @@
+#include "BenchHarness.h"
+#include "MQTTMemory.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <time.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+namespace {
+std::atomic<bool> g_counting{false};
+std::atomic<uint64_t> g_allocations{0};
+std::atomic<uint64_t> g_bytes{0};
+MQTTCore::MemoryPolicy::Stats g_regionsAtStart;
+
+inline void countAllocation(size_t size) {
+  if (g_counting.load(std::memory_order_relaxed)) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+}
+} // namespace
+
+// glibc interposers: everything the library allocates is counted,
+// including Packet buffers obtained through malloc.
+extern "C" {
+void *malloc(size_t size) {
+  countAllocation(size);
+  return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+  countAllocation(count * size);
+  return __libc_calloc(count, size);
+}
+void *realloc(void *ptr, size_t size) {
+  countAllocation(size);
+  return __libc_realloc(ptr, size);
+}
+void free(void *ptr) { __libc_free(ptr); }
+}
+
+void *operator new(size_t size) {
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return malloc(size ? size : 1);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return malloc(size ? size : 1);
+}
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+namespace NestBench {
+
+void allocTrackingStart() {
+  g_regionsAtStart = MQTTCore::MemoryPolicy::instance().stats();
+  g_allocations.store(0);
+  g_bytes.store(0);
+  g_counting.store(true);
+}
+
+AllocStats allocTrackingStop() {
+  g_counting.store(false);
+  // Region blocks come from arenas the interposers never see
+  MQTTCore::MemoryPolicy::Stats regions
+      = MQTTCore::MemoryPolicy::instance().stats();
+  return AllocStats{
+      g_allocations.load() + regions.allocations
+          - g_regionsAtStart.allocations,
+      g_bytes.load() + regions.allocatedBytes
+          - g_regionsAtStart.allocatedBytes};
+}
+
+Runner::Runner(int argc, char **argv)
+    : _minTimeNs(200000000ull), _failed(false), _aborted(false) {
+  _counters.reserve(MAX_COUNTERS);
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      _filter = argv[++i];
+    } else if (strcmp(argv[i], "--min-time-ms") == 0 && i + 1 < argc) {
+      _minTimeNs = strtoull(argv[++i], nullptr, 10) * 1000000ull;
+    }
+  }
+}
+
+bool Runner::_selected(const char *name) const {
+  return _filter.empty() || strstr(name, _filter.c_str()) != nullptr;
+}
+
+void Runner::count(const char *key, uint64_t value) {
+  for (auto &counter : _counters) {
+    if (strcmp(counter.first, key) == 0) {
+      counter.second += value;
+      return;
+    }
+  }
+  if (_counters.size() < _counters.capacity()) {
+    _counters.push_back({key, value});
+  }
+}
+
+void Runner::fail(const char *name, const char *reason) {
+  fprintf(stderr, "%s: %s\n", name, reason);
+  _failed = true;
+  _aborted = true;
+}
+
+void Runner::expectAllocationFree(const char *name) {
+  for (auto it = _results.rbegin(); it != _results.rend(); ++it) {
+    if (it->name == name) {
+      if (it->allocsPerOp > 0) {
+        fprintf(stderr, "%s: %.3f allocations per op, expected none\n",
+                name, it->allocsPerOp);
+        _failed = true;
+      }
+      return;
+    }
+  }
+  if (_selected(name)) {
+    // It failed, or never ran because of a typo in name
+    fprintf(stderr, "%s: no result, expected one without allocations\n",
+            name);
+    _failed = true;
+  }
+}
+
+uint64_t Runner::_nowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int Runner::report() const {
+  printf("{\"benchmarks\":[");
+  for (size_t i = 0; i < _results.size(); ++i) {
+    const Result &r = _results[i];
+    printf("%s\n  {\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+           "\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f",
+           i ? "," : "", r.name.c_str(),
+           static_cast<unsigned long long>(r.iterations), r.nsPerOp,
+           r.allocsPerOp, r.bytesPerOp);
+    for (const auto &counter : r.counters) {
+      printf(",\"%s_per_op\":%.3f", counter.first.c_str(), counter.second);
+    }
+    printf("}");
+  }
+  printf("\n]}\n");
+  return _failed ? 1 : 0;
+}
+
+} // namespace NestBench
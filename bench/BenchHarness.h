@@ -0,0 +1,117 @@
+#ifndef NEST_BENCH_HARNESS_H_
+#define NEST_BENCH_HARNESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace NestBench {
+
+// Allocation counters fed by the malloc/operator new interposers in
+// BenchHarness.cpp, plus what the client placed in its memory regions
+// through MQTTCore::MemoryPolicy. Counting is only active between start()
+// and stop().
+struct AllocStats {
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+void allocTrackingStart();
+AllocStats allocTrackingStop();
+
+struct Result {
+  std::string name;
+  uint64_t iterations;
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp;
+  // Benchmark-specific totals reported per op, e.g. syscalls
+  std::vector<std::pair<std::string, double>> counters;
+};
+
+// Runs fn(iterations) with a growing iteration count until one batch takes
+// at least minTimeMs, then records the final batch. A batch that calls
+// fail() ends the run without a result.
+class Runner {
+public:
+  Runner(int argc, char **argv);
+
+  template <typename Fn> void run(const char *name, Fn fn) {
+    if (!_selected(name)) {
+      return;
+    }
+    uint64_t iterations = 1;
+    _aborted = false;
+    for (;;) {
+      _counters.clear();
+      allocTrackingStart();
+      uint64_t start = _nowNs();
+      fn(iterations);
+      uint64_t elapsed = _nowNs() - start;
+      AllocStats stats = allocTrackingStop();
+      if (_aborted) {
+        return;
+      }
+      if (elapsed >= _minTimeNs || iterations >= (1ull << 30)) {
+        _results.push_back({name, iterations,
+                            static_cast<double>(elapsed) / iterations,
+                            static_cast<double>(stats.allocations)
+                                / iterations,
+                            static_cast<double>(stats.bytes) / iterations,
+                            {}});
+        for (const auto &counter : _counters) {
+          _results.back().counters.push_back(
+              {counter.first,
+               static_cast<double>(counter.second) / iterations});
+        }
+        return;
+      }
+      uint64_t next = elapsed ? iterations * _minTimeNs / elapsed : 0;
+      iterations = next > iterations * 10 ? iterations * 10
+                   : next > iterations    ? next + next / 5
+                                          : iterations * 2;
+    }
+  }
+
+  // Adds value to a named total for the batch in progress; call it from
+  // inside fn, it is reported divided by the iteration count. key must
+  // outlive the run (a literal) so counting stays allocation free.
+  void count(const char *key, uint64_t value);
+
+  // Reports why name could not be measured and fails the run. Called from
+  // inside fn, it also ends that benchmark without a result.
+  void fail(const char *name, const char *reason);
+
+  // Fails the run unless the benchmark called name made no allocation in
+  // its measured batch; also when it was selected but has no result.
+  void expectAllocationFree(const char *name);
+
+  const std::vector<Result> &results() const { return _results; }
+  // Writes {"benchmarks":[...]} to stdout; returns the process exit code,
+  // 1 when an expectation failed.
+  int report() const;
+
+private:
+  static constexpr size_t MAX_COUNTERS = 8;
+
+  bool _selected(const char *name) const;
+  static uint64_t _nowNs();
+
+  std::string _filter;
+  uint64_t _minTimeNs;
+  std::vector<Result> _results;
+  std::vector<std::pair<const char *, uint64_t>> _counters;
+  bool _failed;
+  bool _aborted;
+};
+
+// Keeps the optimiser from discarding benchmarked work.
+template <typename T> inline void doNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} // namespace NestBench
+
+#endif // NEST_BENCH_HARNESS_H_
@@ -0,0 +1,18 @@
+#ifndef NEST_BENCH_SUITES_H_
+#define NEST_BENCH_SUITES_H_
+
+#include "BenchHarness.h"
+
+// Suites that live outside bench_main.cpp.
+namespace NestBench {
+
+void benchTransport(Runner &runner);
+void benchEndToEnd(Runner &runner);
+void benchDispatch(Runner &runner);
+void benchShape(Runner &runner);
+void benchStore(Runner &runner);
+void benchSession(Runner &runner);
+
+} // namespace NestBench
+
+#endif // NEST_BENCH_SUITES_H_
@@ -0,0 +1,317 @@
+#include "FakeBroker.h"
+#include "MQTTPlatform.h"
+#include "MQTTUtility.h"
+#include <string.h>
+
+namespace NestBench {
+
+namespace {
+
+enum : uint8_t {
+  CONNECT = 1,
+  CONNACK = 2,
+  PUBLISH = 3,
+  PUBACK = 4,
+  PUBREC = 5,
+  PUBREL = 6,
+  PUBCOMP = 7,
+  SUBSCRIBE = 8,
+  SUBACK = 9,
+  UNSUBSCRIBE = 10,
+  UNSUBACK = 11,
+  PINGREQ = 12,
+  PINGRESP = 13,
+  DISCONNECT = 14
+};
+
+} // namespace
+
+FakeBroker::FakeBroker(MQTTTransport::Transport &transport)
+    : FakeBroker(transport, Options()) {}
+
+FakeBroker::FakeBroker(MQTTTransport::Transport &transport,
+                       const Options &options)
+    : _transport(transport), _options(options), _stats{}, _now(0),
+      _nextPacketId(1), _refused(false), _outStart(0),
+      _pending(options.maxPendingAcks ? options.maxPendingAcks : 1),
+      _pendingHead(0), _pendingCount(0) {
+  _in.reserve(4096);
+  _out.reserve(4096);
+  _topic.reserve(128);
+}
+
+void FakeBroker::loop() { loop(MQTTPlatform::micros()); }
+
+void FakeBroker::loop(uint32_t nowUs) {
+  _now = nowUs;
+  if (!_transport.connected()) {
+    _closeSession();
+    return;
+  }
+
+  uint8_t buf[512];
+  bool closed = false;
+  for (;;) {
+    int n = _transport.read(buf, sizeof(buf));
+    if (n < 0) {
+      // Whatever arrived before the close, e.g. DISCONNECT, is still handled
+      closed = true;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    _in.insert(_in.end(), buf, buf + n);
+    _stats.bytesIn += n;
+  }
+
+  size_t offset = 0;
+  while (_in.size() - offset >= 2) {
+    uint32_t length = 0;
+    int used = MQTTUtility::decodeRemainingLength(
+        _in.data() + offset + 1, _in.size() - offset - 1, length);
+    if (used < 0) {
+      ++_stats.malformed;
+      _transport.stop();
+      _closeSession();
+      return;
+    }
+    size_t frame = 1 + used + length;
+    if (used == 0 || _in.size() - offset < frame) {
+      break;
+    }
+    _handle(_in[offset], _in.data() + offset + 1 + used, length);
+    offset += frame;
+    if (!_transport.connected()) {
+      _closeSession();
+      return;
+    }
+  }
+  _in.erase(_in.begin(), _in.begin() + offset);
+  if (closed) {
+    _closeSession();
+    return;
+  }
+
+  while (_pendingCount > 0) {
+    Response &response = _pending[_pendingHead];
+    if (static_cast<int32_t>(_now - response.dueUs) < 0) {
+      break;
+    }
+    _send(response.bytes, response.length);
+    _pendingHead = (_pendingHead + 1) % _pending.size();
+    --_pendingCount;
+  }
+  _flush();
+}
+
+void FakeBroker::_handle(uint8_t header, const uint8_t *body,
+                         uint32_t length) {
+  size_t position = 0;
+  if (_refused) {
+    ++_stats.discarded;
+    return;
+  }
+  switch (header >> 4) {
+    case CONNECT: {
+      ++_stats.connects;
+      _subscriptions.clear();
+      _refused = _options.connackCode != 0 || !_options.answerConnect;
+      if (_options.answerConnect) {
+        const uint8_t connack[] = {CONNACK << 4, 2, 0, _options.connackCode};
+        _queue(connack, sizeof(connack));
+      }
+      break;
+    }
+    case PUBLISH:
+      _handlePublish(header, body, length);
+      break;
+    case PUBREL:
+      if (length >= 2) {
+        ++_stats.pubrels;
+        _queueAck(PUBCOMP << 4, MQTTUtility::readTwoBytes(body, position));
+      }
+      break;
+    case PUBREC:
+      // Second leg of a QoS 2 delivery to the client
+      if (length >= 2) {
+        _queueAck(PUBREL << 4 | 0x02,
+                  MQTTUtility::readTwoBytes(body, position));
+      }
+      break;
+    case PUBACK:
+    case PUBCOMP:
+      break;
+    case SUBSCRIBE:
+      _handleSubscribe(body, length, true);
+      break;
+    case UNSUBSCRIBE:
+      _handleSubscribe(body, length, false);
+      break;
+    case PINGREQ: {
+      ++_stats.pings;
+      const uint8_t pingresp[] = {PINGRESP << 4, 0};
+      _queue(pingresp, sizeof(pingresp));
+      break;
+    }
+    case DISCONNECT:
+      ++_stats.disconnects;
+      _flush();
+      _transport.stop();
+      break;
+    default:
+      ++_stats.malformed;
+      break;
+  }
+}
+
+void FakeBroker::_handlePublish(uint8_t header, const uint8_t *body,
+                                uint32_t length) {
+  uint8_t qos = (header >> 1) & 0x03;
+  size_t position = 0;
+  if (qos > 2 || length < 2) {
+    ++_stats.malformed;
+    return;
+  }
+  uint16_t topicLength = MQTTUtility::readTwoBytes(body, position);
+  size_t headerLength = 2 + topicLength + (qos ? 2 : 0);
+  if (headerLength > length) {
+    ++_stats.malformed;
+    return;
+  }
+  _topic.assign(reinterpret_cast<const char *>(body + 2), topicLength);
+  position += topicLength;
+  uint16_t packetId = qos ? MQTTUtility::readTwoBytes(body, position) : 0;
+  ++_stats.publishes[qos];
+
+  if (qos == 1) {
+    _queueAck(PUBACK << 4, packetId);
+  } else if (qos == 2) {
+    _queueAck(PUBREC << 4, packetId);
+  }
+
+  for (const auto &subscription : _subscriptions) {
+    if (!MQTTUtility::topicMatches(subscription.first.c_str(),
+                                   _topic.c_str())) {
+      continue;
+    }
+    uint8_t delivered = qos < subscription.second ? qos : subscription.second;
+    uint32_t remaining = length - headerLength + 2 + topicLength
+                         + (delivered ? 2 : 0);
+    uint8_t fixed[5] = {static_cast<uint8_t>(PUBLISH << 4 | delivered << 1)};
+    uint8_t used = MQTTUtility::encodeRemainingLength(remaining, fixed + 1);
+    _send(fixed, 1 + used);
+    _send(body, 2 + topicLength);
+    if (delivered) {
+      uint8_t id[2] = {static_cast<uint8_t>(_nextPacketId >> 8),
+                       static_cast<uint8_t>(_nextPacketId & 0xFF)};
+      _send(id, sizeof(id));
+      _nextPacketId = _nextPacketId == 0xFFFF ? 1 : _nextPacketId + 1;
+    }
+    _send(body + headerLength, length - headerLength);
+    ++_stats.delivered;
+    break; // one delivery per client, however many filters match
+  }
+}
+
+void FakeBroker::_handleSubscribe(const uint8_t *body, uint32_t length,
+                                  bool subscribe) {
+  size_t position = 0;
+  if (length < 2) {
+    ++_stats.malformed;
+    return;
+  }
+  uint16_t packetId = MQTTUtility::readTwoBytes(body, position);
+  uint8_t response[MAX_RESPONSE] = {
+      static_cast<uint8_t>((subscribe ? SUBACK : UNSUBACK) << 4), 2,
+      static_cast<uint8_t>(packetId >> 8),
+      static_cast<uint8_t>(packetId & 0xFF)};
+  size_t size = 4;
+  while (position + 2 <= length) {
+    uint16_t filterLength = MQTTUtility::readTwoBytes(body, position);
+    if (position + filterLength + (subscribe ? 1 : 0) > length) {
+      ++_stats.malformed;
+      return;
+    }
+    std::string filter(reinterpret_cast<const char *>(body + position),
+                       filterLength);
+    position += filterLength;
+    for (auto it = _subscriptions.begin(); it != _subscriptions.end(); ++it) {
+      if (it->first == filter) {
+        _subscriptions.erase(it);
+        break;
+      }
+    }
+    if (subscribe) {
+      uint8_t qos = body[position++] & 0x03;
+      qos = qos > 2 ? 2 : qos;
+      _subscriptions.push_back({filter, qos});
+      if (size < MAX_RESPONSE) {
+        response[size++] = qos;
+      }
+    }
+  }
+  if (subscribe) {
+    ++_stats.subscribes;
+    response[1] = static_cast<uint8_t>(size - 2);
+  } else {
+    ++_stats.unsubscribes;
+  }
+  _queue(response, size);
+}
+
+void FakeBroker::_queueAck(uint8_t type, uint16_t packetId) {
+  const uint8_t ack[] = {type, 2, static_cast<uint8_t>(packetId >> 8),
+                         static_cast<uint8_t>(packetId & 0xFF)};
+  _queue(ack, sizeof(ack));
+}
+
+void FakeBroker::_queue(const uint8_t *bytes, size_t length) {
+  if (_options.ackDelayUs == 0 && _pendingCount == 0) {
+    _send(bytes, length);
+    return;
+  }
+  if (_pendingCount == _pending.size()) {
+    // Out of slots: the oldest response goes out early
+    Response &oldest = _pending[_pendingHead];
+    _send(oldest.bytes, oldest.length);
+    _pendingHead = (_pendingHead + 1) % _pending.size();
+    --_pendingCount;
+  }
+  Response &response
+      = _pending[(_pendingHead + _pendingCount) % _pending.size()];
+  response.dueUs = _now + _options.ackDelayUs;
+  response.length = static_cast<uint8_t>(length);
+  memcpy(response.bytes, bytes, length);
+  ++_pendingCount;
+}
+
+void FakeBroker::_send(const uint8_t *bytes, size_t length) {
+  _out.insert(_out.end(), bytes, bytes + length);
+}
+
+void FakeBroker::_flush() {
+  while (_outStart < _out.size()) {
+    size_t written
+        = _transport.write(_out.data() + _outStart, _out.size() - _outStart);
+    if (written == 0) {
+      break;
+    }
+    _outStart += written;
+  }
+  if (_outStart == _out.size()) {
+    _out.clear();
+    _outStart = 0;
+  }
+}
+
+void FakeBroker::_closeSession() {
+  _refused = false;
+  _in.clear();
+  _out.clear();
+  _outStart = 0;
+  _pendingHead = 0;
+  _pendingCount = 0;
+}
+
+} // namespace NestBench
@@ -0,0 +1,97 @@
+#ifndef NEST_BENCH_FAKE_BROKER_H_
+#define NEST_BENCH_FAKE_BROKER_H_
+
+#include "MQTTTransport.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace NestBench {
+
+// Minimal MQTT 3.1.1 broker for a single client, driven by loop() from the
+// benchmark thread. It answers CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH at
+// QoS 0/1/2 and PINGREQ, routes publishes back to the client when they
+// match one of its subscriptions, and holds every response for ackDelayUs
+// before sending it. After refusing a CONNECT it reads nothing more on
+// that connection, as MQTT 3.1.1 requires. Steady-state traffic does not
+// allocate, so client allocation counts stay meaningful.
+class FakeBroker {
+public:
+  struct Options {
+    uint32_t ackDelayUs = 0;
+    uint8_t connackCode = 0; // 0 accepts, 1..5 refuse
+    // false hangs after the CONNECT: no CONNACK, nothing read after it
+    bool answerConnect = true;
+    size_t maxPendingAcks = 1024;
+  };
+
+  struct Stats {
+    uint32_t connects;
+    uint32_t publishes[3]; // received from the client, by QoS
+    uint32_t delivered;    // publishes routed back to the client
+    uint32_t pubrels;
+    uint32_t subscribes;
+    uint32_t unsubscribes;
+    uint32_t pings;
+    uint32_t disconnects;
+    uint32_t malformed;
+    uint32_t discarded; // packets behind a refused CONNECT
+    uint64_t bytesIn;
+  };
+
+  explicit FakeBroker(MQTTTransport::Transport &transport);
+  FakeBroker(MQTTTransport::Transport &transport, const Options &options);
+
+  // Reads and answers everything available and sends responses that are
+  // due at nowUs.
+  void loop(uint32_t nowUs);
+  void loop();
+
+  // For the next CONNECT; 0 accepts.
+  void setConnackCode(uint8_t code) { _options.connackCode = code; }
+
+  const Stats &stats() const { return _stats; }
+  void resetStats() { _stats = Stats{}; }
+  // Responses still held back by the ack delay.
+  size_t pendingAcks() const { return _pendingCount; }
+
+private:
+  static constexpr size_t MAX_RESPONSE = 16;
+
+  struct Response {
+    uint32_t dueUs;
+    uint8_t length;
+    uint8_t bytes[MAX_RESPONSE];
+  };
+
+  void _handle(uint8_t header, const uint8_t *body, uint32_t length);
+  void _handlePublish(uint8_t header, const uint8_t *body, uint32_t length);
+  void _handleSubscribe(const uint8_t *body, uint32_t length, bool subscribe);
+  void _queue(const uint8_t *bytes, size_t length);
+  void _queueAck(uint8_t type, uint16_t packetId);
+  void _send(const uint8_t *bytes, size_t length);
+  void _flush();
+  void _closeSession();
+
+  MQTTTransport::Transport &_transport;
+  Options _options;
+  Stats _stats;
+  uint32_t _now;
+  uint16_t _nextPacketId;
+  bool _refused; // this connection's CONNECT was refused
+
+  std::vector<uint8_t> _in;
+  std::vector<uint8_t> _out;
+  size_t _outStart;
+  std::vector<Response> _pending; // ring, ordered by due time
+  size_t _pendingHead;
+  size_t _pendingCount;
+  std::vector<std::pair<std::string, uint8_t>> _subscriptions;
+  std::string _topic; // scratch, keeps its capacity between publishes
+};
+
+} // namespace NestBench
+
+#endif // NEST_BENCH_FAKE_BROKER_H_
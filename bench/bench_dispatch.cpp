@@ -0,0 +1,76 @@
+// Dispatcher scaling: CPU-heavy onMessage() handlers spread over 1..N
+// workers. 64 topics keep every worker busy while per-topic order holds;
+// ns_per_op is wall time per delivered message, so it should fall with
+// the worker count until the host runs out of cores.
+
+#include "BenchSuites.h"
+#include "MQTTDispatcher.h"
+
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using MQTTCore::Dispatcher;
+using MQTTCore::InboundMessage;
+
+namespace NestBench {
+
+namespace {
+
+constexpr size_t TOPICS = 64;
+
+// About 10 us of arithmetic, standing in for parsing or crypto.
+void heavyHandler(const InboundMessage &message, void *) {
+  uint32_t hash = 2166136261u;
+  for (int round = 0; round < 400; ++round) {
+    for (char c : message.payload) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+  }
+  doNotOptimize(hash);
+}
+
+void benchWorkers(Runner &runner, unsigned workers) {
+  char name[64];
+  snprintf(name, sizeof(name), "dispatch/cpu_handler_64_topics_workers%u",
+           workers);
+  MQTTClientDetails::DispatchSettings settings{};
+  settings.enabled = true;
+  settings.queue_depth = 256;
+  settings.workers = static_cast<uint8_t>(workers);
+  Dispatcher dispatcher(settings, &heavyHandler, nullptr);
+  if (!dispatcher.start()) {
+    runner.fail(name, "workers did not start");
+    return;
+  }
+
+  std::vector<std::string> topics;
+  for (size_t i = 0; i < TOPICS; ++i) {
+    topics.push_back("gateway/node" + std::to_string(i) + "/state");
+  }
+  const std::string payload(64, 'x');
+  runner.run(name, [&](uint64_t n) {
+    uint32_t stolen = dispatcher.stats().stolen;
+    for (uint64_t i = 0; i < n; ++i) {
+      InboundMessage message{topics[i % TOPICS], payload, {false, 1, false}};
+      dispatcher.post(message);
+    }
+    dispatcher.flush(60000);
+    runner.count("stolen", dispatcher.stats().stolen - stolen);
+  });
+}
+
+} // namespace
+
+void benchDispatch(Runner &runner) {
+  unsigned cores = std::thread::hardware_concurrency();
+  for (unsigned workers : {1u, 2u, 4u}) {
+    benchWorkers(runner, workers);
+  }
+  if (cores > 4) {
+    benchWorkers(runner, cores);
+  }
+}
+
+} // namespace NestBench
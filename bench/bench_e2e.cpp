@@ -0,0 +1,777 @@
+// Full pipeline: MqttClient over a LoopbackTransport pair against the
+// in-process FakeBroker. Sequential runs give publish->ack latency, windowed
+// runs give throughput with several messages in flight. The sim/ runs put
+// an ImpairedTransport in between and report simulated link time.
+
+#include "BenchSuites.h"
+#include "FakeBroker.h"
+#include "MQTTClient.h"
+#include "MQTTImpairedTransport.h"
+#include "MQTTLoopbackTransport.h"
+
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using MQTTTransport::ImpairedTransport;
+using MQTTTransport::Impairment;
+using MQTTTransport::LoopbackTransport;
+
+namespace NestBench {
+
+namespace {
+
+const uint8_t PAYLOAD[64] = {0x42};
+const char TOPIC[] = "sensors/room1/temp";
+
+MQTTClientDetails::MqttClientCfg sessionConfig() {
+  MQTTClientDetails::MqttClientCfg cfg{};
+  cfg.connections_settings.host = "loopback";
+  cfg.connections_settings._port = 1883;
+  cfg.connections_settings._cleanSession = true;
+  cfg.connections_settings._keepAlive = 600000;
+  cfg.path = "nestmqtt-bench";
+  return cfg;
+}
+
+class Session {
+public:
+  explicit Session(
+      const FakeBroker::Options &options,
+      const Impairment *impairment = nullptr,
+      const MQTTClientDetails::MqttClientCfg &config = sessionConfig())
+      : _impaired(impairment
+                      ? new ImpairedTransport(_clientEnd, *impairment)
+                      : nullptr),
+        _broker(_brokerEnd, options),
+        _client(_impaired ? static_cast<MQTTTransport::Transport *>(
+                                _impaired.get())
+                          : &_clientEnd,
+                config),
+        _clock(nullptr), _stepUs(0), _acked(0), _completed(0) {
+    LoopbackTransport::link(_clientEnd, _brokerEnd);
+    _client.onPublish([this](uint16_t) { ++_acked; });
+  }
+
+  // Every pump() then advances clock by stepUs.
+  void useClock(MQTTPlatform::VirtualClock *clock, uint32_t stepUs) {
+    _clock = clock;
+    _stepUs = stepUs;
+  }
+
+  bool open() {
+    if (!_client.connect()) {
+      return false;
+    }
+    for (int i = 0; i < 100000 && !_client.connected(); ++i) {
+      pump();
+    }
+    return _client.connected();
+  }
+
+  void pump() {
+    if (_clock) {
+      _clock->advance(_stepUs);
+    }
+    _client.mqttloop();
+    _broker.loop();
+  }
+
+  const ImpairedTransport *impaired() const { return _impaired.get(); }
+  const FakeBroker &broker() const { return _broker; }
+  MqttClient &client() { return _client; }
+
+  bool subscribe(const char *filter, uint8_t qos) {
+    Completion completion = _client.subscribeAsync(filter, qos);
+    for (int i = 0; i < 100000 && !completion.ready(); ++i) {
+      pump();
+    }
+    return completion.ready()
+           && completion.result().error == MQTTErrors::SUCCESS;
+  }
+
+  // Publishes n messages keeping at most window of them unacknowledged.
+  bool publish(uint64_t n, uint8_t qos, uint32_t window) {
+    uint64_t start = _acked;
+    uint64_t sent = 0;
+    while (_acked - start < n) {
+      while (sent < n && sent - (_acked - start) < window) {
+        if (_client.publish(TOPIC, qos, false, PAYLOAD, sizeof(PAYLOAD))
+            == 0) {
+          break;
+        }
+        ++sent;
+      }
+      pump();
+      if (!_client.connected()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // As publish(), tracking each message through its own Completion.
+  bool publishTracked(uint64_t n, uint8_t qos, uint32_t window) {
+    uint64_t start = _completed;
+    uint64_t sent = 0;
+    while (_completed - start < n) {
+      while (sent < n && sent - (_completed - start) < window) {
+        Completion completion = _client.publishAsync(
+            TOPIC, qos, false, PAYLOAD, sizeof(PAYLOAD));
+        if (completion.ready()
+            && completion.result().error != MQTTErrors::SUCCESS) {
+          break;
+        }
+        completion.then(&Session::_onCompleted, this);
+        ++sent;
+      }
+      pump();
+      if (!_client.connected()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // QoS 0 has no ack: done once the broker has seen every message.
+  bool publishQos0(uint64_t n) {
+    uint32_t target = _broker.stats().publishes[0] + n;
+    for (uint64_t i = 0; i < n; ++i) {
+      if (_client.publish(TOPIC, 0, false, PAYLOAD, sizeof(PAYLOAD)) == 0) {
+        return false;
+      }
+      pump();
+    }
+    while (_broker.stats().publishes[0] < target && _client.connected()) {
+      pump();
+    }
+    return _client.connected();
+  }
+
+  void close() {
+    _client.disconnect();
+    _broker.loop();
+  }
+
+private:
+  static void _onCompleted(const CompletionResult &result, void *context) {
+    if (result.error == MQTTErrors::SUCCESS) {
+      ++static_cast<Session *>(context)->_completed;
+    }
+  }
+
+  LoopbackTransport _clientEnd;
+  LoopbackTransport _brokerEnd;
+  std::unique_ptr<ImpairedTransport> _impaired;
+  FakeBroker _broker;
+  MqttClient _client;
+  MQTTPlatform::VirtualClock *_clock;
+  uint32_t _stepUs;
+  uint64_t _acked;
+  uint64_t _completed;
+};
+
+void benchSession(Runner &runner, const char *name, uint8_t qos,
+                  uint32_t window, uint32_t ackDelayUs = 0,
+                  bool tracked = false) {
+  FakeBroker::Options options;
+  options.ackDelayUs = ackDelayUs;
+  Session session(options);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  runner.run(name, [&](uint64_t n) {
+    bool ok = qos == 0  ? session.publishQos0(n)
+              : tracked ? session.publishTracked(n, qos, window)
+                        : session.publish(n, qos, window);
+    if (!ok) {
+      runner.fail(name, "connection lost");
+    }
+  });
+  session.close();
+}
+
+// An idle connection on a virtual clock: every op is one keep-alive
+// period, so one PINGREQ out and its PINGRESP back.
+void benchKeepAlive(Runner &runner, const char *name) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  config.connections_settings._keepAlive = 1000;
+  Session session(FakeBroker::Options(), nullptr, config);
+  session.useClock(&clock, 100000);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  runner.run(name, [&](uint64_t n) {
+    uint32_t target = session.broker().stats().pings + n;
+    while (session.broker().stats().pings < target
+           && session.client().connected()) {
+      session.pump();
+    }
+    if (!session.client().connected()) {
+      runner.fail(name, "connection lost");
+    }
+  });
+  session.close();
+}
+
+// The client subscribes to what it publishes and every echo runs a 20 us
+// handler, like one that writes to flash. Inline, the handler stalls the
+// network task; with a dispatch task the acks keep flowing and surplus
+// QoS 0 echoes are dropped instead.
+void benchSlowHandler(
+    Runner &runner, const char *name,
+    const MQTTClientDetails::DispatchSettings *dispatch = nullptr) {
+  std::atomic<uint32_t> handled(0);
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  if (dispatch) {
+    config.dispatch_settings = *dispatch;
+  }
+  Session session(FakeBroker::Options(), nullptr, config);
+  session.client().onMessage([&handled](const std::string &,
+                                        const std::string &,
+                                        MessageProperties, size_t, size_t,
+                                        size_t) {
+    uint32_t start = MQTTPlatform::micros();
+    while (MQTTPlatform::micros() - start < 20) {
+    }
+    handled.fetch_add(1, std::memory_order_relaxed);
+  });
+  if (!session.open() || !session.subscribe(TOPIC, 0)) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  const MQTTCore::Dispatcher *dispatcher = session.client().getDispatcher();
+  runner.run(name, [&](uint64_t n) {
+    uint32_t before = handled.load();
+    uint32_t dropped = dispatcher ? dispatcher->stats().dropped : 0;
+    if (!session.publish(n, 1, 16)) {
+      runner.fail(name, "connection lost");
+    }
+    if (dispatcher) {
+      // Leave nothing queued for the next batch
+      dispatcher->flush(1000);
+      runner.count("dropped", dispatcher->stats().dropped - dropped);
+    }
+    runner.count("handled", handled.load() - before);
+  });
+  session.close();
+}
+
+// Congested 2G-class link: 150 ms one way plus up to 50 ms jitter, 4 kB/s,
+// with the stack handing over small fragments in both directions.
+Impairment slowLink() {
+  Impairment link;
+  link.latencyUs = 150000;
+  link.jitterUs = 50000;
+  link.bytesPerSecond = 4000;
+  link.maxWriteChunk = 48;
+  link.maxReadChunk = 16;
+  link.seed = 42;
+  return link;
+}
+
+void benchSimulated(Runner &runner, const char *name, uint8_t qos,
+                    uint32_t window) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  Impairment link = slowLink();
+  Session session(FakeBroker::Options(), &link);
+  session.useClock(&clock, 1000);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  runner.run(name, [&](uint64_t n) {
+    uint64_t start = clock.nowUs();
+    uint32_t partial = session.impaired()->stats().partialWrites;
+    bool ok = qos == 0 ? session.publishQos0(n)
+                       : session.publish(n, qos, window);
+    if (!ok) {
+      runner.fail(name, "connection lost");
+    }
+    runner.count("virtual_us", clock.nowUs() - start);
+    runner.count("partial_writes",
+                 session.impaired()->stats().partialWrites - partial);
+  });
+  session.close();
+}
+
+uint8_t everythingBulk(const char *, uint8_t) {
+  return MQTTClientDetails::TX_CLASS_BULK;
+}
+
+// An alarm published behind a 4 kB telemetry backlog on the 2G link.
+// alarm_virtual_us is the simulated time from publish to PUBACK; the
+// _fifo run puts the alarm in the same class as the backlog.
+void benchAlarmBehindBacklog(Runner &runner, const char *name, bool fifo) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  Impairment link = slowLink();
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  if (fifo) {
+    config.transmit_settings.classify = &everythingBulk;
+  }
+  Session session(FakeBroker::Options(), &link, config);
+  session.useClock(&clock, 1000);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  const uint8_t telemetry[512] = {0x17};
+  MqttClient &client = session.client();
+  runner.run(name, [&](uint64_t n) {
+    uint64_t alarmUs = 0;
+    for (uint64_t i = 0; i < n && client.connected(); ++i) {
+      for (int j = 0; j < 8; ++j) {
+        client.publish("telemetry/bulk", 0, false, telemetry,
+                       sizeof(telemetry));
+      }
+      uint64_t start = clock.nowUs();
+      Completion alarm = client.publishAsync("alarms/door", 1, false,
+                                             PAYLOAD, sizeof(PAYLOAD));
+      while (!alarm.ready() && client.connected()) {
+        session.pump();
+      }
+      alarmUs += clock.nowUs() - start;
+      // Drain the backlog outside the measured span
+      while (client.getQueueDepth(MQTTClientDetails::TX_CLASS_BULK) > 0
+             && client.connected()) {
+        session.pump();
+      }
+    }
+    if (!client.connected()) {
+      runner.fail(name, "connection lost");
+    }
+    runner.count("alarm_virtual_us", alarmUs);
+  });
+  session.close();
+}
+
+// Twenty sensors keep reporting while the link is stalled, then the 2G
+// link comes back. The _fifo run queues every reading; the _conflated run
+// publishes through topic handles and keeps only the latest per sensor;
+// the _ttl run gives each reading ttlMs from the end of the stall to go
+// out. catchup_virtual_us is the simulated time until the queue has
+// drained.
+void benchCatchUp(Runner &runner, const char *name, bool conflated,
+                  uint32_t ttlMs = 0) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  Impairment link = slowLink();
+  Session session(FakeBroker::Options(), &link);
+  session.useClock(&clock, 1000);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  MqttClient &client = session.client();
+  char topics[20][24];
+  MQTTTransport::TopicHandle handles[20];
+  for (int i = 0; i < 20; ++i) {
+    snprintf(topics[i], sizeof(topics[i]), "sensors/%d/temp", i);
+    handles[i] = client.conflateTopic(topics[i]);
+  }
+  runner.run(name, [&](uint64_t n) {
+    uint64_t catchUpUs = 0;
+    uint32_t received = session.broker().stats().publishes[0];
+    uint32_t expired = client.getExpiredCount();
+    for (uint64_t i = 0; i < n && client.connected(); ++i) {
+      for (int j = 0; j < 1000; ++j) {
+        if (conflated) {
+          client.publish(handles[j % 20], 0, false, PAYLOAD, sizeof(PAYLOAD),
+                         ttlMs);
+        } else {
+          client.publish(topics[j % 20], 0, false, PAYLOAD, sizeof(PAYLOAD),
+                         ttlMs);
+        }
+      }
+      uint64_t start = clock.nowUs();
+      while (client.getQueueDepth(MQTTClientDetails::TX_CLASS_BULK) > 0
+             && client.connected()) {
+        session.pump();
+      }
+      catchUpUs += clock.nowUs() - start;
+    }
+    if (!client.connected()) {
+      runner.fail(name, "connection lost");
+    }
+    runner.count("catchup_virtual_us", catchUpUs);
+    runner.count("delivered",
+                 session.broker().stats().publishes[0] - received);
+    runner.count("expired", client.getExpiredCount() - expired);
+  });
+  session.close();
+}
+
+// A sensor publishing on four topics every (virtual) millisecond behind a
+// 100 msg/s rule with a burst of 10, once per shaping policy. sent_per_op
+// is the share that reached the broker.
+void benchShaped(Runner &runner, const char *name,
+                 MQTTClientDetails::ShapePolicy policy) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  MQTTClientDetails::ShapeRule rule{};
+  rule.prefix = "sensors/";
+  rule.messages_per_sec = 100;
+  rule.burst_messages = 10;
+  rule.policy = policy;
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  config.shape_settings = {&rule, 1, 16};
+  Session session(FakeBroker::Options(), nullptr, config);
+  session.useClock(&clock, 1000);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  const char *topics[] = {"sensors/room1/temp", "sensors/room2/temp",
+                          "sensors/room3/temp", "sensors/room4/temp"};
+  MqttClient &client = session.client();
+  runner.run(name, [&](uint64_t n) {
+    MQTTTransport::Shaper::Stats before = client.getShapeStats(0);
+    uint32_t received = session.broker().stats().publishes[0];
+    for (uint64_t i = 0; i < n; ++i) {
+      client.publish(topics[i % 4], 0, false, PAYLOAD, sizeof(PAYLOAD));
+      session.pump();
+    }
+    MQTTTransport::Shaper::Stats after = client.getShapeStats(0);
+    runner.count("sent", session.broker().stats().publishes[0] - received);
+    runner.count("delayed", after.delayed - before.delayed);
+    runner.count("conflated", after.conflated - before.conflated);
+    runner.count("dropped", after.dropped - before.dropped);
+  });
+  session.close();
+}
+
+// The heap as an ELEVATED board would report it: free memory under the
+// default threshold, plenty of it in one block.
+void elevatedHeap(size_t &freeBytes, size_t &largestBlock) {
+  freeBytes = MQTT_PRESSURE_ELEVATED_FREE / 2;
+  largestBlock = MQTT_PRESSURE_ELEVATED_BLOCK * 2;
+}
+
+// The stall of the catchup_after_stall runs, with plain topic publishes
+// and the heap at ELEVATED under the given policy instead of topic
+// handles. shed_per_op counts the readings conflated or refused.
+void benchCatchUpUnderPressure(Runner &runner, const char *name,
+                               uint8_t policy) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  Impairment link = slowLink();
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  config.pressure_settings.enabled = true;
+  config.pressure_settings.elevated_policy = policy;
+  config.pressure_settings.sample = &elevatedHeap;
+  Session session(FakeBroker::Options(), &link, config);
+  session.useClock(&clock, 1000);
+  if (!session.open()) {
+    runner.fail(name, "session did not connect");
+    return;
+  }
+  MqttClient &client = session.client();
+  char topics[20][24];
+  for (int i = 0; i < 20; ++i) {
+    snprintf(topics[i], sizeof(topics[i]), "sensors/%d/temp", i);
+  }
+  runner.run(name, [&](uint64_t n) {
+    uint64_t catchUpUs = 0;
+    uint32_t received = session.broker().stats().publishes[0];
+    MQTTTransport::PressureMonitor::Stats before = client.getPressureStats();
+    for (uint64_t i = 0; i < n && client.connected(); ++i) {
+      for (int j = 0; j < 1000; ++j) {
+        client.publish(topics[j % 20], 0, false, PAYLOAD, sizeof(PAYLOAD));
+      }
+      uint64_t start = clock.nowUs();
+      while (client.getQueueDepth(MQTTClientDetails::TX_CLASS_BULK) > 0
+             && client.connected()) {
+        session.pump();
+      }
+      catchUpUs += clock.nowUs() - start;
+    }
+    if (!client.connected()) {
+      runner.fail(name, "connection lost");
+    }
+    MQTTTransport::PressureMonitor::Stats after = client.getPressureStats();
+    runner.count("catchup_virtual_us", catchUpUs);
+    runner.count("delivered",
+                 session.broker().stats().publishes[0] - received);
+    runner.count("shed", after.conflated - before.conflated + after.refused
+                             - before.refused);
+  });
+  session.close();
+}
+
+// Reconnect to first data on the 2G link: every op connects, subscribes,
+// publishes one QoS 1 message and disconnects once both are acked. By
+// default the requests wait for the CONNACK; with pipelined_connect they
+// go out behind the CONNECT, a round trip sooner.
+void benchReconnect(Runner &runner, const char *name, bool pipelined) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  Impairment link = slowLink();
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  config.connections_settings.pipelined_connect = pipelined;
+  Session session(FakeBroker::Options(), &link, config);
+  session.useClock(&clock, 1000);
+  MqttClient &client = session.client();
+  runner.run(name, [&](uint64_t n) {
+    uint64_t start = clock.nowUs();
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!client.connect()) {
+        runner.fail(name, "session did not connect");
+        return;
+      }
+      while (!pipelined && !client.connected() && !client.disconnected()) {
+        session.pump();
+      }
+      Completion subscribed = client.subscribeAsync(TOPIC, 1);
+      Completion published
+          = client.publishAsync(TOPIC, 1, false, PAYLOAD, sizeof(PAYLOAD));
+      while (!(subscribed.ready() && published.ready())
+             && !client.disconnected()) {
+        session.pump();
+      }
+      if (subscribed.result().error != MQTTErrors::SUCCESS
+          || published.result().error != MQTTErrors::SUCCESS) {
+        runner.fail(name, "requests failed");
+        return;
+      }
+      session.close();
+    }
+    runner.count("virtual_us", clock.nowUs() - start);
+  });
+}
+
+// Disconnects with QoS 0 messages the broker has not read yet, then
+// reconnects: the new session must not inherit the old control packets.
+void benchReconnectAfterBacklog(Runner &runner, const char *name) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  Impairment link = slowLink();
+  // Room for about one publish, so the DISCONNECT is still queued
+  link.bufferSize = 128;
+  Session session(FakeBroker::Options(), &link);
+  session.useClock(&clock, 1000);
+  MqttClient &client = session.client();
+  runner.run(name, [&](uint64_t n) {
+    uint64_t start = clock.nowUs();
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!session.open()) {
+        runner.fail(name, "session did not reconnect");
+        return;
+      }
+      for (int j = 0; j < 3; ++j) {
+        client.publish(TOPIC, 0, false, PAYLOAD, sizeof(PAYLOAD));
+      }
+      client.disconnect();
+      session.pump();
+    }
+    runner.count("virtual_us", clock.nowUs() - start);
+  });
+}
+
+// Routes the client to one of several simulated brokers by host name,
+// like DNS and the network in between would.
+class Switchboard : public MQTTTransport::Transport {
+public:
+  void add(const char *host, MQTTTransport::Transport &line) {
+    _lines.push_back({host, &line});
+  }
+
+  bool connect(MQTTPlatform::IPv4Address, uint16_t) override {
+    return false;
+  }
+  bool connect(const char *host, uint16_t port) override {
+    stop();
+    for (const Line &line : _lines) {
+      if (strcmp(line.host, host) == 0) {
+        _active = line.transport;
+        return _active->connect(host, port);
+      }
+    }
+    return false;
+  }
+  size_t write(const uint8_t *buf, size_t size) override {
+    return _active ? _active->write(buf, size) : 0;
+  }
+  int read(uint8_t *buf, size_t size) override {
+    return _active ? _active->read(buf, size) : -1;
+  }
+  void stop() override {
+    if (_active) {
+      _active->stop();
+    }
+    _active = nullptr;
+  }
+  bool connected() override { return _active && _active->connected(); }
+  bool disconnected() override { return !connected(); }
+
+private:
+  struct Line {
+    const char *host;
+    MQTTTransport::Transport *transport;
+  };
+
+  std::vector<Line> _lines;
+  MQTTTransport::Transport *_active = nullptr;
+};
+
+Impairment regionLink(uint32_t latencyUs) {
+  Impairment link;
+  link.latencyUs = latencyUs;
+  link.jitterUs = latencyUs / 4;
+  link.seed = 7;
+  return link;
+}
+
+// One simulated broker behind its own link.
+struct Region {
+  Region(const char *name, uint32_t latencyUs,
+         const FakeBroker::Options &options = FakeBroker::Options())
+      : host(name), impaired(clientEnd, regionLink(latencyUs)),
+        broker(brokerEnd, options) {
+    LoopbackTransport::link(clientEnd, brokerEnd);
+  }
+
+  const char *host;
+  LoopbackTransport clientEnd;
+  LoopbackTransport brokerEnd;
+  ImpairedTransport impaired;
+  FakeBroker broker;
+};
+
+// Failover away from a degraded region: "eu" answers over a 400 ms
+// one-way link, "us" over 60 ms. Every op connects, publishes one QoS 1
+// message and disconnects once it is acked. With only host set the client
+// keeps returning to "eu"; given both as endpoints it measures "eu" on the
+// first connect and prefers "us" from then on. With hung set "eu" takes
+// the connection and never answers the CONNECT, and every op starts from
+// a freshly booted client: its first connect waits out the CONNACK
+// timeout, and the retry goes to "us".
+void benchFailover(Runner &runner, const char *name, bool endpoints,
+                   bool hung = false) {
+  MQTTPlatform::VirtualClock clock;
+  clock.install();
+  FakeBroker::Options hangs;
+  hangs.answerConnect = !hung;
+  Region eu("eu", 400000, hangs);
+  Region us("us", 60000);
+  Switchboard switchboard;
+  switchboard.add(eu.host, eu.impaired);
+  switchboard.add(us.host, us.impaired);
+  static const MQTTClientDetails::BrokerEndpoint BROKERS[]
+      = {{"eu", 0}, {"us", 0}};
+  MQTTClientDetails::MqttClientCfg config = sessionConfig();
+  config.connections_settings.host = eu.host;
+  if (endpoints) {
+    config.connections_settings.endpoints = BROKERS;
+    config.connections_settings.endpoint_count = 2;
+  }
+  std::unique_ptr<MqttClient> booted(new MqttClient(&switchboard, config));
+  auto pump = [&]() {
+    clock.advance(1000);
+    booted->mqttloop();
+    eu.broker.loop();
+    us.broker.loop();
+  };
+  runner.run(name, [&](uint64_t n) {
+    uint64_t start = clock.nowUs();
+    uint64_t failed = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      if (hung) {
+        // No scores yet, so "eu" is tried first
+        booted.reset(new MqttClient(&switchboard, config));
+      }
+      MqttClient &client = *booted;
+      // Once per endpoint at most
+      for (int attempt = 0; !client.connected(); ++attempt) {
+        if (attempt == 2 || !client.connect()) {
+          runner.fail(name, "session did not connect");
+          return;
+        }
+        while (!client.connected() && !client.disconnected()) {
+          pump();
+        }
+        failed += client.disconnected();
+      }
+      Completion published
+          = client.publishAsync(TOPIC, 1, false, PAYLOAD, sizeof(PAYLOAD));
+      while (!published.ready() && !client.disconnected()) {
+        pump();
+      }
+      if (published.result().error != MQTTErrors::SUCCESS) {
+        runner.fail(name, "publish failed");
+        return;
+      }
+      client.disconnect();
+      eu.broker.loop();
+      us.broker.loop();
+    }
+    runner.count("virtual_us", clock.nowUs() - start);
+    runner.count("failed_connects", failed);
+  });
+}
+
+} // namespace
+
+void benchEndToEnd(Runner &runner) {
+  benchSession(runner, "e2e/publish_qos0_64B", 0, 1);
+  benchSession(runner, "e2e/publish_qos1_64B", 1, 1);
+  benchSession(runner, "e2e/publish_qos2_64B", 2, 1);
+  benchSession(runner, "e2e/publish_qos1_64B_window16", 1, 16);
+  benchSession(runner, "e2e/publish_qos1_64B_window16_ack100us", 1, 16, 100);
+  benchSession(runner, "e2e/publish_qos1_64B_window16_completion", 1, 16, 0,
+               true);
+  benchKeepAlive(runner, "e2e/keepalive_ping");
+  // After warm-up, publish, ack and ping cycles must not allocate
+  runner.expectAllocationFree("e2e/publish_qos0_64B");
+  runner.expectAllocationFree("e2e/publish_qos1_64B");
+  runner.expectAllocationFree("e2e/publish_qos2_64B");
+  runner.expectAllocationFree("e2e/publish_qos1_64B_window16");
+  runner.expectAllocationFree("e2e/keepalive_ping");
+
+  benchSlowHandler(runner, "e2e/publish_qos1_echo_slow_handler_inline");
+  MQTTClientDetails::DispatchSettings dispatch{};
+  dispatch.enabled = true;
+  dispatch.queue_depth = 64;
+  dispatch.policy = MQTTClientDetails::DispatchPolicy::DROP_QOS0;
+  benchSlowHandler(runner, "e2e/publish_qos1_echo_slow_handler_dispatch",
+                   &dispatch);
+
+  benchShaped(runner, "e2e/shaped_1khz_sensor_100hz_delay",
+              MQTTClientDetails::ShapePolicy::DELAY);
+  benchShaped(runner, "e2e/shaped_1khz_sensor_100hz_conflate",
+              MQTTClientDetails::ShapePolicy::CONFLATE);
+  benchShaped(runner, "e2e/shaped_1khz_sensor_100hz_drop",
+              MQTTClientDetails::ShapePolicy::DROP);
+
+  benchSimulated(runner, "sim/2g_publish_qos0_64B", 0, 1);
+  benchSimulated(runner, "sim/2g_publish_qos1_64B", 1, 1);
+  benchSimulated(runner, "sim/2g_publish_qos1_64B_window16", 1, 16);
+  benchAlarmBehindBacklog(runner, "sim/2g_alarm_behind_4kB_backlog_fifo",
+                          true);
+  benchAlarmBehindBacklog(runner, "sim/2g_alarm_behind_4kB_backlog_classed",
+                          false);
+  benchCatchUp(runner, "sim/2g_catchup_after_stall_fifo", false);
+  benchCatchUp(runner, "sim/2g_catchup_after_stall_conflated", true);
+  benchCatchUp(runner, "sim/2g_catchup_after_stall_ttl2s", false, 2000);
+  benchCatchUpUnderPressure(runner,
+                            "sim/2g_catchup_after_stall_pressure_conflate",
+                            MQTTClientDetails::PRESSURE_CONFLATE);
+  benchCatchUpUnderPressure(runner,
+                            "sim/2g_catchup_after_stall_pressure_refuse",
+                            MQTTClientDetails::PRESSURE_REFUSE_QOS0);
+  benchReconnect(runner, "sim/2g_reconnect_to_ack_wait_connack", false);
+  benchReconnect(runner, "sim/2g_reconnect_to_ack_pipelined", true);
+  benchReconnectAfterBacklog(runner, "sim/2g_reconnect_after_qos0_backlog");
+  benchFailover(runner, "sim/failover_degraded_region_single_host", false);
+  benchFailover(runner, "sim/failover_degraded_region_endpoints", true);
+  benchFailover(runner, "sim/failover_hung_broker_endpoints", true, true);
+}
+
+} // namespace NestBench
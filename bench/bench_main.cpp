@@ -0,0 +1,399 @@
+// Host-side benchmarks for the NestMQTT core. Build with the native_bench
+// PlatformIO environment; results are written to stdout as JSON.
+//
+//   .pio/build/native_bench/program [--filter name] [--min-time-ms 200]
+
+#include "BenchHarness.h"
+#include "BenchSuites.h"
+#include "MQTTBuffer.h"
+#include "MQTTInboundIds.h"
+#include "MQTTMemory.h"
+#include "MQTTPacket.h"
+#include "MQTTPlatform.h"
+#include "MQTTReceiver.h"
+#include "MQTTStateMachine.h"
+#include "MQTTTransmitRegistry.h"
+#include "MQTTUtility.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The repository's data/ directory, holding the filesystem image
+#ifndef NESTMQTT_DATA_DIR
+#define NESTMQTT_DATA_DIR "data"
+#endif
+
+using namespace MQTTCore;
+using namespace MQTTPacket;
+using NestBench::doNotOptimize;
+
+namespace {
+
+const uint8_t PAYLOAD[256] = {0x42};
+
+size_t payloadCallback(uint8_t *data, size_t maxSize, size_t) {
+  size_t n = maxSize < sizeof(PAYLOAD) ? maxSize : sizeof(PAYLOAD);
+  memcpy(data, PAYLOAD, n);
+  return n;
+}
+
+// StateMachine persists every transition, so give it a scratch copy of the
+// filesystem image instead of writing into data/.
+bool prepareFilesystem() {
+  if (getenv("NESTMQTT_FS_ROOT")) {
+    return true;
+  }
+  static char root[] = "/tmp/nestmqtt-bench-XXXXXX";
+  if (!mkdtemp(root)) {
+    fprintf(stderr, "cannot create %s\n", root);
+    return false;
+  }
+  std::string states = std::string(root) + "/states";
+  mkdir(states.c_str(), 0700);
+  const char *image = NESTMQTT_DATA_DIR "/states/device_settings.json";
+  FILE *in = fopen(image, "rb");
+  if (!in) {
+    fprintf(stderr, "cannot open %s\n", image);
+    return false;
+  }
+  FILE *out = fopen((states + "/device_settings.json").c_str(), "wb");
+  bool copied = out != nullptr;
+  if (out) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      copied = copied && fwrite(buf, 1, n, out) == n;
+    }
+    copied = fclose(out) == 0 && copied;
+  }
+  fclose(in);
+  if (!copied) {
+    fprintf(stderr, "cannot copy %s into %s\n", image, root);
+    return false;
+  }
+  MQTTPlatform::setFilesystemRoot(root);
+  return true;
+}
+
+template <typename... Args> void encodePacket(uint64_t n, Args... args) {
+  for (uint64_t i = 0; i < n; ++i) {
+    MQTTErrors error = MQTTErrors::SUCCESS;
+    Packet packet(error, args...);
+    doNotOptimize(packet.data(0));
+  }
+}
+
+void benchPackets(NestBench::Runner &runner) {
+  runner.run("packet/connect", [](uint64_t n) {
+    encodePacket(n, true, "user", "password", "will/topic", false,
+                 static_cast<uint8_t>(1),
+                 reinterpret_cast<const uint8_t *>("gone"),
+                 static_cast<uint16_t>(4), static_cast<uint16_t>(60),
+                 "nestmqtt-bench");
+  });
+  runner.run("packet/publish_qos0_16B", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(0), "sensors/room1/temp", PAYLOAD,
+                 static_cast<size_t>(16), static_cast<uint8_t>(0), false);
+  });
+  runner.run("packet/publish_qos1_256B", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(7), "sensors/room1/temp", PAYLOAD,
+                 sizeof(PAYLOAD), static_cast<uint8_t>(1), false);
+  });
+  runner.run("packet/publish_qos2_256B", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(7), "sensors/room1/temp", PAYLOAD,
+                 sizeof(PAYLOAD), static_cast<uint8_t>(2), true);
+  });
+  runner.run("packet/publish_chunked_256B", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(7), "sensors/room1/temp",
+                 onPayloadInternalCallback(payloadCallback), sizeof(PAYLOAD),
+                 static_cast<uint8_t>(1), false);
+  });
+  runner.run("packet/subscribe", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(9), "sensors/+/temp",
+                 static_cast<uint8_t>(1));
+  });
+  runner.run("packet/subscribe_4_topics", [](uint64_t n) {
+    const SubscribeItem items[] = {{"a/+", 0}, {"b/#", 1}, {"c/d", 2},
+                                   {"e/f/g", 1}};
+    Subscription subscription(4, items);
+    encodePacket(n, static_cast<uint16_t>(9), subscription);
+  });
+  runner.run("packet/unsubscribe", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(9), "sensors/+/temp");
+  });
+  runner.run("packet/puback", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(9), PacketType.PUBACK);
+  });
+  runner.run("packet/pubrec", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(9), PacketType.PUBREC);
+  });
+  runner.run("packet/pubrel", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(9), PacketType.PUBREL);
+  });
+  runner.run("packet/pubcomp", [](uint64_t n) {
+    encodePacket(n, static_cast<uint16_t>(9), PacketType.PUBCOMP);
+  });
+  runner.run("packet/pingreq", [](uint64_t n) {
+    encodePacket(n, PacketType.PINGREQ);
+  });
+  runner.run("packet/disconnect", [](uint64_t n) {
+    encodePacket(n, PacketType.DISCONNECT);
+  });
+}
+
+void benchVarint(NestBench::Runner &runner) {
+  static const uint32_t values[] = {0,     127,     128,      16383,
+                                    16384, 2097151, 2097152, 268435455};
+  const size_t count = sizeof(values) / sizeof(values[0]);
+
+  runner.run("varint/encode", [&](uint64_t n) {
+    uint8_t out[4];
+    for (uint64_t i = 0; i < n; ++i) {
+      doNotOptimize(
+          MQTTUtility::encodeRemainingLength(values[i % count], out));
+      doNotOptimize(out);
+    }
+  });
+
+  uint8_t encoded[count][4];
+  size_t lengths[count];
+  for (size_t i = 0; i < count; ++i) {
+    lengths[i] = MQTTUtility::encodeRemainingLength(values[i], encoded[i]);
+  }
+  runner.run("varint/decode", [&](uint64_t n) {
+    uint32_t value;
+    for (uint64_t i = 0; i < n; ++i) {
+      size_t k = i % count;
+      doNotOptimize(
+          MQTTUtility::decodeRemainingLength(encoded[k], lengths[k], value));
+      doNotOptimize(value);
+    }
+  });
+}
+
+void benchBuffer(NestBench::Runner &runner) {
+  runner.run("buffer/push_back_remove", [](uint64_t n) {
+    MQTTTransport::Buffer<uint32_t> buffer;
+    for (uint64_t i = 0; i < n; ++i) {
+      buffer.pushBack(static_cast<uint32_t>(i));
+      buffer.removeCurrent();
+    }
+  });
+  runner.run("buffer/push_back_depth64", [](uint64_t n) {
+    MQTTTransport::Buffer<uint32_t> buffer;
+    for (uint32_t i = 0; i < 64; ++i) {
+      buffer.pushBack(i);
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+      buffer.pushBack(static_cast<uint32_t>(i));
+      buffer.resetCurrent();
+      buffer.removeCurrent();
+    }
+  });
+  runner.run("buffer/push_front_remove", [](uint64_t n) {
+    MQTTTransport::Buffer<uint32_t> buffer;
+    for (uint64_t i = 0; i < n; ++i) {
+      buffer.pushFront(static_cast<uint32_t>(i));
+      buffer.removeCurrent();
+    }
+  });
+  runner.run("buffer/find_depth64", [](uint64_t n) {
+    MQTTTransport::Buffer<uint32_t> buffer;
+    for (uint32_t i = 0; i < 64; ++i) {
+      buffer.pushBack(i);
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+      doNotOptimize(buffer.find(static_cast<uint32_t>(i % 64)));
+    }
+  });
+  runner.run("buffer/iterate_depth64", [](uint64_t n) {
+    MQTTTransport::Buffer<uint32_t> buffer;
+    for (uint32_t i = 0; i < 64; ++i) {
+      buffer.pushBack(i);
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+      uint32_t sum = 0;
+      for (auto it = buffer.begin(); it != buffer.end(); ++it) {
+        sum += *it;
+      }
+      doNotOptimize(sum);
+    }
+  });
+}
+
+void benchPid(NestBench::Runner &runner) {
+  for (uint16_t inflight : {0, 16, 64}) {
+    std::string name = "pid/next_inflight" + std::to_string(inflight);
+    runner.run(name.c_str(), [inflight](uint64_t n) {
+      MQTTTransport::transmit_registry registry;
+      registry.pid_lfsr = 0;
+      for (uint16_t i = 0; i < inflight; ++i) {
+        registry.packet_queue.pushBack(MQTTTransport::QueuedPacket{
+            nullptr, static_cast<uint16_t>(1000 + i), 0,
+            MQTTTransport::MQTT_QUEUED_AWAITING_ACK, 0, PUBLISH});
+      }
+      for (uint64_t i = 0; i < n; ++i) {
+        doNotOptimize(MQTTTransport::__transmit_next_pid(&registry));
+      }
+    });
+  }
+}
+
+// Inbound QoS 2 bookkeeping with 64 messages between PUBREC and PUBREL:
+// per op one duplicate check and insert for the newest id and the erase
+// of the oldest, as a steady flood would do.
+void benchInboundIds(NestBench::Runner &runner) {
+  MQTTTransport::InboundIds ids;
+  runner.run("qos2ids/receive_release_open64", [&](uint64_t n) {
+    ids.clear();
+    uint64_t duplicates = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      uint16_t id = static_cast<uint16_t>(i * 7919 % 65535 + 1);
+      duplicates += ids.contains(id) || !ids.insert(id);
+      if (i >= 64) {
+        ids.erase(static_cast<uint16_t>((i - 64) * 7919 % 65535 + 1));
+      }
+    }
+    runner.count("duplicates", duplicates);
+  });
+}
+
+void benchMemory(NestBench::Runner &runner) {
+  MQTTCore::MemoryPolicy &policy = MQTTCore::MemoryPolicy::instance();
+  runner.run("memory/place_metadata_32B", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      void *ptr = policy.allocate(MQTTCore::MEMORY_METADATA, 32);
+      doNotOptimize(ptr);
+      policy.release(MQTTCore::MEMORY_METADATA, ptr);
+    }
+  });
+  runner.run("memory/place_payload_1kB", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      void *ptr = policy.allocate(MQTTCore::MEMORY_PAYLOAD, 1024);
+      doNotOptimize(ptr);
+      policy.release(MQTTCore::MEMORY_PAYLOAD, ptr);
+    }
+  });
+
+  // Past MQTT_MEMORY_POOL_MAX_BLOCK, so every block comes from a region
+  runner.run("memory/place_payload_4kB", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      void *ptr = policy.allocate(MQTTCore::MEMORY_PAYLOAD, 4096);
+      doNotOptimize(ptr);
+      policy.release(MQTTCore::MEMORY_PAYLOAD, ptr);
+    }
+  });
+
+  // PSRAM budget used up: large payloads fall back to internal SRAM
+  MQTTCore::MemorySettings settings{};
+  settings.budgets[MQTTCore::MEMORY_PAYLOAD].external_bytes = 1;
+  policy.configure(settings);
+  runner.run("memory/place_payload_1kB_psram_full", [&](uint64_t n) {
+    uint32_t before = policy.stats().fallbacks;
+    for (uint64_t i = 0; i < n; ++i) {
+      void *ptr = policy.allocate(MQTTCore::MEMORY_PAYLOAD, 1024);
+      doNotOptimize(ptr);
+      policy.release(MQTTCore::MEMORY_PAYLOAD, ptr);
+    }
+    runner.count("fallbacks", policy.stats().fallbacks - before);
+  });
+  policy.configure(MQTTCore::MemorySettings{});
+}
+
+void benchStateMachine(NestBench::Runner &runner) {
+  StateMachine machine;
+  runner.run("statemachine/handle_event", [&](uint64_t n) {
+    machine.setState(StateMachine::State::mqtt_ok);
+    for (uint64_t i = 0; i < n; ++i) {
+      machine.handleEvent(StateMachine::Event::PUBLISHED);
+    }
+  });
+}
+
+void benchTopics(NestBench::Runner &runner) {
+  struct Case {
+    const char *name;
+    const char *filter;
+    const char *topic;
+  };
+  static const Case cases[] = {
+      {"topic/match_exact", "home/floor1/room3/temp",
+       "home/floor1/room3/temp"},
+      {"topic/match_plus", "home/+/+/temp", "home/floor1/room3/temp"},
+      {"topic/match_hash", "home/#", "home/floor1/room3/temp"},
+      {"topic/mismatch", "home/floor2/#", "home/floor1/room3/temp"},
+  };
+  for (const Case &c : cases) {
+    runner.run(c.name, [&c](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        doNotOptimize(MQTTUtility::topicMatches(c.filter, c.topic));
+      }
+    });
+  }
+}
+
+void benchDecode(NestBench::Runner &runner) {
+  struct Case {
+    const char *name;
+    std::string bytes;
+  };
+  std::vector<Case> cases;
+
+  {
+    MQTTErrors error;
+    Packet publish(error, static_cast<uint16_t>(11), "sensors/room1/temp",
+                   PAYLOAD, 64, 1, false);
+    cases.push_back({"decode/publish_qos1_64B",
+                     std::string(reinterpret_cast<const char *>(
+                                     publish.data(0)),
+                                 publish.size())});
+  }
+  cases.push_back({"decode/puback", std::string("\x40\x02\x00\x0b", 4)});
+  cases.push_back({"decode/suback", std::string("\x90\x03\x00\x0b\x01", 5)});
+  cases.push_back({"decode/pingresp", std::string("\xd0\x00", 2)});
+
+  for (const Case &c : cases) {
+    runner.run(c.name, [&c](uint64_t n) {
+      const uint8_t *bytes = reinterpret_cast<const uint8_t *>(c.bytes.data());
+      mqtt_response response;
+      MQTTErrors error;
+      for (uint64_t i = 0; i < n; ++i) {
+        doNotOptimize(MQTTTransport::Receiver::decode(bytes, c.bytes.size(),
+                                                      response, error));
+        doNotOptimize(response);
+      }
+    });
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  // Transition logging would otherwise dominate the state machine numbers
+  MQTTPlatform::setLogLevel(MQTTPlatform::LogLevel::WARNING);
+  if (!prepareFilesystem()) {
+    return 1;
+  }
+  NestBench::Runner runner(argc, argv);
+
+  benchPackets(runner);
+  benchVarint(runner);
+  benchBuffer(runner);
+  benchPid(runner);
+  benchInboundIds(runner);
+  benchMemory(runner);
+  benchStateMachine(runner);
+  benchTopics(runner);
+  benchDecode(runner);
+  NestBench::benchTransport(runner);
+  NestBench::benchEndToEnd(runner);
+  NestBench::benchDispatch(runner);
+  NestBench::benchShape(runner);
+  NestBench::benchStore(runner);
+  NestBench::benchSession(runner);
+
+  return runner.report();
+}
@@ -0,0 +1,72 @@
+// Persistent session journal on the host filesystem. publish_ack_64B
+// journals one QoS 1 publish and its PUBACK per op, including syncs and
+// the periodic rewrite; recover_64_inflight is a boot that finds 64
+// unacked publishes and rewrites them to a fresh journal.
+
+#include "BenchSuites.h"
+#include "MQTTSession.h"
+
+using MQTTTransport::SessionStore;
+
+namespace NestBench {
+
+namespace {
+// An encoded QoS 1 PUBLISH: topic "sensors/room1/temp", a 64-byte payload
+struct EncodedPublish {
+  uint8_t bytes[2 + 2 + 18 + 2 + 64];
+  EncodedPublish() : bytes{} {
+    bytes[0] = 0x32;
+    bytes[1] = sizeof(bytes) - 2;
+    bytes[3] = 18;
+    for (size_t i = 0; i < 18; ++i) {
+      bytes[4 + i] = static_cast<uint8_t>("sensors/room1/temp"[i]);
+    }
+  }
+};
+} // namespace
+
+void benchSession(Runner &runner) {
+  EncodedPublish publish;
+  MQTTClientDetails::SessionSettings settings{true, "/bench_session", 0};
+  MQTTTransport::InboundIds inbound;
+  {
+    SessionStore session(settings, inbound);
+    if (!session.open()) {
+      runner.fail("session", "no filesystem");
+      return;
+    }
+    runner.run("session/publish_ack_64B", [&](uint64_t n) {
+      uint32_t rewrites = session.stats().rewrites;
+      for (uint64_t i = 0; i < n; ++i) {
+        uint16_t packetId = static_cast<uint16_t>(i % 0xFFFF + 1);
+        session.sent(packetId, publish.bytes, sizeof(publish.bytes), 0);
+        session.completed(packetId);
+        if (session.rewriteDue() && session.beginRewrite(0)) {
+          session.endRewrite(); // nothing left in flight
+        }
+      }
+      runner.count("rewrites", session.stats().rewrites - rewrites);
+    });
+    session.clear();
+  }
+
+  {
+    SessionStore session(settings, inbound);
+    session.open();
+    for (uint16_t packetId = 1; packetId <= 64; ++packetId) {
+      session.sent(packetId, publish.bytes, sizeof(publish.bytes), 0);
+    }
+  }
+  runner.run("session/recover_64_inflight", [&](uint64_t n) {
+    uint64_t restored = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      SessionStore session(settings, inbound);
+      session.open();
+      restored += session.stats().restored;
+    }
+    runner.count("restored", restored);
+  });
+  SessionStore(settings, inbound).clear();
+}
+
+} // namespace NestBench
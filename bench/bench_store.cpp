@@ -0,0 +1,63 @@
+// Offline store throughput on the host filesystem. append_64B writes one
+// 64-byte publish per op with its sync; roundtrip_64B also reads it back
+// through replay() and commit(), so the difference is the replay side.
+// Files go under the bench's temporary filesystem root.
+
+#include "BenchSuites.h"
+#include "MQTTOfflineStore.h"
+
+using MQTTTransport::OfflineStore;
+
+namespace NestBench {
+
+namespace {
+const uint8_t PAYLOAD[64] = {0};
+const char *const TOPIC = "sensors/room1/temp";
+// Header, topic with its NUL, payload and CRC
+const size_t RECORD_BYTES = 16 + 19 + sizeof(PAYLOAD) + 4;
+
+bool sink(const OfflineStore::Message &message, void *context) {
+  *static_cast<size_t *>(context) += message.length;
+  return true;
+}
+} // namespace
+
+void benchStore(Runner &runner) {
+  MQTTClientDetails::OfflineStoreSettings settings{
+      true, "/bench_outbox", 64 * 1024, 16, 8192};
+  OfflineStore store(settings);
+  if (!store.open()) {
+    runner.fail("store", "no filesystem");
+    return;
+  }
+  runner.run("store/append_64B", [&](uint64_t n) {
+    uint32_t evicted = store.stats().evicted;
+    for (uint64_t i = 0; i < n; ++i) {
+      store.append(TOPIC, PAYLOAD, sizeof(PAYLOAD), 1, false, 0);
+    }
+    runner.count("evicted", store.stats().evicted - evicted);
+  });
+  // Start the round trips from an empty log
+  size_t bytes = 0;
+  while (store.replay(sink, &bytes)) {
+    store.commit();
+  }
+  store.commit();
+  runner.run("store/roundtrip_64B", [&](uint64_t n) {
+    size_t replayed = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      store.append(TOPIC, PAYLOAD, sizeof(PAYLOAD), 1, false, 0);
+      // Drain a batch at a time, the way the transmitter does
+      if (store.pending() * RECORD_BYTES >= 8192 || i + 1 == n) {
+        while (store.pending()) {
+          replayed += store.replay(sink, &bytes);
+          store.commit();
+        }
+      }
+    }
+    runner.count("replayed", replayed);
+  });
+  doNotOptimize(bytes);
+}
+
+} // namespace NestBench
@@ -0,0 +1,297 @@
+// Kernel socket path: PosixTransport against an in-process peer that stands
+// in for the broker. Reports syscalls per message alongside the timings.
+// The loop/ runs put MqttClient on its own network thread and time how
+// long a publish from another thread takes to reach the socket.
+
+#include "BenchSuites.h"
+#include "MQTTClient.h"
+#include "MQTTPacket.h"
+#include "MQTTPosixTransport.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using MQTTCore::MQTTErrors;
+using MQTTTransport::PosixTransport;
+
+namespace NestBench {
+
+namespace {
+
+const uint8_t PAYLOAD[64] = {0x42};
+
+// Listening socket plus the accepted connection of the peer.
+class Peer {
+public:
+  ~Peer() {
+    if (_conn >= 0) {
+      close(_conn);
+    }
+    if (_listener >= 0) {
+      close(_listener);
+    }
+    if (!_path.empty()) {
+      unlink(_path.c_str());
+      rmdir(_path.substr(0, _path.rfind('/')).c_str());
+    }
+  }
+
+  bool listenUnix(std::string &host) {
+    char dir[] = "/tmp/nestmqtt-sock-XXXXXX";
+    if (!mkdtemp(dir)) {
+      return false;
+    }
+    _path = std::string(dir) + "/broker.sock";
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", _path.c_str());
+    _listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    host = "unix:" + _path;
+    return _listener >= 0
+           && bind(_listener, reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) == 0
+           && listen(_listener, 1) == 0;
+  }
+
+  bool listenTcp(uint16_t &port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    _listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (_listener < 0
+        || bind(_listener, reinterpret_cast<sockaddr *>(&address), size) != 0
+        || listen(_listener, 1) != 0
+        || getsockname(_listener, reinterpret_cast<sockaddr *>(&address),
+                       &size) != 0) {
+      return false;
+    }
+    port = ntohs(address.sin_port);
+    return true;
+  }
+
+  bool accept() {
+    _conn = ::accept(_listener, nullptr, nullptr);
+    return _conn >= 0;
+  }
+
+  // Blocking: takes exactly size bytes off the connection.
+  bool drain(size_t size) {
+    uint8_t buf[512];
+    while (size > 0) {
+      ssize_t n = recv(_conn, buf, size < sizeof(buf) ? size : sizeof(buf), 0);
+      if (n <= 0) {
+        return false;
+      }
+      size -= n;
+    }
+    return true;
+  }
+
+  // Blocking: reads one MQTT packet and returns its first header byte.
+  int readPacket() {
+    uint8_t header;
+    uint8_t byte;
+    if (!_receive(&header)) {
+      return -1;
+    }
+    uint32_t length = 0;
+    uint32_t multiplier = 1;
+    do {
+      if (!_receive(&byte)) {
+        return -1;
+      }
+      length += (byte & 0x7F) * multiplier;
+      multiplier *= 128;
+    } while (byte & 0x80);
+    return drain(length) ? header : -1;
+  }
+
+  bool send(const uint8_t *data, size_t size) {
+    return ::send(_conn, data, size, MSG_NOSIGNAL)
+           == static_cast<ssize_t>(size);
+  }
+
+private:
+  bool _receive(uint8_t *byte) { return recv(_conn, byte, 1, 0) == 1; }
+
+  int _listener = -1;
+  int _conn = -1;
+  std::string _path;
+};
+
+// Writes a whole packet, waiting for the socket to drain when it is full.
+bool writeAll(PosixTransport &transport, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    size_t written = transport.write(data, size);
+    if (written == 0) {
+      if (!transport.connected()
+          || !(transport.waitReady(MQTTTransport::READY_WRITE, 1000)
+               & MQTTTransport::READY_WRITE)) {
+        return false;
+      }
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+void reportSyscalls(Runner &runner, const PosixTransport &transport) {
+  const PosixTransport::Stats &stats = transport.stats();
+  runner.count("syscalls", stats.reads + stats.writes + stats.polls);
+  runner.count("would_block", stats.wouldBlock);
+}
+
+// QoS 0 PUBLISH of a 64 byte payload, drained by the peer after each write.
+void benchPublish(Runner &runner, const char *name, PosixTransport &transport,
+                  Peer &peer) {
+  MQTTErrors error = MQTTErrors::SUCCESS;
+  MQTTPacket::Packet packet(error, static_cast<uint16_t>(0),
+                            "sensors/room1/temp", PAYLOAD, sizeof(PAYLOAD),
+                            static_cast<uint8_t>(0), false);
+  runner.run(name, [&](uint64_t n) {
+    transport.resetStats();
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!writeAll(transport, packet.data(0), packet.size())
+          || !peer.drain(packet.size())) {
+        runner.fail(name, "write failed");
+        return;
+      }
+    }
+    reportSyscalls(runner, transport);
+  });
+}
+
+// PUBLISH out, PUBACK back: waits for readability the way an event-driven
+// loop would instead of spinning on read().
+void benchRoundTrip(Runner &runner, const char *name,
+                    PosixTransport &transport, Peer &peer) {
+  MQTTErrors error = MQTTErrors::SUCCESS;
+  MQTTPacket::Packet packet(error, static_cast<uint16_t>(1),
+                            "sensors/room1/temp", PAYLOAD, sizeof(PAYLOAD),
+                            static_cast<uint8_t>(1), false);
+  const uint8_t puback[] = {0x40, 0x02, 0x00, 0x01};
+  runner.run(name, [&](uint64_t n) {
+    transport.resetStats();
+    uint8_t ack[sizeof(puback)];
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!writeAll(transport, packet.data(0), packet.size())
+          || !peer.drain(packet.size()) || !peer.send(puback, sizeof(puback))) {
+        runner.fail(name, "write failed");
+        return;
+      }
+      size_t received = 0;
+      while (received < sizeof(ack)) {
+        transport.waitReady(MQTTTransport::READY_READ, 1000);
+        int got = transport.read(ack + received, sizeof(ack) - received);
+        if (got < 0) {
+          runner.fail(name, "read failed");
+          return;
+        }
+        received += got;
+      }
+    }
+    reportSyscalls(runner, transport);
+  });
+}
+
+// QoS 0 publish from the calling thread while the client runs on a network
+// thread, either event-driven or in the old poll-and-yield style.
+void benchLoop(Runner &runner, const char *name, bool eventDriven) {
+  Peer peer;
+  std::string host;
+  if (!peer.listenUnix(host)) {
+    runner.fail(name, "unix socket setup failed");
+    return;
+  }
+  PosixTransport transport;
+  MQTTClientDetails::MqttClientCfg cfg{};
+  cfg.connections_settings.host = host.c_str();
+  cfg.connections_settings._keepAlive = 600000;
+  cfg.path = "nestmqtt-bench";
+  MqttClient client(&transport, cfg);
+
+  std::atomic<bool> running{true};
+  std::atomic<uint64_t> passes{0};
+  std::thread network([&] {
+    while (running.load(std::memory_order_relaxed)) {
+      if (eventDriven) {
+        client.mqttloop(100);
+      } else {
+        client.mqttloop();
+        MQTTPlatform::yield();
+      }
+      passes.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+  if (client.connect() && peer.accept() && peer.readPacket() == 0x10
+      && peer.send(connack, sizeof(connack))) {
+    while (!client.connected()) {
+      MQTTPlatform::delay(1);
+    }
+    runner.run(name, [&](uint64_t n) {
+      uint64_t start = passes.load();
+      for (uint64_t i = 0; i < n; ++i) {
+        if (client.publish("sensors/room1/temp", 0, false, PAYLOAD,
+                           sizeof(PAYLOAD))
+                == 0
+            || peer.readPacket() < 0) {
+          runner.fail(name, "publish failed");
+          return;
+        }
+      }
+      runner.count("loop_passes", passes.load() - start);
+    });
+  } else {
+    runner.fail(name, "handshake failed");
+  }
+  running = false;
+  network.join();
+  client.disconnect(true);
+}
+
+} // namespace
+
+void benchTransport(Runner &runner) {
+  {
+    Peer peer;
+    std::string host;
+    PosixTransport transport;
+    if (peer.listenUnix(host) && transport.connect(host.c_str(), 0)
+        && peer.accept()) {
+      benchPublish(runner, "transport/unix_publish_qos0_64B", transport, peer);
+      benchRoundTrip(runner, "transport/unix_publish_puback_64B", transport,
+                     peer);
+    } else {
+      runner.fail("transport", "unix socket setup failed");
+    }
+  }
+  {
+    Peer peer;
+    uint16_t port = 0;
+    PosixTransport transport;
+    if (peer.listenTcp(port)
+        && transport.connect(MQTTPlatform::IPv4Address(127, 0, 0, 1), port)
+        && peer.accept()) {
+      benchPublish(runner, "transport/tcp_publish_qos0_64B", transport, peer);
+      benchRoundTrip(runner, "transport/tcp_publish_puback_64B", transport,
+                     peer);
+    } else {
+      runner.fail("transport", "tcp loopback setup failed");
+    }
+  }
+  benchLoop(runner, "loop/publish_to_wire_event_driven", true);
+  benchLoop(runner, "loop/publish_to_wire_polling", false);
+}
+
+} // namespace NestBench
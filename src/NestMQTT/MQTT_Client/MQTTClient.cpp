@@ -0,0 +1,453 @@
+#include "MQTTClient.h"
+#include "MQTTAsyncTask.h"
+#include "MQTTUtility.h"
+
+MqttClient::MqttClient(MQTTTransport::Transport *transport,
+                       const MQTTClientDetails::MqttClientCfg &config)
+    : client_id(nullptr), _ownsClientId(false), _clientcfg(config),
+      _transport(transport), _tx(nullptr), _rx(nullptr),
+      _dispatcher(nullptr), _sessions(0), _connectSentUs(0) {
+  if (_clientcfg.path) {
+    client_id = _clientcfg.path;
+  } else {
+    client_id = generateRandomClientId();
+    _ownsClientId = true;
+  }
+
+  _tx = new MQTTTransport::Transmitter(this);
+  _rx = new MQTTTransport::Receiver(this);
+  addObserver(_tx);
+  if (_clientcfg.dispatch_settings.enabled) {
+    _dispatcher = new MQTTCore::Dispatcher(_clientcfg.dispatch_settings,
+                                           &MqttClient::_dispatchMessage,
+                                           this);
+    if (!_dispatcher->start()) {
+      // Fall back to running the callbacks on the network task
+      delete _dispatcher;
+      _dispatcher = nullptr;
+    }
+  }
+
+  _onConnectInternalCallbacks.push_back(
+      [this](bool, ConnackReturnCode code) {
+        if (code == ConnackReturnCode::MQTT_CONNACK_ACCEPTED) {
+          _endpoints.sample(MQTTPlatform::micros() - _connectSentUs);
+          if (_sessions++ > 0) {
+            _metrics.increment(Counter::RECONNECTS);
+          }
+          _statemachine.handleEvent(StateMachine::Event::CONNECTED);
+        } else {
+          _reportError(MQTTErrors::CONNECTION_REFUSED);
+          _closeConnection(static_cast<DisconnectReason>(code));
+        }
+      });
+  _onPingRespInternalCallbacks.push_back([this]() {
+    uint32_t rttUs;
+    if (_tx->_onPingResp(MQTTPlatform::micros(), rttUs)) {
+      _endpoints.sample(rttUs);
+    }
+  });
+}
+
+MqttClient::~MqttClient() {
+  if (_transport && _transport->connected()) {
+    _transport->stop();
+  }
+  _completions.failAll(MQTTErrors::CONNECTION_CLOSED);
+  delete _dispatcher;
+  delete _rx;
+  delete _tx;
+  if (_ownsClientId) {
+    delete[] client_id;
+  }
+}
+
+bool MqttClient::connected() const {
+  StateMachine::State state = _statemachine.getCurrentState();
+  return state == StateMachine::State::connected
+         || state == StateMachine::State::mqtt_ok;
+}
+
+bool MqttClient::disconnected() const {
+  return _statemachine.getCurrentState() == StateMachine::State::disconnected;
+}
+
+bool MqttClient::_accepting() const {
+  return connected()
+         || (_clientcfg.connections_settings.pipelined_connect
+             && _statemachine.getCurrentState()
+                    == StateMachine::State::connectingMqtt);
+}
+
+uint32_t MqttClient::_msUntilConnackTimeout() const {
+  if (_statemachine.getCurrentState()
+      != StateMachine::State::connectingMqtt) {
+    return UINT32_MAX;
+  }
+  uint32_t timeoutMs = _clientcfg.connections_settings.network_timeout_ms;
+  if (timeoutMs == 0) {
+    timeoutMs = MQTT_CONNACK_TIMEOUT_MS;
+  }
+  uint32_t waitedMs = (MQTTPlatform::micros() - _connectSentUs) / 1000;
+  return waitedMs < timeoutMs ? timeoutMs - waitedMs : 0;
+}
+
+const char *MqttClient::getClientId() const { return client_id; }
+
+bool MqttClient::connect() {
+  // Held throughout so a network task in mqttloop() never sees the
+  // half-open attempt as a lost connection
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  if (!disconnected()) {
+    return false;
+  }
+  _statemachine.handleEvent(StateMachine::Event::BEFORE_CONNECT);
+  if (!_openTransport()) {
+    _reportError(MQTTErrors::SOCKET_ERROR);
+    _statemachine.handleEvent(StateMachine::Event::BROKER_DOWN);
+    return false;
+  }
+  // TCP is up in one step here; TLS transports finish their handshake
+  // inside connect() as well.
+  _statemachine.handleEvent(StateMachine::Event::CONNECTED);
+  _statemachine.handleEvent(StateMachine::Event::CONNECTED);
+  return initiateConnectionRequest(); // queuing CONNECT wakes the loop
+}
+
+bool MqttClient::_openTransport() {
+  const ConnectionSettings &settings = _clientcfg.connections_settings;
+  size_t count = settings.endpoints ? settings.endpoint_count : 0;
+  _endpoints.configure(count);
+  if (count == 0) {
+    bool open = settings._useIp
+                    ? _transport->connect(settings._ip, settings._port)
+                    : _transport->connect(settings.host, settings._port);
+    if (open) {
+      _endpoints.connected(0);
+    } else {
+      _endpoints.failed(0);
+    }
+    return open;
+  }
+
+  // Best scored first; a reconnect after a broker degraded or failed
+  // starts with another one
+  uint8_t order[MQTT_ENDPOINTS];
+  MQTTTransport::Endpoint candidates[MQTT_ENDPOINTS];
+  count = _endpoints.count();
+  _endpoints.rank(order);
+  for (size_t i = 0; i < count; ++i) {
+    const BrokerEndpoint &endpoint = settings.endpoints[order[i]];
+    candidates[i] = {endpoint.host,
+                     endpoint.port ? endpoint.port : settings._port, false};
+  }
+  int winner = _transport->connectAny(
+      candidates, count,
+      settings.endpoint_stagger_ms ? settings.endpoint_stagger_ms
+                                   : MQTT_ENDPOINT_STAGGER_MS);
+  for (size_t i = 0; i < count; ++i) {
+    if (candidates[i].failed) {
+      _endpoints.failed(order[i]);
+    }
+  }
+  if (winner < 0) {
+    return false;
+  }
+  _endpoints.connected(order[winner]);
+  return true;
+}
+
+bool MqttClient::initiateConnectionRequest() {
+  _connectSentUs = MQTTPlatform::micros();
+  if (!_tx->sendConnectionRequest()) {
+    _reportError(MQTTErrors::OUT_OF_MEMORY);
+    _closeConnection(DisconnectReason::TCP_CONNECTION_LOST);
+    return false;
+  }
+  return true;
+}
+
+bool MqttClient::disconnect(bool force) {
+  if (disconnected()) {
+    return false;
+  }
+  if (!force && connected() && _tx->sendDisconnect()) {
+    // Best effort: whatever the socket takes now goes out before closing
+    MQTT_SEMAPHORE_TAKE();
+    while (_tx->_sendPacket() > 0 && _tx->_advanceBuffer()) {
+    }
+    MQTT_SEMAPHORE_GIVE();
+  }
+  _closeConnection(DisconnectReason::USER_OK);
+  return true;
+}
+
+void MqttClient::mqttloop() {
+  // Memory is watched and stale messages leave the queue even while there
+  // is no connection
+  _checkPressure(MQTTPlatform::millis());
+  _tx->_expireQueued(MQTTPlatform::millis());
+  MQTT_SEMAPHORE_TAKE();
+  bool idle = disconnected();
+  bool lost = !idle && !_transport->connected();
+  MQTT_SEMAPHORE_GIVE();
+  if (idle) {
+    return;
+  }
+  if (lost) {
+    _closeConnection(DisconnectReason::TCP_CONNECTION_LOST);
+    return;
+  }
+
+  if (_rx->_receivePacket() < 0) {
+    _closeConnection(DisconnectReason::TCP_CONNECTION_LOST);
+    return;
+  }
+
+  if (_msUntilConnackTimeout() == 0) {
+    // _closeConnection() counts it against the endpoint
+    _reportError(MQTTErrors::CONNECTION_CLOSED);
+    _closeConnection(DisconnectReason::TCP_CONNECTION_LOST);
+    return;
+  }
+
+  uint32_t now = MQTTPlatform::millis();
+  if (connected()) {
+    if (!_tx->_checkKeepAlive(now)) {
+      _endpoints.failed(_endpoints.current());
+      _reportError(MQTTErrors::CONNECTION_CLOSED);
+      _closeConnection(DisconnectReason::TCP_CONNECTION_LOST);
+      return;
+    }
+    _tx->_replayStored();
+    _tx->_releaseHeld(MQTTPlatform::micros());
+    _tx->_checkRetransmit(now);
+    _tx->_publishMetrics(now);
+  } else if (_accepting()) {
+    // Stored and held messages go out behind the CONNECT too
+    _tx->_replayStored();
+    _tx->_releaseHeld(MQTTPlatform::micros());
+  }
+
+  MQTT_SEMAPHORE_TAKE();
+  while (_tx->_sendPacket() > 0 && _tx->_advanceBuffer()) {
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+void MqttClient::mqttloop(uint32_t maxWaitMs) {
+  if (disconnected()) {
+    // Nothing to service until connect() queues a CONNECT, or until a
+    // queued message expires
+    uint32_t expiry = _tx->_msUntilExpiry(MQTTPlatform::millis());
+    _wakeup.wait(maxWaitMs < expiry ? maxWaitMs : expiry);
+    _checkPressure(MQTTPlatform::millis());
+    _tx->_expireQueued(MQTTPlatform::millis());
+    return;
+  }
+  uint32_t timeout = _tx->_msUntilNextTimer(MQTTPlatform::millis());
+  uint32_t connack = _msUntilConnackTimeout();
+  if (connack < timeout) {
+    timeout = connack;
+  }
+  if (maxWaitMs < timeout) {
+    timeout = maxWaitMs;
+  }
+  uint8_t interest = MQTTTransport::READY_READ;
+  if (_tx->_hasUnsent()) {
+    // Only left over when the socket stopped taking bytes
+    interest |= MQTTTransport::READY_WRITE;
+  }
+  _transport->waitReady(interest, timeout, &_wakeup);
+  mqttloop();
+}
+
+uint16_t MqttClient::publish(const char *topic, uint8_t qos, bool retain,
+                             const uint8_t *payload, size_t length,
+                             uint32_t ttlMs) {
+  if (!_accepting()) {
+    // With an offline store the message waits on flash for the next
+    // connection; its packet id is assigned when it is replayed
+    return _tx->store(topic, qos, retain, payload, length, ttlMs) ? 1 : 0;
+  }
+  return _tx->publish(topic, qos, retain, payload, length, ttlMs);
+}
+
+MQTTTransport::TopicHandle MqttClient::conflateTopic(const char *topic) {
+  return _tx->registerConflated(topic);
+}
+
+uint16_t MqttClient::publish(MQTTTransport::TopicHandle topic, uint8_t qos,
+                             bool retain, const uint8_t *payload,
+                             size_t length, uint32_t ttlMs) {
+  return _tx->publish(topic, qos, retain, payload, length, ttlMs);
+}
+
+uint16_t MqttClient::publish(const char *topic, uint8_t qos, bool retain,
+                             const char *payload) {
+  return publish(topic, qos, retain,
+                 reinterpret_cast<const uint8_t *>(payload),
+                 payload ? strlen(payload) : 0);
+}
+
+uint16_t MqttClient::publish(const char *topic, uint8_t qos, bool retain,
+                             MQTTCore::onPayloadInternalCallback callback,
+                             size_t length, uint32_t ttlMs) {
+  if (!_accepting()) {
+    return 0;
+  }
+  return _tx->publish(topic, qos, retain, callback, length, ttlMs);
+}
+
+Completion MqttClient::publishAsync(const char *topic, uint8_t qos,
+                                    bool retain, const uint8_t *payload,
+                                    size_t length, uint32_t ttlMs) {
+  if (!_accepting()) {
+    return Completion({MQTTErrors::CLIENT_NOT_CONNECTED, 0, 0});
+  }
+  if (qos == 0) {
+    // Nothing will acknowledge it: done once queued
+    return Completion({_tx->publish(topic, qos, retain, payload, length,
+                                    ttlMs)
+                           ? MQTTErrors::SUCCESS
+                           : MQTTErrors::SEND_BUFFER_IS_FULL,
+                       0, 0});
+  }
+  // The slot is bound before the loop task can see the ack. A stored
+  // message would get its packet id only when replayed, so it is not.
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  Completion completion = _completions.acquire();
+  if (completion.ready()) {
+    return completion;
+  }
+  uint16_t packetId
+      = _tx->publish(topic, qos, retain, payload, length, ttlMs, false);
+  if (packetId) {
+    _completions.bind(completion, packetId);
+  } else {
+    _completions.cancel(completion, MQTTErrors::SEND_BUFFER_IS_FULL);
+  }
+  return completion;
+}
+
+Completion MqttClient::subscribeAsync(const char *topic, uint8_t qos) {
+  if (!_accepting()) {
+    return Completion({MQTTErrors::CLIENT_NOT_CONNECTED, 0, 0});
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  Completion completion = _completions.acquire();
+  if (completion.ready()) {
+    return completion;
+  }
+  uint16_t packetId = _tx->subscribe(MQTTPacket::Subscription(topic, qos));
+  if (packetId) {
+    _completions.bind(completion, packetId);
+  } else {
+    _completions.cancel(completion, MQTTErrors::SEND_BUFFER_IS_FULL);
+  }
+  return completion;
+}
+
+Completion MqttClient::unsubscribeAsync(const char *topic) {
+  if (!_accepting()) {
+    return Completion({MQTTErrors::CLIENT_NOT_CONNECTED, 0, 0});
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  Completion completion = _completions.acquire();
+  if (completion.ready()) {
+    return completion;
+  }
+  uint16_t packetId = _tx->unsubscribe(MQTTPacket::Subscription(topic));
+  if (packetId) {
+    _completions.bind(completion, packetId);
+  } else {
+    _completions.cancel(completion, MQTTErrors::SEND_BUFFER_IS_FULL);
+  }
+  return completion;
+}
+
+void MqttClient::onConnect(OnConnectUserCallback callback) {
+  _onConnectUserCallbacks.push_back(callback);
+}
+
+void MqttClient::onDisconnect(OnDisconnectUserCallback callback) {
+  _onDisconnectUserCallbacks.push_back(callback);
+}
+
+void MqttClient::onSubscribe(OnSubscribeUserCallback callback) {
+  _onSubscribeUserCallbacks.push_back(callback);
+}
+
+void MqttClient::onUnsubscribe(OnUnsubscribeUserCallback callback) {
+  _onUnsubscribeUserCallbacks.push_back(callback);
+}
+
+void MqttClient::onMessage(OnMessageUserCallback callback,
+                           const char *filter) {
+  _onMessageUserCallbacks.push_back({filter, 0, callback});
+}
+
+void MqttClient::onPublish(OnPublishUserCallback callback) {
+  _onPublishUserCallbacks.push_back(callback);
+}
+
+void MqttClient::onError(OnErrorUserCallback callback) {
+  _onErrorUserCallbacks.push_back(callback);
+}
+
+void MqttClient::onMemoryPressure(OnMemoryPressureUserCallback callback) {
+  _onMemoryPressureUserCallbacks.push_back(callback);
+}
+
+void MqttClient::_closeConnection(DisconnectReason reason) {
+  if (reason != DisconnectReason::USER_OK
+      && _statemachine.getCurrentState()
+             == StateMachine::State::connectingMqtt) {
+    // The broker refused the CONNECT or never answered it
+    _endpoints.failed(_endpoints.current());
+  }
+  _transport->stop();
+  _tx->_onConnectionClosed();
+  _statemachine.setState(StateMachine::State::disconnected);
+  for (auto &cb : _onDisconnectUserCallbacks) {
+    cb(false, reason);
+  }
+}
+
+void MqttClient::_deliverMessage(const std::string &topic,
+                                 const std::string &payload,
+                                 MessageProperties properties) {
+  size_t length = payload.size();
+  for (auto &entry : _onMessageUserCallbacks) {
+    if (MQTTUtility::topicMatches(entry.topic.c_str(), topic.c_str())) {
+      entry.callback(topic, payload, properties, length, 0, length);
+    }
+  }
+}
+
+void MqttClient::_dispatchMessage(const InboundMessage &message,
+                                  void *self) {
+  static_cast<MqttClient *>(self)->_deliverMessage(
+      message.topic, message.payload, message.properties);
+}
+
+void MqttClient::_checkPressure(uint32_t now) {
+  if (!_tx->_checkPressure(now)) {
+    return;
+  }
+  MQTTClientDetails::PressureLevel level = _tx->pressureLevel();
+  if (_dispatcher) {
+    _dispatcher->constrain(
+        _tx->_pressureApplies(MQTTClientDetails::PRESSURE_SHRINK_RX));
+  }
+  for (auto &cb : _onMemoryPressureUserCallbacks) {
+    cb(level);
+  }
+}
+
+void MqttClient::_reportError(MQTTErrors error) {
+  _metrics.recordError(error);
+  for (auto &cb : _onErrorUserCallbacks) {
+    cb(0, error);
+  }
+}
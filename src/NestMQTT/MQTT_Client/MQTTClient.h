@@ -2,14 +2,17 @@
 #define MQTT_CLIENT_H_
 #include "MQTTCallbacks.h"
 #include "MQTTClientConfig.h"
+#include "MQTTCompletion.h"
 #include "MQTTCore.h"
+#include "MQTTDispatcher.h"
+#include "MQTTEndpoints.h"
+#include "MQTTMetrics.h"
+#include "MQTTPlatform.h"
+#include "MQTTTrace.h"
 #include "MQTTReceiver.h"
 #include "MQTTStateMachine.h"
 #include "MQTTTransmitter.h"
 #include "MQTTTransport.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
-#include <Arduino.h>
 #include <atomic>
 #include <random>
 #include <utility>
@@ -23,39 +26,95 @@ class MqttClient {
   friend class MQTTTransport::Receiver;
 
 public:
+  MqttClient(MQTTTransport::Transport *transport,
+             const MQTTClientDetails::MqttClientCfg &config);
   virtual ~MqttClient();
   bool connected() const;
   bool disconnected() const;
   bool connect();
   bool disconnect(bool force = false);
   const char *getClientId() const;
+  // Polling mode: one non-blocking pass over receive, timers and send.
   void mqttloop();
+  // Event-driven mode: sleeps until the socket is ready, another task
+  // queues a packet or a timer falls due, at most maxWaitMs, then runs one
+  // pass. A network task can call it in a loop and idles at zero CPU.
+  void mqttloop(uint32_t maxWaitMs);
   template <typename... Args>
   uint16_t subscribe(const char *topic, uint8_t qos, Args &&...args);
   template <typename... Args>
   uint16_t unsubscribe(const char *topic, Args &&...args);
+  // With a ttlMs, a message that has not started going out that many
+  // milliseconds later is dropped from the queue instead; QoS 1/2 ones
+  // complete with MESSAGE_EXPIRED. While disconnected, publish() returns 0
+  // unless an offline store is configured, which keeps the message for
+  // the next connection and returns 1.
   uint16_t publish(const char *topic, uint8_t qos, bool retain,
-                   const uint8_t *payload, size_t length);
+                   const uint8_t *payload, size_t length, uint32_t ttlMs = 0);
   uint16_t publish(const char *topic, uint8_t qos, bool retain,
                    const char *payload);
   uint16_t publish(const char *topic, uint8_t qos, bool retain,
-                   MQTTCore::onPayloadInternalCallback callback, size_t length);
+                   MQTTCore::onPayloadInternalCallback callback, size_t length,
+                   uint32_t ttlMs = 0);
+  // Latest value wins: a publish on the handle replaces the topic's
+  // message that has not gone out yet, in its place in the queue. Each
+  // topic holds at most one message, so these are queued while
+  // disconnected too. The handle is invalid when the table is full.
+  MQTTTransport::TopicHandle conflateTopic(const char *topic);
+  uint16_t publish(MQTTTransport::TopicHandle topic, uint8_t qos, bool retain,
+                   const uint8_t *payload, size_t length, uint32_t ttlMs = 0);
+  // Same operations returning a handle that completes on the matching ack,
+  // for code that wants to co_await or chain on one particular operation.
+  Completion publishAsync(const char *topic, uint8_t qos, bool retain,
+                          const uint8_t *payload, size_t length,
+                          uint32_t ttlMs = 0);
+  Completion subscribeAsync(const char *topic, uint8_t qos);
+  Completion unsubscribeAsync(const char *topic);
 
-protected:
-  SemaphoreHandle_t _xSemaphore;
-  TaskHandle_t _taskHandle;
+  void onConnect(OnConnectUserCallback callback);
+  void onDisconnect(OnDisconnectUserCallback callback);
+  void onSubscribe(OnSubscribeUserCallback callback);
+  void onUnsubscribe(OnUnsubscribeUserCallback callback);
+  // Filters may use + and #; without one the callback sees every message
+  void onMessage(OnMessageUserCallback callback, const char *filter = "#");
+  void onPublish(OnPublishUserCallback callback);
+  void onError(OnErrorUserCallback callback);
+  // Runs on the network task when the memory pressure level changes
+  // (pressure_settings), so the application can shed load of its own.
+  void onMemoryPressure(OnMemoryPressureUserCallback callback);
 
 private:
   bool initiateConnectionRequest();
+  // Opens the transport to host/_ip, or to the best endpoint that answers.
+  bool _openTransport();
+  // Connected, or waiting for the CONNACK of a pipelined connect.
+  bool _accepting() const;
+  // UINT32_MAX unless a CONNACK is awaited; 0 once it is overdue.
+  uint32_t _msUntilConnackTimeout() const;
+  void _closeConnection(DisconnectReason reason);
+  void _reportError(MQTTErrors error);
+  void _checkPressure(uint32_t now);
+  void _deliverMessage(const std::string &topic, const std::string &payload,
+                       MessageProperties properties);
+  static void _dispatchMessage(const InboundMessage &message, void *self);
   const char *client_id;
-  StateMachine::State _clientState;
+  bool _ownsClientId;
   StateMachine _statemachine;
+  MQTTCore::Metrics _metrics;
+  MQTTCore::LatencyTracer _tracer;
   MQTTClientDetails::MqttClientCfg _clientcfg;
   std::vector<CfgObserver *> observers;
   MQTTTransport::Transport *_transport;
   MQTTTransport::Transmitter *_tx;
   MQTTTransport::Receiver *_rx;
-  void updateClientState() { _clientState = _statemachine.getCurrentState(); }
+  // Runs onMessage() callbacks off the network task when configured
+  MQTTCore::Dispatcher *_dispatcher;
+  // Signalled by new submissions so mqttloop(maxWaitMs) wakes at once
+  MQTTPlatform::Notification _wakeup;
+  MQTTCore::CompletionPool _completions;
+  uint32_t _sessions; // CONNACKs accepted, the first one is no reconnect
+  MQTTTransport::EndpointSelector _endpoints;
+  uint32_t _connectSentUs; // when the last CONNECT was queued
 
   std::vector<OnConnectUserCallback> _onConnectUserCallbacks;
   std::vector<OnDisconnectUserCallback> _onDisconnectUserCallbacks;
@@ -64,6 +123,7 @@ private:
   std::vector<OnMessageUserCallback_t> _onMessageUserCallbacks;
   std::vector<OnPublishUserCallback> _onPublishUserCallbacks;
   std::vector<OnErrorUserCallback> _onErrorUserCallbacks;
+  std::vector<OnMemoryPressureUserCallback> _onMemoryPressureUserCallbacks;
 
   std::vector<OnConnAckInternalCallback> _onConnectInternalCallbacks;
   std::vector<OnPingRespInternalCallback> _onPingRespInternalCallbacks;
@@ -119,7 +179,78 @@ public:
       observer->updateConfig(newConfig);
     }
   }
-  StateMachine::State getClientState() const { return _clientState; }
+  StateMachine::State getClientState() const {
+    return _statemachine.getCurrentState();
+  }
+  void getMetrics(MQTTCore::MetricsSnapshot &snapshot) const {
+    _metrics.snapshot(snapshot, MQTTPlatform::millis());
+  }
+  const MQTTCore::LatencyTracer &getTracer() const { return _tracer; }
+  // Unsent packets in one transmit class (MQTTClientDetails::TxClass)
+  size_t getQueueDepth(uint8_t txClass) const {
+    return _tx->queueDepth(txClass);
+  }
+  // QoS 1/2 publishes, PUBRELs and (un)subscribes waiting for their ack
+  size_t getInFlightCount() const { return _tx->inFlight(); }
+  // Queued messages replaced through conflateTopic() handles
+  uint32_t getConflationCount() const { return _tx->conflations(); }
+  // Messages dropped unsent because their time-to-live ran out
+  uint32_t getExpiredCount() const { return _tx->expired(); }
+  // Offline store activity; all zero without one
+  MQTTTransport::OfflineStore::Stats getStoreStats() const {
+    return _tx->storeStats();
+  }
+  // Persistent session journal activity; all zero without one
+  MQTTTransport::SessionStore::Stats getSessionStats() const {
+    return _tx->sessionStats();
+  }
+  // NORMAL unless pressure_settings.enabled
+  MQTTClientDetails::PressureLevel getPressureLevel() const {
+    return _tx->pressureLevel();
+  }
+  // Level changes and the publishes each policy refused, conflated or
+  // stored
+  MQTTTransport::PressureMonitor::Stats getPressureStats() const {
+    return _tx->pressureStats();
+  }
+  // Packets written ahead of the CONNACK, and QoS 0 publishes requeued
+  // or lost with it; all zero unless pipelined_connect
+  MQTTTransport::Transmitter::PipelineStats getPipelineStats() const {
+    return _tx->pipelineStats();
+  }
+  // Round trip and failures of one broker endpoint, as ranked for the
+  // next connect; without connections_settings.endpoints, host/_ip is 0
+  MQTTTransport::EndpointSelector::Stats getEndpointStats(
+      size_t endpoint) const {
+    return _endpoints.stats(endpoint);
+  }
+  // Index of the endpoint connected to last
+  size_t getEndpoint() const { return _endpoints.current(); }
+  // Passed, delayed, conflated and dropped publishes of one shaping rule
+  MQTTTransport::Shaper::Stats getShapeStats(uint8_t rule) const {
+    return _tx->shapeStats(rule);
+  }
+  // nullptr unless dispatch_settings.enabled
+  const MQTTCore::Dispatcher *getDispatcher() const { return _dispatcher; }
 };
 
+template <typename... Args>
+uint16_t MqttClient::subscribe(const char *topic, uint8_t qos,
+                               Args &&...args) {
+  if (!_accepting()) {
+    return 0;
+  }
+  return _tx->subscribe(
+      MQTTPacket::Subscription(topic, qos, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+uint16_t MqttClient::unsubscribe(const char *topic, Args &&...args) {
+  if (!_accepting()) {
+    return 0;
+  }
+  return _tx->unsubscribe(
+      MQTTPacket::Subscription(topic, std::forward<Args>(args)...));
+}
+
 #endif // MQTT_CLIENT_H_
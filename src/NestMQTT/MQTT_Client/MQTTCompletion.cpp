@@ -0,0 +1,219 @@
+#include "MQTTCompletion.h"
+#include "MQTTPlatform.h"
+
+namespace MQTTCore {
+
+Completion::~Completion() { _release(); }
+
+Completion::Completion(Completion &&other) noexcept
+    : _pool(other._pool), _slot(other._slot), _generation(other._generation),
+      _result(other._result) {
+  other._pool = nullptr;
+  other._result = CompletionResult{MQTTErrors::UNKNOWN, 0, 0};
+}
+
+Completion &Completion::operator=(Completion &&other) noexcept {
+  if (this != &other) {
+    _release();
+    _pool = other._pool;
+    _slot = other._slot;
+    _generation = other._generation;
+    _result = other._result;
+    other._pool = nullptr;
+    other._result = CompletionResult{MQTTErrors::UNKNOWN, 0, 0};
+  }
+  return *this;
+}
+
+void Completion::_release() {
+  if (!_pool) {
+    return;
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  CompletionPool::Slot *slot = _pool->_lookup(*this);
+  if (slot) {
+    if (slot->state == CompletionPool::SlotState::PENDING) {
+      // The ack still has to arrive; the pool frees the slot then. A
+      // callback set with then() still runs.
+      slot->detached = true;
+#if MQTT_HAS_COROUTINES
+      slot->waiter = nullptr;
+#endif
+    } else {
+      slot->state = CompletionPool::SlotState::FREE;
+    }
+  }
+  _pool = nullptr;
+}
+
+bool Completion::ready() const {
+  if (!_pool) {
+    return true;
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  CompletionPool::Slot *slot = _pool->_lookup(*this);
+  return !slot || slot->state == CompletionPool::SlotState::DONE;
+}
+
+CompletionResult Completion::result() const {
+  if (!_pool) {
+    return _result;
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  CompletionPool::Slot *slot = _pool->_lookup(*this);
+  return slot ? slot->result : CompletionResult{MQTTErrors::UNKNOWN, 0, 0};
+}
+
+uint16_t Completion::packetId() const {
+  if (!_pool) {
+    return _result.packetId;
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  CompletionPool::Slot *slot = _pool->_lookup(*this);
+  return slot ? slot->packetId : 0;
+}
+
+void Completion::then(CompletionCallback callback, void *context) {
+  if (_pool) {
+    MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+    CompletionPool::Slot *slot = _pool->_lookup(*this);
+    if (slot && slot->state != CompletionPool::SlotState::DONE) {
+      slot->callback = callback;
+      slot->context = context;
+      return;
+    }
+  }
+  callback(result(), context);
+}
+
+#if MQTT_HAS_COROUTINES
+bool Completion::Awaiter::await_suspend(std::coroutine_handle<> waiter) {
+  if (!completion._pool) {
+    return false;
+  }
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  CompletionPool::Slot *slot = completion._pool->_lookup(completion);
+  if (!slot || slot->state == CompletionPool::SlotState::DONE) {
+    return false; // completed since await_ready(): carry on without waiting
+  }
+  slot->waiter = waiter;
+  return true;
+}
+#endif
+
+CompletionPool::CompletionPool() {
+  for (Slot &slot : _slots) {
+    slot = Slot{};
+    slot.state = SlotState::FREE;
+  }
+}
+
+Completion CompletionPool::acquire() {
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  for (size_t i = 0; i < SIZE; ++i) {
+    Slot &slot = _slots[i];
+    if (slot.state != SlotState::FREE) {
+      continue;
+    }
+    uint16_t generation = slot.generation + 1;
+    slot = Slot{};
+    slot.state = SlotState::RESERVED;
+    slot.generation = generation;
+    return Completion(this, static_cast<uint8_t>(i), generation);
+  }
+  return Completion(CompletionResult{MQTTErrors::OUT_OF_MEMORY, 0, 0});
+}
+
+void CompletionPool::bind(Completion &completion, uint16_t packetId) {
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  Slot *slot = _lookup(completion);
+  if (slot && slot->state == SlotState::RESERVED) {
+    slot->packetId = packetId;
+    slot->state = SlotState::PENDING;
+  }
+}
+
+void CompletionPool::cancel(Completion &completion, MQTTErrors error) {
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  Slot *slot = _lookup(completion);
+  if (slot) {
+    slot->state = SlotState::FREE;
+  }
+  // Nothing was queued, so the handle keeps the result itself
+  completion._pool = nullptr;
+  completion._result = CompletionResult{error, 0, 0};
+}
+
+bool CompletionPool::complete(uint16_t packetId, MQTTErrors error,
+                              uint8_t returnCode) {
+  Slot *found = nullptr;
+  MQTTPlatform::clientMutex().lock();
+  for (Slot &slot : _slots) {
+    if (slot.state == SlotState::PENDING && slot.packetId == packetId) {
+      found = &slot;
+      break;
+    }
+  }
+  if (!found) {
+    MQTTPlatform::clientMutex().unlock();
+    return false;
+  }
+  // Hands the lock over to _finish(), which releases it
+  _finish(*found, CompletionResult{error, packetId, returnCode});
+  return true;
+}
+
+void CompletionPool::failAll(MQTTErrors error) {
+  for (Slot &slot : _slots) {
+    MQTTPlatform::clientMutex().lock();
+    if (slot.state == SlotState::PENDING) {
+      _finish(slot, CompletionResult{error, slot.packetId, 0});
+    } else {
+      MQTTPlatform::clientMutex().unlock();
+    }
+  }
+}
+
+size_t CompletionPool::inUse() const {
+  MQTTPlatform::LockGuard lock(MQTTPlatform::clientMutex());
+  size_t count = 0;
+  for (const Slot &slot : _slots) {
+    count += slot.state != SlotState::FREE;
+  }
+  return count;
+}
+
+CompletionPool::Slot *CompletionPool::_lookup(const Completion &completion) {
+  Slot &slot = _slots[completion._slot];
+  if (slot.state == SlotState::FREE
+      || slot.generation != completion._generation) {
+    return nullptr;
+  }
+  return &slot;
+}
+
+// Entered with the client lock held; the callback and the coroutine run
+// after it is released so they may issue further operations freely.
+void CompletionPool::_finish(Slot &slot, const CompletionResult &result) {
+  slot.result = result;
+  slot.state = slot.detached ? SlotState::FREE : SlotState::DONE;
+  CompletionCallback callback = slot.callback;
+  void *context = slot.context;
+#if MQTT_HAS_COROUTINES
+  std::coroutine_handle<> waiter = slot.waiter;
+  slot.waiter = nullptr;
+#endif
+  slot.callback = nullptr;
+  MQTTPlatform::clientMutex().unlock();
+
+  if (callback) {
+    callback(result, context);
+  }
+#if MQTT_HAS_COROUTINES
+  if (waiter) {
+    waiter.resume();
+  }
+#endif
+}
+
+} // namespace MQTTCore
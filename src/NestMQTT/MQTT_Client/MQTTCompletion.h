@@ -0,0 +1,125 @@
+#ifndef MQTT_COMPLETION_H_
+#define MQTT_COMPLETION_H_
+
+#include "MQTTConfig.h"
+#include "MQTTError.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L \
+    && __has_include(<coroutine>)
+#include <coroutine>
+#define MQTT_HAS_COROUTINES 1
+#else
+#define MQTT_HAS_COROUTINES 0
+#endif
+
+namespace MQTTCore {
+
+struct CompletionResult {
+  MQTTErrors error;    // SUCCESS, or why the operation did not complete
+  uint16_t packetId;   // 0 for QoS 0 publishes
+  uint8_t returnCode;  // SUBACK: granted QoS or 0x80; otherwise 0
+};
+
+using CompletionCallback = void (*)(const CompletionResult &result,
+                                    void *context);
+
+class CompletionPool;
+
+// Handle to one publish, subscribe or unsubscribe. It completes on PUBACK
+// (QoS 1), PUBCOMP (QoS 2), SUBACK or UNSUBACK on the task running
+// mqttloop(); QoS 0 publishes and operations that could not be queued are
+// complete from the start. Handles must not outlive their client.
+class Completion {
+public:
+  explicit Completion(const CompletionResult &result)
+      : _pool(nullptr), _slot(0), _generation(0), _result(result) {}
+  ~Completion();
+  Completion(Completion &&other) noexcept;
+  Completion &operator=(Completion &&other) noexcept;
+  Completion(const Completion &) = delete;
+  Completion &operator=(const Completion &) = delete;
+
+  bool ready() const;
+  // Meaningful once ready().
+  CompletionResult result() const;
+  uint16_t packetId() const;
+  // Runs callback once complete, immediately if it already is. The
+  // callback survives the handle, so fire-and-forget use is fine.
+  void then(CompletionCallback callback, void *context);
+
+#if MQTT_HAS_COROUTINES
+  struct Awaiter {
+    Completion &completion;
+    bool await_ready() const { return completion.ready(); }
+    bool await_suspend(std::coroutine_handle<> waiter);
+    CompletionResult await_resume() const { return completion.result(); }
+  };
+  // co_await yields the CompletionResult; the coroutine resumes on the
+  // task running mqttloop().
+  Awaiter operator co_await() { return Awaiter{*this}; }
+#endif
+
+private:
+  friend class CompletionPool;
+  Completion(CompletionPool *pool, uint8_t slot, uint16_t generation)
+      : _pool(pool), _slot(slot), _generation(generation), _result{} {}
+  void _release();
+
+  CompletionPool *_pool; // nullptr once the result is held inline
+  uint8_t _slot;
+  uint16_t _generation;
+  CompletionResult _result;
+};
+
+// Fixed set of completion slots, so issuing an operation never allocates.
+// Slots are matched to acks by packet id, which the transmitter keeps
+// unique among operations in flight.
+class CompletionPool {
+public:
+  static constexpr size_t SIZE = MQTT_COMPLETION_SLOTS;
+
+  CompletionPool();
+
+  // Reserves a slot for an operation about to be queued; the handle is
+  // complete with OUT_OF_MEMORY when every slot is busy. Call bind() with
+  // the packet id once queued, or cancel() if queuing failed.
+  Completion acquire();
+  void bind(Completion &completion, uint16_t packetId);
+  void cancel(Completion &completion, MQTTErrors error);
+
+  // Called from the receiver; false when no operation waits on packetId.
+  bool complete(uint16_t packetId, MQTTErrors error, uint8_t returnCode = 0);
+  // Completes every operation still in flight, e.g. when the client goes.
+  void failAll(MQTTErrors error);
+
+  size_t inUse() const;
+
+private:
+  friend class Completion;
+
+  enum class SlotState : uint8_t { FREE, RESERVED, PENDING, DONE };
+
+  struct Slot {
+    SlotState state;
+    bool detached; // handle gone: free the slot on completion
+    uint16_t generation;
+    uint16_t packetId;
+    CompletionResult result;
+    CompletionCallback callback;
+    void *context;
+#if MQTT_HAS_COROUTINES
+    std::coroutine_handle<> waiter;
+#endif
+  };
+
+  Slot *_lookup(const Completion &completion);
+  void _finish(Slot &slot, const CompletionResult &result);
+
+  Slot _slots[SIZE];
+};
+
+} // namespace MQTTCore
+
+#endif // MQTT_COMPLETION_H_
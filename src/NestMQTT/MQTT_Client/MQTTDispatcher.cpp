@@ -0,0 +1,300 @@
+#include "MQTTDispatcher.h"
+#include <stdio.h>
+
+namespace MQTTCore {
+
+Dispatcher::Dispatcher(const MQTTClientDetails::DispatchSettings &settings,
+                       Deliver deliver, void *context)
+    : _settings(settings), _deliver(deliver), _context(context), _free(0),
+      _strandCount(settings.workers > 1 ? STRANDS : 1), _spillBytes(0),
+      _constrained(false), _inFlight(0),
+      _workerCount(settings.workers ? settings.workers : 1),
+      _stopping(false), _stats{} {
+  size_t depth = settings.queue_depth ? settings.queue_depth
+                                      : MQTT_DISPATCH_QUEUE_DEPTH;
+  if (depth >= NONE) {
+    depth = NONE - 1;
+  }
+  _slots.resize(depth);
+  _next.resize(depth);
+  for (size_t i = 0; i < depth; ++i) {
+    _next[i] = i + 1 < depth ? static_cast<uint16_t>(i + 1) : NONE;
+  }
+  for (Strand &strand : _strands) {
+    strand = Strand{NONE, NONE, false};
+  }
+  _workers.reset(new Worker[_workerCount]);
+  for (size_t i = 0; i < _workerCount; ++i) {
+    Worker &worker = _workers[i];
+    worker.dispatcher = this;
+    worker.index = static_cast<uint8_t>(i);
+    worker.idle = false;
+    worker.runnable = RunQueue{};
+  }
+}
+
+Dispatcher::~Dispatcher() { stop(); }
+
+bool Dispatcher::start() {
+  _stopping = false;
+  for (size_t i = 0; i < _workerCount; ++i) {
+    char name[16];
+    if (_workerCount > 1) {
+      snprintf(name, sizeof(name), "mqtt_dispatch%u",
+               static_cast<unsigned>(i));
+    } else {
+      snprintf(name, sizeof(name), "mqtt_dispatch");
+    }
+    // Pinned workers take consecutive cores from the configured one
+    MQTTPlatform::ThreadOptions options{
+        name, _settings.stack_size, _settings.priority,
+        _settings.pin_to_core, static_cast<uint8_t>(_settings.core + i)};
+    if (!_workers[i].thread.start(&Dispatcher::_run, &_workers[i],
+                                  options)) {
+      stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+void Dispatcher::stop() {
+  if (!_workers[0].thread.started()) {
+    return;
+  }
+  _stopping = true;
+  for (size_t i = 0; i < _workerCount; ++i) {
+    _workers[i].wake.notify();
+  }
+  for (size_t i = 0; i < _workerCount; ++i) {
+    _workers[i].thread.join();
+  }
+  _room.notify();
+}
+
+bool Dispatcher::post(InboundMessage &message) {
+  for (;;) {
+    {
+      MQTTPlatform::LockGuard lock(_lock);
+      if (_stopping) {
+        return false;
+      }
+      if (_hasRoom()) {
+        uint16_t slot = _free;
+        _free = _next[slot];
+        _slots[slot] = std::move(message);
+        _queued();
+        _append(slot);
+        return true;
+      }
+      if (_settings.policy == MQTTClientDetails::DispatchPolicy::DROP_QOS0
+          && message.properties.qos == 0) {
+        ++_stats.dropped;
+        return false;
+      }
+      size_t size = message.topic.size() + message.payload.size();
+      if (_settings.policy == MQTTClientDetails::DispatchPolicy::SPILL
+          && !_constrained.load(std::memory_order_relaxed)
+          && _spillBytes + size <= _settings.spill_limit) {
+        _spillBytes += size;
+        _spill.push_back(std::move(message));
+        ++_stats.spilled;
+        _queued();
+        return true;
+      }
+      ++_stats.blocked;
+    }
+    // Full: the network task stops reading until the handlers catch up,
+    // and TCP flow control pushes back on the broker
+    _room.wait(MQTT_POLL_INTERVAL_MS);
+  }
+}
+
+bool Dispatcher::flush(uint32_t timeoutMs) const {
+  uint32_t start = MQTTPlatform::millis();
+  while (_inFlight.load() > 0) {
+    if (MQTTPlatform::millis() - start >= timeoutMs) {
+      return false;
+    }
+    MQTTPlatform::yield();
+  }
+  return true;
+}
+
+void Dispatcher::constrain(bool constrained) {
+  MQTTPlatform::LockGuard lock(_lock);
+  _constrained = constrained;
+  if (constrained) {
+    // Hands back the blocks the overflow list kept from earlier bursts
+    _spill.shrink_to_fit();
+  }
+}
+
+size_t Dispatcher::depth() const { return _inFlight.load(); }
+
+Dispatcher::Stats Dispatcher::stats() const {
+  MQTTPlatform::LockGuard lock(_lock);
+  return _stats;
+}
+
+void Dispatcher::_run(void *param) {
+  Worker &worker = *static_cast<Worker *>(param);
+  Dispatcher &dispatcher = *worker.dispatcher;
+  InboundMessage message;
+  dispatcher._lock.lock();
+  for (;;) {
+    uint16_t index = dispatcher._take(worker);
+    if (index == NONE) {
+      if (dispatcher._stopping) {
+        break;
+      }
+      worker.idle = true;
+      dispatcher._lock.unlock();
+      worker.wake.wait(UINT32_MAX);
+      dispatcher._lock.lock();
+      worker.idle = false;
+      continue;
+    }
+
+    Strand &strand = dispatcher._strands[index];
+    uint16_t slot = strand.head;
+    strand.head = dispatcher._next[slot];
+    if (strand.head == NONE) {
+      strand.tail = NONE;
+    }
+    message = std::move(dispatcher._slots[slot]);
+    dispatcher._release(slot);
+    ++dispatcher._stats.dispatched;
+    dispatcher._lock.unlock();
+
+    dispatcher._deliver(message, dispatcher._context);
+    dispatcher._inFlight.fetch_sub(1);
+
+    dispatcher._lock.lock();
+    // One message per turn, so busy strands share the worker fairly
+    if (strand.head != NONE) {
+      worker.runnable.push(index);
+      if (worker.runnable.count > 1) {
+        dispatcher._wakeIdle();
+      }
+    } else {
+      strand.scheduled = false;
+    }
+  }
+  dispatcher._lock.unlock();
+}
+
+uint16_t Dispatcher::_strandOf(const std::string &topic) const {
+  if (_strandCount == 1) {
+    return 0;
+  }
+  uint32_t key;
+  if (_settings.ordering_key) {
+    key = _settings.ordering_key(topic);
+  } else {
+    // FNV-1a
+    key = 2166136261u;
+    for (char c : topic) {
+      key = (key ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+  }
+  return static_cast<uint16_t>(key % _strandCount);
+}
+
+bool Dispatcher::_hasRoom() const {
+  // While anything sits in the spill list freed slots are refilled from
+  // there first, so new messages queue behind it
+  return _spill.empty() && _free != NONE;
+}
+
+void Dispatcher::_append(uint16_t slot) {
+  uint16_t index = _strandOf(_slots[slot].topic);
+  Strand &strand = _strands[index];
+  _next[slot] = NONE;
+  if (strand.tail == NONE) {
+    strand.head = slot;
+  } else {
+    _next[strand.tail] = slot;
+  }
+  strand.tail = slot;
+  if (strand.scheduled) {
+    return; // the worker running it picks the message up in turn
+  }
+  strand.scheduled = true;
+  Worker &owner = _workers[index % _workerCount];
+  owner.runnable.push(index);
+  if (owner.idle) {
+    owner.wake.notify();
+  } else {
+    _wakeIdle();
+  }
+}
+
+void Dispatcher::_wakeIdle() {
+  for (size_t i = 0; i < _workerCount; ++i) {
+    if (_workers[i].idle) {
+      _workers[i].wake.notify();
+      return;
+    }
+  }
+}
+
+void Dispatcher::_queued() {
+  uint32_t inFlight = _inFlight.fetch_add(1) + 1;
+  if (inFlight > _stats.highWater) {
+    _stats.highWater = inFlight;
+  }
+}
+
+uint16_t Dispatcher::_take(Worker &worker) {
+  if (worker.runnable.count > 0) {
+    return worker.runnable.popFront();
+  }
+  // Steal the strand the busiest peer would get to last
+  Worker *victim = nullptr;
+  for (size_t i = 0; i < _workerCount; ++i) {
+    Worker &peer = _workers[i];
+    if (peer.runnable.count > 0
+        && (!victim || peer.runnable.count > victim->runnable.count)) {
+      victim = &peer;
+    }
+  }
+  if (!victim) {
+    return NONE;
+  }
+  ++_stats.stolen;
+  return victim->runnable.popBack();
+}
+
+void Dispatcher::_release(uint16_t slot) {
+  if (!_spill.empty()) {
+    InboundMessage &next = _spill.front();
+    _spillBytes -= next.topic.size() + next.payload.size();
+    _slots[slot] = std::move(next);
+    _spill.pop_front();
+    _append(slot);
+  } else {
+    _next[slot] = _free;
+    _free = slot;
+  }
+  _room.notify();
+}
+
+void Dispatcher::RunQueue::push(uint16_t strand) {
+  items[(head + count) % STRANDS] = strand;
+  ++count;
+}
+
+uint16_t Dispatcher::RunQueue::popFront() {
+  uint16_t strand = items[head];
+  head = (head + 1) % STRANDS;
+  --count;
+  return strand;
+}
+
+uint16_t Dispatcher::RunQueue::popBack() {
+  --count;
+  return items[(head + count) % STRANDS];
+}
+
+} // namespace MQTTCore
@@ -0,0 +1,138 @@
+#ifndef MQTT_DISPATCHER_H_
+#define MQTT_DISPATCHER_H_
+
+#include "MQTTClientConfig.h"
+#include "MQTTConfig.h"
+#include "MQTTCore.h"
+#include "MQTTPlatform.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace MQTTCore {
+
+struct InboundMessage {
+  std::string topic;
+  std::string payload;
+  MessageProperties properties;
+};
+
+// Runs onMessage() callbacks on tasks of their own so a slow handler does
+// not hold up reading, acks and keep alive on the network task. Messages
+// sit in a pool of queue_depth slots; post() moves the decoded topic and
+// payload strings in and a worker moves them out again, so the payload is
+// never copied on the way.
+//
+// With several workers, messages are sorted into strands by ordering key
+// (the topic unless the settings supply a key function). A strand runs on
+// one worker at a time, so messages with the same key keep their order
+// while different keys run in parallel. Each worker has a queue of
+// runnable strands and takes from the others' when its own is empty. A
+// single worker uses one strand and delivers in arrival order.
+class Dispatcher {
+public:
+  using Deliver = void (*)(const InboundMessage &message, void *context);
+
+  struct Stats {
+    uint32_t dispatched;
+    uint32_t dropped; // QoS 0 messages discarded under DROP_QOS0
+    uint32_t spilled; // messages that went through the overflow list
+    uint32_t blocked; // times the network task waited for room
+    uint32_t stolen;  // strands a worker took from another's queue
+    uint32_t highWater;
+  };
+
+  static constexpr size_t STRANDS = MQTT_DISPATCH_STRANDS;
+
+  Dispatcher(const MQTTClientDetails::DispatchSettings &settings,
+             Deliver deliver, void *context);
+  ~Dispatcher();
+  Dispatcher(const Dispatcher &) = delete;
+  Dispatcher &operator=(const Dispatcher &) = delete;
+
+  bool start();
+  // Delivers what is still queued, then ends the workers.
+  void stop();
+
+  // Network task only. Takes the strings out of message; false when the
+  // message was dropped.
+  bool post(InboundMessage &message);
+  // Waits until every message posted so far has been delivered.
+  bool flush(uint32_t timeoutMs) const;
+  // While constrained a full queue blocks instead of spilling onto the
+  // heap, for when memory runs short.
+  void constrain(bool constrained);
+
+  size_t depth() const;
+  size_t workers() const { return _workerCount; }
+  Stats stats() const;
+
+private:
+  static constexpr uint16_t NONE = 0xFFFF;
+
+  // Messages of one strand, linked through _next in arrival order.
+  struct Strand {
+    uint16_t head;
+    uint16_t tail;
+    bool scheduled; // in a run queue or being delivered
+  };
+
+  // Fixed ring of strand indices; a strand is in at most one of them.
+  struct RunQueue {
+    uint16_t items[STRANDS];
+    size_t head;
+    size_t count;
+
+    void push(uint16_t strand);
+    uint16_t popFront();
+    uint16_t popBack();
+  };
+
+  struct Worker {
+    Dispatcher *dispatcher;
+    uint8_t index;
+    bool idle;
+    RunQueue runnable;
+    MQTTPlatform::Notification wake;
+    MQTTPlatform::Thread thread;
+  };
+
+  static void _run(void *worker);
+  uint16_t _strandOf(const std::string &topic) const;
+  bool _hasRoom() const;
+  void _append(uint16_t slot);
+  void _wakeIdle();
+  void _queued();
+  uint16_t _take(Worker &worker);
+  void _release(uint16_t slot);
+
+  const MQTTClientDetails::DispatchSettings _settings;
+  Deliver _deliver;
+  void *_context;
+
+  mutable MQTTPlatform::Mutex _lock;
+  std::vector<InboundMessage> _slots;
+  std::vector<uint16_t> _next; // strand chain, then free list
+  uint16_t _free;
+  size_t _strandCount;
+  Strand _strands[STRANDS];
+  // Newer than everything in the pool; moves into freed slots in order
+  std::deque<InboundMessage> _spill;
+  size_t _spillBytes;
+  std::atomic<bool> _constrained;
+  std::atomic<uint32_t> _inFlight; // posted but not yet delivered
+
+  size_t _workerCount;
+  std::unique_ptr<Worker[]> _workers;
+  MQTTPlatform::Notification _room; // waited on by the network task
+  std::atomic<bool> _stopping;
+  Stats _stats;
+};
+
+} // namespace MQTTCore
+
+#endif // MQTT_DISPATCHER_H_
@@ -1,19 +1,12 @@
 #ifndef MQTT_ASYNC_TASK_H_
 #define MQTT_ASYNC_TASK_H_
 
-#include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
-#include <Arduino.h>
+#include "MQTTPlatform.h"
 
-extern SemaphoreHandle_t _xSemaphore;
-extern TaskHandle_t _taskHandle;
-extern EspClass ESP;
+#define MQTT_SEMAPHORE_TAKE() MQTTPlatform::clientMutex().lock()
+#define MQTT_SEMAPHORE_GIVE() MQTTPlatform::clientMutex().unlock()
+#define MQTT_GET_FREE_MEMORY() MQTTPlatform::largestFreeBlock()
 
-#define MQTT_SEMAPHORE_TAKE() xSemaphoreTake(_xSemaphore, portMAX_DELAY)
-#define MQTT_SEMAPHORE_GIVE() xSemaphoreGive(_xSemaphore)
-#define MQTT_GET_FREE_MEMORY()                                                 \
-  std::max(ESP.getMaxAllocHeap(), ESP.getMaxAllocPsram())
-
-#define MQTT_YIELD() vTaskDelay(1)
+#define MQTT_YIELD() MQTTPlatform::yield()
 
 #endif // MQTT_ASYNC_TASK_H_
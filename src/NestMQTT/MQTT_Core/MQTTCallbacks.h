@@ -4,6 +4,7 @@
 
 #include <functional>
 #include <string>
+#include "MQTTClientConfig.h"
 #include "MQTTCore.h"
 #include "MQTTError.h"
 #include "MQTTCodes.h"
@@ -19,6 +20,7 @@ using OnUnsubscribeUserCallback = std::function<void(uint16_t packetId, uint8_t
 using OnMessageUserCallback = std::function<void(const std::string& topic, const std::string& payload,  MessageProperties properties, size_t length, size_t index, size_t total)>;
 using OnPublishUserCallback = std::function<void(uint16_t packetId)>;
 using OnErrorUserCallback = std::function<void(uint16_t packetId, MQTTErrors error)>;
+using OnMemoryPressureUserCallback = std::function<void(MQTTClientDetails::PressureLevel level)>;
 
 
 
@@ -1,6 +1,9 @@
 #ifndef MQTT_CLIENT_CONFIG_H_
 #define MQTT_CLIENT_CONFIG_H_
+#include "MQTTConfig.h"
 #include "MQTTCore.h"
+#include "MQTTPlatform.h"
+#include <string>
 namespace MQTTClientDetails {
 
 struct lastWillSettings {
@@ -12,20 +15,37 @@ struct lastWillSettings {
   const uint8_t *_lwt_msg;
   uint16_t _lwt_msg_len;
 };
+// One broker of ConnectionSettings::endpoints; port 0 takes _port.
+struct BrokerEndpoint {
+  const char *host;
+  uint16_t port;
+};
 struct ConnectionSettings {
   const char *host;
   const char *uri;
   uint16_t _port;
   bool _useIp;
-  IPAddress _ip;
+  MQTTPlatform::IPv4Address _ip;
   bool _cleanSession;
   bool disable_auto_reconnect;
   bool disable_keepalive;
   uint32_t reconnect_timeout_ms;
+  // Longest wait for the CONNACK (0 takes MQTT_CONNACK_TIMEOUT_MS)
   uint32_t network_timeout_ms;
   uint32_t refresh_connection_after_ms;
   uint32_t message_retransmit_timeout;
   uint32_t _keepAlive;
+  // Requests made after connect() go out right behind the CONNECT instead
+  // of waiting a round trip for the CONNACK. QoS 0 publishes written
+  // before it are kept until then and requeued if the broker refuses.
+  bool pipelined_connect;
+  // Brokers to choose from instead of host/_ip, at most MQTT_ENDPOINTS.
+  // connect() tries the best scored first and starts each next attempt
+  // endpoint_stagger_ms later while the earlier ones are still pending
+  // (0 takes MQTT_ENDPOINT_STAGGER_MS).
+  const BrokerEndpoint *endpoints;
+  uint8_t endpoint_count;
+  uint32_t endpoint_stagger_ms;
 };
 struct SecureConnection_Settings {
   const char *cert_pem;
@@ -36,7 +56,7 @@ struct SecureConnection_Settings {
 
   const struct psk_key_hint *psk_hint_key;
   bool use_global_ca_store;
-  esp_err_t (*crt_bundle_attach)(void *conf);
+  int (*crt_bundle_attach)(void *conf); // esp_err_t on the ESP32
 
   const char **alpn_protos;
   const char *clientkey_password;
@@ -44,6 +64,107 @@ struct SecureConnection_Settings {
   bool skip_cert_common_name_check;
   bool use_secure_element;
 };
+struct MetricsSettings {
+  const char *topic; // nullptr disables self-publishing
+  uint32_t interval_ms;
+  bool json; // false publishes the compact binary layout
+};
+// Transmit classes. CONTROL (CONNECT, acks, PINGREQ, SUBSCRIBE, DISCONNECT)
+// always goes first; publishes are classified into the others, which share
+// the link by weight. Classes above BULK are free for classify() to use.
+enum TxClass : uint8_t {
+  TX_CLASS_CONTROL = 0,
+  TX_CLASS_ALARM = 1, // default for QoS 1 and 2 publishes
+  TX_CLASS_BULK = 2,  // default for QoS 0 publishes
+};
+struct TransmitSettings {
+  // Publish class for a message; nullptr uses the QoS defaults above
+  uint8_t (*classify)(const char *topic, uint8_t qos);
+  // Relative share under contention; 0 keeps the default (ALARM 4, else 1)
+  uint8_t weights[MQTT_TX_CLASSES];
+};
+// What happens to a publish its rate limit has no room for.
+enum class ShapePolicy : uint8_t {
+  DELAY,    // hold it until the buckets refill
+  CONFLATE, // hold it, replacing a held message on the same topic
+  DROP,     // discard it
+};
+struct ShapeRule {
+  const char *prefix; // topics starting with it; nullptr matches tx_class
+  uint8_t tx_class;
+  uint32_t messages_per_sec; // 0 leaves the message rate unlimited
+  uint32_t bytes_per_sec;    // encoded size; 0 leaves it unlimited
+  uint32_t burst_messages;   // bucket depth; 0 allows one second's worth
+  uint32_t burst_bytes;
+  ShapePolicy policy;
+};
+struct ShapeSettings {
+  const ShapeRule *rules; // first match wins; at most MQTT_SHAPE_RULES
+  size_t rule_count;
+  size_t hold_limit; // delayed messages across all rules
+};
+// Publishes made while offline go to a log on the data partition and are
+// sent after the next connect. Zero sizes take the MQTT_STORE_* defaults.
+struct OfflineStoreSettings {
+  bool enabled;
+  const char *path;     // file name prefix; nullptr uses "/outbox"
+  size_t segment_bytes; // one log file
+  uint8_t segments;     // the oldest is dropped when all are full
+  size_t batch_bytes;   // read per replay step
+};
+// QoS 1 and 2 state journaled on the data partition: unacked outbound
+// messages, inbound ids awaiting PUBREL and the packet id generator. With
+// clean session off, a reset resumes where the last run stopped.
+struct SessionSettings {
+  bool enabled;
+  const char *path;     // file name prefix; nullptr uses "/session"
+  size_t journal_bytes; // growth before a rewrite; 0 takes the default
+};
+// How short of memory the heap is. ELEVATED once free heap or its largest
+// free block falls below the elevated thresholds, CRITICAL below the
+// critical ones; PSRAM counts where the board has it.
+enum class PressureLevel : uint8_t { NORMAL, ELEVATED, CRITICAL };
+// What the client gives up at a pressure level, or-ed together.
+enum PressurePolicy : uint8_t {
+  PRESSURE_REFUSE_QOS0 = 0x01, // QoS 0 publishes return 0
+  PRESSURE_CONFLATE = 0x02,    // QoS 0 replaces its topic's unsent message
+  PRESSURE_SPILL = 0x04,       // publishes go to the offline store instead
+  PRESSURE_SHRINK_RX = 0x08,   // inbound messages no longer spill to heap
+};
+// Zero thresholds take the MQTT_PRESSURE_* defaults.
+struct PressureSettings {
+  bool enabled;
+  size_t elevated_free;
+  size_t elevated_block;
+  size_t critical_free;
+  size_t critical_block;
+  uint8_t elevated_policy; // PressurePolicy flags
+  uint8_t critical_policy;
+  uint32_t sample_ms;
+  // Reads the heap figures in place of the platform; nullptr for those
+  void (*sample)(size_t &freeBytes, size_t &largestBlock);
+};
+// What the network task does with an inbound message when the dispatch
+// queue is full.
+enum class DispatchPolicy : uint8_t {
+  BLOCK,     // stop reading until the handler catches up
+  DROP_QOS0, // discard QoS 0 messages, block for QoS 1 and 2
+  SPILL,     // overflow onto the heap up to spill_limit bytes, then block
+};
+struct DispatchSettings {
+  bool enabled; // false runs onMessage() callbacks on the network task
+  size_t queue_depth;
+  DispatchPolicy policy;
+  size_t spill_limit;
+  // More than one worker delivers messages in parallel, in order per
+  // ordering key; the key is the topic unless ordering_key is set.
+  uint8_t workers;
+  uint32_t (*ordering_key)(const std::string &topic);
+  bool pin_to_core; // worker n runs on core + n
+  uint8_t core;
+  int priority;
+  uint32_t stack_size;
+};
 struct MqttClientCfg {
   typedef void (*mqttClientHook)(void *);
   MQTTCore::MQTT_Protocol_Version_t _protocolVersion;
@@ -52,6 +173,13 @@ struct MqttClientCfg {
   lastWillSettings last_will_settings;
   ConnectionSettings connections_settings;
   SecureConnection_Settings secure_connection_settings;
+  MetricsSettings metrics_settings;
+  DispatchSettings dispatch_settings;
+  TransmitSettings transmit_settings;
+  ShapeSettings shape_settings;
+  OfflineStoreSettings offline_store;
+  SessionSettings session_settings;
+  PressureSettings pressure_settings;
   void *user_context;
   int task_prio;
   int task_stack;
@@ -62,6 +190,7 @@ struct MqttClientCfg {
 
 class CfgObserver {
 public:
+  virtual ~CfgObserver() = default;
   virtual void
   updateConfig(const MQTTClientDetails::MqttClientCfg &newConfig) = 0;
 };
@@ -0,0 +1,152 @@
+#ifndef MQTT_CONFIG_H_
+#define MQTT_CONFIG_H_
+
+// Compile-time feature switches; override through build_flags.
+
+// Per-message stage timestamps and latency histograms (MQTTTrace.h).
+#ifndef MQTT_LATENCY_TRACE
+#define MQTT_LATENCY_TRACE 0
+#endif
+
+// mqttloop(maxWaitMs) sleeps on socket readiness where the transport can
+// report it; other transports are polled at this interval while idle.
+#ifndef MQTT_POLL_INTERVAL_MS
+#define MQTT_POLL_INTERVAL_MS 10
+#endif
+
+// Publishes, subscribes and unsubscribes that can wait on a Completion
+// handle at once (publishAsync() and friends).
+#ifndef MQTT_COMPLETION_SLOTS
+#define MQTT_COMPLETION_SLOTS 32
+#endif
+
+// Messages the dispatch task can hold when the client configuration asks
+// for one but leaves queue_depth at zero.
+#ifndef MQTT_DISPATCH_QUEUE_DEPTH
+#define MQTT_DISPATCH_QUEUE_DEPTH 16
+#endif
+
+// Ordering groups of a multi-worker dispatcher. Keys that share a strand
+// are delivered one after another even when their topics differ.
+#ifndef MQTT_DISPATCH_STRANDS
+#define MQTT_DISPATCH_STRANDS 32
+#endif
+
+// Transmit classes: class 0 carries control packets and acks, the others
+// share the link by weight, MQTT_TX_QUANTUM bytes per unit of weight and
+// round.
+#ifndef MQTT_TX_CLASSES
+#define MQTT_TX_CLASSES 4
+#endif
+#ifndef MQTT_TX_QUANTUM
+#define MQTT_TX_QUANTUM 512
+#endif
+
+// Rate-limit rules the shaper checks, in table order, for each publish;
+// and the messages held for later when the configuration leaves
+// hold_limit at zero.
+#ifndef MQTT_SHAPE_RULES
+#define MQTT_SHAPE_RULES 8
+#endif
+#ifndef MQTT_SHAPE_HOLD_LIMIT
+#define MQTT_SHAPE_HOLD_LIMIT 32
+#endif
+
+// Topics that can be registered for latest-value-wins publishing.
+#ifndef MQTT_CONFLATED_TOPICS
+#define MQTT_CONFLATED_TOPICS 32
+#endif
+
+// Timer wheel for message time-to-live: deadlines are kept to
+// MQTT_EXPIRY_TICK_MS, and longer ones wait out whole turns of the
+// MQTT_EXPIRY_SLOTS slots (a power of two).
+#ifndef MQTT_EXPIRY_SLOTS
+#define MQTT_EXPIRY_SLOTS 64
+#endif
+#ifndef MQTT_EXPIRY_TICK_MS
+#define MQTT_EXPIRY_TICK_MS 100
+#endif
+
+// Offline store defaults: the log takes up to SEGMENTS * SEGMENT_BYTES of
+// flash and replays BATCH_BYTES per read.
+#ifndef MQTT_STORE_SEGMENT_BYTES
+#define MQTT_STORE_SEGMENT_BYTES 16384
+#endif
+#ifndef MQTT_STORE_SEGMENTS
+#define MQTT_STORE_SEGMENTS 8
+#endif
+#ifndef MQTT_STORE_BATCH_BYTES
+#define MQTT_STORE_BATCH_BYTES 4096
+#endif
+
+// Inbound QoS 2 ids awaiting PUBREL: 0 tracks every id in an 8 KB
+// bitset, a power of two a table of that many slots (one stays free), for
+// brokers that keep at most that many QoS 2 messages open.
+#ifndef MQTT_INBOUND_QOS2_WINDOW
+#define MQTT_INBOUND_QOS2_WINDOW 0
+#endif
+
+// Bytes the session journal may grow past its last rewrite before it is
+// compacted to the live state again.
+#ifndef MQTT_SESSION_JOURNAL_BYTES
+#define MQTT_SESSION_JOURNAL_BYTES 8192
+#endif
+
+// Memory pressure thresholds in bytes of free heap and of its largest free
+// block, for settings left at zero, and how often the heap is sampled.
+#ifndef MQTT_PRESSURE_ELEVATED_FREE
+#define MQTT_PRESSURE_ELEVATED_FREE 32768
+#endif
+#ifndef MQTT_PRESSURE_ELEVATED_BLOCK
+#define MQTT_PRESSURE_ELEVATED_BLOCK 8192
+#endif
+#ifndef MQTT_PRESSURE_CRITICAL_FREE
+#define MQTT_PRESSURE_CRITICAL_FREE 16384
+#endif
+#ifndef MQTT_PRESSURE_CRITICAL_BLOCK
+#define MQTT_PRESSURE_CRITICAL_BLOCK 4096
+#endif
+#ifndef MQTT_PRESSURE_SAMPLE_MS
+#define MQTT_PRESSURE_SAMPLE_MS 250
+#endif
+
+// Payload buffers of at least this many bytes are placed in PSRAM.
+#ifndef MQTT_PSRAM_THRESHOLD
+#define MQTT_PSRAM_THRESHOLD 512
+#endif
+
+// Freed blocks of up to MQTT_MEMORY_POOL_MAX_BLOCK bytes are kept for
+// reuse, up to MQTT_MEMORY_POOL_DEPTH of each size, so a steady stream
+// of publishes stops reaching the heap. 0 turns the pool off.
+#ifndef MQTT_MEMORY_POOL_DEPTH
+#define MQTT_MEMORY_POOL_DEPTH 16
+#endif
+#ifndef MQTT_MEMORY_POOL_MAX_BLOCK
+#define MQTT_MEMORY_POOL_MAX_BLOCK 2048
+#endif
+
+// Broker endpoints a client keeps scores for, and the defaults behind
+// the scores: the round trip assumed before one is measured, what each
+// failure in a row adds, and how long a connection attempt has before the
+// next endpoint joins the race.
+#ifndef MQTT_ENDPOINTS
+#define MQTT_ENDPOINTS 4
+#endif
+#ifndef MQTT_ENDPOINT_INITIAL_RTT_MS
+#define MQTT_ENDPOINT_INITIAL_RTT_MS 200
+#endif
+#ifndef MQTT_ENDPOINT_FAILURE_PENALTY_MS
+#define MQTT_ENDPOINT_FAILURE_PENALTY_MS 1000
+#endif
+#ifndef MQTT_ENDPOINT_STAGGER_MS
+#define MQTT_ENDPOINT_STAGGER_MS 250
+#endif
+
+// How long a CONNECT waits for its CONNACK when network_timeout_ms is left
+// at zero. A broker that accepts the connection and then says nothing is
+// given up on and counts as a failed endpoint.
+#ifndef MQTT_CONNACK_TIMEOUT_MS
+#define MQTT_CONNACK_TIMEOUT_MS 10000
+#endif
+
+#endif // MQTT_CONFIG_H_
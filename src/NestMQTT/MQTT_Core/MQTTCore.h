@@ -1,6 +1,5 @@
 #ifndef MQTT_CORE_H_
 #define MQTT_CORE_H_
-#include "Arduino.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -1,10 +1,10 @@
 #ifndef MQTT_ERROR_H_
 #define MQTT_ERROR_H_
 
-#include <cassert>
 #include <limits>
-#include <string>
-#include <unordered_map>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
 
 namespace MQTTCore {
 
@@ -39,67 +39,146 @@ enum class MQTTErrors {
   CONNECTION_REFUSED,
   SUBSCRIBE_FAILED,
   CONNECTION_CLOSED,
+  MESSAGE_DROPPED,
+  MESSAGE_EXPIRED,
   SUCCESS = 1
 };
 
+enum class ErrorCategory : uint8_t {
+  NONE,
+  RESOURCE,
+  PROTOCOL,
+  USAGE,
+  NETWORK,
+  BROKER,
+  INTERNAL
+};
+
+struct MQTTErrorInfo {
+  MQTTErrors code;
+  const char *message;
+  ErrorCategory category;
+  bool retryable;
+};
+
+// Indexed by (code - UNKNOWN); SUCCESS occupies the slot after
+// MESSAGE_EXPIRED. Order must follow the enum, checked below.
+constexpr MQTTErrorInfo error_table[] = {
+    {MQTTErrors::UNKNOWN, "Unknown error", ErrorCategory::INTERNAL, false},
+    {MQTTErrors::NULLPTR, "NULL pointer error", ErrorCategory::USAGE, false},
+    {MQTTErrors::OUT_OF_MEMORY, "Out of memory", ErrorCategory::RESOURCE,
+     true},
+    {MQTTErrors::CONTROL_FORBIDDEN_TYPE, "Forbidden control type",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::CONTROL_INVALID_FLAGS, "Invalid control flags",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::CONTROL_WRONG_TYPE, "Wrong control type",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::CONNECT_NULL_CLIENT_ID, "NULL client ID in connect",
+     ErrorCategory::USAGE, false},
+    {MQTTErrors::CONNECT_NULL_WILL_MESSAGE, "NULL will message in connect",
+     ErrorCategory::USAGE, false},
+    {MQTTErrors::CONNECT_FORBIDDEN_WILL_QOS,
+     "Forbidden QoS for will message in connect", ErrorCategory::USAGE, false},
+    {MQTTErrors::CONNACK_FORBIDDEN_FLAGS, "Forbidden flags in CONNACK packet",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::CONNACK_FORBIDDEN_CODE, "Forbidden code in CONNACK packet",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::PUBLISH_FORBIDDEN_QOS, "Forbidden QoS in publish packet",
+     ErrorCategory::USAGE, false},
+    {MQTTErrors::SUBSCRIBE_TOO_MANY_TOPICS,
+     "Too many topics in subscribe packet", ErrorCategory::USAGE, false},
+    {MQTTErrors::SUBSCRIBE_UNEVEN_TOPIC_QOS,
+     "Topic and Qos must come in pairs", ErrorCategory::USAGE, false},
+    {MQTTErrors::STRING_LENGTH_ERROR, "String length error",
+     ErrorCategory::USAGE, false},
+    {MQTTErrors::UNSUBSCRIBE_TOO_MANY_TOPICS,
+     "Too many topics in unsubscribe packet", ErrorCategory::USAGE, false},
+    {MQTTErrors::RESPONSE_INVALID_CONTROL_TYPE,
+     "Invalid control type in response", ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::CLIENT_NOT_CONNECTED, "Client not connected",
+     ErrorCategory::NETWORK, true},
+    {MQTTErrors::SEND_BUFFER_IS_FULL, "Send buffer is full",
+     ErrorCategory::RESOURCE, true},
+    {MQTTErrors::SOCKET_ERROR, "Socket error", ErrorCategory::NETWORK, true},
+    {MQTTErrors::MALFORMED_RESPONSE, "Malformed response",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::MALFORMED_REMAINING_LENGTH, "Malformed Remaining Length",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::MALFORMED_REQUEST, "Malformed request", ErrorCategory::USAGE,
+     false},
+    {MQTTErrors::MALFORMED_PARAMETER, "Malformed parameter",
+     ErrorCategory::USAGE, false},
+    {MQTTErrors::RECV_BUFFER_TOO_SMALL, "Receive buffer too small",
+     ErrorCategory::RESOURCE, false},
+    {MQTTErrors::ACK_OF_UNKNOWN, "ACK of unknown packet",
+     ErrorCategory::PROTOCOL, false},
+    {MQTTErrors::NOT_IMPLEMENTED, "Feature not implemented",
+     ErrorCategory::INTERNAL, false},
+    {MQTTErrors::CONNECTION_REFUSED, "Connection refused",
+     ErrorCategory::BROKER, true},
+    {MQTTErrors::SUBSCRIBE_FAILED, "Subscribe failed", ErrorCategory::BROKER,
+     false},
+    {MQTTErrors::CONNECTION_CLOSED, "Connection closed",
+     ErrorCategory::NETWORK, true},
+    {MQTTErrors::MESSAGE_DROPPED, "Message dropped by queue policy",
+     ErrorCategory::RESOURCE, true},
+    {MQTTErrors::MESSAGE_EXPIRED, "Message expired before it was sent",
+     ErrorCategory::RESOURCE, false},
+    {MQTTErrors::SUCCESS, "OK", ErrorCategory::NONE, false}};
+
+constexpr size_t ERROR_TABLE_SIZE
+    = sizeof(error_table) / sizeof(error_table[0]);
+
+constexpr long long errorOffset(MQTTErrors error) {
+  return static_cast<long long>(error)
+         - static_cast<long long>(MQTTErrors::UNKNOWN);
+}
+
+// Out-of-range codes resolve to UNKNOWN.
+constexpr size_t errorIndex(MQTTErrors error) {
+  return error == MQTTErrors::SUCCESS ? ERROR_TABLE_SIZE - 1
+         : errorOffset(error) < static_cast<long long>(ERROR_TABLE_SIZE - 1)
+             ? static_cast<size_t>(errorOffset(error))
+             : 0;
+}
+
+constexpr const MQTTErrorInfo &errorInfo(MQTTErrors error) {
+  return error_table[errorIndex(error)];
+}
+
+constexpr bool errorTableOrdered(size_t i = 0) {
+  return i == ERROR_TABLE_SIZE
+         || (errorIndex(error_table[i].code) == i && errorTableOrdered(i + 1));
+}
+
+static_assert(errorTableOrdered(), "error_table must follow MQTTErrors order");
+static_assert(ERROR_TABLE_SIZE
+                  == errorOffset(MQTTErrors::MESSAGE_EXPIRED) + 2,
+              "error_table must cover every MQTTErrors code");
+
 class MQTTError {
 public:
-  MQTTError(MQTTErrors error) : errorCode(error) {
-    auto it = error_strings.find(error);
-    if (it != error_strings.end()) {
-      errorMessage = it->second.c_str();
-    } else {
-      // If the error code is not found, use the string representation of
-      // UNKNOWN error
-      errorMessage = error_strings.at(MQTTErrors::UNKNOWN).c_str();
-    }
-  }
+  constexpr MQTTError(MQTTErrors error) : errorCode(error) {}
 
-  MQTTErrors getErrorCode() const { return errorCode; }
-  const char *what() const noexcept { return errorMessage; }
+  constexpr MQTTErrors getErrorCode() const { return errorCode; }
+  constexpr const char *what() const noexcept {
+    return errorInfo(errorCode).message;
+  }
+  constexpr ErrorCategory category() const {
+    return errorInfo(errorCode).category;
+  }
+  constexpr bool retryable() const { return errorInfo(errorCode).retryable; }
 
 private:
   MQTTErrors errorCode;
-  const char *errorMessage;
-  const std::unordered_map<MQTTErrors, std::string> error_strings = {
-      {MQTTErrors::UNKNOWN, "Unknown error"},
-      {MQTTErrors::NULLPTR, "NULL pointer error"},
-      {MQTTErrors::CONTROL_FORBIDDEN_TYPE, "Forbidden control type"},
-      {MQTTErrors::CONTROL_INVALID_FLAGS, "Invalid control flags"},
-      {MQTTErrors::CONTROL_WRONG_TYPE, "Wrong control type"},
-      {MQTTErrors::CONNECT_NULL_CLIENT_ID, "NULL client ID in connect"},
-      {MQTTErrors::CONNECT_NULL_WILL_MESSAGE, "NULL will message in connect"},
-      {MQTTErrors::CONNECT_FORBIDDEN_WILL_QOS,
-       "Forbidden QoS for will message in connect"},
-      {MQTTErrors::CONNACK_FORBIDDEN_FLAGS,
-       "Forbidden flags in CONNACK packet"},
-      {MQTTErrors::CONNACK_FORBIDDEN_CODE, "Forbidden code in CONNACK packet"},
-      {MQTTErrors::PUBLISH_FORBIDDEN_QOS, "Forbidden QoS in publish packet"},
-      {MQTTErrors::SUBSCRIBE_TOO_MANY_TOPICS,
-       "Too many topics in subscribe packet"},
-      {MQTTErrors::SUBSCRIBE_UNEVEN_TOPIC_QOS,
-       "Topic and Qos must come in pairs"},
-      {MQTTErrors::STRING_LENGTH_ERROR, "String length error"},
-      {MQTTErrors::MALFORMED_RESPONSE, "Malformed response"},
-      {MQTTErrors::MALFORMED_REMAINING_LENGTH, "Malformed Remaining Length"},
-      {MQTTErrors::UNSUBSCRIBE_TOO_MANY_TOPICS,
-       "Too many topics in unsubscribe packet"},
-      {MQTTErrors::RESPONSE_INVALID_CONTROL_TYPE,
-       "Invalid control type in response"},
-      {MQTTErrors::CLIENT_NOT_CONNECTED, "Client not connected"},
-      {MQTTErrors::SEND_BUFFER_IS_FULL, "Send buffer is full"},
-      {MQTTErrors::SOCKET_ERROR, "Socket error"},
-      {MQTTErrors::MALFORMED_REQUEST, "Malformed request"},
-      {MQTTErrors::RECV_BUFFER_TOO_SMALL, "Receive buffer too small"},
-      {MQTTErrors::ACK_OF_UNKNOWN, "ACK of unknown packet"},
-      {MQTTErrors::NOT_IMPLEMENTED, "Feature not implemented"},
-      {MQTTErrors::CONNECTION_REFUSED, "Connection refused"},
-      {MQTTErrors::SUBSCRIBE_FAILED, "Subscribe failed"},
-      {MQTTErrors::CONNECTION_CLOSED, "Connection closed"},
-      {MQTTErrors::SUCCESS , "OK"}};
-  // static const std::unordered_map<MQTTErrors, std::string> error_strings;
 };
 
+static_assert(std::is_trivially_copyable<MQTTError>::value,
+              "MQTTError must stay a plain error code");
+static_assert(sizeof(MQTTError) == sizeof(MQTTErrors),
+              "MQTTError must not carry more than its code");
+
 } // namespace MQTTCore
 
 #endif /* MQTT_ERROR_H_ */
@@ -0,0 +1,176 @@
+#include "MQTTMemory.h"
+
+namespace MQTTCore {
+
+using MQTTPlatform::Region;
+
+MemoryPolicy &MemoryPolicy::instance() {
+  // Never destroyed: static objects may still release memory at exit
+  static MemoryPolicy *policy = new MemoryPolicy();
+  return *policy;
+}
+
+MemoryPolicy::MemoryPolicy()
+    : _threshold(MQTT_PSRAM_THRESHOLD), _budgets{}, _pools{}, _stats{} {}
+
+void MemoryPolicy::configure(const MemorySettings &settings) {
+  MQTTPlatform::LockGuard lock(_lock);
+  _threshold = settings.psram_threshold ? settings.psram_threshold
+                                        : MQTT_PSRAM_THRESHOLD;
+  for (size_t i = 0; i < MEMORY_CLASSES; ++i) {
+    _budgets[i] = settings.budgets[i];
+  }
+  // Pooled blocks were placed under the old settings
+  trim();
+}
+
+void *MemoryPolicy::allocate(MemoryClass memoryClass, size_t size) {
+  MQTTPlatform::LockGuard lock(_lock);
+  Region preferred = _preferred(memoryClass, size);
+  Region other = preferred == Region::INTERNAL ? Region::EXTERNAL
+                                               : Region::INTERNAL;
+  size_t pool = _poolFor(size);
+  if (pool < POOL_SIZES) {
+    void *spare = _reuse(memoryClass, preferred, pool);
+    if (!spare) {
+      spare = _reuse(memoryClass, other, pool);
+      if (spare) {
+        ++_stats.fallbacks;
+      }
+    }
+    if (spare) {
+      ++_stats.reused;
+      return spare;
+    }
+    // Rounded up so the block can serve any later request of its pool
+    size = POOL_MIN_BLOCK << pool;
+  }
+  void *ptr = _take(memoryClass, preferred, size);
+  if (!ptr) {
+    ptr = _take(memoryClass, other, size);
+    if (ptr) {
+      ++_stats.fallbacks;
+    } else {
+      ++_stats.refused;
+    }
+  }
+  return ptr;
+}
+
+void MemoryPolicy::release(MemoryClass memoryClass, void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  size_t region = static_cast<size_t>(MQTTPlatform::regionOf(ptr));
+  size_t size = MQTTPlatform::regionSize(ptr);
+  MQTTPlatform::LockGuard lock(_lock);
+  size_t pool = _poolOf(size);
+  if (pool < POOL_SIZES) {
+    Pool &spares = _pools[memoryClass][region][pool];
+    if (spares.count < MQTT_MEMORY_POOL_DEPTH) {
+      Spare *spare = static_cast<Spare *>(ptr);
+      spare->next = spares.head;
+      spares.head = spare;
+      ++spares.count;
+      return;
+    }
+  }
+  _stats.inUse[memoryClass][region] -= size;
+  MQTTPlatform::regionFree(ptr);
+}
+
+void MemoryPolicy::trim() {
+  MQTTPlatform::LockGuard lock(_lock);
+  for (size_t memoryClass = 0; memoryClass < MEMORY_CLASSES; ++memoryClass) {
+    for (size_t region = 0; region < REGIONS; ++region) {
+      for (Pool &spares : _pools[memoryClass][region]) {
+        while (spares.head) {
+          Spare *spare = spares.head;
+          spares.head = spare->next;
+          _stats.inUse[memoryClass][region]
+              -= MQTTPlatform::regionSize(spare);
+          MQTTPlatform::regionFree(spare);
+        }
+        spares.count = 0;
+      }
+    }
+  }
+}
+
+MemoryPolicy::Stats MemoryPolicy::stats() const {
+  MQTTPlatform::LockGuard lock(_lock);
+  return _stats;
+}
+
+Region MemoryPolicy::_preferred(MemoryClass memoryClass, size_t size) const {
+  switch (memoryClass) {
+    case MEMORY_METADATA:
+      return Region::INTERNAL;
+    case MEMORY_PAYLOAD:
+      return size >= _threshold ? Region::EXTERNAL : Region::INTERNAL;
+    default:
+      return Region::EXTERNAL;
+  }
+}
+
+size_t MemoryPolicy::_poolFor(size_t size) {
+  if (MQTT_MEMORY_POOL_DEPTH == 0) {
+    return POOL_SIZES;
+  }
+  size_t pool = 0;
+  while (pool < POOL_SIZES && (POOL_MIN_BLOCK << pool) < size) {
+    ++pool;
+  }
+  if (pool < POOL_SIZES
+      && (POOL_MIN_BLOCK << pool) > MQTT_MEMORY_POOL_MAX_BLOCK) {
+    return POOL_SIZES;
+  }
+  return pool;
+}
+
+size_t MemoryPolicy::_poolOf(size_t size) {
+  if (size < POOL_MIN_BLOCK) {
+    return POOL_SIZES;
+  }
+  size_t pool = 0;
+  while (pool + 1 < POOL_SIZES && (POOL_MIN_BLOCK << (pool + 1)) <= size) {
+    ++pool;
+  }
+  // Blocks well past the largest pooled size go back to their region
+  if ((POOL_MIN_BLOCK << pool) > MQTT_MEMORY_POOL_MAX_BLOCK
+      || size >= (POOL_MIN_BLOCK << (pool + 1))) {
+    return POOL_SIZES;
+  }
+  return _poolFor(POOL_MIN_BLOCK << pool);
+}
+
+void *MemoryPolicy::_reuse(MemoryClass memoryClass, Region region,
+                           size_t pool) {
+  Pool &spares = _pools[memoryClass][static_cast<size_t>(region)][pool];
+  Spare *spare = spares.head;
+  if (spare) {
+    spares.head = spare->next;
+    --spares.count;
+  }
+  return spare;
+}
+
+void *MemoryPolicy::_take(MemoryClass memoryClass, Region region,
+                          size_t size) {
+  const MemoryBudget &budget = _budgets[memoryClass];
+  size_t limit = region == Region::INTERNAL ? budget.internal_bytes
+                                            : budget.external_bytes;
+  size_t &inUse = _stats.inUse[memoryClass][static_cast<size_t>(region)];
+  if (limit && inUse + size > limit) {
+    return nullptr;
+  }
+  void *ptr = MQTTPlatform::regionAlloc(region, size);
+  if (ptr) {
+    inUse += MQTTPlatform::regionSize(ptr);
+    ++_stats.allocations;
+    _stats.allocatedBytes += size;
+  }
+  return ptr;
+}
+
+} // namespace MQTTCore
@@ -0,0 +1,136 @@
+#ifndef MQTT_MEMORY_H_
+#define MQTT_MEMORY_H_
+
+#include "MQTTConfig.h"
+#include "MQTTPlatform.h"
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTCore {
+
+// What an allocation of the client holds.
+enum MemoryClass : uint8_t {
+  MEMORY_METADATA, // queue entries and other bookkeeping touched per packet
+  MEMORY_PAYLOAD,  // encoded packets
+  MEMORY_STORE,    // the offline store's read buffer
+  MEMORY_CLASSES
+};
+
+// Bytes a class may hold in each region; 0 leaves it unlimited.
+struct MemoryBudget {
+  size_t internal_bytes;
+  size_t external_bytes;
+};
+
+struct MemorySettings {
+  size_t psram_threshold; // 0 takes MQTT_PSRAM_THRESHOLD
+  MemoryBudget budgets[MEMORY_CLASSES];
+};
+
+// Decides where the client's own allocations go. Metadata and payloads
+// under psram_threshold bytes prefer internal SRAM; larger payloads and
+// the offline store prefer PSRAM. When the preferred region is full, or
+// the class has used up its budget there, the other region is tried. One
+// policy serves every client in the process, like the heap it divides.
+//
+// Freed small blocks are pooled by class, region and power-of-two size
+// (see MQTT_MEMORY_POOL_DEPTH); pooled blocks still count against the
+// budgets until trim() hands them back.
+class MemoryPolicy {
+public:
+  static constexpr size_t REGIONS = 2;
+
+  struct Stats {
+    size_t inUse[MEMORY_CLASSES][REGIONS]; // by MQTTPlatform::Region
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    uint64_t reused;    // served from the pool, no region allocation
+    uint32_t fallbacks; // placed outside the preferred region
+    uint32_t refused;   // no region had room within the budgets
+  };
+
+  static MemoryPolicy &instance();
+
+  // Best called before the first client is created.
+  void configure(const MemorySettings &settings);
+
+  void *allocate(MemoryClass memoryClass, size_t size);
+  void release(MemoryClass memoryClass, void *ptr);
+
+  // Returns every pooled block to its region.
+  void trim();
+
+  Stats stats() const;
+
+private:
+  // Pooled sizes run from POOL_MIN_BLOCK up in powers of two
+  static constexpr size_t POOL_MIN_BLOCK = 32;
+  static constexpr size_t POOL_SIZES = 8;
+
+  struct Spare {
+    Spare *next;
+  };
+
+  struct Pool {
+    Spare *head;
+    size_t count;
+  };
+
+  MemoryPolicy();
+
+  // Smallest pool for a request of size bytes, or POOL_SIZES
+  static size_t _poolFor(size_t size);
+  // Largest pool a block of size bytes can serve, or POOL_SIZES
+  static size_t _poolOf(size_t size);
+  void *_reuse(MemoryClass memoryClass, MQTTPlatform::Region region,
+               size_t pool);
+
+  MQTTPlatform::Region _preferred(MemoryClass memoryClass,
+                                  size_t size) const;
+  void *_take(MemoryClass memoryClass, MQTTPlatform::Region region,
+              size_t size);
+
+  mutable MQTTPlatform::Mutex _lock;
+  size_t _threshold;
+  MemoryBudget _budgets[MEMORY_CLASSES];
+  Pool _pools[MEMORY_CLASSES][REGIONS][POOL_SIZES];
+  Stats _stats;
+};
+
+// Standard allocator placing a container's storage through the policy,
+// like std::allocator it throws when no region has room.
+template <typename T, MemoryClass CLASS> struct PolicyAllocator {
+  using value_type = T;
+  template <typename U> struct rebind {
+    using other = PolicyAllocator<U, CLASS>;
+  };
+
+  PolicyAllocator() = default;
+  template <typename U>
+  PolicyAllocator(const PolicyAllocator<U, CLASS> &) {}
+
+  T *allocate(size_t count) {
+    void *ptr = MemoryPolicy::instance().allocate(CLASS, count * sizeof(T));
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+  void deallocate(T *ptr, size_t) {
+    MemoryPolicy::instance().release(CLASS, ptr);
+  }
+
+  template <typename U>
+  bool operator==(const PolicyAllocator<U, CLASS> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const PolicyAllocator<U, CLASS> &) const {
+    return false;
+  }
+};
+
+} // namespace MQTTCore
+
+#endif // MQTT_MEMORY_H_
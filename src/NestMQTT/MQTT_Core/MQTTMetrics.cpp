@@ -0,0 +1,207 @@
+#include "MQTTMetrics.h"
+#include <cstdio>
+#include <cstring>
+
+namespace MQTTCore {
+
+FixedHistogram::FixedHistogram() { reset(); }
+
+void FixedHistogram::record(uint32_t value) {
+  size_t bucket = 0;
+  while (bucket < ACK_LATENCY_BUCKETS - 1
+         && value > ACK_LATENCY_BOUNDS_MS[bucket]) {
+    ++bucket;
+  }
+  _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+
+  uint32_t seen = _max.load(std::memory_order_relaxed);
+  while (value > seen
+         && !_max.compare_exchange_weak(seen, value,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+void FixedHistogram::snapshot(HistogramSnapshot &out) const {
+  for (size_t i = 0; i < ACK_LATENCY_BUCKETS; ++i) {
+    out.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+  }
+  out.count = _count.load(std::memory_order_relaxed);
+  out.sum = _sum.load(std::memory_order_relaxed);
+  out.max = _max.load(std::memory_order_relaxed);
+}
+
+void FixedHistogram::reset() {
+  for (auto &bucket : _buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  _count.store(0, std::memory_order_relaxed);
+  _sum.store(0, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+Metrics::Metrics() : _lastReport(0), _reported(false) { reset(); }
+
+void Metrics::recordPublish(uint8_t qos) {
+  switch (qos) {
+    case 0:
+      increment(Counter::PUBLISH_QOS0);
+      break;
+    case 1:
+      increment(Counter::PUBLISH_QOS1);
+      break;
+    default:
+      increment(Counter::PUBLISH_QOS2);
+      break;
+  }
+}
+
+void Metrics::observeHeap(uint32_t freeBytes) {
+  std::atomic<uint32_t> &lowWater
+      = _gauges[static_cast<size_t>(Gauge::HEAP_LOW_WATER)];
+  uint32_t seen = lowWater.load(std::memory_order_relaxed);
+  while ((seen == 0 || freeBytes < seen)
+         && !lowWater.compare_exchange_weak(seen, freeBytes,
+                                            std::memory_order_relaxed)) {
+  }
+}
+
+void Metrics::snapshot(MetricsSnapshot &out, uint32_t now) const {
+  out.uptime_ms = now;
+  for (size_t i = 0; i < METRICS_COUNTERS; ++i) {
+    out.counters[i] = _counters[i].load(std::memory_order_relaxed);
+  }
+  for (size_t i = 0; i < METRICS_GAUGES; ++i) {
+    out.gauges[i] = _gauges[i].load(std::memory_order_relaxed);
+  }
+  for (size_t i = 0; i < ERROR_TABLE_SIZE; ++i) {
+    out.errors[i] = _errors[i].load(std::memory_order_relaxed);
+  }
+  _ackLatency.snapshot(out.ack_latency);
+}
+
+void Metrics::reset() {
+  for (auto &c : _counters) {
+    c.store(0, std::memory_order_relaxed);
+  }
+  for (auto &g : _gauges) {
+    g.store(0, std::memory_order_relaxed);
+  }
+  for (auto &e : _errors) {
+    e.store(0, std::memory_order_relaxed);
+  }
+  _ackLatency.reset();
+}
+
+bool Metrics::reportDue(uint32_t now, uint32_t intervalMs) {
+  if (intervalMs == 0) {
+    return false;
+  }
+  if (!_reported) {
+    _reported = true;
+    _lastReport = now;
+    return false;
+  }
+  if (now - _lastReport < intervalMs) {
+    return false;
+  }
+  _lastReport = now;
+  return true;
+}
+
+uint32_t Metrics::msUntilReport(uint32_t now, uint32_t intervalMs) const {
+  if (intervalMs == 0) {
+    return UINT32_MAX;
+  }
+  if (!_reported) {
+    return 0; // the first call only arms the timer
+  }
+  uint32_t elapsed = now - _lastReport;
+  return elapsed < intervalMs ? intervalMs - elapsed : 0;
+}
+
+// Compact JSON, no allocation. Errors are keyed by their index in
+// error_table and only non-zero entries are emitted. Returns 0 if the
+// document does not fit.
+size_t Metrics::encodeJson(const MetricsSnapshot &snap, char *buf,
+                           size_t size) {
+  size_t pos = 0;
+  bool overflow = false;
+  auto append = [&](const char *fmt, uint32_t a, uint32_t b) {
+    if (overflow) {
+      return;
+    }
+    int n = snprintf(buf + pos, size - pos, fmt, a, b);
+    if (n < 0 || static_cast<size_t>(n) >= size - pos) {
+      overflow = true;
+      return;
+    }
+    pos += n;
+  };
+
+  append("{\"up\":%u,\"pub\":[%u,", snap.uptime_ms,
+         snap.counter(Counter::PUBLISH_QOS0));
+  append("%u,%u],", snap.counter(Counter::PUBLISH_QOS1),
+         snap.counter(Counter::PUBLISH_QOS2));
+  append("\"tx\":%u,\"rx\":%u,", snap.counter(Counter::BYTES_OUT),
+         snap.counter(Counter::BYTES_IN));
+  append("\"retx\":%u,\"reconn\":%u,", snap.counter(Counter::RETRANSMITS),
+         snap.counter(Counter::RECONNECTS));
+  append("\"queue\":%u,\"pid\":%u,", snap.gauge(Gauge::QUEUE_DEPTH),
+         snap.gauge(Gauge::PID_IN_USE));
+  append("\"heap_min\":%u,\"ack\":{\"n\":%u,", snap.gauge(Gauge::HEAP_LOW_WATER),
+         snap.ack_latency.count);
+  append("\"sum\":%u,\"max\":%u,\"b\":[", snap.ack_latency.sum,
+         snap.ack_latency.max);
+  for (size_t i = 0; i < ACK_LATENCY_BUCKETS; ++i) {
+    append(i ? ",%u" : "%u", snap.ack_latency.buckets[i], 0);
+  }
+  append("]},\"err\":{", 0, 0);
+  bool first = true;
+  for (size_t i = 0; i < ERROR_TABLE_SIZE; ++i) {
+    if (snap.errors[i]) {
+      append(first ? "\"%u\":%u" : ",\"%u\":%u", i, snap.errors[i]);
+      first = false;
+    }
+  }
+  append("}}", 0, 0);
+  return overflow ? 0 : pos;
+}
+
+// Layout: version byte followed by big-endian uint32 fields in the order
+// uptime, counters, gauges, errors, latency buckets, count, sum, max.
+size_t Metrics::encodeBinary(const MetricsSnapshot &snap, uint8_t *buf,
+                             size_t size) {
+  if (size < BINARY_SIZE) {
+    return 0;
+  }
+  size_t pos = 0;
+  auto put = [&](uint32_t v) {
+    buf[pos++] = v >> 24;
+    buf[pos++] = v >> 16;
+    buf[pos++] = v >> 8;
+    buf[pos++] = v & 0xFF;
+  };
+
+  buf[pos++] = BINARY_VERSION;
+  put(snap.uptime_ms);
+  for (uint32_t v : snap.counters) {
+    put(v);
+  }
+  for (uint32_t v : snap.gauges) {
+    put(v);
+  }
+  for (uint32_t v : snap.errors) {
+    put(v);
+  }
+  for (uint32_t v : snap.ack_latency.buckets) {
+    put(v);
+  }
+  put(snap.ack_latency.count);
+  put(snap.ack_latency.sum);
+  put(snap.ack_latency.max);
+  return pos;
+}
+
+} // namespace MQTTCore
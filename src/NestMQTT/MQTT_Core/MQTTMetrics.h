@@ -0,0 +1,133 @@
+#ifndef MQTT_METRICS_H_
+#define MQTT_METRICS_H_
+
+#include "MQTTError.h"
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTCore {
+
+// All counters are 32 bit so they stay lock-free on the ESP32; byte
+// counters wrap after 4 GiB and consumers should diff snapshots.
+enum class Counter : uint8_t {
+  PUBLISH_QOS0 = 0,
+  PUBLISH_QOS1,
+  PUBLISH_QOS2,
+  BYTES_OUT,
+  BYTES_IN,
+  RETRANSMITS,
+  RECONNECTS,
+  ACKS,
+  COUNT
+};
+
+enum class Gauge : uint8_t {
+  QUEUE_DEPTH = 0,
+  PID_IN_USE,
+  HEAP_LOW_WATER,
+  COUNT
+};
+
+constexpr size_t METRICS_COUNTERS = static_cast<size_t>(Counter::COUNT);
+constexpr size_t METRICS_GAUGES = static_cast<size_t>(Gauge::COUNT);
+
+// Upper bounds (ms) of the ack latency buckets; the last bucket is open.
+constexpr uint32_t ACK_LATENCY_BOUNDS_MS[] = {10,   25,   50,   100,
+                                              250,  500,  1000, 2500,
+                                              5000, 10000};
+constexpr size_t ACK_LATENCY_BUCKETS
+    = sizeof(ACK_LATENCY_BOUNDS_MS) / sizeof(ACK_LATENCY_BOUNDS_MS[0]) + 1;
+
+struct HistogramSnapshot {
+  uint32_t buckets[ACK_LATENCY_BUCKETS];
+  uint32_t count;
+  uint32_t sum;
+  uint32_t max;
+};
+
+class FixedHistogram {
+public:
+  FixedHistogram();
+  void record(uint32_t value);
+  void snapshot(HistogramSnapshot &out) const;
+  void reset();
+
+private:
+  std::atomic<uint32_t> _buckets[ACK_LATENCY_BUCKETS];
+  std::atomic<uint32_t> _count;
+  std::atomic<uint32_t> _sum;
+  std::atomic<uint32_t> _max;
+};
+
+struct MetricsSnapshot {
+  uint32_t uptime_ms;
+  uint32_t counters[METRICS_COUNTERS];
+  uint32_t gauges[METRICS_GAUGES];
+  uint32_t errors[ERROR_TABLE_SIZE];
+  HistogramSnapshot ack_latency;
+
+  uint32_t counter(Counter c) const {
+    return counters[static_cast<size_t>(c)];
+  }
+  uint32_t gauge(Gauge g) const { return gauges[static_cast<size_t>(g)]; }
+  uint32_t error(MQTTErrors e) const { return errors[errorIndex(e)]; }
+};
+
+class Metrics {
+public:
+  Metrics();
+
+  void increment(Counter c, uint32_t by = 1) {
+    _counters[static_cast<size_t>(c)].fetch_add(by, std::memory_order_relaxed);
+  }
+  void set(Gauge g, uint32_t value) {
+    _gauges[static_cast<size_t>(g)].store(value, std::memory_order_relaxed);
+  }
+  void add(Gauge g, int32_t delta) {
+    _gauges[static_cast<size_t>(g)].fetch_add(static_cast<uint32_t>(delta),
+                                              std::memory_order_relaxed);
+  }
+  void recordError(MQTTErrors error) {
+    _errors[errorIndex(error)].fetch_add(1, std::memory_order_relaxed);
+  }
+  void recordPublish(uint8_t qos);
+  void recordAckLatency(uint32_t ms) {
+    _ackLatency.record(ms);
+    increment(Counter::ACKS);
+  }
+  void observeHeap(uint32_t freeBytes);
+
+  void snapshot(MetricsSnapshot &out, uint32_t now) const;
+  void reset();
+
+  // Self-publishing: true once every intervalMs, and at most once per call.
+  bool reportDue(uint32_t now, uint32_t intervalMs);
+  // Milliseconds until reportDue() next returns true, UINT32_MAX if never.
+  uint32_t msUntilReport(uint32_t now, uint32_t intervalMs) const;
+
+  static size_t encodeJson(const MetricsSnapshot &snap, char *buf,
+                           size_t size);
+  static size_t encodeBinary(const MetricsSnapshot &snap, uint8_t *buf,
+                             size_t size);
+
+  static constexpr uint8_t BINARY_VERSION = 3;
+  static constexpr size_t BINARY_SIZE
+      = 1 + 4
+        * (1 + METRICS_COUNTERS + METRICS_GAUGES + ERROR_TABLE_SIZE
+           + ACK_LATENCY_BUCKETS + 3);
+  // Worst case with every counter and error slot at ten digits.
+  static constexpr size_t JSON_MAX_SIZE = 1024;
+
+private:
+  std::atomic<uint32_t> _counters[METRICS_COUNTERS];
+  std::atomic<uint32_t> _gauges[METRICS_GAUGES];
+  std::atomic<uint32_t> _errors[ERROR_TABLE_SIZE];
+  FixedHistogram _ackLatency;
+  uint32_t _lastReport;
+  bool _reported;
+};
+
+} // namespace MQTTCore
+
+#endif // MQTT_METRICS_H_
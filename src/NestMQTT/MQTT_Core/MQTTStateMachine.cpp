@@ -1,6 +1,6 @@
 #include "MQTTStateMachine.h"
+#include "MQTTPlatform.h"
 #include <ArduinoJson.h>
-#include <LittleFS.h>
 #include <cstddef>
 #include <cstring>
 #include <functional>
@@ -9,10 +9,36 @@
 
 namespace MQTTCore {
 
+using MQTTPlatform::LogLevel;
+
+namespace {
+
+bool readFile(const char *filename, std::string &out) {
+  MQTTPlatform::File file;
+  if (!file.open(filename, "r")) {
+    return false;
+  }
+  out.resize(file.size());
+  out.resize(file.read(reinterpret_cast<uint8_t *>(&out[0]), out.size()));
+  return true;
+}
+
+bool writeFile(const char *filename, const std::string &content) {
+  MQTTPlatform::File file;
+  if (!file.open(filename, "w")) {
+    return false;
+  }
+  return file.write(reinterpret_cast<const uint8_t *>(content.data()),
+                    content.size())
+         == content.size();
+}
+
+} // namespace
+
 StateMachine::StateMachine()
     : current_state(State::disconnected), retry_count(0) {
-  if (!LittleFS.begin(true)) {
-    Serial.println("LittleFS Mount Failed");
+  if (!MQTTPlatform::mountFilesystem(true)) {
+    MQTTPlatform::log(LogLevel::ERROR, "Filesystem mount failed");
     return;
   }
   deserializeTransitions("/states/device_settings.json");
@@ -23,19 +49,20 @@ StateMachine::~StateMachine() {
 }
 
 void StateMachine::deserializeTransitions(const char *filename) {
-  File file = LittleFS.open(filename, "r");
-  if (!file) {
-    Serial.println("Failed to open file for reading");
+  std::string content;
+  if (!readFile(filename, content)) {
+    MQTTPlatform::log(LogLevel::ERROR, "Failed to open %s for reading",
+                      filename);
     return;
   }
 
-  // size_t fileSize = file.size();
   JsonDocument doc;
 
-  DeserializationError error = deserializeJson(doc, file);
+  DeserializationError error = deserializeJson(doc, content);
   if (error) {
-    Serial.print("Failed to read file, using default configuration: ");
-    Serial.println(error.c_str());
+    MQTTPlatform::log(LogLevel::WARNING,
+                      "Failed to read file, using default configuration: %s",
+                      error.c_str());
     return;
   }
 
@@ -53,12 +80,12 @@ void StateMachine::deserializeTransitions(const char *filename) {
     GuardFunction guard = []() { return true; };
 
     if (!transition["action"].isNull()) {
-      action = []() { Serial.println("Action executed"); };
+      action = []() { MQTTPlatform::log(LogLevel::DEBUG, "Action executed"); };
     }
 
     if (!transition["guard"].isNull()) {
       guard = []() -> bool {
-        Serial.println("Guard checked");
+        MQTTPlatform::log(LogLevel::DEBUG, "Guard checked");
         return true;
       };
     }
@@ -69,8 +96,8 @@ void StateMachine::deserializeTransitions(const char *filename) {
 }
 
 void StateMachine::handleEvent(Event event) {
-  Serial.printf("Handling event: %s from state: %s\n", eventToString(event),
-                stateToString(current_state));
+  MQTTPlatform::log(LogLevel::DEBUG, "Handling event: %s from state: %s",
+                    eventToString(event), stateToString(current_state));
 
   if (event == Event::SYSTEM_FAULT) {
     handleSystemFaultEvent();
@@ -104,13 +131,16 @@ void StateMachine::handleEvent(Event event) {
 }
 
 void StateMachine::handleRetryEvent() {
-  Serial.printf("Retry count before increment: %d\n", retry_count.load());
+  MQTTPlatform::log(LogLevel::DEBUG, "Retry count before increment: %d",
+                    retry_count.load());
   if (retry_count.load() >= max_retries) {
-    Serial.printf("Max retries reached! %d\n", retry_count.load() + 1);
+    MQTTPlatform::log(LogLevel::WARNING, "Max retries reached! %d",
+                      retry_count.load() + 1);
     setState(State::timeout);
   } else {
     retry_count++;
-    Serial.printf("Retry count after increment: %d\n", retry_count.load());
+    MQTTPlatform::log(LogLevel::DEBUG, "Retry count after increment: %d",
+                      retry_count.load());
     setState(State::reconnect);
   }
 }
@@ -129,8 +159,10 @@ void StateMachine::setState(State new_state) {
 }
 
 void StateMachine::logStateTransition(State from, State to, Event event) {
-  Serial.printf("Transitioned from state: %s to state: %s on event: %s\n",
-                stateToString(from), stateToString(to), eventToString(event));
+  MQTTPlatform::log(LogLevel::INFO,
+                    "Transitioned from state: %s to state: %s on event: %s",
+                    stateToString(from), stateToString(to),
+                    eventToString(event));
 }
 
 const char *StateMachine::stateToString(State state) {
@@ -292,12 +324,6 @@ StateMachine::Event StateMachine::stringToEvent(const char *str) {
 }
 
 void StateMachine::serializeTransitions(const char *filename) {
-  File file = LittleFS.open(filename, "w");
-  if (!file) {
-    Serial.println("Failed to open file for writing");
-    return;
-  }
-
   JsonDocument doc;
 
   JsonArray transitions = doc.createNestedArray("transitions");
@@ -309,44 +335,38 @@ void StateMachine::serializeTransitions(const char *filename) {
     transitionObj["next_state"] = stateToString(transition.next_state);
   }
 
-  if (serializeJson(doc, file) == 0) {
-    Serial.println("Failed to write to file");
+  std::string content;
+  if (serializeJson(doc, content) == 0 || !writeFile(filename, content)) {
+    MQTTPlatform::log(LogLevel::ERROR, "Failed to write %s", filename);
   }
-
-  file.close();
 }
 
 void StateMachine::saveState(State state) {
-  File file = LittleFS.open("/current_state.json", "w");
-  if (!file) {
-    Serial.println("Failed to open file for writing");
-    return;
-  }
-
   JsonDocument doc;
   doc["current_state"] = stateToString(state);
 
-  if (serializeJson(doc, file) == 0) {
-    Serial.println("Failed to write to file");
+  std::string content;
+  if (serializeJson(doc, content) == 0
+      || !writeFile("/current_state.json", content)) {
+    MQTTPlatform::log(LogLevel::ERROR, "Failed to write /current_state.json");
   }
-
-  file.close();
 }
 
 StateMachine::State StateMachine::loadState() {
-  File file = LittleFS.open("/current_state.json", "r");
-  if (!file) {
-    Serial.println("Failed to open file for reading");
+  std::string content;
+  if (!readFile("/current_state.json", content)) {
+    MQTTPlatform::log(LogLevel::WARNING,
+                      "Failed to open /current_state.json for reading");
     return State::disconnected;
   }
 
-  // size_t fileSize = file.size();
   JsonDocument doc;
 
-  DeserializationError error = deserializeJson(doc, file);
+  DeserializationError error = deserializeJson(doc, content);
   if (error) {
-    Serial.print("Failed to read file, using default configuration: ");
-    Serial.println(error.c_str());
+    MQTTPlatform::log(LogLevel::WARNING,
+                      "Failed to read file, using default configuration: %s",
+                      error.c_str());
     return State::disconnected;
   }
 
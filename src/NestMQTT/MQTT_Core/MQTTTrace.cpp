@@ -0,0 +1,169 @@
+#include "MQTTTrace.h"
+#include <cstdio>
+
+namespace MQTTCore {
+
+constexpr uint8_t LogHistogram::SUB_BITS;
+constexpr uint32_t LogHistogram::SUB_COUNT;
+constexpr size_t LogHistogram::BUCKETS;
+
+size_t LogHistogram::bucketOf(uint32_t value) {
+  if (value < SUB_COUNT) {
+    return value;
+  }
+  uint32_t magnitude = 31 - __builtin_clz(value);
+  return ((magnitude - SUB_BITS + 1) << SUB_BITS)
+         + ((value >> (magnitude - SUB_BITS)) - SUB_COUNT);
+}
+
+uint32_t LogHistogram::lowerBound(size_t bucket) {
+  if (bucket < SUB_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> SUB_BITS) - 1;
+  return (SUB_COUNT + (bucket & (SUB_COUNT - 1))) << shift;
+}
+
+uint32_t LogHistogram::upperBound(size_t bucket) {
+  if (bucket < SUB_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> SUB_BITS) - 1;
+  return lowerBound(bucket) + ((1u << shift) - 1);
+}
+
+void LogHistogram::record(uint32_t value) {
+  _buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  uint32_t seen = _max.load(std::memory_order_relaxed);
+  while (value > seen
+         && !_max.compare_exchange_weak(seen, value,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+uint32_t LogHistogram::percentile(float p) const {
+  uint32_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+  uint32_t rank = static_cast<uint32_t>(p / 100.0f * total + 0.5f);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint32_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    seen += _buckets[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      uint32_t bound = upperBound(i);
+      return bound < max() ? bound : max();
+    }
+  }
+  return max();
+}
+
+void LogHistogram::reset() {
+  for (auto &bucket : _buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  _count.store(0, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+#if MQTT_LATENCY_TRACE
+
+void LatencyTracer::_span(TraceSpan span, const MessageTrace &trace,
+                          TraceStage from, TraceStage to) {
+  // Unstamped stages are skipped rather than recorded as huge values.
+  if (!trace.has(from) || !trace.has(to)) {
+    return;
+  }
+  record(span, trace.at(to) - trace.at(from));
+}
+
+void LatencyTracer::recordOutbound(const MessageTrace &trace, bool acked) {
+  _span(TraceSpan::OUT_ENCODE, trace, TraceStage::PUBLISH_CALL,
+        TraceStage::ENCODED);
+  _span(TraceSpan::OUT_QUEUED, trace, TraceStage::ENCODED,
+        TraceStage::FIRST_WRITE);
+  _span(TraceSpan::OUT_WRITE, trace, TraceStage::FIRST_WRITE,
+        TraceStage::LAST_WRITE);
+  if (acked) {
+    _span(TraceSpan::OUT_ACK, trace, TraceStage::LAST_WRITE,
+          TraceStage::ACKED);
+    _span(TraceSpan::OUT_TOTAL, trace, TraceStage::PUBLISH_CALL,
+          TraceStage::ACKED);
+  } else {
+    _span(TraceSpan::OUT_TOTAL, trace, TraceStage::PUBLISH_CALL,
+          TraceStage::LAST_WRITE);
+  }
+}
+
+void LatencyTracer::recordInbound(const MessageTrace &trace) {
+  _span(TraceSpan::IN_DECODE, trace, TraceStage::INBOUND_FIRST_BYTE,
+        TraceStage::INBOUND_DECODED);
+  _span(TraceSpan::IN_CALLBACK, trace, TraceStage::INBOUND_DECODED,
+        TraceStage::CALLBACK_DONE);
+  _span(TraceSpan::IN_TOTAL, trace, TraceStage::INBOUND_FIRST_BYTE,
+        TraceStage::CALLBACK_DONE);
+}
+
+size_t LatencyTracer::report(char *buf, size_t size) const {
+  size_t pos = 0;
+  for (size_t i = 0; i < TRACE_SPANS; ++i) {
+    const LogHistogram &h = _spans[i];
+    int n = snprintf(buf + pos, size - pos,
+                     "%s\"%s\":{\"n\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,"
+                     "\"max\":%u}",
+                     i ? "," : "{",
+                     spanToString(static_cast<TraceSpan>(i)),
+                     static_cast<unsigned>(h.count()),
+                     static_cast<unsigned>(h.percentile(50)),
+                     static_cast<unsigned>(h.percentile(90)),
+                     static_cast<unsigned>(h.percentile(99)),
+                     static_cast<unsigned>(h.max()));
+    if (n < 0 || static_cast<size_t>(n) >= size - pos) {
+      return 0;
+    }
+    pos += n;
+  }
+  if (pos + 2 > size) {
+    return 0;
+  }
+  buf[pos++] = '}';
+  buf[pos] = '\0';
+  return pos;
+}
+
+void LatencyTracer::reset() {
+  for (auto &span : _spans) {
+    span.reset();
+  }
+}
+
+const char *LatencyTracer::spanToString(TraceSpan span) {
+  switch (span) {
+    case TraceSpan::OUT_ENCODE:
+      return "out_encode";
+    case TraceSpan::OUT_QUEUED:
+      return "out_queued";
+    case TraceSpan::OUT_WRITE:
+      return "out_write";
+    case TraceSpan::OUT_ACK:
+      return "out_ack";
+    case TraceSpan::OUT_TOTAL:
+      return "out_total";
+    case TraceSpan::IN_DECODE:
+      return "in_decode";
+    case TraceSpan::IN_CALLBACK:
+      return "in_callback";
+    case TraceSpan::IN_TOTAL:
+      return "in_total";
+    default:
+      return "unknown";
+  }
+}
+
+#endif // MQTT_LATENCY_TRACE
+
+} // namespace MQTTCore
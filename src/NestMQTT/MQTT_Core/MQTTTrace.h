@@ -0,0 +1,144 @@
+#ifndef MQTT_TRACE_H_
+#define MQTT_TRACE_H_
+
+#include "MQTTConfig.h"
+#include "MQTTPlatform.h"
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTCore {
+
+// Points in a message's life, stamped in microseconds.
+enum class TraceStage : uint8_t {
+  PUBLISH_CALL = 0,
+  ENCODED,
+  FIRST_WRITE,
+  LAST_WRITE,
+  ACKED,
+  INBOUND_FIRST_BYTE,
+  INBOUND_DECODED,
+  CALLBACK_DONE,
+  COUNT
+};
+
+// Intervals aggregated by the tracer.
+enum class TraceSpan : uint8_t {
+  OUT_ENCODE = 0, // publish() -> packet encoded
+  OUT_QUEUED,     // encoded -> first byte handed to Transport::write
+  OUT_WRITE,      // first byte -> last byte written
+  OUT_ACK,        // last byte -> PUBACK/PUBCOMP
+  OUT_TOTAL,      // publish() -> ack, or last byte for QoS 0
+  IN_DECODE,      // first byte read -> packet decoded
+  IN_CALLBACK,    // decoded -> user callbacks returned
+  IN_TOTAL,
+  COUNT
+};
+
+constexpr size_t TRACE_STAGES = static_cast<size_t>(TraceStage::COUNT);
+constexpr size_t TRACE_SPANS = static_cast<size_t>(TraceSpan::COUNT);
+
+// HDR-style histogram: values below 2^SUB_BITS are exact, above that each
+// power of two is split into 2^SUB_BITS linear buckets (~25% precision)
+// up to the full uint32_t range, in fixed memory.
+class LogHistogram {
+public:
+  static constexpr uint8_t SUB_BITS = 2;
+  static constexpr uint32_t SUB_COUNT = 1u << SUB_BITS;
+  static constexpr size_t BUCKETS = ((32 - SUB_BITS) + 1) << SUB_BITS;
+
+  LogHistogram() { reset(); }
+
+  static size_t bucketOf(uint32_t value);
+  static uint32_t lowerBound(size_t bucket);
+  static uint32_t upperBound(size_t bucket);
+
+  void record(uint32_t value);
+  uint32_t count() const { return _count.load(std::memory_order_relaxed); }
+  uint32_t max() const { return _max.load(std::memory_order_relaxed); }
+  // Upper bound of the bucket holding the given percentile (0-100).
+  uint32_t percentile(float p) const;
+  void reset();
+
+private:
+  std::atomic<uint32_t> _buckets[BUCKETS];
+  std::atomic<uint32_t> _count;
+  std::atomic<uint32_t> _max;
+};
+
+#if MQTT_LATENCY_TRACE
+
+// Which stages are stamped is kept apart from the times, since micros()
+// may read 0 at any stage (a VirtualClock starting at 0, or the wrap).
+struct MessageTrace {
+  uint32_t stamps[TRACE_STAGES] = {};
+  uint8_t stamped = 0; // bit per TraceStage
+
+  void stamp(TraceStage stage) {
+    stamps[static_cast<size_t>(stage)] = MQTTPlatform::micros();
+    stamped |= _bit(stage);
+  }
+  bool has(TraceStage stage) const { return stamped & _bit(stage); }
+  uint32_t at(TraceStage stage) const {
+    return stamps[static_cast<size_t>(stage)];
+  }
+  void reset() { stamped = 0; }
+
+private:
+  static uint8_t _bit(TraceStage stage) {
+    return static_cast<uint8_t>(1u << static_cast<size_t>(stage));
+  }
+};
+static_assert(TRACE_STAGES <= 8, "MessageTrace::stamped holds 8 stages");
+
+class LatencyTracer {
+public:
+  void recordOutbound(const MessageTrace &trace, bool acked);
+  void recordInbound(const MessageTrace &trace);
+  void record(TraceSpan span, uint32_t us) {
+    _spans[static_cast<size_t>(span)].record(us);
+  }
+
+  const LogHistogram &histogram(TraceSpan span) const {
+    return _spans[static_cast<size_t>(span)];
+  }
+  uint32_t percentile(TraceSpan span, float p) const {
+    return histogram(span).percentile(p);
+  }
+  // {"span":{"n":..,"p50":..,"p90":..,"p99":..,"max":..},...} in
+  // microseconds. Returns 0 if the buffer is too small.
+  size_t report(char *buf, size_t size) const;
+  void reset();
+
+  static const char *spanToString(TraceSpan span);
+
+private:
+  void _span(TraceSpan span, const MessageTrace &trace, TraceStage from,
+             TraceStage to);
+  LogHistogram _spans[TRACE_SPANS];
+};
+
+#else
+
+struct MessageTrace {
+  void stamp(TraceStage) {}
+  bool has(TraceStage) const { return false; }
+  uint32_t at(TraceStage) const { return 0; }
+  void reset() {}
+};
+
+class LatencyTracer {
+public:
+  void recordOutbound(const MessageTrace &, bool) {}
+  void recordInbound(const MessageTrace &) {}
+  void record(TraceSpan, uint32_t) {}
+  uint32_t percentile(TraceSpan, float) const { return 0; }
+  size_t report(char *, size_t) const { return 0; }
+  void reset() {}
+};
+
+#endif // MQTT_LATENCY_TRACE
+
+} // namespace MQTTCore
+
+#endif // MQTT_TRACE_H_
@@ -1,13 +1,16 @@
 #include "MQTTPacket.h"
 #include "MQTTAsyncTask.h"
 #include "MQTTCore.h"
+#include "MQTTMemory.h"
 #include "MQTTUtility.h"
 
 using namespace MQTTCore;
 
 namespace MQTTPacket {
 
-Packet::~Packet() { free(_packetData); }
+Packet::~Packet() {
+  MemoryPolicy::instance().release(MEMORY_PAYLOAD, _packetData);
+}
 
 size_t Packet::available(size_t index) {
   if (index >= _packetSize)
@@ -46,10 +49,39 @@ MQTTPacketType Packet::packetType() const {
   return static_cast<MQTTPacketType>(0);
 }
 
+uint8_t Packet::qos() const {
+  if (packetType() != MQTTCore::PacketType.PUBLISH)
+    return 0;
+  return (_packetData[0] & MQTTCore::HeaderFlag.PUBLISH_QOSRESERVED) >> 1;
+}
+
+bool Packet::isDup() const {
+  if (packetType() != MQTTCore::PacketType.PUBLISH)
+    return false;
+  return _packetData[0] & MQTTCore::HeaderFlag.PUBLISH_DUP;
+}
+
+const char *Packet::topic(uint16_t &length) const {
+  length = 0;
+  if (packetType() != MQTTCore::PacketType.PUBLISH)
+    return nullptr;
+  // Skip the remaining length, one to four bytes
+  size_t pos = 1;
+  while (pos < 4 && (_packetData[pos] & 0x80))
+    ++pos;
+  ++pos;
+  length = static_cast<uint16_t>((_packetData[pos] << 8)
+                                 | _packetData[pos + 1]);
+  return reinterpret_cast<const char *>(&_packetData[pos + 2]);
+}
+
 bool Packet::removable() const {
   if (_packetId == 0)
     return true;
+  // Our acks are never acked in turn; a lost PUBREC is answered again
+  // when the broker resends its PUBLISH
   if (packetType() == MQTTCore::PacketType.PUBACK
+      || packetType() == MQTTCore::PacketType.PUBREC
       || packetType() == MQTTCore::PacketType.PUBCOMP)
     return true;
   return false;
@@ -106,8 +138,6 @@ Packet::Packet(MQTTErrors &error, bool cleanSession, const char *username,
       _payloadIndex(0),
       _payloadStartIndex(0),
       _payloadEndIndex(0),
-      _subscription{},
-      _subscriptionPtr(nullptr),
       _getPayload(nullptr) {
   if (willPayload && willPayloadLength == 0) {
     size_t length = strlen(reinterpret_cast<const char *>(willPayload));
@@ -121,7 +151,7 @@ Packet::Packet(MQTTErrors &error, bool cleanSession, const char *username,
   size_t remainingLength = calculateRemainingLength(
       clientId, username, password, willTopic, willPayloadLength);
 
-  if (!_allocateMemory(remainingLength, false)) {
+  if (!_allocateMemory(remainingLength)) {
     error = MQTTErrors::OUT_OF_MEMORY;
     return;
   }
@@ -176,7 +206,7 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId, const char *topic,
   size_t remainingLength
       = calculateRemainingLength(topic, payloadLength, 0, qos);
 
-  if (!_allocateMemory(remainingLength, false)) {
+  if (!_allocateMemory(remainingLength)) {
     error = MQTTErrors::OUT_OF_MEMORY;
     return;
   }
@@ -210,7 +240,7 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId, const char *topic,
     _packetId = 0;
   }
 
-  if (!_allocateMemory(remainingLength, false)) {
+  if (!_allocateMemory(remainingLength)) {
     error = MQTTErrors::OUT_OF_MEMORY;
     return;
   }
@@ -222,6 +252,43 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId, const char *topic,
 
   error = MQTTErrors::SUCCESS;
 }
+// PUBLISH, restored
+Packet::Packet(MQTTErrors &error, const uint8_t *encoded, size_t length)
+    : _packetId(0),
+      _packetData(nullptr),
+      _packetSize(0),
+      _payloadIndex(0),
+      _payloadStartIndex(0),
+      _payloadEndIndex(0),
+      _getPayload(nullptr) {
+  error = MQTTErrors::MALFORMED_REQUEST;
+  if (length < 2 || (encoded[0] & 0xF0) != PacketType.PUBLISH
+      || (encoded[0] & HeaderFlag.PUBLISH_QOSRESERVED) == 0) {
+    return;
+  }
+  uint32_t remainingLength = 0;
+  int fieldSize
+      = MQTTUtility::decodeRemainingLength(encoded + 1, length - 1,
+                                           remainingLength);
+  size_t pos = 1 + (fieldSize > 0 ? fieldSize : 0);
+  if (fieldSize <= 0 || pos + remainingLength != length
+      || remainingLength < 4) {
+    return;
+  }
+  size_t topicLength = (encoded[pos] << 8) | encoded[pos + 1];
+  pos += 2 + topicLength;
+  if (pos + 2 > length) {
+    return;
+  }
+  _packetId = (encoded[pos] << 8) | encoded[pos + 1];
+  if (_packetId == 0 || !_allocateMemory(remainingLength)) {
+    error = _packetId ? MQTTErrors::OUT_OF_MEMORY : error;
+    _packetId = 0;
+    return;
+  }
+  memcpy(_packetData, encoded, length);
+  error = MQTTErrors::SUCCESS;
+}
 // SUBSCRIBE
 Packet::Packet(MQTTErrors &error, uint16_t packetId, const char *topic,
                uint8_t qos)
@@ -231,11 +298,9 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId, const char *topic,
       _payloadIndex(0),
       _payloadStartIndex(0),
       _payloadEndIndex(0),
-      _subscription(Subscription(topic, qos)),
-      _subscriptionPtr(&_subscription),
-
       _getPayload(nullptr) {
-  _updateSubscribe(error, Subscription_task::SUBSCRIBE, _subscription);
+  _updateSubscribe(error, Subscription_task::SUBSCRIBE,
+                   Subscription(topic, qos));
 }
 // SUBSCRIBE
 Packet::Packet(MQTTErrors &error, uint16_t packetId,
@@ -246,11 +311,8 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId,
       _payloadIndex(0),
       _payloadStartIndex(0),
       _payloadEndIndex(0),
-      _subscription(subscription),
-      _subscriptionPtr(&_subscription),
-
       _getPayload(nullptr) {
-  _updateSubscribe(error, Subscription_task::SUBSCRIBE, _subscription);
+  _updateSubscribe(error, Subscription_task::SUBSCRIBE, subscription);
 }
 // SUBSCRIBE
 template <typename... Args>
@@ -263,12 +325,10 @@ Packet::Packet(MQTTCore::MQTTErrors &error, uint16_t packetId,
       _payloadIndex(0),
       _payloadStartIndex(0),
       _payloadEndIndex(0),
-      _subscription(Subscription(topic1, qos1, topic2, qos2,
-                                 std::forward<Args>(args)...)),
-      _subscriptionPtr(&_subscription),
-
       _getPayload(nullptr) {
-  _updateSubscribe(error, Subscription_task::SUBSCRIBE, _subscription);
+  _updateSubscribe(error, Subscription_task::SUBSCRIBE,
+                   Subscription(topic1, qos1, topic2, qos2,
+                                std::forward<Args>(args)...));
 }
 
 // UNSUBSCRIBE
@@ -279,11 +339,9 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId, const char *topic)
       _payloadIndex(0),
       _payloadStartIndex(0),
       _payloadEndIndex(0),
-      _subscription(Subscription(topic)),
-      _subscriptionPtr(&_subscription),
-
       _getPayload(nullptr) {
-  _updateSubscribe(error, Subscription_task::UNSUBSCRIBE, _subscription);
+  _updateSubscribe(error, Subscription_task::UNSUBSCRIBE,
+                   Subscription(topic));
 }
 // UNSUBSCRIBE
 template <typename... Args>
@@ -296,12 +354,23 @@ Packet::Packet(MQTTErrors &error,  // NOLINT(runtime/references)
       _payloadIndex(0),
       _payloadStartIndex(0),
       _payloadEndIndex(0),
-      _subscription(Subscription(topic1, topic2, std::forward<Args>(args)...)),
-
-      _subscriptionPtr(&_subscription),
+      _getPayload(nullptr) {
+  _updateSubscribe(
+      error, Subscription_task::UNSUBSCRIBE,
+      Subscription(topic1, topic2, std::forward<Args>(args)...));
+}
 
+// SUBSCRIBE, UNSUBSCRIBE
+Packet::Packet(MQTTErrors &error, uint16_t packetId,
+               const Subscription &subscription, Subscription_task task)
+    : _packetId(packetId),
+      _packetData(nullptr),
+      _packetSize(0),
+      _payloadIndex(0),
+      _payloadStartIndex(0),
+      _payloadEndIndex(0),
       _getPayload(nullptr) {
-  _updateSubscribe(error, Subscription_task::UNSUBSCRIBE, _subscription);
+  _updateSubscribe(error, task, subscription);
 }
 
 // PUBACK, PUBREC, PUBREL, PUBCOMP
@@ -315,7 +384,7 @@ Packet::Packet(MQTTErrors &error, uint16_t packetId, MQTTPacketType type)
       _getPayload(nullptr) {
   size_t remainingLength = 2;
 
-  if (!_allocateMemory(remainingLength, false)) {
+  if (!_allocateMemory(remainingLength)) {
     error = MQTTErrors::OUT_OF_MEMORY;
     return;
   }
@@ -343,7 +412,7 @@ Packet::Packet(MQTTErrors &error, MQTTPacketType type)
       _getPayload(nullptr) {
   size_t remainingLength = 0;
 
-  if (!_allocateMemory(remainingLength, false)) {
+  if (!_allocateMemory(remainingLength)) {
     error = MQTTErrors::OUT_OF_MEMORY;
     return;
   }
@@ -356,7 +425,10 @@ Packet &Packet::operator=(const Packet &other) {
   if (this != &other) {
     _packetId = other._packetId;
     _packetSize = other._packetSize;
-    _packetData = static_cast<uint8_t *>(realloc(_packetData, _packetSize));
+    MemoryPolicy &memory = MemoryPolicy::instance();
+    memory.release(MEMORY_PAYLOAD, _packetData);
+    _packetData = static_cast<uint8_t *>(
+        memory.allocate(MEMORY_PAYLOAD, _packetSize));
     if (_packetData) {
       memcpy(_packetData, other._packetData, _packetSize);
     }
@@ -364,6 +436,17 @@ Packet &Packet::operator=(const Packet &other) {
   return *this;
 }
 
+void Packet::swapPublish(Packet &other) {
+  std::swap(_error, other._error);
+  std::swap(_packetId, other._packetId);
+  std::swap(_packetData, other._packetData);
+  std::swap(_packetSize, other._packetSize);
+  std::swap(_payloadIndex, other._payloadIndex);
+  std::swap(_payloadStartIndex, other._payloadStartIndex);
+  std::swap(_payloadEndIndex, other._payloadEndIndex);
+  std::swap(_getPayload, other._getPayload);
+}
+
 bool Packet::isEmpty() const {
   return (_packetData == nullptr || _packetSize == 0);
 }
@@ -406,15 +489,12 @@ const uint8_t *Packet::_chunkedData(size_t index) const {
   return &_packetData[index];
 }
 
-bool Packet::_allocateMemory(size_t remainingLength, bool check) {
-
-  if (check && MQTT_GET_FREE_MEMORY() < MQTT_MIN_FREE_MEMORY) {
-    // emc_log_w("Packet buffer not allocated: low memory");
-    return false;
-  }
+bool Packet::_allocateMemory(size_t remainingLength) {
   _packetSize = 1 + MQTTUtility::remainingLengthFieldSize(remainingLength)
                 + remainingLength;
-  _packetData = reinterpret_cast<uint8_t *>(malloc(_packetSize));
+  // Large payloads go to PSRAM, see MQTTCore::MemoryPolicy
+  _packetData = static_cast<uint8_t *>(
+      MemoryPolicy::instance().allocate(MEMORY_PAYLOAD, _packetSize));
   if (!_packetData) {
     _packetSize = 0;
     // emc_log_w("Alloc failed (l:%zu)", _size);
@@ -454,11 +534,14 @@ size_t Packet::_fillPublishHeader(uint16_t packetId, const char *topic,
 void Packet::_updateSubscribe(MQTTErrors &error, Subscription_task task,
                               const Subscription &subscription) {
 
-  // Calculate the remaining length
+  // Calculate the remaining length; UNSUBSCRIBE carries no QoS bytes
   size_t remainingLength = calculateRemainingLength(subscription);
+  if (task == Subscription_task::UNSUBSCRIBE) {
+    remainingLength -= subscription.numberTopics;
+  }
 
   // Allocate memory for the packet
-  if (!_allocateMemory(remainingLength, false)) {
+  if (!_allocateMemory(remainingLength)) {
     error = MQTTErrors::OUT_OF_MEMORY;
     return;
   }
@@ -470,9 +553,6 @@ void Packet::_updateSubscribe(MQTTErrors &error, Subscription_task task,
                                  | MQTTCore::HeaderFlag.SUBSCRIBE_RESERVED
                            : MQTTCore::PacketType.UNSUBSCRIBE
                                  | MQTTCore::HeaderFlag.UNSUBSCRIBE_RESERVED;
-  pos = 1
-        + MQTTUtility::encodeRemainingLength(remainingLength, &_packetData[1]);
-  ;
   pos += MQTTUtility::encodeRemainingLength(remainingLength, &_packetData[pos]);
   MQTTUtility::fillTwoBytes(_packetId, _packetData, pos);
 
@@ -26,13 +26,10 @@ private:
   size_t _payloadStartIndex;
   size_t _payloadEndIndex;
 
-  Subscription _subscription;
-  Subscription *_subscriptionPtr;
-
   // Callback for getting payload
   MQTTCore::onPayloadInternalCallback _getPayload;
 
-  bool _allocateMemory(size_t remainingLength, bool check = true);
+  bool _allocateMemory(size_t remainingLength);
   size_t _fillPublishHeader(uint16_t packetId, const char *topic,
                             size_t remainingLength, uint8_t qos, bool retain);
 
@@ -53,6 +50,8 @@ public:
   Packet(MQTTErrors &error, uint16_t packetId, const char *topic,
          MQTTCore::onPayloadInternalCallback payloadCallback,
          size_t payloadLength, uint8_t qos, bool retain);
+  // Constructor for a QoS 1/2 PUBLISH restored from its encoded bytes
+  Packet(MQTTErrors &error, const uint8_t *encoded, size_t length);
 
   // Constructor for SUBSCRIBE
   Packet(MQTTErrors &error, uint16_t packetId, const char *topic, uint8_t qos);
@@ -70,6 +69,10 @@ public:
          uint16_t packetId, const char *topic1, const char *topic2,
          Args &&...args);
 
+  // Constructor for SUBSCRIBE or UNSUBSCRIBE from a prepared list
+  Packet(MQTTErrors &error, uint16_t packetId,
+         const Subscription &subscription, Subscription_task task);
+
   // Constructor for PUBACK, PUBREC, PUBREL, PUBCOMP
   Packet(MQTTErrors &error, uint16_t packetId, MQTTPacketType type);
 
@@ -79,14 +82,29 @@ public:
   // Destructor
   ~Packet();
 
+  // Owns its buffer; copies would free it twice
+  Packet(const Packet &) = delete;
+
   // Copy assignment operator
   Packet &operator=(const Packet &other);
 
+  // Exchanges the contents of two PUBLISH packets, so a queued message can
+  // be replaced where it stands.
+  void swapPublish(Packet &other);
+
   size_t size() const;
   uint16_t packetId() const;
   const uint8_t *data() const;
   const uint8_t *data(size_t index) const;
   MQTTCore::MQTTPacketType packetType() const;
+  uint8_t qos() const;
+  bool isDup() const;
+  // True when the payload is fetched through a callback as it is written,
+  // so data() does not hold the whole packet.
+  bool hasPayloadCallback() const { return _getPayload != nullptr; }
+  // Topic of a PUBLISH, pointing into the encoded packet; nullptr and a
+  // length of 0 for other packets.
+  const char *topic(uint16_t &length) const;
   size_t available(size_t index);
   void setDup();
   size_t calculateRemainingLength(const char *clientId = nullptr,
@@ -0,0 +1,114 @@
+#include "MQTTPlatform.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Parts shared by every target: files go through stdio, which the ESP-IDF
+// VFS routes to LittleFS once it is mounted.
+namespace MQTTPlatform {
+
+namespace {
+
+constexpr size_t MAX_PATH_LENGTH = 128;
+
+bool resolvePath(const char *path, char *out, size_t size) {
+  int written = snprintf(out, size, "%s%s", filesystemRoot(), path);
+  return written > 0 && static_cast<size_t>(written) < size;
+}
+
+LogLevel _logLevel = LogLevel::INFO;
+
+} // namespace
+
+Mutex &clientMutex() {
+  static Mutex mutex;
+  return mutex;
+}
+
+bool fileExists(const char *path) {
+  char full[MAX_PATH_LENGTH];
+  struct stat st;
+  return resolvePath(path, full, sizeof(full)) && stat(full, &st) == 0;
+}
+
+bool removeFile(const char *path) {
+  char full[MAX_PATH_LENGTH];
+  return resolvePath(path, full, sizeof(full)) && remove(full) == 0;
+}
+
+File &File::operator=(File &&other) noexcept {
+  if (this != &other) {
+    close();
+    _handle = other._handle;
+    other._handle = nullptr;
+  }
+  return *this;
+}
+
+bool File::open(const char *path, const char *mode) {
+  close();
+  char full[MAX_PATH_LENGTH];
+  if (!resolvePath(path, full, sizeof(full))) {
+    return false;
+  }
+  char binaryMode[4] = {mode[0], 'b', '\0', '\0'};
+  if (mode[0] && mode[1] == '+') {
+    binaryMode[2] = '+';
+  }
+  _handle = fopen(full, binaryMode);
+  return _handle != nullptr;
+}
+
+void File::close() {
+  if (_handle) {
+    fclose(static_cast<FILE *>(_handle));
+    _handle = nullptr;
+  }
+}
+
+size_t File::read(uint8_t *buf, size_t size) {
+  return _handle ? fread(buf, 1, size, static_cast<FILE *>(_handle)) : 0;
+}
+
+size_t File::write(const uint8_t *buf, size_t size) {
+  return _handle ? fwrite(buf, 1, size, static_cast<FILE *>(_handle)) : 0;
+}
+
+size_t File::size() {
+  if (!_handle) {
+    return 0;
+  }
+  FILE *file = static_cast<FILE *>(_handle);
+  long position = ftell(file);
+  fseek(file, 0, SEEK_END);
+  long end = ftell(file);
+  fseek(file, position, SEEK_SET);
+  return end < 0 ? 0 : static_cast<size_t>(end);
+}
+
+bool File::seek(size_t offset) {
+  return _handle
+         && fseek(static_cast<FILE *>(_handle), static_cast<long>(offset),
+                  SEEK_SET)
+                == 0;
+}
+
+bool File::flush() {
+  return _handle && fflush(static_cast<FILE *>(_handle)) == 0;
+}
+
+void setLogLevel(LogLevel level) { _logLevel = level; }
+
+LogLevel logLevel() { return _logLevel; }
+
+void log(LogLevel level, const char *format, ...) {
+  if (level < _logLevel) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vlog(level, format, args);
+  va_end(args);
+}
+
+} // namespace MQTTPlatform
@@ -0,0 +1,221 @@
+#ifndef MQTT_PLATFORM_H_
+#define MQTT_PLATFORM_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(ESP_PLATFORM)
+#define MQTT_PLATFORM_ESP32 1
+#else
+#define MQTT_PLATFORM_POSIX 1
+#endif
+
+#ifdef ARDUINO
+#include <IPAddress.h>
+#endif
+
+// Everything the client core needs from the system. One implementation per
+// target lives next to this header; exactly one of them is compiled.
+namespace MQTTPlatform {
+
+// Time. Both clocks are monotonic and wrap like their Arduino namesakes.
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+// Gives other tasks a chance to run; sleeps for about a millisecond.
+void yield();
+
+#ifdef MQTT_PLATFORM_POSIX
+// Simulated time for host runs. While a clock is installed, millis() and
+// micros() follow it instead of the system clock; delay() and yield() still
+// sleep for real.
+class VirtualClock {
+public:
+  explicit VirtualClock(uint64_t startUs = 0) : _nowUs(startUs) {}
+  ~VirtualClock() { uninstall(); }
+  VirtualClock(const VirtualClock &) = delete;
+  VirtualClock &operator=(const VirtualClock &) = delete;
+
+  void install();
+  void uninstall();
+  uint64_t nowUs() const { return _nowUs; }
+  void advance(uint64_t us) { _nowUs += us; }
+
+private:
+  uint64_t _nowUs;
+};
+#endif
+
+// Heap introspection, in bytes.
+size_t freeHeap();
+size_t largestFreeBlock();
+size_t minFreeHeap();
+
+// Memory regions: INTERNAL is on-chip SRAM, EXTERNAL is PSRAM where the
+// board has it. On POSIX each region is an arena of its own, so placement
+// behaves on a host as it would on a board.
+enum class Region : uint8_t { INTERNAL, EXTERNAL };
+
+// nullptr when the region is full or absent.
+void *regionAlloc(Region region, size_t size);
+void regionFree(void *ptr);
+// Usable bytes of a block from regionAlloc(), and the region it is in.
+size_t regionSize(const void *ptr);
+Region regionOf(const void *ptr);
+
+#ifdef MQTT_PLATFORM_POSIX
+// Bytes of a host arena. Takes effect while it has nothing allocated.
+void setRegionCapacity(Region region, size_t bytes);
+#endif
+
+// Recursive, so a locked section may call into another one.
+class Mutex {
+public:
+  Mutex();
+  ~Mutex();
+  Mutex(const Mutex &) = delete;
+  Mutex &operator=(const Mutex &) = delete;
+
+  void lock();
+  void unlock();
+
+private:
+  void *_handle;
+};
+
+class LockGuard {
+public:
+  explicit LockGuard(Mutex &mutex) : _mutex(mutex) { _mutex.lock(); }
+  ~LockGuard() { _mutex.unlock(); }
+  LockGuard(const LockGuard &) = delete;
+  LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+  Mutex &_mutex;
+};
+
+// Lock shared by the client, transmitter and receiver.
+Mutex &clientMutex();
+
+// Binary wake-up signal with a single waiter. notify() may be called from
+// any task; notifications before wait() are not lost.
+class Notification {
+public:
+  Notification();
+  ~Notification();
+  Notification(const Notification &) = delete;
+  Notification &operator=(const Notification &) = delete;
+
+  void notify();
+  // True when notified, false on timeout.
+  bool wait(uint32_t timeoutMs);
+#ifdef MQTT_PLATFORM_POSIX
+  // Polls readable while a notification is pending, so it can share a
+  // poll() with sockets; call wait(0) afterwards to consume it.
+  int fd() const;
+#endif
+
+private:
+  void *_handle;
+};
+
+// A FreeRTOS task on the ESP32, a thread on POSIX. Zero stack size and
+// priority pick the platform defaults; priority is ignored on POSIX.
+struct ThreadOptions {
+  const char *name;
+  uint32_t stackSize;
+  int priority;
+  bool pinToCore;
+  uint8_t core;
+};
+
+class Thread {
+public:
+  using Function = void (*)(void *arg);
+
+  Thread() : _handle(nullptr) {}
+  ~Thread() { join(); }
+  Thread(const Thread &) = delete;
+  Thread &operator=(const Thread &) = delete;
+
+  bool start(Function function, void *arg, const ThreadOptions &options);
+  // Waits for the function to return; a no-op when not started.
+  void join();
+  bool started() const { return _handle != nullptr; }
+
+private:
+  void *_handle;
+};
+
+// Filesystem. Paths are absolute within the data partition ("/states/..."),
+// which is LittleFS on the ESP32 and a host directory on POSIX.
+bool mountFilesystem(bool formatOnFail);
+// Host directory backing the data partition; ignored on the ESP32.
+void setFilesystemRoot(const char *root);
+const char *filesystemRoot();
+bool fileExists(const char *path);
+bool removeFile(const char *path);
+
+class File {
+public:
+  File() : _handle(nullptr) {}
+  ~File() { close(); }
+  File(File &&other) noexcept : _handle(other._handle) {
+    other._handle = nullptr;
+  }
+  File &operator=(File &&other) noexcept;
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+
+  // Modes follow fopen(): "r", "w" or "a"; files are always binary.
+  bool open(const char *path, const char *mode);
+  void close();
+  explicit operator bool() const { return _handle != nullptr; }
+
+  size_t read(uint8_t *buf, size_t size);
+  size_t write(const uint8_t *buf, size_t size);
+  size_t size();
+  // Moves the read/write position to offset bytes from the start.
+  bool seek(size_t offset);
+  // flush() hands the data to the filesystem; sync() also waits until it
+  // is on the medium and survives a power cut. Much slower on flash.
+  bool flush();
+  bool sync();
+
+private:
+  void *_handle;
+};
+
+// Logging.
+enum class LogLevel : uint8_t { DEBUG, INFO, WARNING, ERROR, NONE };
+
+void setLogLevel(LogLevel level);
+LogLevel logLevel();
+void log(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void vlog(LogLevel level, const char *format, va_list args);
+
+// IPv4 address independent of the network stack.
+struct IPv4Address {
+  uint8_t octets[4];
+
+  constexpr IPv4Address() : octets{0, 0, 0, 0} {}
+  constexpr IPv4Address(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : octets{a, b, c, d} {}
+#ifdef ARDUINO
+  IPv4Address(const IPAddress &ip) : octets{ip[0], ip[1], ip[2], ip[3]} {}
+  operator IPAddress() const {
+    return IPAddress(octets[0], octets[1], octets[2], octets[3]);
+  }
+#endif
+
+  uint8_t operator[](size_t i) const { return octets[i]; }
+  bool isSet() const {
+    return octets[0] | octets[1] | octets[2] | octets[3];
+  }
+};
+
+} // namespace MQTTPlatform
+
+#endif // MQTT_PLATFORM_H_
@@ -0,0 +1,212 @@
+#include "MQTTPlatform.h"
+
+#ifdef MQTT_PLATFORM_ESP32
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#if __has_include("esp_memory_utils.h")
+#include "esp_memory_utils.h"
+#else
+#include "soc/soc_memory_layout.h"
+#endif
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <LittleFS.h>
+#include <algorithm>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace MQTTPlatform {
+
+namespace {
+
+constexpr const char *TAG = "NestMQTT";
+constexpr const char *MOUNT_POINT = "/littlefs";
+
+TickType_t toTicks(uint32_t ms) {
+  return ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(ms);
+}
+
+} // namespace
+
+uint32_t millis() { return static_cast<uint32_t>(esp_timer_get_time() / 1000); }
+
+uint32_t micros() { return static_cast<uint32_t>(esp_timer_get_time()); }
+
+void delay(uint32_t ms) { vTaskDelay(toTicks(ms)); }
+
+void yield() { vTaskDelay(1); }
+
+size_t freeHeap() { return heap_caps_get_free_size(MALLOC_CAP_8BIT); }
+
+size_t largestFreeBlock() {
+  return std::max(heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+                  heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+}
+
+size_t minFreeHeap() {
+  return heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+}
+
+void *regionAlloc(Region region, size_t size) {
+  uint32_t caps = region == Region::EXTERNAL ? MALLOC_CAP_SPIRAM
+                                             : MALLOC_CAP_INTERNAL;
+  return heap_caps_malloc(size, caps | MALLOC_CAP_8BIT);
+}
+
+void regionFree(void *ptr) { heap_caps_free(ptr); }
+
+size_t regionSize(const void *ptr) {
+  return heap_caps_get_allocated_size(const_cast<void *>(ptr));
+}
+
+Region regionOf(const void *ptr) {
+  return esp_ptr_external_ram(ptr) ? Region::EXTERNAL : Region::INTERNAL;
+}
+
+Mutex::Mutex() : _handle(xSemaphoreCreateRecursiveMutex()) {}
+
+Mutex::~Mutex() { vSemaphoreDelete(static_cast<SemaphoreHandle_t>(_handle)); }
+
+void Mutex::lock() {
+  xSemaphoreTakeRecursive(static_cast<SemaphoreHandle_t>(_handle),
+                          portMAX_DELAY);
+}
+
+void Mutex::unlock() {
+  xSemaphoreGiveRecursive(static_cast<SemaphoreHandle_t>(_handle));
+}
+
+// Direct-to-task notification: lighter than a semaphore and wakes the
+// waiting task without a tick of delay. The flag keeps notify() calls made
+// before the first wait() from being lost.
+struct NotificationState {
+  TaskHandle_t waiter = nullptr;
+  bool pending = false;
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+Notification::Notification() : _handle(new NotificationState()) {}
+
+Notification::~Notification() {
+  delete static_cast<NotificationState *>(_handle);
+}
+
+void Notification::notify() {
+  NotificationState *state = static_cast<NotificationState *>(_handle);
+  portENTER_CRITICAL(&state->lock);
+  bool wasPending = state->pending;
+  state->pending = true;
+  TaskHandle_t waiter = state->waiter;
+  portEXIT_CRITICAL(&state->lock);
+  if (waiter && !wasPending) {
+    xTaskNotifyGive(waiter);
+  }
+}
+
+bool Notification::wait(uint32_t timeoutMs) {
+  NotificationState *state = static_cast<NotificationState *>(_handle);
+  portENTER_CRITICAL(&state->lock);
+  state->waiter = xTaskGetCurrentTaskHandle();
+  bool pending = state->pending;
+  state->pending = false;
+  portEXIT_CRITICAL(&state->lock);
+  if (pending) {
+    return true;
+  }
+  ulTaskNotifyTake(pdTRUE, toTicks(timeoutMs));
+  portENTER_CRITICAL(&state->lock);
+  pending = state->pending;
+  state->pending = false;
+  portEXIT_CRITICAL(&state->lock);
+  return pending;
+}
+
+namespace {
+
+// FreeRTOS tasks cannot be joined: the task signals a semaphore when its
+// function returns and then deletes itself.
+struct ThreadState {
+  Thread::Function function;
+  void *arg;
+  SemaphoreHandle_t done;
+};
+
+void threadEntry(void *param) {
+  ThreadState *state = static_cast<ThreadState *>(param);
+  state->function(state->arg);
+  xSemaphoreGive(state->done);
+  vTaskDelete(nullptr);
+}
+
+} // namespace
+
+bool Thread::start(Function function, void *arg,
+                   const ThreadOptions &options) {
+  if (_handle) {
+    return false;
+  }
+  ThreadState *state
+      = new ThreadState{function, arg, xSemaphoreCreateBinary()};
+  uint32_t stack = options.stackSize ? options.stackSize : 4096;
+  UBaseType_t priority
+      = options.priority ? options.priority : tskIDLE_PRIORITY + 5;
+  const char *name = options.name ? options.name : "nestmqtt";
+  BaseType_t created
+      = xTaskCreatePinnedToCore(threadEntry, name, stack, state, priority,
+                                nullptr,
+                                options.pinToCore ? options.core
+                                                  : tskNO_AFFINITY);
+  if (created != pdPASS) {
+    vSemaphoreDelete(state->done);
+    delete state;
+    return false;
+  }
+  _handle = state;
+  return true;
+}
+
+void Thread::join() {
+  ThreadState *state = static_cast<ThreadState *>(_handle);
+  if (state) {
+    xSemaphoreTake(state->done, portMAX_DELAY);
+    vSemaphoreDelete(state->done);
+    delete state;
+    _handle = nullptr;
+  }
+}
+
+bool mountFilesystem(bool formatOnFail) {
+  return LittleFS.begin(formatOnFail, MOUNT_POINT);
+}
+
+void setFilesystemRoot(const char *) {}
+
+const char *filesystemRoot() { return MOUNT_POINT; }
+
+bool File::sync() {
+  // The VFS passes fsync() on to lfs_file_sync(), which commits the
+  // block LittleFS is still caching
+  FILE *file = static_cast<FILE *>(_handle);
+  return file && fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
+void vlog(LogLevel level, const char *format, va_list args) {
+  static const esp_log_level_t LEVELS[]
+      = {ESP_LOG_DEBUG, ESP_LOG_INFO, ESP_LOG_WARN, ESP_LOG_ERROR};
+  static const char LETTERS[] = {'D', 'I', 'W', 'E'};
+  if (level < logLevel() || level >= LogLevel::NONE) {
+    return;
+  }
+  char message[192];
+  vsnprintf(message, sizeof(message), format, args);
+  int index = static_cast<int>(level);
+  esp_log_write(LEVELS[index], TAG, "%c (%u) %s: %s\n", LETTERS[index],
+                esp_log_timestamp(), TAG, message);
+}
+
+} // namespace MQTTPlatform
+
+#endif // MQTT_PLATFORM_ESP32
@@ -0,0 +1,355 @@
+#include "MQTTPlatform.h"
+
+#ifdef MQTT_PLATFORM_POSIX
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <thread>
+#include <unistd.h>
+
+namespace MQTTPlatform {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const Clock::time_point _start = Clock::now();
+
+std::string &root() {
+  static std::string dir = [] {
+    const char *env = getenv("NESTMQTT_FS_ROOT");
+    return std::string(env ? env : "data");
+  }();
+  return dir;
+}
+
+size_t _minFreeHeap = SIZE_MAX;
+
+const VirtualClock *_virtualClock = nullptr;
+
+uint64_t nowUs() {
+  if (_virtualClock) {
+    return _virtualClock->nowUs();
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()
+                                                               - _start)
+      .count();
+}
+
+// First-fit allocator over one block reserved on first use, standing in
+// for a memory region. Free blocks are kept in address order and merged
+// with their neighbours when released.
+class Arena {
+public:
+  explicit Arena(size_t capacity)
+      : _capacity(capacity), _base(nullptr), _free(nullptr), _used(0) {}
+
+  void *allocate(size_t size) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (!_base && !_reserve()) {
+      return nullptr;
+    }
+    size_t need = (size + HEADER + ALIGN - 1) & ~(ALIGN - 1);
+    for (Block **link = &_free; *link; link = &(*link)->next) {
+      Block *block = *link;
+      if (block->size < need) {
+        continue;
+      }
+      if (block->size - need >= MIN_BLOCK) {
+        Block *rest = reinterpret_cast<Block *>(
+            reinterpret_cast<uint8_t *>(block) + need);
+        rest->size = block->size - need;
+        rest->next = block->next;
+        block->size = need;
+        *link = rest;
+      } else {
+        *link = block->next;
+      }
+      _used += block->size;
+      return reinterpret_cast<uint8_t *>(block) + HEADER;
+    }
+    return nullptr;
+  }
+
+  void release(void *ptr) {
+    std::lock_guard<std::mutex> lock(_lock);
+    Block *block = _blockOf(ptr);
+    _used -= block->size;
+    Block *prev = nullptr;
+    Block *next = _free;
+    while (next && next < block) {
+      prev = next;
+      next = next->next;
+    }
+    block->next = next;
+    if (next && _end(block) == next) {
+      block->size += next->size;
+      block->next = next->next;
+    }
+    if (prev && _end(prev) == block) {
+      prev->size += block->size;
+      prev->next = block->next;
+    } else if (prev) {
+      prev->next = block;
+    } else {
+      _free = block;
+    }
+  }
+
+  bool owns(const void *ptr) const {
+    const uint8_t *p = static_cast<const uint8_t *>(ptr);
+    return _base && p >= _base && p < _base + _capacity;
+  }
+
+  size_t sizeOf(const void *ptr) const {
+    return _blockOf(ptr)->size - HEADER;
+  }
+
+  void setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_used == 0) {
+      ::free(_base);
+      _base = nullptr;
+      _free = nullptr;
+      _capacity = capacity;
+    }
+  }
+
+private:
+  // Header of every block; next links free blocks only.
+  struct Block {
+    size_t size; // header included
+    Block *next;
+  };
+  static constexpr size_t ALIGN = 16;
+  static constexpr size_t HEADER = sizeof(Block);
+  static constexpr size_t MIN_BLOCK = HEADER + ALIGN;
+
+  bool _reserve() {
+    _capacity &= ~(ALIGN - 1);
+    if (_capacity < MIN_BLOCK) {
+      return false;
+    }
+    _base = static_cast<uint8_t *>(::malloc(_capacity));
+    if (!_base) {
+      return false;
+    }
+    _free = reinterpret_cast<Block *>(_base);
+    _free->size = _capacity;
+    _free->next = nullptr;
+    return true;
+  }
+
+  static Block *_blockOf(const void *ptr) {
+    return reinterpret_cast<Block *>(
+        const_cast<uint8_t *>(static_cast<const uint8_t *>(ptr)) - HEADER);
+  }
+
+  static Block *_end(Block *block) {
+    return reinterpret_cast<Block *>(reinterpret_cast<uint8_t *>(block)
+                                     + block->size);
+  }
+
+  size_t _capacity;
+  uint8_t *_base;
+  Block *_free;
+  size_t _used;
+  std::mutex _lock;
+};
+
+// Generous next to a board, so host runs are not cut short by default.
+// Never destroyed: static objects may still release blocks at exit.
+Arena &arena(Region region) {
+  static Arena *internal = new Arena(4 * 1024 * 1024);
+  static Arena *external = new Arena(16 * 1024 * 1024);
+  return region == Region::EXTERNAL ? *external : *internal;
+}
+
+// eventfd plus a flag, so repeated notify() calls while one is already
+// pending cost no syscall.
+struct NotificationState {
+  int fd;
+  std::atomic<bool> pending{false};
+};
+
+} // namespace
+
+uint32_t millis() { return static_cast<uint32_t>(nowUs() / 1000); }
+
+uint32_t micros() { return static_cast<uint32_t>(nowUs()); }
+
+void VirtualClock::install() { _virtualClock = this; }
+
+void VirtualClock::uninstall() {
+  if (_virtualClock == this) {
+    _virtualClock = nullptr;
+  }
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+
+// The process has no fixed heap, so report what the system could still
+// hand out.
+size_t freeHeap() {
+  struct sysinfo info;
+  if (sysinfo(&info) != 0) {
+    return SIZE_MAX;
+  }
+  size_t free = static_cast<size_t>(info.freeram) * info.mem_unit;
+  if (free < _minFreeHeap) {
+    _minFreeHeap = free;
+  }
+  return free;
+}
+
+size_t largestFreeBlock() { return freeHeap(); }
+
+size_t minFreeHeap() {
+  freeHeap();
+  return _minFreeHeap;
+}
+
+void *regionAlloc(Region region, size_t size) {
+  return arena(region).allocate(size);
+}
+
+void regionFree(void *ptr) {
+  if (ptr) {
+    arena(regionOf(ptr)).release(ptr);
+  }
+}
+
+size_t regionSize(const void *ptr) {
+  return arena(regionOf(ptr)).sizeOf(ptr);
+}
+
+Region regionOf(const void *ptr) {
+  return arena(Region::EXTERNAL).owns(ptr) ? Region::EXTERNAL
+                                           : Region::INTERNAL;
+}
+
+void setRegionCapacity(Region region, size_t bytes) {
+  arena(region).setCapacity(bytes);
+}
+
+Mutex::Mutex() : _handle(new std::recursive_mutex()) {}
+
+Mutex::~Mutex() { delete static_cast<std::recursive_mutex *>(_handle); }
+
+void Mutex::lock() { static_cast<std::recursive_mutex *>(_handle)->lock(); }
+
+void Mutex::unlock() {
+  static_cast<std::recursive_mutex *>(_handle)->unlock();
+}
+
+Notification::Notification() {
+  NotificationState *state = new NotificationState();
+  state->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  _handle = state;
+}
+
+Notification::~Notification() {
+  NotificationState *state = static_cast<NotificationState *>(_handle);
+  close(state->fd);
+  delete state;
+}
+
+void Notification::notify() {
+  NotificationState *state = static_cast<NotificationState *>(_handle);
+  if (!state->pending.exchange(true)) {
+    uint64_t one = 1;
+    (void)!write(state->fd, &one, sizeof(one));
+  }
+}
+
+bool Notification::wait(uint32_t timeoutMs) {
+  NotificationState *state = static_cast<NotificationState *>(_handle);
+  pollfd pfd{state->fd, POLLIN, 0};
+  int timeout = timeoutMs > INT32_MAX ? -1 : static_cast<int>(timeoutMs);
+  if (poll(&pfd, 1, timeout) > 0) {
+    uint64_t count;
+    (void)!read(state->fd, &count, sizeof(count));
+  }
+  return state->pending.exchange(false);
+}
+
+int Notification::fd() const {
+  return static_cast<NotificationState *>(_handle)->fd;
+}
+
+bool Thread::start(Function function, void *arg,
+                   const ThreadOptions &options) {
+  if (_handle) {
+    return false;
+  }
+  std::thread *thread = new std::thread(function, arg);
+  if (options.name) {
+    // Linux limits thread names to 15 characters
+    char name[16];
+    snprintf(name, sizeof(name), "%s", options.name);
+    pthread_setname_np(thread->native_handle(), name);
+  }
+  if (options.pinToCore) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(options.core, &cpus);
+    pthread_setaffinity_np(thread->native_handle(), sizeof(cpus), &cpus);
+  }
+  _handle = thread;
+  return true;
+}
+
+void Thread::join() {
+  std::thread *thread = static_cast<std::thread *>(_handle);
+  if (thread) {
+    thread->join();
+    delete thread;
+    _handle = nullptr;
+  }
+}
+
+bool mountFilesystem(bool formatOnFail) {
+  struct stat st;
+  if (stat(root().c_str(), &st) == 0) {
+    return S_ISDIR(st.st_mode);
+  }
+  return formatOnFail && mkdir(root().c_str(), 0755) == 0;
+}
+
+void setFilesystemRoot(const char *dir) { root() = dir; }
+
+const char *filesystemRoot() { return root().c_str(); }
+
+bool File::sync() {
+  FILE *file = static_cast<FILE *>(_handle);
+  return file && fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
+void vlog(LogLevel level, const char *format, va_list args) {
+  static const char LEVELS[] = {'D', 'I', 'W', 'E'};
+  if (level < logLevel() || level >= LogLevel::NONE) {
+    return;
+  }
+  fprintf(stderr, "[NestMQTT] %c (%u) ", LEVELS[static_cast<int>(level)],
+          millis());
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+}
+
+} // namespace MQTTPlatform
+
+#endif // MQTT_PLATFORM_POSIX
@@ -1,8 +1,11 @@
 #ifndef MQTT_BUFFER_H_
 #define MQTT_BUFFER_H_
 
-#include "Arduino.h"
 #include "MQTTConstants.h"
+#include "MQTTMemory.h"
+#include "MQTTPlatform.h"
+#include <new>
+#include <string>
 #include <utility>
 
 namespace MQTTTransport {
@@ -79,7 +82,7 @@ public:
 
   Buffer()
       : _head(nullptr), _tail(nullptr), _current(nullptr), _prev(nullptr),
-        _bufferState(*this) {}
+        _size(0), _bufferState(*this) {}
 
   Buffer(const Buffer &other) : Buffer() {
     Node<T> *current = other._head;
@@ -91,8 +94,10 @@ public:
 
   Buffer(Buffer &&other) noexcept
       : _head(other._head), _tail(other._tail), _current(other._current),
-        _prev(other._prev), _bufferState(other._bufferState) {
+        _prev(other._prev), _size(other._size), _bufferState(*this) {
     other._head = other._tail = other._current = other._prev = nullptr;
+    other._size = 0;
+    other._bufferState.update();
   }
 
   Buffer &operator=(const Buffer &other) {
@@ -109,9 +114,11 @@ public:
     while (_head) {
       Node<T> *temp = _head;
       _head = _head->nextLink;
-      delete temp;
+      _deleteNode(temp);
     }
     _tail = _current = _prev = nullptr;
+    _size = 0;
+    _bufferState.update();
   }
 
   void swap(Buffer &other) noexcept {
@@ -119,6 +126,9 @@ public:
     std::swap(_tail, other._tail);
     std::swap(_current, other._current);
     std::swap(_prev, other._prev);
+    std::swap(_size, other._size);
+    _bufferState.update();
+    other._bufferState.update();
   }
 
   struct BufferState {
@@ -142,9 +152,10 @@ public:
     }
   };
 
-  String getStatus() const {
-    String result = "Current Size: " + String(_bufferState.currentSize) + "   ";
-    result += "Free Size: " + String(_bufferState.freeSize) + "   ";
+  std::string getStatus() const {
+    std::string result
+        = "Current Size: " + std::to_string(_bufferState.currentSize) + "   ";
+    result += "Free Size: " + std::to_string(_bufferState.freeSize) + "   ";
     return result;
   }
 
@@ -158,7 +169,7 @@ public:
 
   template <class... Args> Iterator pushBack(Args &&...args) {
     Iterator it;
-    Node<T> *newNode = new (std::nothrow) Node<T>(std::forward<Args>(args)...);
+    Node<T> *newNode = _newNode(std::forward<Args>(args)...);
     if (newNode != nullptr) {
       newNode->nextLink = nullptr;
 
@@ -166,12 +177,18 @@ public:
         _head = _current = newNode;
       } else {
         _tail->nextLink = newNode;
+        // Keep the cursor on unsent data; only pick up the new node once
+        // everything before it has been walked.
+        if (!_current) {
+          _current = newNode;
+          _prev = _tail;
+        }
       }
-      _current = _head;
+      it.currentNode = newNode;
+      it.prevNode = _tail;
       _tail = newNode;
-      it.currentNode = _current;
-      it.prevNode = _prev;
 
+      ++_size;
       _bufferState.update();
     }
     return it;
@@ -179,7 +196,7 @@ public:
 
   template <class... Args> Iterator pushFront(Args &&...args) {
     Iterator it;
-    Node<T> *newNode = new (std::nothrow) Node<T>(std::forward<Args>(args)...);
+    Node<T> *newNode = _newNode(std::forward<Args>(args)...);
     if (newNode != nullptr) {
       newNode->nextLink = nullptr;
 
@@ -194,75 +211,137 @@ public:
       it.currentNode = _current;
       it.prevNode = _prev;
 
+      ++_size;
       _bufferState.update();
     }
     return it;
   }
 
-  void _remove(Node<T> *prev, Node<T> *node) {
-    if (!node)
-      return;
+  // Nodes are metadata: internal SRAM, see MQTTCore::MemoryPolicy
+  template <class... Args> static Node<T> *_newNode(Args &&...args) {
+    void *memory = MQTTCore::MemoryPolicy::instance().allocate(
+        MQTTCore::MEMORY_METADATA, sizeof(Node<T>));
+    return memory ? new (memory) Node<T>(std::forward<Args>(args)...)
+                  : nullptr;
+  }
+
+  static void _deleteNode(Node<T> *node) {
+    node->~Node<T>();
+    MQTTCore::MemoryPolicy::instance().release(MQTTCore::MEMORY_METADATA,
+                                               node);
+  }
 
-    if (_head == _tail) {
-      _head = _tail = nullptr;
-    } else if (_head == node) {
+  void _unlink(Node<T> *prev, Node<T> *node) {
+    if (_head == node) {
       _head = node->nextLink;
-    } else if (_tail == node) {
-      if (prev) {
-        prev->nextLink = nullptr;
-        _tail = prev;
-      } else {
-        _head = nullptr;
-        _tail = nullptr;
-      }
     } else {
       prev->nextLink = node->nextLink;
     }
-
+    if (_tail == node) {
+      _tail = prev;
+    }
     if (_current == node) {
       _current = node->nextLink;
     }
-
     if (_prev == node) {
       _prev = prev;
     }
+    node->nextLink = nullptr;
+  }
+
+  void _remove(Node<T> *prev, Node<T> *node) {
+    if (!node)
+      return;
 
-    delete node;
+    _unlink(prev, node);
+    _deleteNode(node);
 
+    --_size;
     _bufferState.update();
   }
 
-  void remove(Iterator &it) {
-    if (!it)
+  // Moves the node under the cursor into dest, just ahead of dest's
+  // cursor, without copying it. The cursor here moves on to the next node.
+  void moveCurrentTo(Buffer &dest) {
+    Node<T> *node = _current;
+    if (!node)
       return;
 
-    Node<T> *currentNode = it.currentNode;
-    Node<T> *prevNode = it.prevNode;
-
-    if (_head == currentNode) {
-      _head = currentNode->nextLink;
-    } else if (_tail == currentNode) {
-      if (prevNode) {
-        prevNode->nextLink = nullptr;
-        _tail = prevNode;
+    _unlink(_prev, node);
+    if (dest._current) {
+      node->nextLink = dest._current;
+      if (dest._prev) {
+        dest._prev->nextLink = node;
       } else {
-        _head = nullptr;
-        _tail = nullptr;
+        dest._head = node;
       }
     } else {
-      ++it;
+      if (dest._tail) {
+        dest._tail->nextLink = node;
+      } else {
+        dest._head = node;
+      }
+      dest._tail = node;
     }
+    dest._prev = node;
+
+    --_size;
+    ++dest._size;
+    _bufferState.update();
+    dest._bufferState.update();
+  }
 
-    _remove(prevNode, currentNode);
+  // Moves the node under the cursor to the back of dest, as pushBack()
+  // would place a new one.
+  void appendCurrentTo(Buffer &dest) {
+    Node<T> *node = _current;
+    if (!node)
+      return;
 
-    if (!_head) {
-      _tail = nullptr;
+    _unlink(_prev, node);
+    if (dest._tail) {
+      dest._tail->nextLink = node;
+    } else {
+      dest._head = node;
+    }
+    if (!dest._current) {
+      dest._current = node;
+      dest._prev = dest._tail;
     }
+    dest._tail = node;
+
+    --_size;
+    ++dest._size;
+    _bufferState.update();
+    dest._bufferState.update();
+  }
+
+  // Moves the head node behind the tail. It becomes the cursor unless the
+  // cursor already sits on a node after it.
+  void requeueHead() {
+    Node<T> *node = _head;
+    if (!node || node == _current)
+      return;
 
-    if (_prev == currentNode) {
-      _prev = prevNode;
+    _unlink(nullptr, node);
+    if (_tail) {
+      _tail->nextLink = node;
+    } else {
+      _head = node;
     }
+    if (!_current) {
+      _current = node;
+      _prev = _tail;
+    }
+    _tail = node;
+  }
+
+  void remove(Iterator &it) {
+    if (!it)
+      return;
 
+    // _remove relinks head, tail and the cursor itself
+    _remove(it.prevNode, it.currentNode);
     it = end(); // Reset iterator after removal
   }
 
@@ -273,18 +352,35 @@ public:
 
   void removeCurrent() { _remove(_prev, _current); }
 
-  void resetCurrent() { _current = _head; }
-
-  size_t getBufferSize() const {
-    size_t count = 0;
-    Node<T> *n = _head;
-    while (n) {
-      ++count;
-      n = n->nextLink;
+  // One pass over the list, however many nodes go.
+  template <typename Predicate> size_t removeIf(Predicate predicate) {
+    size_t removed = 0;
+    Node<T> *prev = nullptr;
+    for (Node<T> *node = _head; node;) {
+      Node<T> *next = node->nextLink;
+      if (predicate(node->data)) {
+        _unlink(prev, node);
+        _deleteNode(node);
+        ++removed;
+      } else {
+        prev = node;
+      }
+      node = next;
+    }
+    if (removed) {
+      _size -= removed;
+      _bufferState.update();
     }
-    return count;
+    return removed;
+  }
+
+  void resetCurrent() {
+    _current = _head;
+    _prev = nullptr;
   }
 
+  size_t getBufferSize() const { return _size; }
+
   size_t getFreeBufferSize() const {
     if (MQTTCore::TX_BUFFER_MAX_SIZE_BYTE > 0) {
       size_t currentSize = getBufferSize();
@@ -352,45 +448,37 @@ private:
   Node<T> *_tail;
   Node<T> *_current;
   Node<T> *_prev;
+  size_t _size; // nodes, kept so BufferState::update() is O(1)
   BufferState _bufferState;
 };
 
 } // namespace MQTTTransport
 
 inline void printBufferState(const MQTTTransport::Buffer<int> &buffer) {
-  String status = buffer.getStatus();
-  Serial.println(status);
+  MQTTPlatform::log(MQTTPlatform::LogLevel::INFO, "%s",
+                    buffer.getStatus().c_str());
 }
 
 inline void printBuffer(const MQTTTransport::Buffer<int> &buffer) {
-  Serial.print("Buffer: ");
+  std::string line = "Buffer: ";
   MQTTTransport::Buffer<int>::Iterator it = buffer.begin();
   while (it != buffer.end()) {
-    Serial.print(*it);
-    Serial.print(" ");
+    line += std::to_string(*it) + " ";
     ++it;
   }
-  Serial.println();
+  MQTTPlatform::log(MQTTPlatform::LogLevel::INFO, "%s", line.c_str());
 }
 
 inline void testBuffer() {
-  Serial.println("-------------------------------------------------------------"
-                 "----------------");
-  Serial.println("-------------------------------------------------------------"
-                 "----------------");
-  Serial.println("---------------------------BUFFER TEST FOR ESP "
-                 "32-----------------------------");
-  Serial.println("-------------------------------------------------------------"
-                 "----------------");
-  Serial.println("-------------------------------------------------------------"
-                 "----------------");
+  using MQTTPlatform::LogLevel;
+  using MQTTPlatform::log;
+  log(LogLevel::INFO, "---------------------------BUFFER TEST FOR ESP "
+                      "32-----------------------------");
   // Create a buffer object
   MQTTTransport::Buffer<int> buffer;
 
   // Test pushing nodes to the back
-
-  // Test pushing nodes to the back
-  Serial.println("Pushing nodes to the back...");
+  log(LogLevel::INFO, "Pushing nodes to the back...");
   buffer.pushBack(1);
   printBufferState(buffer);
   printBuffer(buffer);
@@ -402,7 +490,7 @@ inline void testBuffer() {
   printBuffer(buffer);
 
   // Test pushing nodes to the front
-  Serial.println("Pushing nodes to the front...");
+  log(LogLevel::INFO, "Pushing nodes to the front...");
   buffer.pushFront(0);
   printBufferState(buffer);
   printBuffer(buffer);
@@ -412,50 +500,34 @@ inline void testBuffer() {
   buffer.pushFront(-2);
   printBufferState(buffer);
   printBuffer(buffer);
-  buffer.getStatus();
 
   // Test iterating through the buffer
-  Serial.println("Iterating through the buffer...");
+  log(LogLevel::INFO, "Iterating through the buffer...");
   printBuffer(buffer);
 
   // Test next() function multiple times
-  Serial.println("Testing next() function multiple times:");
+  log(LogLevel::INFO, "Testing next() function multiple times:");
   for (int i = 0; i < 3; ++i) {
-    Serial.println("Testing next() function " + String(i + 1) + ":");
     buffer.next();
-    Serial.println("Next element dequeued.");
-    Serial.print("Current element value: ");
-    if (buffer.getCurrent()) {
-      Serial.println(*(buffer.getCurrent()));
-    } else {
-      Serial.println("null");
-    }
-    Serial.print("Previous element value: ");
-    if (buffer.getPrev()) {
-      Serial.println(*(buffer.getPrev()));
-    } else {
-      Serial.println("null");
-    }
+    std::string current
+        = buffer.getCurrent() ? std::to_string(*buffer.getCurrent()) : "null";
+    std::string previous
+        = buffer.getPrev() ? std::to_string(*buffer.getPrev()) : "null";
+    log(LogLevel::INFO, "next() %d: current %s, previous %s", i + 1,
+        current.c_str(), previous.c_str());
   }
 
   // Test finding nodes
-  Serial.println("Finding nodes...");
+  log(LogLevel::INFO, "Finding nodes...");
   MQTTTransport::Buffer<int>::Iterator it = buffer.find(2);
-  if (it != buffer.end()) {
-    Serial.println("Found node with data 2.");
-  } else {
-    Serial.println("Node with data 2 not found.");
-  }
-
+  log(LogLevel::INFO, it != buffer.end() ? "Found node with data 2."
+                                         : "Node with data 2 not found.");
   it = buffer.find(10);
-  if (it != buffer.end()) {
-    Serial.println("Found node with data 10.");
-  } else {
-    Serial.println("Node with data 10 not found.");
-  }
+  log(LogLevel::INFO, it != buffer.end() ? "Found node with data 10."
+                                         : "Node with data 10 not found.");
 
   // Test removing nodes
-  Serial.println("Removing nodes...");
+  log(LogLevel::INFO, "Removing nodes...");
   buffer.remove(0); // Removing node from the middle
   printBuffer(buffer);
   buffer.remove(-2); // Removing node from the beginning
@@ -464,37 +536,25 @@ inline void testBuffer() {
   printBuffer(buffer);
 
   // Test edge cases
-  Serial.println("Testing edge cases...");
-  Serial.println("Is the buffer empty? " +
-                 String(buffer.isEmptyBuffer() ? "Yes" : "No"));
-  Serial.println("Is the buffer full? " +
-                 String(buffer.isFullBuffer() ? "Yes" : "No"));
-  Serial.println("Size of the buffer: " + String(buffer.getBufferSize()));
-  Serial.println("Free buffer size: " + String(buffer.getFreeBufferSize()));
-
-  // Test getStatus function
-  Serial.println("Buffer status:");
-  String status = buffer.getStatus();
-  Serial.println(status);
-
-  // // Testing the copy constructor
-  // Serial.println("Testing copy constructor...");
-  // MQTTTransport::Buffer<int> copiedBuffer = buffer;
-  // Serial.println("Copied buffer:");
-  // printBuffer(copiedBuffer);
+  log(LogLevel::INFO, "Is the buffer empty? %s",
+      buffer.isEmptyBuffer() ? "Yes" : "No");
+  log(LogLevel::INFO, "Is the buffer full? %s",
+      buffer.isFullBuffer() ? "Yes" : "No");
+  log(LogLevel::INFO, "Size of the buffer: %zu", buffer.getBufferSize());
+  log(LogLevel::INFO, "Free buffer size: %zu", buffer.getFreeBufferSize());
+  log(LogLevel::INFO, "Buffer status: %s", buffer.getStatus().c_str());
 
   // Testing the move constructor
-  Serial.println("Testing move constructor...");
+  log(LogLevel::INFO, "Testing move constructor...");
   MQTTTransport::Buffer<int> movedBuffer = std::move(buffer);
-  Serial.println("Moved buffer:");
   printBuffer(movedBuffer);
 
   // Test clearing the buffer
-  Serial.println("Clearing the buffer...");
+  log(LogLevel::INFO, "Clearing the buffer...");
   buffer.clear();
   printBuffer(buffer);
 
-  Serial.println("Test completed.");
+  log(LogLevel::INFO, "Test completed.");
 }
 
 #endif
@@ -0,0 +1,92 @@
+#include "MQTTEndpoints.h"
+
+namespace MQTTTransport {
+
+namespace {
+
+// Beyond this many failures in a row the penalty stops growing, so a
+// broker that comes back is not ranked last for good
+constexpr uint32_t MAX_PENALTIES = 8;
+
+} // namespace
+
+EndpointSelector::EndpointSelector() : _entries{}, _count(1), _current(0) {}
+
+void EndpointSelector::configure(size_t count) {
+  MQTTPlatform::LockGuard lock(_lock);
+  if (count == 0) {
+    count = 1;
+  } else if (count > MQTT_ENDPOINTS) {
+    count = MQTT_ENDPOINTS;
+  }
+  if (count == _count) {
+    return;
+  }
+  for (Stats &entry : _entries) {
+    entry = Stats{};
+  }
+  _count = count;
+  _current = 0;
+}
+
+size_t EndpointSelector::count() const {
+  MQTTPlatform::LockGuard lock(_lock);
+  return _count;
+}
+
+void EndpointSelector::rank(uint8_t *order) const {
+  MQTTPlatform::LockGuard lock(_lock);
+  // Insertion sort: stable, and there are only a handful
+  for (size_t i = 0; i < _count; ++i) {
+    size_t j = i;
+    for (; j > 0 && _score(order[j - 1]) > _score(i); --j) {
+      order[j] = order[j - 1];
+    }
+    order[j] = static_cast<uint8_t>(i);
+  }
+}
+
+void EndpointSelector::connected(size_t endpoint) {
+  MQTTPlatform::LockGuard lock(_lock);
+  if (endpoint < _count) {
+    _current = endpoint;
+    ++_entries[endpoint].connects;
+  }
+}
+
+size_t EndpointSelector::current() const {
+  MQTTPlatform::LockGuard lock(_lock);
+  return _current;
+}
+
+void EndpointSelector::sample(uint32_t rttUs) {
+  MQTTPlatform::LockGuard lock(_lock);
+  Stats &entry = _entries[_current];
+  entry.rttUs = entry.samples ? entry.rttUs - entry.rttUs / 8 + rttUs / 8
+                              : rttUs;
+  ++entry.samples;
+  entry.failures = 0;
+}
+
+void EndpointSelector::failed(size_t endpoint) {
+  MQTTPlatform::LockGuard lock(_lock);
+  if (endpoint < _count) {
+    ++_entries[endpoint].failures;
+  }
+}
+
+EndpointSelector::Stats EndpointSelector::stats(size_t endpoint) const {
+  MQTTPlatform::LockGuard lock(_lock);
+  return endpoint < _count ? _entries[endpoint] : Stats{};
+}
+
+uint64_t EndpointSelector::_score(size_t endpoint) const {
+  const Stats &entry = _entries[endpoint];
+  uint64_t score = entry.samples ? entry.rttUs
+                                 : MQTT_ENDPOINT_INITIAL_RTT_MS * 1000ULL;
+  uint32_t penalties
+      = entry.failures < MAX_PENALTIES ? entry.failures : MAX_PENALTIES;
+  return score + penalties * (MQTT_ENDPOINT_FAILURE_PENALTY_MS * 1000ULL);
+}
+
+} // namespace MQTTTransport
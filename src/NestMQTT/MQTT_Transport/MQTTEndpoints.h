@@ -0,0 +1,55 @@
+#ifndef MQTT_ENDPOINTS_H_
+#define MQTT_ENDPOINTS_H_
+
+#include "MQTTConfig.h"
+#include "MQTTPlatform.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTTransport {
+
+// Scores the broker endpoints of a client from the round trips measured
+// on them, CONNECT to CONNACK and PINGREQ to PINGRESP, and from failed
+// attempts, and ranks them best first for the next connect. Round trips
+// are smoothed like TCP's (an eighth of each new sample); each failure in
+// a row adds MQTT_ENDPOINT_FAILURE_PENALTY_MS until the endpoint succeeds
+// again. Endpoints not measured yet count MQTT_ENDPOINT_INITIAL_RTT_MS,
+// and equal scores keep list order. Safe to read from any task.
+class EndpointSelector {
+public:
+  struct Stats {
+    uint32_t rttUs;    // smoothed round trip, 0 until measured
+    uint32_t samples;  // round trips measured
+    uint32_t failures; // in a row
+    uint32_t connects; // connections opened
+  };
+
+  EndpointSelector();
+
+  // Keeps the scores while the number of endpoints stays the same.
+  void configure(size_t count);
+  size_t count() const;
+
+  // Fills order with every endpoint index, best first.
+  void rank(uint8_t *order) const;
+
+  // The endpoint the connection was opened to; samples go to it.
+  void connected(size_t endpoint);
+  size_t current() const;
+  void sample(uint32_t rttUs);
+  void failed(size_t endpoint);
+
+  Stats stats(size_t endpoint) const;
+
+private:
+  uint64_t _score(size_t endpoint) const;
+
+  mutable MQTTPlatform::Mutex _lock;
+  Stats _entries[MQTT_ENDPOINTS];
+  size_t _count;
+  size_t _current;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_ENDPOINTS_H_
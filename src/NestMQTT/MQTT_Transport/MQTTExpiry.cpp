@@ -0,0 +1,56 @@
+#include "MQTTExpiry.h"
+#include "MQTTPlatform.h"
+
+namespace MQTTTransport {
+
+ExpiryWheel::ExpiryWheel()
+    : _tick(MQTTPlatform::millis() / TICK_MS), _count(0) {
+  for (ExpiryLink &head : _slots) {
+    head.prev = head.next = &head;
+  }
+}
+
+void ExpiryWheel::schedule(ExpiryLink &link, void *owner,
+                           uint32_t deadlineMs) {
+  cancel(link);
+  // Rounded up, so a slot is never visited before its entries are due
+  uint32_t tick = deadlineMs / TICK_MS + (deadlineMs % TICK_MS != 0);
+  if (static_cast<int32_t>(tick - _tick) <= 0) {
+    tick = _tick + 1; // already due: the next advance() takes it
+  }
+  ExpiryLink &head = _slots[tick & (SLOTS - 1)];
+  link.owner = owner;
+  link.deadline = deadlineMs;
+  link.prev = head.prev;
+  link.next = &head;
+  head.prev->next = &link;
+  head.prev = &link;
+  ++_count;
+}
+
+void ExpiryWheel::cancel(ExpiryLink &link) {
+  if (!link.scheduled()) {
+    return;
+  }
+  link.prev->next = link.next;
+  link.next->prev = link.prev;
+  link.prev = link.next = nullptr;
+  --_count;
+}
+
+uint32_t ExpiryWheel::msUntilNext(uint32_t nowMs) const {
+  if (_count == 0) {
+    return UINT32_MAX;
+  }
+  for (uint32_t i = 1; i <= SLOTS; ++i) {
+    uint32_t tick = _tick + i;
+    const ExpiryLink &head = _slots[tick & (SLOTS - 1)];
+    if (head.next != &head) {
+      uint32_t at = tick * TICK_MS;
+      return static_cast<int32_t>(at - nowMs) > 0 ? at - nowMs : 0;
+    }
+  }
+  return 0;
+}
+
+} // namespace MQTTTransport
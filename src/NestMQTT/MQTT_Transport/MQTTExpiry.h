@@ -0,0 +1,79 @@
+#ifndef MQTT_EXPIRY_H_
+#define MQTT_EXPIRY_H_
+
+#include "MQTTConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTTransport {
+
+// Hook embedded in anything with a deadline. Slots are circular lists
+// through their own head link, so a scheduled entry unlinks in O(1)
+// without knowing its slot.
+struct ExpiryLink {
+  ExpiryLink *prev = nullptr;
+  ExpiryLink *next = nullptr;
+  void *owner = nullptr;
+  uint32_t deadline = 0;
+
+  bool scheduled() const { return prev != nullptr; }
+};
+
+// Hashed timer wheel over millis(). An entry sits in the slot of the tick
+// its deadline falls in; each tick the loop passes visits only that slot,
+// and entries due a full turn or more later stay where they are. Cost per
+// loop is the entries in the slots passed, never the length of a queue.
+class ExpiryWheel {
+public:
+  static constexpr size_t SLOTS = MQTT_EXPIRY_SLOTS;
+  static constexpr uint32_t TICK_MS = MQTT_EXPIRY_TICK_MS;
+  static_assert(SLOTS > 0 && (SLOTS & (SLOTS - 1)) == 0,
+                "MQTT_EXPIRY_SLOTS must be a power of two");
+
+  ExpiryWheel();
+  ExpiryWheel(const ExpiryWheel &) = delete;
+  ExpiryWheel &operator=(const ExpiryWheel &) = delete;
+
+  // Reschedules the link if it is already in the wheel.
+  void schedule(ExpiryLink &link, void *owner, uint32_t deadlineMs);
+  void cancel(ExpiryLink &link);
+
+  // Unlinks every entry due by nowMs and calls expire(owner) for it;
+  // returns how many expired.
+  template <typename Expire> size_t advance(uint32_t nowMs, Expire expire) {
+    uint32_t tick = nowMs / TICK_MS;
+    uint32_t ticks = tick - _tick;
+    if (ticks > SLOTS) {
+      ticks = SLOTS; // one turn visits every slot
+    }
+    size_t expired = 0;
+    for (uint32_t i = 1; i <= ticks && _count > 0; ++i) {
+      ExpiryLink &head = _slots[(_tick + i) & (SLOTS - 1)];
+      for (ExpiryLink *link = head.next; link != &head;) {
+        ExpiryLink *next = link->next;
+        if (static_cast<int32_t>(nowMs - link->deadline) >= 0) {
+          void *owner = link->owner;
+          cancel(*link);
+          expire(owner);
+          ++expired;
+        }
+        link = next;
+      }
+    }
+    _tick = tick;
+    return expired;
+  }
+
+  // Time until advance() has a slot with entries to visit.
+  uint32_t msUntilNext(uint32_t nowMs) const;
+  size_t size() const { return _count; }
+
+private:
+  ExpiryLink _slots[SLOTS];
+  uint32_t _tick; // last tick advance() visited
+  size_t _count;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_EXPIRY_H_
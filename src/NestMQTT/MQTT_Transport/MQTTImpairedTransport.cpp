@@ -0,0 +1,229 @@
+#include "MQTTImpairedTransport.h"
+
+namespace MQTTTransport {
+
+ImpairedTransport::ImpairedTransport(Transport &inner,
+                                     const Impairment &impairment)
+    : _inner(inner), _impairment(impairment), _stats{}, _rng(0),
+      _lastMicros(MQTTPlatform::micros()), _nowUs(0), _dropped(false) {
+  setImpairment(impairment);
+}
+
+void ImpairedTransport::setImpairment(const Impairment &impairment) {
+  _impairment = impairment;
+  // xorshift state must not be zero
+  _rng = impairment.seed ? impairment.seed : 1;
+}
+
+bool ImpairedTransport::connect(MQTTPlatform::IPv4Address ip,
+                                uint16_t port) {
+  _reset();
+  return _inner.connect(ip, port);
+}
+
+bool ImpairedTransport::connect(const char *host, uint16_t port) {
+  _reset();
+  return _inner.connect(host, port);
+}
+
+size_t ImpairedTransport::write(const uint8_t *buf, size_t size) {
+  pump();
+  if (!connected()) {
+    return 0;
+  }
+  if (_impairment.dropPerMillion
+      && _random() % 1000000 < _impairment.dropPerMillion) {
+    drop();
+    return 0;
+  }
+  size_t space = _impairment.bufferSize > _outbound.bytes.size()
+                     ? _impairment.bufferSize - _outbound.bytes.size()
+                     : 0;
+  size_t n = _chunk(size < space ? size : space, _impairment.maxWriteChunk);
+  if (n > 0 && n < size) {
+    ++_stats.partialWrites;
+  }
+  _enqueue(_outbound, buf, n);
+  _stats.bytesOut += n;
+  pump();
+  return n;
+}
+
+int ImpairedTransport::read(uint8_t *buf, size_t size) {
+  pump();
+  size_t available = _inbound.due(_nowUs);
+  if (available == 0) {
+    return connected() ? 0 : -1;
+  }
+  size_t wanted = size < available ? size : available;
+  size_t n = _chunk(wanted, _impairment.maxReadChunk);
+  if (n < wanted) {
+    ++_stats.shortReads;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    buf[i] = _inbound.bytes[i];
+  }
+  _consume(_inbound, n);
+  _stats.bytesIn += n;
+  return static_cast<int>(n);
+}
+
+void ImpairedTransport::stop() {
+  _inner.stop();
+  _reset();
+}
+
+bool ImpairedTransport::connected() {
+  // Bytes still on the wire arrive even after the far end closed
+  return !_dropped && (_inner.connected() || !_inbound.bytes.empty());
+}
+
+bool ImpairedTransport::disconnected() { return !connected(); }
+
+uint8_t ImpairedTransport::waitReady(uint8_t interest, uint32_t timeoutMs,
+                                    MQTTPlatform::Notification *wakeup) {
+  // Never blocks: under a virtual clock time only moves when the caller
+  // advances it.
+  (void)timeoutMs;
+  pump();
+  uint8_t ready = wakeup && wakeup->wait(0) ? READY_WAKE : READY_NONE;
+  if (!connected()) {
+    return ready | READY_ERROR;
+  }
+  if ((interest & READY_READ) && _inbound.due(_nowUs) > 0) {
+    ready |= READY_READ;
+  }
+  if ((interest & READY_WRITE)
+      && _outbound.bytes.size() < _impairment.bufferSize) {
+    ready |= READY_WRITE;
+  }
+  return ready;
+}
+
+void ImpairedTransport::pump() {
+  if (_dropped) {
+    return;
+  }
+  uint64_t now = _now();
+  uint8_t chunk[512];
+
+  size_t due = _outbound.due(now);
+  while (due > 0) {
+    size_t n = due < sizeof(chunk) ? due : sizeof(chunk);
+    for (size_t i = 0; i < n; ++i) {
+      chunk[i] = _outbound.bytes[i];
+    }
+    size_t written = _inner.write(chunk, n);
+    _consume(_outbound, written);
+    due -= written;
+    if (written < n) {
+      break;
+    }
+  }
+
+  while (_inner.connected()
+         && _inbound.bytes.size() < _impairment.bufferSize) {
+    size_t space = _impairment.bufferSize - _inbound.bytes.size();
+    int n
+        = _inner.read(chunk, space < sizeof(chunk) ? space : sizeof(chunk));
+    if (n <= 0) {
+      break;
+    }
+    _enqueue(_inbound, chunk, n);
+  }
+}
+
+void ImpairedTransport::drop() {
+  _inner.stop();
+  _reset();
+  _dropped = true;
+  ++_stats.drops;
+}
+
+uint64_t ImpairedTransport::_now() {
+  uint32_t micros = MQTTPlatform::micros();
+  _nowUs += static_cast<uint32_t>(micros - _lastMicros);
+  _lastMicros = micros;
+  return _nowUs;
+}
+
+uint32_t ImpairedTransport::_random() {
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
+
+size_t ImpairedTransport::_chunk(size_t size, size_t limit) {
+  if (limit == 0 || size <= 1) {
+    return size;
+  }
+  size_t max = size < limit ? size : limit;
+  return 1 + _random() % max;
+}
+
+void ImpairedTransport::_enqueue(DelayLine &line, const uint8_t *buf,
+                                 size_t size) {
+  if (size == 0) {
+    return;
+  }
+  uint64_t start = _nowUs > line.linkFreeUs ? _nowUs : line.linkFreeUs;
+  uint64_t transmitUs = 0;
+  if (_impairment.bytesPerSecond) {
+    transmitUs
+        = static_cast<uint64_t>(size) * 1000000 / _impairment.bytesPerSecond;
+  }
+  line.linkFreeUs = start + transmitUs;
+  uint64_t dueUs = line.linkFreeUs + _impairment.latencyUs;
+  if (_impairment.jitterUs) {
+    dueUs += _random() % (_impairment.jitterUs + 1);
+  }
+  // Jitter must not reorder bytes: nothing is due before what precedes it
+  if (dueUs < line.lastDueUs) {
+    dueUs = line.lastDueUs;
+  }
+  line.lastDueUs = dueUs;
+  line.bytes.insert(line.bytes.end(), buf, buf + size);
+  line.segments.push_back({dueUs, size});
+}
+
+void ImpairedTransport::_consume(DelayLine &line, size_t size) {
+  line.bytes.erase(line.bytes.begin(), line.bytes.begin() + size);
+  while (size > 0) {
+    DelayLine::Segment &front = line.segments.front();
+    if (front.length > size) {
+      front.length -= size;
+      return;
+    }
+    size -= front.length;
+    line.segments.pop_front();
+  }
+}
+
+void ImpairedTransport::_reset() {
+  _outbound.clear();
+  _inbound.clear();
+  _dropped = false;
+  // Resynchronise without a jump, e.g. after a VirtualClock was installed
+  _lastMicros = MQTTPlatform::micros();
+}
+
+void ImpairedTransport::DelayLine::clear() {
+  bytes.clear();
+  segments.clear();
+  linkFreeUs = 0;
+  lastDueUs = 0;
+}
+
+size_t ImpairedTransport::DelayLine::due(uint64_t nowUs) const {
+  size_t total = 0;
+  for (const Segment &segment : segments) {
+    if (segment.dueUs > nowUs) {
+      break;
+    }
+    total += segment.length;
+  }
+  return total;
+}
+
+} // namespace MQTTTransport
@@ -0,0 +1,100 @@
+#ifndef MQTT_IMPAIRED_TRANSPORT_H_
+#define MQTT_IMPAIRED_TRANSPORT_H_
+
+#include "MQTTTransport.h"
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace MQTTTransport {
+
+// Link conditions applied by ImpairedTransport. Zero disables an effect.
+struct Impairment {
+  uint32_t latencyUs = 0; // one-way, both directions
+  uint32_t jitterUs = 0;  // extra delay drawn from [0, jitterUs]
+  uint32_t bytesPerSecond = 0;
+  // write() accepts and read() returns a random 1..N bytes at a time
+  size_t maxWriteChunk = 0;
+  size_t maxReadChunk = 0;
+  // Chance per write() that the connection drops, in parts per million
+  uint32_t dropPerMillion = 0;
+  uint32_t seed = 1;
+  // Bytes each direction may have in flight before writes push back
+  size_t bufferSize = 65536;
+};
+
+// Decorator that makes any Transport behave like a slow, lossy link. Bytes
+// are timestamped on their way through and only handed on once the link
+// would have delivered them; order is always preserved. Time comes from
+// MQTTPlatform::micros(), so runs under an installed VirtualClock are fully
+// deterministic for a given seed. Call pump() (or any I/O method) as time
+// advances to move data along.
+class ImpairedTransport : public Transport {
+public:
+  struct Stats {
+    uint32_t partialWrites;
+    uint32_t shortReads;
+    uint32_t drops;
+    uint64_t bytesOut;
+    uint64_t bytesIn;
+  };
+
+  ImpairedTransport(Transport &inner, const Impairment &impairment);
+
+  bool connect(MQTTPlatform::IPv4Address ip, uint16_t port) override;
+  bool connect(const char *host, uint16_t port) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  int read(uint8_t *buf, size_t size) override;
+  void stop() override;
+  bool connected() override;
+  bool disconnected() override;
+  uint8_t waitReady(uint8_t interest, uint32_t timeoutMs,
+                    MQTTPlatform::Notification *wakeup = nullptr) override;
+
+  // Moves due bytes between the wrapped transport and the delay lines.
+  void pump();
+  // Severs the connection as if the link had gone down.
+  void drop();
+
+  void setImpairment(const Impairment &impairment);
+  const Impairment &impairment() const { return _impairment; }
+  const Stats &stats() const { return _stats; }
+
+private:
+  // One direction of the link: bytes waiting for their delivery time.
+  struct DelayLine {
+    struct Segment {
+      uint64_t dueUs;
+      size_t length;
+    };
+    std::deque<uint8_t> bytes;
+    std::deque<Segment> segments;
+    uint64_t linkFreeUs = 0; // end of the last transmission slot
+    uint64_t lastDueUs = 0;
+
+    void clear();
+    size_t due(uint64_t nowUs) const;
+  };
+
+  uint64_t _now();
+  uint32_t _random();
+  size_t _chunk(size_t size, size_t limit);
+  void _enqueue(DelayLine &line, const uint8_t *buf, size_t size);
+  void _consume(DelayLine &line, size_t size);
+  void _reset();
+
+  Transport &_inner;
+  Impairment _impairment;
+  Stats _stats;
+  uint32_t _rng;
+  uint32_t _lastMicros;
+  uint64_t _nowUs;
+  bool _dropped;
+  DelayLine _outbound;
+  DelayLine _inbound;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_IMPAIRED_TRANSPORT_H_
@@ -0,0 +1,101 @@
+#include "MQTTInboundIds.h"
+#include <string.h>
+
+namespace MQTTTransport {
+
+InboundIds::InboundIds() { clear(); }
+
+#if MQTT_INBOUND_QOS2_WINDOW == 0
+
+bool InboundIds::insert(uint16_t id) {
+  uint32_t mask = 1u << (id & 31);
+  uint32_t &word = _bits[id >> 5];
+  if (word & mask) {
+    return false;
+  }
+  word |= mask;
+  ++_count;
+  return true;
+}
+
+bool InboundIds::contains(uint16_t id) const {
+  return (_bits[id >> 5] >> (id & 31)) & 1;
+}
+
+void InboundIds::erase(uint16_t id) {
+  uint32_t mask = 1u << (id & 31);
+  uint32_t &word = _bits[id >> 5];
+  if (word & mask) {
+    word &= ~mask;
+    --_count;
+  }
+}
+
+void InboundIds::clear() {
+  memset(_bits, 0, sizeof(_bits));
+  _count = 0;
+}
+
+#else
+
+size_t InboundIds::_home(uint16_t id) {
+  // Fibonacci hashing: the top bits of id * 2^16 / phi
+  return (static_cast<uint32_t>(id) * 40503u & 0xFFFF) * WINDOW >> 16;
+}
+
+size_t InboundIds::_find(uint16_t id) const {
+  size_t slot = _home(id);
+  while (_slots[slot] && _slots[slot] != id) {
+    slot = (slot + 1) & (WINDOW - 1);
+  }
+  return slot;
+}
+
+bool InboundIds::insert(uint16_t id) {
+  if (id == 0 || _count == WINDOW - 1) {
+    return false; // one slot stays free so probes end
+  }
+  size_t slot = _find(id);
+  if (_slots[slot]) {
+    return false;
+  }
+  _slots[slot] = id;
+  ++_count;
+  return true;
+}
+
+bool InboundIds::contains(uint16_t id) const {
+  return id != 0 && _slots[_find(id)] == id;
+}
+
+void InboundIds::erase(uint16_t id) {
+  if (id == 0) {
+    return;
+  }
+  size_t hole = _find(id);
+  if (!_slots[hole]) {
+    return;
+  }
+  _slots[hole] = 0;
+  --_count;
+  // Pulls later entries of the run back over the hole when their home
+  // slot does not lie between the hole and where they sit
+  for (size_t slot = (hole + 1) & (WINDOW - 1); _slots[slot];
+       slot = (slot + 1) & (WINDOW - 1)) {
+    size_t home = _home(_slots[slot]);
+    if (((slot - home) & (WINDOW - 1)) >= ((slot - hole) & (WINDOW - 1))) {
+      _slots[hole] = _slots[slot];
+      _slots[slot] = 0;
+      hole = slot;
+    }
+  }
+}
+
+void InboundIds::clear() {
+  memset(_slots, 0, sizeof(_slots));
+  _count = 0;
+}
+
+#endif
+
+} // namespace MQTTTransport
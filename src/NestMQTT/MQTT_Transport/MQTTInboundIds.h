@@ -0,0 +1,65 @@
+#ifndef MQTT_INBOUND_IDS_H_
+#define MQTT_INBOUND_IDS_H_
+
+#include "MQTTConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTTransport {
+
+// Packet ids of inbound QoS 2 messages from our PUBREC to the broker's
+// PUBREL; a PUBLISH whose id is in the set was delivered already. With
+// MQTT_INBOUND_QOS2_WINDOW at 0 this is one bit per id, 8 KB in all.
+// Otherwise it is an open-addressed table of that many slots for brokers
+// that keep few QoS 2 messages open at a time (their receive maximum).
+// Lookups probe linearly from a multiplicative hash and erase shifts the
+// run back, so no tombstones build up. Nothing allocates.
+class InboundIds {
+public:
+  static constexpr size_t WINDOW = MQTT_INBOUND_QOS2_WINDOW;
+  static_assert((WINDOW & (WINDOW - 1)) == 0,
+                "MQTT_INBOUND_QOS2_WINDOW must be 0 or a power of two");
+
+  InboundIds();
+  InboundIds(const InboundIds &) = delete;
+  InboundIds &operator=(const InboundIds &) = delete;
+
+  // False when the id is present already or the table is full.
+  bool insert(uint16_t id);
+  bool contains(uint16_t id) const;
+  void erase(uint16_t id);
+  void clear();
+  size_t size() const { return _count; }
+
+  template <typename Visit> void forEach(Visit visit) const {
+#if MQTT_INBOUND_QOS2_WINDOW == 0
+    for (size_t word = 0; word < WORDS; ++word) {
+      for (uint32_t bits = _bits[word]; bits; bits &= bits - 1) {
+        visit(static_cast<uint16_t>(word * 32 + __builtin_ctz(bits)));
+      }
+    }
+#else
+    for (uint16_t id : _slots) {
+      if (id) {
+        visit(id);
+      }
+    }
+#endif
+  }
+
+private:
+#if MQTT_INBOUND_QOS2_WINDOW == 0
+  static constexpr size_t WORDS = 65536 / 32;
+  uint32_t _bits[WORDS];
+#else
+  // Packet id 0 is never used, so it marks a free slot
+  static size_t _home(uint16_t id);
+  size_t _find(uint16_t id) const;
+  uint16_t _slots[WINDOW];
+#endif
+  size_t _count;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_INBOUND_IDS_H_
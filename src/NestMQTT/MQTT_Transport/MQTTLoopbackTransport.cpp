@@ -0,0 +1,122 @@
+#include "MQTTLoopbackTransport.h"
+
+namespace MQTTTransport {
+
+LoopbackTransport::LoopbackTransport(size_t capacity)
+    : _peer(nullptr), _ring(capacity ? capacity : 1), _head(0), _count(0),
+      _connected(false), _peerClosed(false), _accepting(true),
+      _connections(0) {}
+
+LoopbackTransport::~LoopbackTransport() {
+  stop();
+  if (_peer) {
+    _peer->_peer = nullptr;
+  }
+}
+
+void LoopbackTransport::link(LoopbackTransport &a, LoopbackTransport &b) {
+  a.stop();
+  b.stop();
+  a._peer = &b;
+  b._peer = &a;
+}
+
+bool LoopbackTransport::connect(MQTTPlatform::IPv4Address ip, uint16_t port) {
+  (void)ip;
+  (void)port;
+  if (!_peer || !_peer->_accepting) {
+    return false;
+  }
+  _open();
+  return true;
+}
+
+bool LoopbackTransport::connect(const char *host, uint16_t port) {
+  (void)host;
+  return connect(MQTTPlatform::IPv4Address(), port);
+}
+
+void LoopbackTransport::_open() {
+  _reset();
+  _peer->_reset();
+  _connected = _peer->_connected = true;
+  ++_connections;
+  ++_peer->_connections;
+}
+
+void LoopbackTransport::_reset() {
+  _head = 0;
+  _count = 0;
+  _connected = false;
+  _peerClosed = false;
+}
+
+size_t LoopbackTransport::write(const uint8_t *buf, size_t size) {
+  if (!_connected || !_peer || _peerClosed) {
+    return 0;
+  }
+  std::vector<uint8_t> &ring = _peer->_ring;
+  size_t space = ring.size() - _peer->_count;
+  size_t n = size < space ? size : space;
+  size_t tail = (_peer->_head + _peer->_count) % ring.size();
+  for (size_t i = 0; i < n; ++i) {
+    ring[tail] = buf[i];
+    tail = tail + 1 == ring.size() ? 0 : tail + 1;
+  }
+  _peer->_count += n;
+  return n;
+}
+
+int LoopbackTransport::read(uint8_t *buf, size_t size) {
+  if (!_connected) {
+    return -1;
+  }
+  if (_count == 0) {
+    // The peer's bytes are drained before its close becomes visible
+    if (_peerClosed) {
+      _connected = false;
+      return -1;
+    }
+    return 0;
+  }
+  size_t n = size < _count ? size : _count;
+  for (size_t i = 0; i < n; ++i) {
+    buf[i] = _ring[_head];
+    _head = _head + 1 == _ring.size() ? 0 : _head + 1;
+  }
+  _count -= n;
+  return static_cast<int>(n);
+}
+
+uint8_t LoopbackTransport::waitReady(uint8_t interest, uint32_t timeoutMs,
+                                    MQTTPlatform::Notification *wakeup) {
+  // Both ends are driven from one thread, so blocking here would never see
+  // the peer act: report the current state only.
+  (void)timeoutMs;
+  uint8_t ready = wakeup && wakeup->wait(0) ? READY_WAKE : READY_NONE;
+  if (!_connected) {
+    return ready | READY_ERROR;
+  }
+  if ((interest & READY_READ) && (_count > 0 || _peerClosed)) {
+    ready |= READY_READ;
+  }
+  if ((interest & READY_WRITE) && _peer
+      && _peer->_count < _peer->_ring.size()) {
+    ready |= READY_WRITE;
+  }
+  return ready;
+}
+
+void LoopbackTransport::stop() {
+  if (_connected && _peer) {
+    _peer->_peerClosed = true;
+  }
+  _connected = false;
+  _count = 0;
+}
+
+bool LoopbackTransport::connected() { return _connected; }
+
+bool LoopbackTransport::disconnected() { return !_connected; }
+
+} // namespace MQTTTransport
@@ -0,0 +1,59 @@
+#ifndef MQTT_LOOPBACK_TRANSPORT_H_
+#define MQTT_LOOPBACK_TRANSPORT_H_
+
+#include "MQTTTransport.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace MQTTTransport {
+
+// One end of an in-memory byte stream. Two ends joined with link() behave
+// like a connected socket pair: bytes written on one end are read on the
+// other, each direction holding at most `capacity` bytes so a slow reader
+// pushes back on the writer. connect() on either end opens the pair; the
+// address arguments are ignored. Not thread safe: both ends are meant to be
+// driven from one thread, which keeps runs deterministic.
+class LoopbackTransport : public Transport {
+public:
+  explicit LoopbackTransport(size_t capacity = 16384);
+  ~LoopbackTransport() override;
+  LoopbackTransport(const LoopbackTransport &) = delete;
+  LoopbackTransport &operator=(const LoopbackTransport &) = delete;
+
+  static void link(LoopbackTransport &a, LoopbackTransport &b);
+
+  bool connect(MQTTPlatform::IPv4Address ip, uint16_t port) override;
+  bool connect(const char *host, uint16_t port) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  int read(uint8_t *buf, size_t size) override;
+  void stop() override;
+  bool connected() override;
+  bool disconnected() override;
+  uint8_t waitReady(uint8_t interest, uint32_t timeoutMs,
+                    MQTTPlatform::Notification *wakeup = nullptr) override;
+
+  // Refuses connect() while false, like a port nobody listens on.
+  void setAccepting(bool accepting) { _accepting = accepting; }
+  // Bytes waiting to be read on this end.
+  size_t pending() const { return _count; }
+  // Incremented each time the pair is (re)opened.
+  uint32_t connections() const { return _connections; }
+
+private:
+  void _open();
+  void _reset();
+
+  LoopbackTransport *_peer;
+  std::vector<uint8_t> _ring; // bytes travelling towards this end
+  size_t _head;
+  size_t _count;
+  bool _connected;
+  bool _peerClosed;
+  bool _accepting;
+  uint32_t _connections;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_LOOPBACK_TRANSPORT_H_
@@ -0,0 +1,442 @@
+#include "MQTTOfflineStore.h"
+#include "MQTTUtility.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace MQTTTransport {
+
+namespace {
+
+// Little-endian throughout. A segment starts with its magic and sequence
+// number; a record is
+//   magic:2 flags:1 reserved:1 topic_length:2 epoch:2 payload_length:4
+//   deadline:4 topic (NUL included) payload crc32:4
+// with the CRC over everything before it. The position file holds the
+// read segment's sequence, the offset in it and the epoch, plus a CRC.
+constexpr uint32_t SEGMENT_MAGIC = 0x4753514E;  // "NQSG"
+constexpr uint32_t POSITION_MAGIC = 0x5350514E; // "NQPS"
+constexpr uint16_t RECORD_MAGIC = 0x514E;
+constexpr size_t SEGMENT_HEADER = 8;
+constexpr size_t RECORD_HEADER = 16;
+constexpr size_t RECORD_TRAILER = 4;
+constexpr size_t POSITION_SIZE = 20;
+constexpr size_t PATH_LENGTH = 64;
+
+constexpr uint8_t FLAG_QOS = 0x03;
+constexpr uint8_t FLAG_RETAIN = 0x04;
+constexpr uint8_t FLAG_DEADLINE = 0x08;
+
+size_t recordSize(const uint8_t *header) {
+  return RECORD_HEADER + MQTTUtility::getLE16(header + 4)
+         + MQTTUtility::getLE32(header + 8) + RECORD_TRAILER;
+}
+
+} // namespace
+
+OfflineStore::OfflineStore(
+    const MQTTClientDetails::OfflineStoreSettings &settings)
+    : _prefix(settings.path ? settings.path : "/outbox"),
+      _segmentBytes(settings.segment_bytes ? settings.segment_bytes
+                                           : MQTT_STORE_SEGMENT_BYTES),
+      _batchBytes(settings.batch_bytes ? settings.batch_bytes
+                                       : MQTT_STORE_BATCH_BYTES),
+      _segments(settings.segments && settings.segments < NO_SLOT
+                    ? settings.segments
+                    : MQTT_STORE_SEGMENTS),
+      _writeSlot(NO_SLOT), _nextSequence(1), _readSequence(0),
+      _readOffset(SEGMENT_HEADER), _readerSlot(NO_SLOT), _epoch(0),
+      _dirty(false), _pending(0), _batchLength(0), _stats{} {}
+
+bool OfflineStore::open() {
+  if (!MQTTPlatform::mountFilesystem(true)) {
+    return false;
+  }
+  _batch.resize(_batchBytes);
+  uint32_t readSequence = 0;
+  size_t readOffset = SEGMENT_HEADER;
+  if (!_loadPosition(readSequence, readOffset)) {
+    readSequence = 0;
+    readOffset = SEGMENT_HEADER;
+  }
+  ++_epoch;
+
+  uint32_t newest = 0;
+  for (uint8_t slot = 0; slot < _segments.size(); ++slot) {
+    _scan(slot, readSequence, readOffset);
+    if (_segments[slot].sequence > newest) {
+      newest = _segments[slot].sequence;
+      _writeSlot = slot;
+    }
+  }
+  _nextSequence = newest + 1;
+  if (_writeSlot != NO_SLOT) {
+    char path[PATH_LENGTH];
+    _path(_writeSlot, path, sizeof(path));
+    if (_segments[_writeSlot].sealed || !_writer.open(path, "a")) {
+      _writeSlot = NO_SLOT;
+    }
+  }
+  _readSequence = readSequence;
+  _readOffset = readOffset;
+  // Saves the new epoch straight away
+  _savePosition();
+  return true;
+}
+
+bool OfflineStore::append(const char *topic, const uint8_t *payload,
+                          size_t length, uint8_t qos, bool retain,
+                          uint32_t ttlMs) {
+  size_t topicLength = strlen(topic) + 1;
+  size_t total = RECORD_HEADER + topicLength + length + RECORD_TRAILER;
+  if (topicLength > UINT16_MAX || total > _segmentBytes - SEGMENT_HEADER) {
+    return false;
+  }
+  if (_writeSlot == NO_SLOT
+      || _segments[_writeSlot].end + total > _segmentBytes) {
+    if (!_roll()) {
+      return false;
+    }
+  }
+
+  uint8_t header[RECORD_HEADER];
+  MQTTUtility::putLE16(header, RECORD_MAGIC);
+  header[2] = (qos & FLAG_QOS) | (retain ? FLAG_RETAIN : 0)
+              | (ttlMs ? FLAG_DEADLINE : 0);
+  header[3] = 0;
+  MQTTUtility::putLE16(header + 4, static_cast<uint16_t>(topicLength));
+  MQTTUtility::putLE16(header + 6, _epoch);
+  MQTTUtility::putLE32(header + 8, static_cast<uint32_t>(length));
+  MQTTUtility::putLE32(header + 12, ttlMs ? MQTTPlatform::millis() + ttlMs : 0);
+  const uint8_t *name = reinterpret_cast<const uint8_t *>(topic);
+  uint32_t crc = MQTTUtility::crc32(header, sizeof(header));
+  crc = MQTTUtility::crc32(name, topicLength, crc);
+  crc = MQTTUtility::crc32(payload, length, crc);
+  uint8_t trailer[RECORD_TRAILER];
+  MQTTUtility::putLE32(trailer, crc);
+
+  Segment &segment = _segments[_writeSlot];
+  bool written = _writer.write(header, sizeof(header)) == sizeof(header)
+                 && _writer.write(name, topicLength) == topicLength
+                 && (length == 0 || _writer.write(payload, length) == length)
+                 && _writer.write(trailer, sizeof(trailer))
+                        == sizeof(trailer)
+                 && _writer.sync();
+  if (!written) {
+    // A partial record would fail its CRC; the segment ends before it
+    segment.sealed = true;
+    _writer.close();
+    _writeSlot = NO_SLOT;
+    return false;
+  }
+  segment.end += total;
+  ++segment.unread;
+  ++_pending;
+  ++_stats.stored;
+  return true;
+}
+
+size_t OfflineStore::replay(Sink sink, void *context) {
+  if (_pending == 0) {
+    return 0;
+  }
+  uint8_t slot = _readSlot();
+  if (slot == NO_SLOT || _readOffset >= _segments[slot].end) {
+    return 0;
+  }
+  Segment &segment = _segments[slot];
+  size_t available = segment.end - _readOffset;
+  if (!_fill(slot, available < _batchBytes ? available : _batchBytes)) {
+    return 0;
+  }
+
+  uint32_t now = MQTTPlatform::millis();
+  size_t used = 0;
+  size_t count = 0;
+  while (used + RECORD_HEADER <= _batchLength) {
+    const uint8_t *record = &_batch[used];
+    size_t total = recordSize(record);
+    bool valid = MQTTUtility::getLE16(record) == RECORD_MAGIC
+                 && used + total <= available;
+    if (valid && used + total > _batchLength) {
+      if (used > 0) {
+        break; // the next batch starts with it
+      }
+      // Larger than a batch: read it whole
+      if (!_fill(slot, total)) {
+        return 0;
+      }
+      record = &_batch[0];
+    }
+    valid = valid
+            && MQTTUtility::crc32(record, total - RECORD_TRAILER)
+                   == MQTTUtility::getLE32(record + total - RECORD_TRAILER);
+    if (!valid) {
+      // Nothing after it in this segment can be trusted
+      ++_stats.corrupt;
+      _pending -= segment.unread;
+      segment.unread = 0;
+      segment.sealed = true;
+      if (slot == _writeSlot) {
+        _writer.close();
+        _writeSlot = NO_SLOT;
+      }
+      _readOffset = segment.end;
+      _dirty = true;
+      return count;
+    }
+    uint8_t flags = record[2];
+    size_t topicLength = MQTTUtility::getLE16(record + 4);
+    OfflineStore::Message message{
+        reinterpret_cast<const char *>(record + RECORD_HEADER),
+        record + RECORD_HEADER + topicLength, MQTTUtility::getLE32(record + 8),
+        static_cast<uint8_t>(flags & FLAG_QOS), (flags & FLAG_RETAIN) != 0,
+        0};
+    bool expired = false;
+    if (flags & FLAG_DEADLINE) {
+      int32_t left
+          = static_cast<int32_t>(MQTTUtility::getLE32(record + 12) - now);
+      expired = MQTTUtility::getLE16(record + 6) != _epoch || left <= 0;
+      message.ttlMs = expired ? 0 : static_cast<uint32_t>(left);
+    }
+    if (!expired && !sink(message, context)) {
+      break; // the next replay starts with it
+    }
+    used += total;
+    ++count;
+    --segment.unread;
+    --_pending;
+    if (expired) {
+      ++_stats.expired;
+    } else {
+      ++_stats.replayed;
+    }
+  }
+  _readOffset += used;
+  _dirty = true;
+  return count;
+}
+
+void OfflineStore::commit() {
+  if (!_dirty) {
+    return;
+  }
+  _readSlot();
+  // Everything older than the read segment has been replayed
+  for (uint8_t slot = 0; slot < _segments.size(); ++slot) {
+    Segment &segment = _segments[slot];
+    if (segment.sequence != 0 && segment.sequence < _readSequence) {
+      _evict(slot);
+    }
+  }
+  _savePosition();
+  _dirty = false;
+}
+
+void OfflineStore::_path(uint8_t slot, char *out, size_t size) const {
+  snprintf(out, size, "%s.%u", _prefix, static_cast<unsigned>(slot));
+}
+
+void OfflineStore::_scan(uint8_t slot, uint32_t readSequence,
+                         size_t readOffset) {
+  Segment &segment = _segments[slot];
+  segment = Segment{0, 0, 0, false};
+  char path[PATH_LENGTH];
+  _path(slot, path, sizeof(path));
+  if (!MQTTPlatform::fileExists(path)) {
+    return;
+  }
+  MQTTPlatform::File file;
+  uint8_t header[RECORD_HEADER];
+  if (!file.open(path, "r")
+      || file.read(header, SEGMENT_HEADER) != SEGMENT_HEADER
+      || MQTTUtility::getLE32(header) != SEGMENT_MAGIC
+      || MQTTUtility::getLE32(header + 4) == 0
+      || MQTTUtility::getLE32(header + 4) < readSequence) {
+    // Unreadable, or replayed before the last run ended
+    file.close();
+    MQTTPlatform::removeFile(path);
+    return;
+  }
+  uint32_t sequence = MQTTUtility::getLE32(header + 4);
+  size_t size = file.size();
+  size_t offset = SEGMENT_HEADER;
+  uint32_t unread = 0;
+  // Walks every record once, checking its CRC through the batch buffer
+  while (offset + RECORD_HEADER + RECORD_TRAILER <= size) {
+    if (file.read(header, RECORD_HEADER) != RECORD_HEADER
+        || MQTTUtility::getLE16(header) != RECORD_MAGIC) {
+      break;
+    }
+    size_t total = recordSize(header);
+    if (offset + total > size) {
+      break;
+    }
+    uint32_t crc = MQTTUtility::crc32(header, RECORD_HEADER);
+    size_t body = total - RECORD_HEADER - RECORD_TRAILER;
+    while (body > 0) {
+      size_t chunk = body < _batch.size() ? body : _batch.size();
+      if (file.read(_batch.data(), chunk) != chunk) {
+        break;
+      }
+      crc = MQTTUtility::crc32(_batch.data(), chunk, crc);
+      body -= chunk;
+    }
+    uint8_t trailer[RECORD_TRAILER];
+    if (body > 0 || file.read(trailer, sizeof(trailer)) != sizeof(trailer)
+        || MQTTUtility::getLE32(trailer) != crc) {
+      break;
+    }
+    if (sequence != readSequence || offset >= readOffset) {
+      ++unread;
+    }
+    offset += total;
+  }
+  if (offset < size) {
+    ++_stats.corrupt; // torn by a reset mid-append
+  }
+  segment = Segment{sequence, unread, offset, offset < size};
+  _pending += unread;
+}
+
+bool OfflineStore::_roll() {
+  _writer.close();
+  _writeSlot = NO_SLOT;
+  uint8_t slot = NO_SLOT;
+  uint8_t oldest = NO_SLOT;
+  for (uint8_t i = 0; i < _segments.size() && slot == NO_SLOT; ++i) {
+    if (_segments[i].sequence == 0) {
+      slot = i;
+    } else if (oldest == NO_SLOT
+               || _segments[i].sequence < _segments[oldest].sequence) {
+      oldest = i;
+    }
+  }
+  if (slot == NO_SLOT) {
+    slot = oldest;
+    _evict(slot);
+  }
+
+  char path[PATH_LENGTH];
+  _path(slot, path, sizeof(path));
+  uint8_t header[SEGMENT_HEADER];
+  MQTTUtility::putLE32(header, SEGMENT_MAGIC);
+  MQTTUtility::putLE32(header + 4, _nextSequence);
+  if (!_writer.open(path, "w")
+      || _writer.write(header, sizeof(header)) != sizeof(header)
+      || !_writer.sync()) {
+    _writer.close();
+    MQTTPlatform::removeFile(path);
+    return false;
+  }
+  _segments[slot] = Segment{_nextSequence++, 0, SEGMENT_HEADER, false};
+  _writeSlot = slot;
+  return true;
+}
+
+void OfflineStore::_evict(uint8_t slot) {
+  Segment &segment = _segments[slot];
+  _stats.evicted += segment.unread;
+  _pending -= segment.unread;
+  if (_readerSlot == slot) {
+    _reader.close();
+    _readerSlot = NO_SLOT;
+  }
+  if (_writeSlot == slot) {
+    _writer.close();
+    _writeSlot = NO_SLOT;
+  }
+  char path[PATH_LENGTH];
+  _path(slot, path, sizeof(path));
+  MQTTPlatform::removeFile(path);
+  segment = Segment{0, 0, 0, false};
+}
+
+uint8_t OfflineStore::_slotOf(uint32_t sequence) const {
+  for (uint8_t slot = 0; slot < _segments.size() && sequence != 0; ++slot) {
+    if (_segments[slot].sequence == sequence) {
+      return slot;
+    }
+  }
+  return NO_SLOT;
+}
+
+uint8_t OfflineStore::_readSlot() {
+  uint8_t slot = _slotOf(_readSequence);
+  while (slot == NO_SLOT
+         || (_readOffset >= _segments[slot].end && slot != _writeSlot)) {
+    // Gone or read to the end: continue with the next newer segment
+    uint8_t next = NO_SLOT;
+    for (uint8_t i = 0; i < _segments.size(); ++i) {
+      uint32_t sequence = _segments[i].sequence;
+      if (sequence > _readSequence
+          && (next == NO_SLOT || sequence < _segments[next].sequence)) {
+        next = i;
+      }
+    }
+    if (next == NO_SLOT) {
+      return slot;
+    }
+    slot = next;
+    _readSequence = _segments[slot].sequence;
+    _readOffset = SEGMENT_HEADER;
+    _dirty = true;
+  }
+  return slot;
+}
+
+bool OfflineStore::_fill(uint8_t slot, size_t want) {
+  if (_readerSlot != slot) {
+    _reader.close();
+    char path[PATH_LENGTH];
+    _path(slot, path, sizeof(path));
+    if (!_reader.open(path, "r")) {
+      return false;
+    }
+    _readerSlot = slot;
+  }
+  if (_batch.size() < want) {
+    _batch.resize(want);
+  }
+  // Seeking also drops stdio's read-ahead, so appends since show up
+  if (!_reader.seek(_readOffset)) {
+    return false;
+  }
+  _batchLength = _reader.read(_batch.data(), want);
+  return _batchLength == want;
+}
+
+bool OfflineStore::_loadPosition(uint32_t &sequence, size_t &offset) {
+  char path[PATH_LENGTH];
+  snprintf(path, sizeof(path), "%s.pos", _prefix);
+  MQTTPlatform::File file;
+  uint8_t data[POSITION_SIZE];
+  if (!file.open(path, "r") || file.read(data, sizeof(data)) != sizeof(data)
+      || MQTTUtility::getLE32(data) != POSITION_MAGIC
+      || MQTTUtility::crc32(data, POSITION_SIZE - 4)
+             != MQTTUtility::getLE32(data + POSITION_SIZE - 4)) {
+    return false;
+  }
+  sequence = MQTTUtility::getLE32(data + 4);
+  offset = MQTTUtility::getLE32(data + 8);
+  _epoch = MQTTUtility::getLE16(data + 12);
+  return true;
+}
+
+void OfflineStore::_savePosition() {
+  char path[PATH_LENGTH];
+  snprintf(path, sizeof(path), "%s.pos", _prefix);
+  uint8_t data[POSITION_SIZE] = {};
+  MQTTUtility::putLE32(data, POSITION_MAGIC);
+  MQTTUtility::putLE32(data + 4, _readSequence);
+  MQTTUtility::putLE32(data + 8, static_cast<uint32_t>(_readOffset));
+  MQTTUtility::putLE16(data + 12, _epoch);
+  MQTTUtility::putLE32(data + POSITION_SIZE - 4,
+        MQTTUtility::crc32(data, POSITION_SIZE - 4));
+  MQTTPlatform::File file;
+  if (file.open(path, "w")) {
+    file.write(data, sizeof(data));
+    file.sync();
+  }
+}
+
+} // namespace MQTTTransport
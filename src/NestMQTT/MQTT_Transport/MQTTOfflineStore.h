@@ -0,0 +1,112 @@
+#ifndef MQTT_OFFLINE_STORE_H_
+#define MQTT_OFFLINE_STORE_H_
+
+#include "MQTTClientConfig.h"
+#include "MQTTMemory.h"
+#include "MQTTPlatform.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace MQTTTransport {
+
+// Publishes made while offline, kept on the data partition until the next
+// connection. The log is a ring of segment files "<path>.0" to
+// "<path>.N-1" that are only ever appended to; every record carries a
+// CRC32, so one torn by a power cut ends its segment instead of replaying
+// garbage. When all segments are full the oldest is deleted, messages and
+// all.
+//
+// replay() reads up to batch_bytes of records with one sequential read.
+// The read position is saved in "<path>.pos" by commit(), which also
+// deletes segments read to the end; whatever was read but not committed
+// replays again after a reboot, so commit only what has been delivered.
+// A time-to-live only counts within one run: millis() starts over on
+// boot, so records with a TTL from an earlier run are dropped as expired.
+class OfflineStore {
+public:
+  struct Message {
+    const char *topic;
+    const uint8_t *payload;
+    size_t length;
+    uint8_t qos;
+    bool retain;
+    uint32_t ttlMs; // left to live, 0 for none
+  };
+
+  struct Stats {
+    uint32_t stored;
+    uint32_t replayed;
+    uint32_t evicted; // went with the oldest segment when the log was full
+    uint32_t expired;
+    uint32_t corrupt; // segments cut short by a record failing its CRC
+  };
+
+  // Returns false to leave the message in the log.
+  using Sink = bool (*)(const Message &message, void *context);
+
+  explicit OfflineStore(
+      const MQTTClientDetails::OfflineStoreSettings &settings);
+  OfflineStore(const OfflineStore &) = delete;
+  OfflineStore &operator=(const OfflineStore &) = delete;
+
+  // Picks up the log an earlier run left; false without a filesystem.
+  bool open();
+  bool append(const char *topic, const uint8_t *payload, size_t length,
+              uint8_t qos, bool retain, uint32_t ttlMs);
+  // Hands the next batch to sink, oldest first, up to the first message
+  // sink refuses; the next replay() starts with that one. Returns the
+  // records read, expired ones included.
+  size_t replay(Sink sink, void *context);
+  void commit();
+
+  // Records stored and not read yet.
+  size_t pending() const { return _pending; }
+  Stats stats() const { return _stats; }
+
+private:
+  static constexpr uint8_t NO_SLOT = 0xFF;
+
+  struct Segment {
+    uint32_t sequence; // 0 while the slot is free
+    uint32_t unread;   // records after the read position
+    size_t end;        // bytes of whole, valid records plus the header
+    bool sealed;       // takes no more records
+  };
+
+  void _path(uint8_t slot, char *out, size_t size) const;
+  void _scan(uint8_t slot, uint32_t readSequence, size_t readOffset);
+  bool _roll();
+  void _evict(uint8_t slot);
+  uint8_t _slotOf(uint32_t sequence) const;
+  // Slot to read from next, moving past segments read to the end.
+  uint8_t _readSlot();
+  bool _fill(uint8_t slot, size_t want);
+  bool _loadPosition(uint32_t &sequence, size_t &offset);
+  void _savePosition();
+
+  const char *_prefix;
+  size_t _segmentBytes;
+  size_t _batchBytes;
+  std::vector<Segment> _segments;
+  uint8_t _writeSlot;
+  uint32_t _nextSequence;
+  uint32_t _readSequence;
+  size_t _readOffset;
+  uint8_t _readerSlot; // the segment _reader has open
+  uint16_t _epoch;     // this run, to tell TTL deadlines of earlier ones
+  bool _dirty;         // read past the saved position
+  size_t _pending;
+  MQTTPlatform::File _writer;
+  MQTTPlatform::File _reader;
+  // In PSRAM where there is some
+  std::vector<uint8_t,
+              MQTTCore::PolicyAllocator<uint8_t, MQTTCore::MEMORY_STORE>>
+      _batch;
+  size_t _batchLength;
+  Stats _stats;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_OFFLINE_STORE_H_
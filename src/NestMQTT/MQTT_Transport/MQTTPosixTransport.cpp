@@ -0,0 +1,326 @@
+#include "MQTTPosixTransport.h"
+
+#ifdef MQTT_PLATFORM_POSIX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace MQTTTransport {
+
+namespace {
+
+constexpr const char UNIX_PREFIX[] = "unix:";
+
+bool wouldBlock(int error) {
+  return error == EAGAIN || error == EWOULDBLOCK || error == EINTR;
+}
+
+// Fills address for a "unix:" host; false when the path does not fit
+bool unixAddress(const char *host, sockaddr_un &address) {
+  const char *path = host + sizeof(UNIX_PREFIX) - 1;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return false;
+  }
+  address = sockaddr_un{};
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  return true;
+}
+
+// Real time even under a VirtualClock, which poll() does not follow
+uint32_t monotonicMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint32_t>(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+bool connectSucceeded(int fd) {
+  int error = 0;
+  socklen_t size = sizeof(error);
+  return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0
+         && error == 0;
+}
+
+} // namespace
+
+PosixTransport::PosixTransport(uint32_t connectTimeoutMs)
+    : _fd(-1), _connected(false), _connectTimeoutMs(connectTimeoutMs),
+      _stats{} {}
+
+PosixTransport::~PosixTransport() { stop(); }
+
+bool PosixTransport::connect(MQTTPlatform::IPv4Address ip, uint16_t port) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  memcpy(&address.sin_addr, ip.octets, sizeof(ip.octets));
+  return _connect(AF_INET, &address, sizeof(address));
+}
+
+bool PosixTransport::connect(const char *host, uint16_t port) {
+  if (!host) {
+    return false;
+  }
+  if (strncmp(host, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+    sockaddr_un address;
+    return unixAddress(host, address)
+           && _connect(AF_UNIX, &address, sizeof(address));
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[6];
+  snprintf(service, sizeof(service), "%u", port);
+  addrinfo *results = nullptr;
+  if (getaddrinfo(host, service, &hints, &results) != 0) {
+    return false;
+  }
+  bool open = false;
+  for (addrinfo *ai = results; ai && !open; ai = ai->ai_next) {
+    open = _connect(ai->ai_family, ai->ai_addr, ai->ai_addrlen);
+  }
+  freeaddrinfo(results);
+  return open;
+}
+
+int PosixTransport::connectAny(Endpoint *endpoints, size_t count,
+                               uint32_t staggerMs) {
+  stop();
+  if (count > MQTT_ENDPOINTS) {
+    count = MQTT_ENDPOINTS;
+  }
+  // Attempts in progress, and the endpoint each belongs to
+  pollfd pending[MQTT_ENDPOINTS];
+  size_t owners[MQTT_ENDPOINTS];
+  size_t waiting = 0;
+  size_t next = 0;
+  int winner = -1;
+  uint32_t start = monotonicMs();
+  uint32_t nextAt = 0; // since start
+  while (winner < 0) {
+    uint32_t elapsed = monotonicMs() - start;
+    if (elapsed >= _connectTimeoutMs) {
+      break;
+    }
+    if (next < count && (waiting == 0 || elapsed >= nextAt)) {
+      bool open = false;
+      int fd = _start(endpoints[next].host, endpoints[next].port, open);
+      if (fd < 0) {
+        endpoints[next++].failed = true;
+      } else if (open) {
+        _fd = fd;
+        winner = static_cast<int>(next++);
+      } else {
+        pending[waiting] = {fd, POLLOUT, 0};
+        owners[waiting++] = next++;
+        nextAt = elapsed + staggerMs;
+      }
+      continue;
+    }
+    if (waiting == 0) {
+      break;
+    }
+    uint32_t wait = _connectTimeoutMs - elapsed;
+    if (next < count && nextAt - elapsed < wait) {
+      wait = nextAt - elapsed;
+    }
+    if (poll(pending, waiting, static_cast<int>(wait)) <= 0) {
+      continue;
+    }
+    for (size_t i = 0; i < waiting && winner < 0;) {
+      if (!pending[i].revents) {
+        ++i;
+        continue;
+      }
+      if (connectSucceeded(pending[i].fd)) {
+        _fd = pending[i].fd;
+        winner = static_cast<int>(owners[i]);
+      } else {
+        // The next endpoint need not wait out the stagger
+        endpoints[owners[i]].failed = true;
+        close(pending[i].fd);
+        nextAt = 0;
+      }
+      pending[i] = pending[--waiting];
+      owners[i] = owners[waiting];
+    }
+  }
+  for (size_t i = 0; i < waiting; ++i) {
+    // Losers were only slower; attempts left when time ran out failed
+    if (winner < 0) {
+      endpoints[owners[i]].failed = true;
+    }
+    close(pending[i].fd);
+  }
+  _connected = winner >= 0;
+  return winner;
+}
+
+bool PosixTransport::_connect(int family, const void *address,
+                              unsigned length) {
+  stop();
+  bool open = false;
+  _fd = _start(family, address, length, open);
+  if (_fd < 0) {
+    return false;
+  }
+  if (!open) {
+    // Completes asynchronously; wait here so connect() keeps its contract
+    pollfd pfd{_fd, POLLOUT, 0};
+    if (poll(&pfd, 1, static_cast<int>(_connectTimeoutMs)) != 1
+        || !connectSucceeded(_fd)) {
+      _fail();
+      return false;
+    }
+  }
+  _connected = true;
+  return true;
+}
+
+int PosixTransport::_start(int family, const void *address, unsigned length,
+                           bool &open) {
+  int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (family != AF_UNIX) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (::connect(fd, static_cast<const sockaddr *>(address), length) == 0) {
+    open = true;
+  } else if (errno != EINPROGRESS && errno != EAGAIN) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int PosixTransport::_start(const char *host, uint16_t port, bool &open) {
+  if (!host) {
+    return -1;
+  }
+  if (strncmp(host, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+    sockaddr_un address;
+    return unixAddress(host, address)
+               ? _start(AF_UNIX, &address, sizeof(address), open)
+               : -1;
+  }
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[6];
+  snprintf(service, sizeof(service), "%u", port);
+  addrinfo *results = nullptr;
+  if (getaddrinfo(host, service, &hints, &results) != 0) {
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo *ai = results; ai && fd < 0; ai = ai->ai_next) {
+    fd = _start(ai->ai_family, ai->ai_addr, ai->ai_addrlen, open);
+  }
+  freeaddrinfo(results);
+  return fd;
+}
+
+size_t PosixTransport::write(const uint8_t *buf, size_t size) {
+  if (!_connected) {
+    return 0;
+  }
+  ++_stats.writes;
+  ssize_t written = send(_fd, buf, size, MSG_NOSIGNAL);
+  if (written < 0) {
+    if (wouldBlock(errno)) {
+      ++_stats.wouldBlock;
+    } else {
+      _fail();
+    }
+    return 0;
+  }
+  return static_cast<size_t>(written);
+}
+
+int PosixTransport::read(uint8_t *buf, size_t size) {
+  if (!_connected) {
+    return -1;
+  }
+  ++_stats.reads;
+  ssize_t received = recv(_fd, buf, size, 0);
+  if (received > 0) {
+    return static_cast<int>(received);
+  }
+  if (received < 0 && wouldBlock(errno)) {
+    ++_stats.wouldBlock;
+    return 0;
+  }
+  // Orderly shutdown by the peer or a socket error
+  _fail();
+  return -1;
+}
+
+uint8_t PosixTransport::waitReady(uint8_t interest, uint32_t timeoutMs,
+                                  MQTTPlatform::Notification *wakeup) {
+  // Socket first, the wakeup's eventfd second; either may be absent
+  pollfd pfds[2] = {{_fd, 0, 0}, {wakeup ? wakeup->fd() : -1, POLLIN, 0}};
+  if (interest & READY_READ) {
+    pfds[0].events |= POLLIN;
+  }
+  if (interest & READY_WRITE) {
+    pfds[0].events |= POLLOUT;
+  }
+  if (!_connected) {
+    if (!wakeup) {
+      return READY_ERROR;
+    }
+    pfds[0].fd = -1;
+  }
+  ++_stats.polls;
+  int timeout = timeoutMs > INT32_MAX ? -1 : static_cast<int>(timeoutMs);
+  if (poll(pfds, 2, timeout) <= 0) {
+    return _connected ? READY_NONE : READY_ERROR;
+  }
+  uint8_t ready = _connected ? READY_NONE : READY_ERROR;
+  if (pfds[0].revents & (POLLIN | POLLHUP)) {
+    // A hang-up reads as end of stream, which read() turns into an error
+    ready |= READY_READ;
+  }
+  if (pfds[0].revents & POLLOUT) {
+    ready |= READY_WRITE;
+  }
+  if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+    ready |= READY_ERROR;
+  }
+  if ((pfds[1].revents & POLLIN) && wakeup->wait(0)) {
+    ready |= READY_WAKE;
+  }
+  return ready;
+}
+
+void PosixTransport::stop() {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+  _fd = -1;
+  _connected = false;
+}
+
+void PosixTransport::_fail() { stop(); }
+
+bool PosixTransport::connected() { return _connected; }
+
+bool PosixTransport::disconnected() { return !_connected; }
+
+} // namespace MQTTTransport
+
+#endif // MQTT_PLATFORM_POSIX
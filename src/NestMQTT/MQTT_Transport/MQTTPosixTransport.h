@@ -0,0 +1,69 @@
+#ifndef MQTT_POSIX_TRANSPORT_H_
+#define MQTT_POSIX_TRANSPORT_H_
+
+#include "MQTTPlatform.h"
+
+#ifdef MQTT_PLATFORM_POSIX
+
+#include "MQTTTransport.h"
+#include <stdint.h>
+
+namespace MQTTTransport {
+
+// Non-blocking socket transport for Linux hosts. connect(host, port)
+// resolves TCP hosts through getaddrinfo(); hosts of the form
+// "unix:/path/to/socket" (port ignored) use a Unix domain socket.
+// connectAny() races the endpoints Happy Eyeballs style (RFC 8305), one
+// socket per endpoint on its first resolved address, all within the
+// connect timeout.
+class PosixTransport : public Transport {
+public:
+  // Syscalls issued by this transport, for measuring cost per message.
+  struct Stats {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t polls;
+    uint32_t wouldBlock;
+  };
+
+  explicit PosixTransport(uint32_t connectTimeoutMs = 5000);
+  ~PosixTransport() override;
+  PosixTransport(const PosixTransport &) = delete;
+  PosixTransport &operator=(const PosixTransport &) = delete;
+
+  bool connect(MQTTPlatform::IPv4Address ip, uint16_t port) override;
+  bool connect(const char *host, uint16_t port) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  int read(uint8_t *buf, size_t size) override;
+  void stop() override;
+  bool connected() override;
+  bool disconnected() override;
+  int connectAny(Endpoint *endpoints, size_t count,
+                 uint32_t staggerMs) override;
+  uint8_t waitReady(uint8_t interest, uint32_t timeoutMs,
+                    MQTTPlatform::Notification *wakeup = nullptr) override;
+
+  int fd() const { return _fd; }
+  const Stats &stats() const { return _stats; }
+  void resetStats() { _stats = Stats{}; }
+
+private:
+  bool _connect(int family, const void *address, unsigned length);
+  // Issues a non-blocking connect on a new socket and returns it, or -1
+  // when the attempt failed at once; open is set if it already completed.
+  static int _start(int family, const void *address, unsigned length,
+                    bool &open);
+  static int _start(const char *host, uint16_t port, bool &open);
+  void _fail();
+
+  int _fd;
+  bool _connected;
+  uint32_t _connectTimeoutMs;
+  Stats _stats;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_PLATFORM_POSIX
+
+#endif // MQTT_POSIX_TRANSPORT_H_
@@ -0,0 +1,105 @@
+#include "MQTTPressure.h"
+#include "MQTTPlatform.h"
+
+namespace MQTTTransport {
+
+using MQTTClientDetails::PressureLevel;
+
+PressureMonitor::PressureMonitor()
+    : _enabled(false), _elevatedFree(0), _elevatedBlock(0), _criticalFree(0),
+      _criticalBlock(0), _elevatedPolicy(0), _criticalPolicy(0),
+      _sampleMs(0), _sample(nullptr), _level(PressureLevel::NORMAL),
+      _policy(0), _sampledAt(0), _due(true), _stats{0, 0, 0, 0, SIZE_MAX} {}
+
+void PressureMonitor::configure(
+    const MQTTClientDetails::PressureSettings &settings) {
+  _enabled = settings.enabled;
+  _elevatedFree = settings.elevated_free ? settings.elevated_free
+                                         : MQTT_PRESSURE_ELEVATED_FREE;
+  _elevatedBlock = settings.elevated_block ? settings.elevated_block
+                                           : MQTT_PRESSURE_ELEVATED_BLOCK;
+  _criticalFree = settings.critical_free ? settings.critical_free
+                                         : MQTT_PRESSURE_CRITICAL_FREE;
+  _criticalBlock = settings.critical_block ? settings.critical_block
+                                           : MQTT_PRESSURE_CRITICAL_BLOCK;
+  _elevatedPolicy = settings.elevated_policy;
+  _criticalPolicy = settings.critical_policy;
+  _sampleMs = settings.sample_ms ? settings.sample_ms
+                                 : MQTT_PRESSURE_SAMPLE_MS;
+  _sample = settings.sample;
+  _policy = _level == PressureLevel::CRITICAL   ? _criticalPolicy
+            : _level == PressureLevel::ELEVATED ? _elevatedPolicy
+                                                : 0;
+  _due = true;
+}
+
+bool PressureMonitor::update(uint32_t now) {
+  if (!_enabled) {
+    // Turned off while under pressure: back to normal once
+    bool changed = _level != PressureLevel::NORMAL;
+    _level = PressureLevel::NORMAL;
+    _policy = 0;
+    return changed;
+  }
+  if (!_due && now - _sampledAt < _sampleMs) {
+    return false;
+  }
+  _sampledAt = now;
+  _due = false;
+  size_t freeBytes;
+  size_t largestBlock;
+  if (_sample) {
+    _sample(freeBytes, largestBlock);
+  } else {
+    freeBytes = MQTTPlatform::freeHeap();
+    largestBlock = MQTTPlatform::largestFreeBlock();
+  }
+  if (freeBytes < _stats.lowestFree) {
+    _stats.lowestFree = freeBytes;
+  }
+  PressureLevel level = _classify(freeBytes, largestBlock);
+  if (level == _level) {
+    return false;
+  }
+  _level = level;
+  _policy = level == PressureLevel::CRITICAL   ? _criticalPolicy
+            : level == PressureLevel::ELEVATED ? _elevatedPolicy
+                                               : 0;
+  ++_stats.changes;
+  return true;
+}
+
+void PressureMonitor::count(Outcome outcome) {
+  switch (outcome) {
+    case REFUSED:
+      ++_stats.refused;
+      break;
+    case CONFLATED:
+      ++_stats.conflated;
+      break;
+    case SPILLED:
+      ++_stats.spilled;
+      break;
+  }
+}
+
+PressureLevel PressureMonitor::_classify(size_t freeBytes,
+                                         size_t largestBlock) const {
+  bool critical = _level == PressureLevel::CRITICAL;
+  if (_below(freeBytes, _criticalFree, critical)
+      || _below(largestBlock, _criticalBlock, critical)) {
+    return PressureLevel::CRITICAL;
+  }
+  bool elevated = _level != PressureLevel::NORMAL;
+  if (_below(freeBytes, _elevatedFree, elevated)
+      || _below(largestBlock, _elevatedBlock, elevated)) {
+    return PressureLevel::ELEVATED;
+  }
+  return PressureLevel::NORMAL;
+}
+
+bool PressureMonitor::_below(size_t value, size_t threshold, bool leaving) {
+  return value < (leaving ? threshold + threshold / 8 : threshold);
+}
+
+} // namespace MQTTTransport
@@ -0,0 +1,66 @@
+#ifndef MQTT_PRESSURE_H_
+#define MQTT_PRESSURE_H_
+
+#include "MQTTClientConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTTransport {
+
+// Samples the heap and maps it to a MQTTClientDetails::PressureLevel. A
+// level is only left for a lower one once both figures are an eighth
+// above its thresholds, so memory hovering at a threshold does not flip
+// the level on every sample.
+class PressureMonitor {
+public:
+  enum Outcome : uint8_t { REFUSED, CONFLATED, SPILLED };
+
+  struct Stats {
+    uint32_t changes;   // level transitions
+    uint32_t refused;   // QoS 0 publishes turned away
+    uint32_t conflated; // unsent messages replaced by a newer one
+    uint32_t spilled;   // publishes sent to the offline store instead
+    size_t lowestFree;  // lowest free heap sampled
+  };
+
+  PressureMonitor();
+
+  void configure(const MQTTClientDetails::PressureSettings &settings);
+  // Samples the heap once sample_ms has passed since the last sample;
+  // true when the level changed.
+  bool update(uint32_t now);
+  // The next update() samples whatever the time, after an allocation
+  // failed.
+  void sampleSoon() { _due = true; }
+
+  MQTTClientDetails::PressureLevel level() const { return _level; }
+  // Whether the current level's policy has all of flags.
+  bool applies(uint8_t flags) const { return (_policy & flags) == flags; }
+
+  void count(Outcome outcome);
+  Stats stats() const { return _stats; }
+
+private:
+  MQTTClientDetails::PressureLevel _classify(size_t freeBytes,
+                                             size_t largestBlock) const;
+  static bool _below(size_t value, size_t threshold, bool leaving);
+
+  bool _enabled;
+  size_t _elevatedFree;
+  size_t _elevatedBlock;
+  size_t _criticalFree;
+  size_t _criticalBlock;
+  uint8_t _elevatedPolicy;
+  uint8_t _criticalPolicy;
+  uint32_t _sampleMs;
+  void (*_sample)(size_t &freeBytes, size_t &largestBlock);
+  MQTTClientDetails::PressureLevel _level;
+  uint8_t _policy; // flags of _level
+  uint32_t _sampledAt;
+  bool _due;
+  Stats _stats;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_PRESSURE_H_
@@ -0,0 +1,361 @@
+#include "MQTTReceiver.h"
+#include "MQTTClient.h"
+#include "MQTTUtility.h"
+#include <string>
+
+namespace MQTTTransport {
+
+Receiver::Receiver(MqttClient *client)
+    : _client(client), _transport(client->_transport), _rxLength(0) {}
+
+int Receiver::_receivePacket() {
+  int handled = 0;
+  for (;;) {
+    int haveRead = 0;
+    if (_rxLength < sizeof(_rxBuffer)) {
+      haveRead = _transport->read(&_rxBuffer[_rxLength],
+                                  sizeof(_rxBuffer) - _rxLength);
+      if (haveRead < 0) {
+        _client->_metrics.recordError(MQTTErrors::SOCKET_ERROR);
+        return -1;
+      }
+      if (haveRead > 0) {
+        if (_rxLength == 0) {
+          _trace.stamp(TraceStage::INBOUND_FIRST_BYTE);
+        }
+        _rxLength += haveRead;
+        _client->_metrics.increment(Counter::BYTES_IN, haveRead);
+      }
+    }
+
+    int processed = _processBuffer();
+    if (processed < 0) {
+      return -1;
+    }
+    handled += processed;
+
+    if (haveRead == 0) {
+      break;
+    }
+  }
+  return handled;
+}
+
+int Receiver::_processBuffer() {
+  int handled = 0;
+  while (_rxLength > 0) {
+    mqtt_response response;
+    MQTTErrors error = MQTTErrors::SUCCESS;
+    int32_t consumed = decode(_rxBuffer, _rxLength, response, error);
+    if (consumed == 0 && _rxLength == sizeof(_rxBuffer)) {
+      error = MQTTErrors::RECV_BUFFER_TOO_SMALL;
+      consumed = -1;
+    }
+    if (consumed < 0) {
+      _client->_metrics.recordError(error);
+      _rxLength = 0;
+      _trace.reset();
+      return -1;
+    }
+    if (consumed == 0) {
+      break;
+    }
+
+    _trace.stamp(TraceStage::INBOUND_DECODED);
+    _dispatch(response);
+    if (response.fixed_header.control_type == PUBLISH) {
+      _trace.stamp(TraceStage::CALLBACK_DONE);
+      _client->_tracer.recordInbound(_trace);
+    }
+
+    _rxLength -= consumed;
+    memmove(_rxBuffer, &_rxBuffer[consumed], _rxLength);
+    _trace.reset();
+    if (_rxLength > 0) {
+      _trace.stamp(TraceStage::INBOUND_FIRST_BYTE);
+    }
+    ++handled;
+  }
+  return handled;
+}
+
+int32_t Receiver::decode(const uint8_t *buf, size_t length,
+                         mqtt_response &response, MQTTErrors &error) {
+  if (length < 2) {
+    return 0;
+  }
+
+  uint32_t remainingLength = 0;
+  int lengthBytes
+      = MQTTUtility::decodeRemainingLength(&buf[1], length - 1,
+                                           remainingLength);
+  if (lengthBytes < 0) {
+    error = MQTTErrors::MALFORMED_REMAINING_LENGTH;
+    return -1;
+  }
+  if (lengthBytes == 0) {
+    return 0;
+  }
+
+  size_t pos = 1 + lengthBytes;
+  size_t total = pos + remainingLength;
+  if (total > RX_BUFFER_MAX_SIZE_BYTE) {
+    error = MQTTErrors::RECV_BUFFER_TOO_SMALL;
+    return -1;
+  }
+  if (total > length) {
+    return 0;
+  }
+
+  uint8_t flags = buf[0] & 0x0F;
+  response.fixed_header.control_type
+      = static_cast<ControlPacketType>(buf[0] >> 4);
+  response.fixed_header.control_flags = flags;
+  response.fixed_header.remaining_length = remainingLength;
+
+  switch (response.fixed_header.control_type) {
+    case CONNACK:
+      if (remainingLength != 2 || flags != HeaderFlag.CONNACK_RESERVED) {
+        error = MQTTErrors::MALFORMED_RESPONSE;
+        return -1;
+      }
+      if (buf[pos] & 0xFE) {
+        error = MQTTErrors::CONNACK_FORBIDDEN_FLAGS;
+        return -1;
+      }
+      if (buf[pos + 1] > 5) {
+        error = MQTTErrors::CONNACK_FORBIDDEN_CODE;
+        return -1;
+      }
+      response.decoded.connack.session_present_flag = buf[pos] & 0x01;
+      response.decoded.connack.return_code
+          = static_cast<ConnackReturnCode>(buf[pos + 1]);
+      break;
+
+    case PUBLISH: {
+      mqtt_response_publish &publish = response.decoded.publish;
+      publish.dup_flag = (flags & HeaderFlag.PUBLISH_DUP) >> 3;
+      publish.qos_level = (flags & HeaderFlag.PUBLISH_QOSRESERVED) >> 1;
+      publish.retain_flag = flags & HeaderFlag.PUBLISH_RETAIN;
+      if (publish.qos_level > 2) {
+        error = MQTTErrors::PUBLISH_FORBIDDEN_QOS;
+        return -1;
+      }
+      if (remainingLength < 2) {
+        error = MQTTErrors::MALFORMED_RESPONSE;
+        return -1;
+      }
+      publish.topic_name_size = MQTTUtility::readTwoBytes(buf, pos);
+      size_t header = 2 + publish.topic_name_size
+                      + (publish.qos_level ? 2 : 0);
+      if (header > remainingLength) {
+        error = MQTTErrors::MALFORMED_RESPONSE;
+        return -1;
+      }
+      publish.topic_name = &buf[pos];
+      pos += publish.topic_name_size;
+      publish.packet_id
+          = publish.qos_level ? MQTTUtility::readTwoBytes(buf, pos) : 0;
+      publish.application_message = &buf[pos];
+      publish.application_message_size = total - pos;
+      break;
+    }
+
+    case PUBACK:
+    case PUBREC:
+    case PUBREL:
+    case PUBCOMP:
+    case UNSUBACK: {
+      uint8_t expectedFlags = response.fixed_header.control_type == PUBREL
+                                  ? HeaderFlag.PUBREL_RESERVED
+                                  : 0;
+      if (remainingLength != 2 || flags != expectedFlags) {
+        error = MQTTErrors::MALFORMED_RESPONSE;
+        return -1;
+      }
+      // Every one of these responses is just the packet id
+      response.decoded.puback.packet_id = MQTTUtility::readTwoBytes(buf, pos);
+      break;
+    }
+
+    case SUBACK:
+      if (remainingLength < 3 || flags != HeaderFlag.SUBACK_RESERVED) {
+        error = MQTTErrors::MALFORMED_RESPONSE;
+        return -1;
+      }
+      response.decoded.suback.packet_id = MQTTUtility::readTwoBytes(buf, pos);
+      response.decoded.suback._return_codes = &buf[pos];
+      response.decoded.suback.num_return_codes = total - pos;
+      break;
+
+    case PINGRESP:
+      if (remainingLength != 0) {
+        error = MQTTErrors::MALFORMED_RESPONSE;
+        return -1;
+      }
+      break;
+
+    default:
+      error = MQTTErrors::RESPONSE_INVALID_CONTROL_TYPE;
+      return -1;
+  }
+
+  error = MQTTErrors::SUCCESS;
+  return static_cast<int32_t>(total);
+}
+
+void Receiver::_dispatch(const mqtt_response &response) {
+  MqttClient &client = *_client;
+  uint16_t packetId = response.decoded.puback.packet_id;
+  bool known = false;
+
+  switch (response.fixed_header.control_type) {
+    case CONNACK: {
+      bool sessionPresent = response.decoded.connack.session_present_flag;
+      ConnackReturnCode code = response.decoded.connack.return_code;
+      // Before a refusal closes the connection
+      client._tx->_onConnack(code
+                             == ConnackReturnCode::MQTT_CONNACK_ACCEPTED);
+      for (auto &cb : client._onConnectInternalCallbacks) {
+        cb(sessionPresent, code);
+      }
+      if (code == ConnackReturnCode::MQTT_CONNACK_ACCEPTED) {
+        client._tx->_onSessionPresent(sessionPresent);
+        for (auto &cb : client._onConnectUserCallbacks) {
+          cb(sessionPresent);
+        }
+      }
+      break;
+    }
+
+    case PUBLISH: {
+      const mqtt_response_publish &publish = response.decoded.publish;
+      if (publish.qos_level == 2
+          && !client._tx->_receivedQos2(publish.packet_id)) {
+        // Delivered before a reset or a lost PUBREC; only ack it again
+        client._tx->sendAck(publish.packet_id, PacketType.PUBREC);
+        break;
+      }
+      std::string topic(static_cast<const char *>(publish.topic_name),
+                        publish.topic_name_size);
+      std::string payload(
+          static_cast<const char *>(publish.application_message),
+          publish.application_message_size);
+      size_t length = publish.application_message_size;
+
+      for (auto &cb : client._onMessageInternalCallbacks) {
+        cb(topic, payload, publish.qos_level, publish.dup_flag,
+           publish.retain_flag, length, 0, length, publish.packet_id);
+      }
+      MessageProperties properties{static_cast<bool>(publish.dup_flag),
+                                   publish.qos_level,
+                                   static_cast<bool>(publish.retain_flag)};
+      if (client._dispatcher) {
+        // Acked once queued; the handler runs on the dispatch task
+        InboundMessage message{std::move(topic), std::move(payload),
+                               properties};
+        client._dispatcher->post(message);
+      } else {
+        client._deliverMessage(topic, payload, properties);
+      }
+
+      if (publish.qos_level == 1) {
+        client._tx->sendAck(publish.packet_id, PacketType.PUBACK);
+      } else if (publish.qos_level == 2) {
+        client._tx->sendAck(publish.packet_id, PacketType.PUBREC);
+      }
+      break;
+    }
+
+    case PUBACK:
+      // Only an ack that matches a packet in flight completes it
+      known = client._tx->_handleAck(packetId, PacketType.PUBACK);
+      if (known) {
+        client._completions.complete(packetId, MQTTErrors::SUCCESS);
+      }
+      for (auto &cb : client._onPubAckInternalCallbacks) {
+        cb(packetId);
+      }
+      // A retransmission can draw a second ack; report the first only
+      if (known) {
+        for (auto &cb : client._onPublishUserCallbacks) {
+          cb(packetId);
+        }
+      }
+      break;
+
+    case PUBREC:
+      client._tx->_handleAck(packetId, PacketType.PUBREC);
+      for (auto &cb : client._onPubRecInternalCallbacks) {
+        cb(packetId);
+      }
+      break;
+
+    case PUBREL:
+      client._tx->_releasedQos2(packetId);
+      client._tx->sendAck(packetId, PacketType.PUBCOMP);
+      for (auto &cb : client._onPubRelInternalCallbacks) {
+        cb(packetId);
+      }
+      break;
+
+    case PUBCOMP:
+      known = client._tx->_handleAck(packetId, PacketType.PUBCOMP);
+      if (known) {
+        client._completions.complete(packetId, MQTTErrors::SUCCESS);
+      }
+      for (auto &cb : client._onPubCompInternalCallbacks) {
+        cb(packetId);
+      }
+      // A retransmission can draw a second ack; report the first only
+      if (known) {
+        for (auto &cb : client._onPublishUserCallbacks) {
+          cb(packetId);
+        }
+      }
+      break;
+
+    case SUBACK: {
+      const mqtt_response_suback &suback = response.decoded.suback;
+      SubscribeReturncode code
+          = static_cast<SubscribeReturncode>(suback._return_codes[0]);
+      if (client._tx->_handleAck(suback.packet_id, PacketType.SUBACK)) {
+        client._completions.complete(
+            suback.packet_id,
+            code == SubscribeReturncode::FAIL ? MQTTErrors::SUBSCRIBE_FAILED
+                                              : MQTTErrors::SUCCESS,
+            suback._return_codes[0]);
+      }
+      for (auto &cb : client._onSubAckInternalCallbacks) {
+        cb(suback.packet_id, MQTTUtility::subscribeReturncodeToString(code));
+      }
+      for (auto &cb : client._onSubscribeUserCallbacks) {
+        cb(suback.packet_id, suback._return_codes[0]);
+      }
+      break;
+    }
+
+    case UNSUBACK:
+      if (client._tx->_handleAck(packetId, PacketType.UNSUBACK)) {
+        client._completions.complete(packetId, MQTTErrors::SUCCESS);
+      }
+      for (auto &cb : client._onUnsubAckInternalCallbacks) {
+        cb(packetId);
+      }
+      for (auto &cb : client._onUnsubscribeUserCallbacks) {
+        cb(packetId, 0);
+      }
+      break;
+
+    case PINGRESP:
+      for (auto &cb : client._onPingRespInternalCallbacks) {
+        cb();
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+} // namespace MQTTTransport
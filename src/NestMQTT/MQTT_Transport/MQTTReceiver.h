@@ -1,17 +1,47 @@
 #ifndef MQTT_RECEIVER_H_
 #define MQTT_RECEIVER_H_
+#include "MQTTConstants.h"
+#include "MQTTCore.h"
+#include "MQTTError.h"
+#include "MQTTTrace.h"
+#include "MQTTTransport.h"
 #include <stdint.h>
+
+// Forward declaration of MqttClient
+class MqttClient;
+
 namespace MQTTTransport {
 
 class Receiver {
 
 public:
   // Constructor
-  Receiver() {}
+  explicit Receiver(MqttClient *client);
 
   // Destructor
   ~Receiver() {}
+
+  // Drains the transport and dispatches every complete packet. Returns the
+  // number of packets handled, or -1 on a transport or protocol error.
+  int _receivePacket();
+
+  // Decodes one packet at the start of buf. Returns the bytes consumed, 0
+  // if the packet is not complete yet, or -1 (with error set) if it is
+  // malformed. Pointers in the response refer into buf.
+  static int32_t decode(const uint8_t *buf, size_t length,
+                        MQTTCore::mqtt_response &response,
+                        MQTTCore::MQTTErrors &error);
+
+private:
+  int _processBuffer();
+  void _dispatch(const MQTTCore::mqtt_response &response);
+
+  MqttClient *_client;
+  Transport *_transport;
+  uint8_t _rxBuffer[MQTTCore::RX_BUFFER_MAX_SIZE_BYTE];
+  size_t _rxLength;
+  MQTTCore::MessageTrace _trace;
 };
 
 } // namespace MQTTTransport
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,312 @@
+#include "MQTTSession.h"
+#include "MQTTUtility.h"
+#include <stdio.h>
+
+namespace MQTTTransport {
+
+namespace {
+
+// Little-endian throughout. A journal starts with its magic, generation
+// and the packet id generator state, plus a CRC over them; a record is
+//   type:1 reserved:1 packet_id:2 length:4 body crc32:4
+// with the CRC over header and body. The body of a SENT record is the
+// generator state followed by the encoded PUBLISH.
+constexpr uint32_t JOURNAL_MAGIC = 0x5353514E; // "NQSS"
+constexpr size_t JOURNAL_HEADER = 16;
+constexpr size_t RECORD_HEADER = 8;
+constexpr size_t RECORD_TRAILER = 4;
+constexpr size_t PATH_LENGTH = 64;
+
+enum RecordType : uint8_t {
+  SENT = 1,
+  RELEASED,
+  COMPLETED,
+  RECEIVED,
+  RELEASED_INBOUND,
+  FORGOT_INBOUND,
+  REWRITTEN, // follows the live state written by a rewrite
+};
+
+std::vector<SessionStore::Outbound>::iterator
+find(std::vector<SessionStore::Outbound> &outbound, uint16_t packetId) {
+  auto it = outbound.begin();
+  while (it != outbound.end() && it->packetId != packetId) {
+    ++it;
+  }
+  return it;
+}
+
+} // namespace
+
+SessionStore::SessionStore(
+    const MQTTClientDetails::SessionSettings &settings, InboundIds &inbound)
+    : _prefix(settings.path ? settings.path : "/session"),
+      _journalBytes(settings.journal_bytes ? settings.journal_bytes
+                                           : MQTT_SESSION_JOURNAL_BYTES),
+      _slot(NO_SLOT), _generation(0), _size(0), _rewriteSize(0),
+      _rewriting(false), _pidState(0), _inbound(inbound), _stats{} {}
+
+bool SessionStore::open() {
+  if (!MQTTPlatform::mountFilesystem(true)) {
+    return false;
+  }
+  uint32_t generations[2] = {_readGeneration(0), _readGeneration(1)};
+  uint8_t newest = generations[1] > generations[0] ? 1 : 0;
+  uint8_t older = 1 - newest;
+  _generation = generations[newest];
+  // A rewrite cut short leaves the newer file incomplete, and the older
+  // one still holds the state
+  if (generations[newest] && _load(newest)) {
+    _slot = newest;
+  } else if (generations[older] && _load(older)) {
+    _slot = older;
+  } else {
+    _inbound.clear();
+  }
+  _stats.restored = static_cast<uint32_t>(_restored.size());
+
+  if (beginRewrite(_pidState)) {
+    for (const Outbound &message : _restored) {
+      if (message.released) {
+        released(message.packetId);
+      } else {
+        sent(message.packetId, message.packet.data(), message.packet.size(),
+             _pidState);
+      }
+    }
+    endRewrite();
+  }
+  return true;
+}
+
+void SessionStore::clear() {
+  _writer.close();
+  for (uint8_t slot = 0; slot < 2; ++slot) {
+    char path[PATH_LENGTH];
+    _path(slot, path, sizeof(path));
+    MQTTPlatform::removeFile(path);
+  }
+  dropRestored();
+  _slot = NO_SLOT;
+  _size = 0;
+  _rewriteSize = 0;
+}
+
+void SessionStore::sent(uint16_t packetId, const uint8_t *packet,
+                        size_t size, uint16_t pidState) {
+  uint8_t state[2];
+  MQTTUtility::putLE16(state, pidState);
+  _append(SENT, packetId, state, sizeof(state), packet, size);
+}
+
+void SessionStore::released(uint16_t packetId) {
+  _append(RELEASED, packetId, nullptr, 0, nullptr, 0);
+}
+
+void SessionStore::completed(uint16_t packetId) {
+  _append(COMPLETED, packetId, nullptr, 0, nullptr, 0);
+}
+
+void SessionStore::received(uint16_t packetId) {
+  _append(RECEIVED, packetId, nullptr, 0, nullptr, 0);
+}
+
+void SessionStore::releasedInbound(uint16_t packetId) {
+  _append(RELEASED_INBOUND, packetId, nullptr, 0, nullptr, 0);
+}
+
+void SessionStore::forgetInbound() {
+  _append(FORGOT_INBOUND, 0, nullptr, 0, nullptr, 0);
+}
+
+bool SessionStore::rewriteDue() const {
+  // A failed write closes the journal; a rewrite starts a fresh one
+  return !_writer || _size - _rewriteSize >= _journalBytes;
+}
+
+bool SessionStore::beginRewrite(uint16_t pidState) {
+  _writer.close();
+  _rewriting = false;
+  uint8_t target = _slot == 0 ? 1 : 0;
+  char path[PATH_LENGTH];
+  _path(target, path, sizeof(path));
+  uint8_t header[JOURNAL_HEADER] = {};
+  MQTTUtility::putLE32(header, JOURNAL_MAGIC);
+  MQTTUtility::putLE32(header + 4, ++_generation);
+  MQTTUtility::putLE16(header + 8, pidState);
+  MQTTUtility::putLE32(header + 12, MQTTUtility::crc32(header, 12));
+  if (!_writer.open(path, "w")
+      || _writer.write(header, sizeof(header)) != sizeof(header)
+      || !_writer.sync()) {
+    _writer.close();
+    return false;
+  }
+  _size = JOURNAL_HEADER;
+  _rewriting = true;
+  return true;
+}
+
+void SessionStore::endRewrite() {
+  _inbound.forEach([this](uint16_t packetId) {
+    _append(RECEIVED, packetId, nullptr, 0, nullptr, 0);
+  });
+  _rewriting = false;
+  if (!_append(REWRITTEN, 0, nullptr, 0, nullptr, 0)) {
+    return; // the previous journal stays the valid one
+  }
+  uint8_t target = _slot == 0 ? 1 : 0;
+  char path[PATH_LENGTH];
+  _path(1 - target, path, sizeof(path));
+  MQTTPlatform::removeFile(path);
+  _slot = target;
+  _rewriteSize = _size;
+  ++_stats.rewrites;
+}
+
+void SessionStore::_path(uint8_t slot, char *out, size_t size) const {
+  snprintf(out, size, "%s.%u", _prefix, static_cast<unsigned>(slot));
+}
+
+uint32_t SessionStore::_readGeneration(uint8_t slot) const {
+  char path[PATH_LENGTH];
+  _path(slot, path, sizeof(path));
+  MQTTPlatform::File file;
+  uint8_t header[JOURNAL_HEADER];
+  if (!MQTTPlatform::fileExists(path) || !file.open(path, "r")
+      || file.read(header, sizeof(header)) != sizeof(header)
+      || MQTTUtility::getLE32(header) != JOURNAL_MAGIC
+      || MQTTUtility::crc32(header, 12) != MQTTUtility::getLE32(header + 12)) {
+    return 0;
+  }
+  return MQTTUtility::getLE32(header + 4);
+}
+
+bool SessionStore::_load(uint8_t slot) {
+  char path[PATH_LENGTH];
+  _path(slot, path, sizeof(path));
+  MQTTPlatform::File file;
+  uint8_t header[JOURNAL_HEADER];
+  if (!file.open(path, "r")
+      || file.read(header, sizeof(header)) != sizeof(header)) {
+    return false;
+  }
+  std::vector<Outbound> outbound;
+  _inbound.clear();
+  uint16_t pidState = MQTTUtility::getLE16(header + 8);
+  bool complete = false;
+
+  // One pass in file order; later records override earlier ones
+  size_t size = file.size();
+  size_t offset = JOURNAL_HEADER;
+  std::vector<uint8_t> body;
+  while (offset + RECORD_HEADER + RECORD_TRAILER <= size) {
+    uint8_t record[RECORD_HEADER];
+    uint8_t trailer[RECORD_TRAILER];
+    if (file.read(record, sizeof(record)) != sizeof(record)) {
+      break;
+    }
+    size_t length = MQTTUtility::getLE32(record + 4);
+    if (length > size - offset - RECORD_HEADER - RECORD_TRAILER
+        || (record[0] == SENT && length < 2)) {
+      break;
+    }
+    body.resize(length);
+    if ((length > 0 && file.read(body.data(), length) != length)
+        || file.read(trailer, sizeof(trailer)) != sizeof(trailer)) {
+      break;
+    }
+    uint32_t crc = MQTTUtility::crc32(record, sizeof(record));
+    if (MQTTUtility::crc32(body.data(), length, crc)
+        != MQTTUtility::getLE32(trailer)) {
+      break;
+    }
+    offset += RECORD_HEADER + length + RECORD_TRAILER;
+
+    uint16_t packetId = MQTTUtility::getLE16(record + 2);
+    auto it = find(outbound, packetId);
+    switch (record[0]) {
+      case SENT:
+        pidState = MQTTUtility::getLE16(body.data());
+        if (it != outbound.end()) {
+          outbound.erase(it);
+        }
+        outbound.push_back(Outbound{
+            packetId, false,
+            std::vector<uint8_t>(body.begin() + 2, body.end())});
+        break;
+      case RELEASED:
+        if (it == outbound.end()) {
+          outbound.push_back(Outbound{packetId, true, {}});
+        } else {
+          it->released = true;
+          std::vector<uint8_t>().swap(it->packet);
+        }
+        break;
+      case COMPLETED:
+        if (it != outbound.end()) {
+          outbound.erase(it);
+        }
+        break;
+      case RECEIVED:
+        _inbound.insert(packetId);
+        break;
+      case RELEASED_INBOUND:
+        _inbound.erase(packetId);
+        break;
+      case FORGOT_INBOUND:
+        _inbound.clear();
+        break;
+      case REWRITTEN:
+        complete = true;
+        break;
+      default:
+        break;
+    }
+  }
+  if (offset < size) {
+    ++_stats.corrupt; // torn by a reset mid-append
+  }
+  if (!complete) {
+    return false;
+  }
+  _restored.swap(outbound);
+  _pidState = pidState;
+  return true;
+}
+
+bool SessionStore::_append(uint8_t type, uint16_t packetId,
+                           const uint8_t *prefix, size_t prefixLength,
+                           const uint8_t *body, size_t length) {
+  if (!_writer) {
+    return false;
+  }
+  uint8_t header[RECORD_HEADER];
+  header[0] = type;
+  header[1] = 0;
+  MQTTUtility::putLE16(header + 2, packetId);
+  MQTTUtility::putLE32(header + 4,
+                       static_cast<uint32_t>(prefixLength + length));
+  uint32_t crc = MQTTUtility::crc32(header, sizeof(header));
+  crc = MQTTUtility::crc32(prefix, prefixLength, crc);
+  crc = MQTTUtility::crc32(body, length, crc);
+  uint8_t trailer[RECORD_TRAILER];
+  MQTTUtility::putLE32(trailer, crc);
+
+  bool written
+      = _writer.write(header, sizeof(header)) == sizeof(header)
+        && (prefixLength == 0
+            || _writer.write(prefix, prefixLength) == prefixLength)
+        && (length == 0 || _writer.write(body, length) == length)
+        && _writer.write(trailer, sizeof(trailer)) == sizeof(trailer)
+        && (_rewriting ? _writer.flush() : _writer.sync());
+  if (!written) {
+    // A partial record fails its CRC, so the journal ends before it
+    _writer.close();
+    return false;
+  }
+  _size += sizeof(header) + prefixLength + length + sizeof(trailer);
+  ++_stats.records;
+  return true;
+}
+
+} // namespace MQTTTransport
@@ -0,0 +1,108 @@
+#ifndef MQTT_SESSION_H_
+#define MQTT_SESSION_H_
+
+#include "MQTTClientConfig.h"
+#include "MQTTInboundIds.h"
+#include "MQTTPlatform.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace MQTTTransport {
+
+// QoS 1 and 2 session state on the data partition, kept as a journal in
+// "<path>.0" or "<path>.1". Each change is one record appended to it: a
+// publish as its first byte goes out, the PUBREC that leaves only its
+// PUBREL, the final ack, and inbound QoS 2 ids from PUBREC to PUBREL.
+// Records carry a CRC32, so one torn by a reset ends the journal there,
+// and each is synced to flash before the call that wrote it returns.
+//
+// Acks only ever add records. Once the journal has grown journal_bytes
+// past its last rewrite the owner writes the live state to the other file
+// between beginRewrite() and endRewrite(); the old file goes only when the
+// new one is complete, and open() picks the newest complete file. open()
+// also rewrites what it recovered, so nothing is appended after a torn
+// tail.
+class SessionStore {
+public:
+  // An outbound message still unacked, in the order first sent.
+  struct Outbound {
+    uint16_t packetId;
+    bool released;               // PUBREC came back, the PUBREL is next
+    std::vector<uint8_t> packet; // the encoded PUBLISH until then
+  };
+
+  struct Stats {
+    uint32_t restored; // outbound messages recovered by open()
+    uint32_t records;
+    uint32_t rewrites;
+    uint32_t corrupt; // journals cut short by a record failing its CRC
+  };
+
+  // inbound belongs to the caller; open() fills it from the journal and
+  // a rewrite saves what it holds.
+  SessionStore(const MQTTClientDetails::SessionSettings &settings,
+               InboundIds &inbound);
+  SessionStore(const SessionStore &) = delete;
+  SessionStore &operator=(const SessionStore &) = delete;
+
+  // Recovers the journal an earlier run left; false without a filesystem.
+  bool open();
+  // Deletes the journal, for a client that connects with clean session.
+  void clear();
+
+  // Outbound messages open() recovered; the owner queues them again and
+  // then drops them.
+  std::vector<Outbound> &restored() { return _restored; }
+  void dropRestored() { std::vector<Outbound>().swap(_restored); }
+  // Packet id generator state when the last run stopped.
+  uint16_t pidState() const { return _pidState; }
+
+  void sent(uint16_t packetId, const uint8_t *packet, size_t size,
+            uint16_t pidState);
+  void released(uint16_t packetId);
+  void completed(uint16_t packetId);
+  // Inbound QoS 2 ids added to and taken from the caller's set.
+  void received(uint16_t packetId);
+  void releasedInbound(uint16_t packetId);
+  // The caller cleared its set.
+  void forgetInbound();
+
+  bool rewriteDue() const;
+  // The owner passes its live outbound state to sent() and released() in
+  // between.
+  bool beginRewrite(uint16_t pidState);
+  void endRewrite();
+
+  Stats stats() const { return _stats; }
+
+private:
+  static constexpr uint8_t NO_SLOT = 0xFF;
+
+  void _path(uint8_t slot, char *out, size_t size) const;
+  // Generation of a journal file, 0 when it has no valid header.
+  uint32_t _readGeneration(uint8_t slot) const;
+  // Applies a journal's records; false unless it holds a whole rewrite.
+  bool _load(uint8_t slot);
+  bool _append(uint8_t type, uint16_t packetId, const uint8_t *prefix,
+               size_t prefixLength, const uint8_t *body, size_t length);
+
+  const char *_prefix;
+  size_t _journalBytes;
+  MQTTPlatform::File _writer;
+  uint8_t _slot; // the last complete journal, NO_SLOT before the first
+  uint32_t _generation;
+  size_t _size;
+  size_t _rewriteSize; // _size when the last rewrite ended
+  // Between beginRewrite() and endRewrite(); until its last record the
+  // new journal counts for nothing, so one sync at the end covers it
+  bool _rewriting;
+  uint16_t _pidState;
+  InboundIds &_inbound;
+  std::vector<Outbound> _restored;
+  Stats _stats;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_SESSION_H_
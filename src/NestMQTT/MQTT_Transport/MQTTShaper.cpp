@@ -0,0 +1,137 @@
+#include "MQTTShaper.h"
+#include <string.h>
+
+namespace MQTTTransport {
+
+namespace {
+constexpr uint64_t MICRO = 1000000;
+} // namespace
+
+Shaper::Shaper() : _rules{}, _ruleCount(0), _holdLimit(0) {}
+
+void Shaper::configure(const MQTTClientDetails::ShapeSettings &settings,
+                       uint32_t nowUs) {
+  _ruleCount = settings.rules ? settings.rule_count : 0;
+  if (_ruleCount > RULES) {
+    _ruleCount = RULES;
+  }
+  _holdLimit = settings.hold_limit ? settings.hold_limit
+                                   : MQTT_SHAPE_HOLD_LIMIT;
+  for (size_t i = 0; i < _ruleCount; ++i) {
+    const MQTTClientDetails::ShapeRule &config = settings.rules[i];
+    Rule &rule = _rules[i];
+    rule.prefix = config.prefix;
+    rule.prefixLength = config.prefix ? strlen(config.prefix) : 0;
+    rule.txClass = config.tx_class;
+    rule.policy = config.policy;
+    _setup(rule.messages, config.messages_per_sec, config.burst_messages);
+    _setup(rule.bytes, config.bytes_per_sec, config.burst_bytes);
+    rule.refilledUs = nowUs;
+    rule.stats = Stats{};
+  }
+}
+
+uint8_t Shaper::match(const char *topic, uint8_t txClass) const {
+  for (size_t i = 0; i < _ruleCount; ++i) {
+    const Rule &rule = _rules[i];
+    if (rule.prefix ? strncmp(topic, rule.prefix, rule.prefixLength) == 0
+                    : rule.txClass == txClass) {
+      return static_cast<uint8_t>(i);
+    }
+  }
+  return NO_RULE;
+}
+
+MQTTClientDetails::ShapePolicy Shaper::policy(uint8_t rule) const {
+  return _rules[rule].policy;
+}
+
+bool Shaper::take(uint8_t index, size_t size, uint32_t nowUs) {
+  Rule &rule = _rules[index];
+  _refill(rule, nowUs);
+  uint64_t messages = _need(rule.messages, 1);
+  uint64_t bytes = _need(rule.bytes, size);
+  if (rule.messages.level < messages || rule.bytes.level < bytes) {
+    return false;
+  }
+  rule.messages.level -= messages;
+  rule.bytes.level -= bytes;
+  return true;
+}
+
+uint32_t Shaper::usUntil(uint8_t index, size_t size, uint32_t nowUs) {
+  Rule &rule = _rules[index];
+  _refill(rule, nowUs);
+  uint32_t messages = _wait(rule.messages, 1);
+  uint32_t bytes = _wait(rule.bytes, size);
+  return messages > bytes ? messages : bytes;
+}
+
+void Shaper::count(uint8_t rule, Outcome outcome) {
+  Stats &stats = _rules[rule].stats;
+  switch (outcome) {
+    case PASSED:
+      ++stats.passed;
+      break;
+    case DELAYED:
+      ++stats.delayed;
+      break;
+    case CONFLATED:
+      ++stats.conflated;
+      break;
+    case DROPPED:
+      ++stats.dropped;
+      break;
+  }
+}
+
+Shaper::Stats Shaper::stats(uint8_t rule) const {
+  return rule < _ruleCount ? _rules[rule].stats : Stats{};
+}
+
+void Shaper::_setup(Bucket &bucket, uint32_t rate, uint32_t burst) {
+  bucket.rate = rate;
+  bucket.capacity = static_cast<uint64_t>(burst ? burst : rate) * MICRO;
+  bucket.level = bucket.capacity;
+}
+
+uint64_t Shaper::_need(const Bucket &bucket, size_t tokens) {
+  if (bucket.rate == 0) {
+    return 0;
+  }
+  uint64_t need = static_cast<uint64_t>(tokens) * MICRO;
+  return need < bucket.capacity ? need : bucket.capacity;
+}
+
+uint32_t Shaper::_wait(const Bucket &bucket, size_t tokens) {
+  uint64_t need = _need(bucket, tokens);
+  if (bucket.level >= need) {
+    return 0;
+  }
+  // Rate is in tokens per second and level in millionths, so the missing
+  // millionths divided by the rate come out in microseconds
+  uint64_t us = (need - bucket.level + bucket.rate - 1) / bucket.rate;
+  return us < UINT32_MAX ? static_cast<uint32_t>(us) : UINT32_MAX;
+}
+
+void Shaper::_refill(Rule &rule, uint32_t nowUs) {
+  uint32_t elapsed = nowUs - rule.refilledUs;
+  rule.refilledUs = nowUs;
+  _fill(rule.messages, elapsed);
+  _fill(rule.bytes, elapsed);
+}
+
+void Shaper::_fill(Bucket &bucket, uint32_t elapsedUs) {
+  if (bucket.rate == 0) {
+    return;
+  }
+  // Tokens per second times microseconds gives millionths
+  uint64_t room = bucket.capacity - bucket.level;
+  if (elapsedUs > room / bucket.rate) {
+    bucket.level = bucket.capacity;
+  } else {
+    bucket.level += static_cast<uint64_t>(bucket.rate) * elapsedUs;
+  }
+}
+
+} // namespace MQTTTransport
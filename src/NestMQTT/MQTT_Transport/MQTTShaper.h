@@ -0,0 +1,86 @@
+#ifndef MQTT_SHAPER_H_
+#define MQTT_SHAPER_H_
+
+#include "MQTTClientConfig.h"
+#include "MQTTConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MQTTTransport {
+
+// Token buckets in front of the transmit queues. A rule matches a topic
+// prefix or a transmit class and owns two buckets, one counting messages
+// and one counting bytes; a publish passes while both hold enough tokens.
+// Buckets refill continuously from the elapsed microseconds and keep
+// tokens in millionths, so low rates lose nothing to rounding. A decision
+// is a handful of integer operations, and matching walks the fixed rule
+// table with first match winning.
+//
+// The shaper only decides and counts; the transmitter holds the messages
+// that have to wait.
+class Shaper {
+public:
+  enum Outcome : uint8_t { PASSED, DELAYED, CONFLATED, DROPPED };
+
+  struct Stats {
+    uint32_t passed;    // sent without waiting
+    uint32_t delayed;   // held until the buckets refilled
+    uint32_t conflated; // replaced by a newer message on the same topic
+    uint32_t dropped;
+  };
+
+  static constexpr uint8_t NO_RULE = 0xFF;
+  static constexpr size_t RULES = MQTT_SHAPE_RULES;
+
+  Shaper();
+
+  // Starts every bucket full.
+  void configure(const MQTTClientDetails::ShapeSettings &settings,
+                 uint32_t nowUs);
+
+  // First rule for the topic, NO_RULE when none applies.
+  uint8_t match(const char *topic, uint8_t txClass) const;
+  MQTTClientDetails::ShapePolicy policy(uint8_t rule) const;
+  size_t holdLimit() const { return _holdLimit; }
+
+  // Takes one message of size bytes when both buckets have room for it.
+  // A message larger than the byte burst waits for a full bucket.
+  bool take(uint8_t rule, size_t size, uint32_t nowUs);
+  // Microseconds until take() would succeed.
+  uint32_t usUntil(uint8_t rule, size_t size, uint32_t nowUs);
+
+  void count(uint8_t rule, Outcome outcome);
+  Stats stats(uint8_t rule) const;
+
+private:
+  struct Bucket {
+    uint32_t rate; // tokens per second, 0 for no limit
+    uint64_t capacity;
+    uint64_t level; // in millionths of a token
+  };
+
+  struct Rule {
+    const char *prefix;
+    size_t prefixLength;
+    uint8_t txClass;
+    MQTTClientDetails::ShapePolicy policy;
+    Bucket messages;
+    Bucket bytes;
+    uint32_t refilledUs;
+    Stats stats;
+  };
+
+  static void _setup(Bucket &bucket, uint32_t rate, uint32_t burst);
+  static uint64_t _need(const Bucket &bucket, size_t tokens);
+  static uint32_t _wait(const Bucket &bucket, size_t tokens);
+  static void _fill(Bucket &bucket, uint32_t elapsedUs);
+  void _refill(Rule &rule, uint32_t nowUs);
+
+  Rule _rules[RULES];
+  size_t _ruleCount;
+  size_t _holdLimit;
+};
+
+} // namespace MQTTTransport
+
+#endif // MQTT_SHAPER_H_
@@ -1,5 +1,5 @@
 #include "MQTTTransmitRegistry.h"
-#include "Arduino.h"
+#include "MQTTPlatform.h"
 
 namespace MQTTTransport {
 
@@ -38,22 +38,13 @@ void testPacketIDGeneration() {
   MQTTTransport::transmit_registry registry;
   registry.pid_lfsr = 0; // Ensure initial state
 
-  // Initialize Serial communication
-  Serial.begin(9600);
-  while (!Serial)
-    continue;
-
   // Test generating packet IDs
   for (int i = 0; i < 10; ++i) {
     // Retrieve last generated packet ID
     uint16_t lastPacketID = MQTTTransport::__transmit_next_pid(&registry);
 
-    // Output result
-    Serial.print("Packet ID added: ");
-    Serial.println(lastPacketID);
-
-    // Debug: Print pid_lfsr value
-    Serial.print("pid_lfsr value after generation: ");
-    Serial.println(registry.pid_lfsr);
+    MQTTPlatform::log(MQTTPlatform::LogLevel::INFO,
+                      "Packet ID added: %u, pid_lfsr: %u", lastPacketID,
+                      registry.pid_lfsr);
   }
 }
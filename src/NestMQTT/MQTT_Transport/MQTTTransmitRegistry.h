@@ -3,6 +3,8 @@
 
 #include "MQTTBuffer.h"
 #include "MQTTCore.h"
+#include "MQTTMemory.h"
+#include <functional>
 #include <set>
 #include <stdint.h>
 
@@ -27,7 +29,9 @@ struct QueuedPacket {
 struct transmit_registry {
   Buffer<QueuedPacket> packet_queue;
   uint16_t pid_lfsr;
-  std::set<uint16_t> used_packet_ids;
+  std::set<uint16_t, std::less<uint16_t>,
+           MQTTCore::PolicyAllocator<uint16_t, MQTTCore::MEMORY_METADATA>>
+      used_packet_ids;
 };
 
 uint16_t __transmit_next_pid(transmit_registry *treg);
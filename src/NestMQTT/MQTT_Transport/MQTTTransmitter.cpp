@@ -1,31 +1,53 @@
 #include "MQTTTransmitter.h"
 #include "MQTTAsyncTask.h"
 #include "MQTTPacket.h"
-#include "MqttClient.h"
+#include "MQTTClient.h"
+#include "MQTTMemory.h"
 
 namespace MQTTTransport {
 
-template <typename... Args>
-Transmitter::Transmitter(MqttClient *client, Args &&...args)
-    : _client(client), _transport(client->_transport),
-      _clientCfg(client->_clientcfg), _transmitTime(0), _transmitStatus{} {
+Transmitter::Transmitter(MqttClient *client)
+    : _client(client), _clientCfg(client->_clientcfg), _transmitTime(0),
+      _packetID(0), _metrics(&client->_metrics),
+      _transport(client->_transport), _depth{}, _inFlightCount(0),
+      _heldCount(0), _conflatedCount(0), _conflations(0),
+      _lastQueued(nullptr), _expired(0), _replayQueued(0),
+      _pipelining(false), _pipeline{}, _deficit{},
+      _active(NO_CLASS), _roundRobin(TX_CLASS_ALARM), _granted(false),
+      _transmitStatus{}, _pingSentUs(0) {
+  _registry.pid_lfsr = 0;
+  _shaper.configure(_clientCfg.shape_settings, MQTTPlatform::micros());
+  _pressure.configure(_clientCfg.pressure_settings);
+  if (_clientCfg.offline_store.enabled) {
+    _store.reset(new (std::nothrow) OfflineStore(_clientCfg.offline_store));
+    if (_store && !_store->open()) {
+      MQTTPlatform::log(MQTTPlatform::LogLevel::WARNING,
+                        "Offline store unavailable");
+      _store.reset();
+    }
+  }
+  if (_clientCfg.session_settings.enabled) {
+    _openSession();
+  }
   // Initial status update
   _transmitStatus.update(
-      TransmitStatusUpdate::withLastClientActivity(millis()));
+      TransmitStatusUpdate::withLastClientActivity(MQTTPlatform::millis()));
 }
 
 void Transmitter::updateConfig(
     const MQTTClientDetails::MqttClientCfg &newConfig) {
   _clientCfg = newConfig;
-  // You can perform any necessary actions here
+  MQTT_SEMAPHORE_TAKE();
+  _shaper.configure(_clientCfg.shape_settings, MQTTPlatform::micros());
+  _pressure.configure(_clientCfg.pressure_settings);
+  MQTT_SEMAPHORE_GIVE();
 }
 
 bool Transmitter::sendConnectionRequest() {
   bool result = false;
-  if (_client->getClientState() == StateMachine::State::disconnected) {
+  if (_client->getClientState() == StateMachine::State::connectingMqtt) {
     MQTT_SEMAPHORE_TAKE();
     if (_addPacketFront(
-
             _clientCfg.connections_settings._cleanSession,
             _clientCfg.last_will_settings._username,
             _clientCfg.last_will_settings._password,
@@ -35,11 +57,12 @@ bool Transmitter::sendConnectionRequest() {
             _clientCfg.last_will_settings._lwt_msg,
             _clientCfg.last_will_settings._lwt_msg_len,
             (uint16_t)(_clientCfg.connections_settings._keepAlive / 1000),
-            _clientCfg.set_null_client_id ? nullptr : _clientCfg.path)) {
+            _clientCfg.set_null_client_id ? nullptr : _client->getClientId())) {
       result = true;
-      _client->_statemachine.handleEvent(StateMachine::Event::CONNECTED);
-    } else {
-      MQTT_SEMAPHORE_GIVE();
+      if (_clientCfg.connections_settings.pipelined_connect) {
+        _pipelining = true;
+        ++_pipeline.connects;
+      }
     }
     MQTT_SEMAPHORE_GIVE();
   }
@@ -48,102 +71,1162 @@ bool Transmitter::sendConnectionRequest() {
 
 int Transmitter::_sendPacket() {
   MQTT_SEMAPHORE_TAKE();
-  OutboundPacket *packet = transmitBuffer.getCurrent();
-  size_t haveWritten = 0;
+  if (_active != NO_CLASS && !_queueOf(_active).getCurrent()) {
+    _active = NO_CLASS; // acked before a byte of it went out
+  }
+  if (_active == NO_CLASS) {
+    _active = _selectClass();
+  }
+  OutboundPacket *packet
+      = _active == NO_CLASS ? nullptr : _queueOf(_active).getCurrent();
+  // Catches deadlines that fell between two ticks of the wheel
+  while (packet && packet->expiry.scheduled()
+         && static_cast<int32_t>(MQTTPlatform::millis()
+                                 - packet->expiry.deadline)
+                >= 0) {
+    _expire(*packet);
+    _queueOf(_active).removeCurrent();
+    if (_active < MQTT_TX_CLASSES) {
+      --_depth[_active];
+    } else {
+      --_inFlightCount;
+    }
+    _metrics->add(Gauge::QUEUE_DEPTH, -1);
+    _active = _selectClass();
+    packet = _active == NO_CLASS ? nullptr : _queueOf(_active).getCurrent();
+  }
 
   if (packet) {
+    // Too late to replace or expire once bytes go out
+    _leaveQueue(*packet);
+    Packet &encoded = packet->packet;
+    if (_session && !packet->journaled
+        && encoded.packetType() == PacketType.PUBLISH && encoded.qos() > 0
+        && !encoded.hasPayloadCallback()) {
+      // On flash before the broker can see it. A payload callback cannot
+      // be read back, so such a message lives in RAM only.
+      _session->sent(encoded.packetId(), encoded.data(0), encoded.size(),
+                     _registry.pid_lfsr);
+      packet->journaled = true;
+      _compactSession();
+    }
+    if (packet->journaled
+        || (encoded.packetType() == PacketType.PUBLISH && encoded.qos() == 0)) {
+      // The journal has it now; QoS 0 is at most once anyway
+      _settleReplayed(*packet);
+    }
     size_t wantToWrite = packet->packet.available(_transmitStatus._bytesSent);
+    if (!packet->trace.has(TraceStage::FIRST_WRITE)) {
+      packet->trace.stamp(TraceStage::FIRST_WRITE);
+    }
     size_t haveWritten = _transport->write(
         packet->packet.data(_transmitStatus._bytesSent), wantToWrite);
-    if (haveWritten == wantToWrite) {
-      packet->transmit_time = millis();
+    _metrics->increment(Counter::BYTES_OUT, haveWritten);
+    if (haveWritten > 0) {
+      // Partial writes still advance, the rest goes out on the next call
+      packet->transmit_time = MQTTPlatform::millis();
       _transmitStatus.update(
-          TransmitStatusUpdate::withLastClientActivity(millis()));
+          TransmitStatusUpdate::withLastClientActivity(MQTTPlatform::millis()));
       _transmitStatus.update(TransmitStatusUpdate::withBytesSent(
-          _transmitStatus._bytesSent += haveWritten));
-
-      MQTT_SEMAPHORE_GIVE();
-      return haveWritten;
-    } else {
-      MQTT_SEMAPHORE_GIVE();
-      return 0;
+          _transmitStatus._bytesSent + haveWritten));
     }
+    MQTT_SEMAPHORE_GIVE();
+    return haveWritten;
   } else {
     MQTT_SEMAPHORE_GIVE();
     return 0;
   }
 }
 
-template <typename... Args> bool Transmitter::addPacket(Args &&...args) {
+template <typename... Args>
+bool Transmitter::addPacket(uint8_t txClass, Args &&...args) {
+  if (!_enqueue(_queues[txClass], std::forward<Args>(args)...)) {
+    return false;
+  }
+  ++_depth[txClass];
+  _client->_wakeup.notify();
+  return true;
+}
+
+template <typename... Args>
+Buffer<Transmitter::OutboundPacket>::Iterator
+Transmitter::_enqueue(Buffer<OutboundPacket> &queue, Args &&...args) {
   MQTTCore::MQTTErrors error(MQTTCore::MQTTErrors::SUCCESS);
 
-  OutboundPacket transmitPacket(_transmitTime, error,
-                                std::forward<Args>(args)...);
+  MessageTrace trace;
+  trace.stamp(TraceStage::PUBLISH_CALL);
+  // Built in place: a Packet owns its buffer and cannot be copied
+  auto it = queue.pushBack(_transmitTime, error, std::forward<Args>(args)...);
+  trace.stamp(TraceStage::ENCODED);
 
-  _registry.packet_queue.pushBack(
-      QueuedPacket{nullptr, 0, MQTT_QUEUED_UNSENT, 0, DISCONNECT});
+  if (!it) {
+    _metrics->recordError(MQTTCore::MQTTErrors::OUT_OF_MEMORY);
+    _pressure.sampleSoon();
+    return it; // Failed to add packet to buffer
+  }
   if (error != MQTTCore::MQTTErrors::SUCCESS) {
-    return false; // Failed to create packet
+    queue.remove(it);
+    _metrics->recordError(error);
+    return it; // Failed to create packet
   }
-  if (!transmitBuffer.pushBack(transmitPacket)) {
-    return false; // Failed to add packet to buffer
+  it->trace = trace;
+  _metrics->add(Gauge::QUEUE_DEPTH, 1);
+  _lastQueued = it.get();
+  return it;
+}
+
+template <typename Payload>
+uint16_t Transmitter::_queuePublish(const char *topic, uint8_t qos,
+                                    bool retain, Payload payload,
+                                    size_t length, uint32_t ttlMs) {
+  MQTT_SEMAPHORE_TAKE();
+  uint16_t packetId = qos > 0 ? generateUniquePacketID() : 0;
+  uint8_t txClass = _classify(topic, qos);
+  uint8_t rule = _shaper.match(topic, txClass);
+  bool queued
+      = rule == Shaper::NO_RULE
+            ? addPacket(txClass, packetId, topic, payload, length, qos, retain)
+            : _shape(rule, txClass, packetId, topic, payload, length, qos,
+                     retain);
+  if (!queued && packetId) {
+    releasePacketID(packetId);
+  }
+  if (queued && ttlMs) {
+    _expiry.schedule(_lastQueued->expiry, _lastQueued,
+                     MQTTPlatform::millis() + ttlMs);
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return queued ? (packetId ? packetId : 1) : 0;
+}
+
+template <typename... Args>
+bool Transmitter::_shape(uint8_t rule, uint8_t txClass, Args &&...args) {
+  Buffer<OutboundPacket> &held = _held[rule];
+  auto it = _enqueue(held, std::forward<Args>(args)...);
+  if (!it) {
+    return false;
   }
+  it->txClass = txClass;
+  // Straight through unless older messages of the rule are still held
+  if (held.getCurrent() == it.get()
+      && _shaper.take(rule, it->packet.size(), MQTTPlatform::micros())) {
+    held.appendCurrentTo(_queues[txClass]);
+    ++_depth[txClass];
+    _shaper.count(rule, Shaper::PASSED);
+    _client->_wakeup.notify();
+    return true;
+  }
+
+  ShapePolicy policy = _shaper.policy(rule);
+  if (policy == ShapePolicy::CONFLATE) {
+    uint16_t length;
+    const char *topic = it->packet.topic(length);
+    for (auto older = held.begin(); older != it; ++older) {
+      uint16_t olderLength;
+      const char *olderTopic = older->packet.topic(olderLength);
+      if (olderLength == length && memcmp(olderTopic, topic, length) == 0) {
+        // The newer message takes over the held slot
+        _discardHeld(rule, older);
+        _shaper.count(rule, Shaper::CONFLATED);
+        return true;
+      }
+    }
+  }
+  if (policy == ShapePolicy::DROP || _heldCount >= _shaper.holdLimit()) {
+    // The caller still owns the packet id
+    held.remove(it);
+    _metrics->add(Gauge::QUEUE_DEPTH, -1);
+    _metrics->recordError(MQTTErrors::MESSAGE_DROPPED);
+    _shaper.count(rule, Shaper::DROPPED);
+    return false;
+  }
+  ++_heldCount;
+  _shaper.count(rule, Shaper::DELAYED);
   return true;
 }
 
+void Transmitter::_discardHeld(uint8_t rule,
+                               Buffer<OutboundPacket>::Iterator &it) {
+  uint16_t packetId = it->packet.packetId();
+  _leaveQueue(*it);
+  _settleReplayed(*it);
+  _held[rule].remove(it);
+  _metrics->add(Gauge::QUEUE_DEPTH, -1);
+  if (packetId) {
+    _client->_completions.complete(packetId, MQTTErrors::MESSAGE_DROPPED);
+    releasePacketID(packetId);
+  }
+}
+
 template <typename... Args> bool Transmitter::_addPacketFront(Args &&...args) {
   MQTTCore::MQTTErrors error(MQTTCore::MQTTErrors::SUCCESS);
 
-  OutboundPacket transmitPacket(_transmitTime, error,
-                                std::forward<Args>(args)...);
+  Buffer<OutboundPacket> &queue = _queues[TX_CLASS_CONTROL];
+  auto it = queue.pushFront(_transmitTime, error, std::forward<Args>(args)...);
+  if (!it) {
+    _metrics->recordError(MQTTCore::MQTTErrors::OUT_OF_MEMORY);
+    return false; // Failed to add packet to buffer
+  }
   if (error != MQTTCore::MQTTErrors::SUCCESS) {
+    queue.remove(it);
+    _metrics->recordError(error);
     return false; // Failed to create packet
   }
-  if (!transmitBuffer.pushFront(transmitPacket)) {
-    return false; // Failed to add packet to buffer
-  }
+  ++_depth[TX_CLASS_CONTROL];
+  _metrics->add(Gauge::QUEUE_DEPTH, 1);
+  _client->_wakeup.notify();
   return true;
 }
 
 bool Transmitter::_advanceBuffer() {
-  OutboundPacket *transmitPacket = transmitBuffer.getCurrent();
+  if (_active == NO_CLASS) {
+    return false;
+  }
+  Buffer<OutboundPacket> &queue = _queueOf(_active);
+  OutboundPacket *transmitPacket = queue.getCurrent();
 
   if (!transmitPacket) {
-    return false;
+    _active = NO_CLASS;
+    return _hasUnsent();
   }
 
   MQTTPacket::Packet &packet = transmitPacket->packet;
 
   if (packet.isValid() && _transmitStatus._bytesSent == packet.size()) {
-    if (packet.packetType() == ControlPacketType::DISCONNECT) {
+    transmitPacket->trace.stamp(TraceStage::LAST_WRITE);
+    if (_pipelining && packet.packetType() != PacketType.CONNECT) {
+      ++_pipeline.early;
+    }
+    if (packet.packetType() == PacketType.DISCONNECT) {
       _transmitStatus.update(TransmitStatusUpdate::withDisconnectReason(
           DisconnectReason::USER_OK));
     }
-    if (packet.removable()) {
-      transmitBuffer.removeCurrent();
+    if (packet.packetType() == PacketType.PUBLISH) {
+      if (packet.isDup()) {
+        _metrics->increment(Counter::RETRANSMITS);
+      } else {
+        _metrics->recordPublish(packet.qos());
+      }
+    }
+    if (transmitPacket->acked) {
+      // _handleAck() has settled it already
+      queue.removeCurrent();
+      --_inFlightCount;
+      _metrics->add(Gauge::QUEUE_DEPTH, -1);
+    } else if (packet.removable()) {
+      if (packet.packetType() == PacketType.PUBLISH) {
+        _client->_tracer.recordOutbound(transmitPacket->trace, false);
+      }
+      if (_pipelining && packet.packetType() == PacketType.PUBLISH) {
+        // Nothing but the CONNACK tells whether the broker took it
+        transmitPacket->txClass = _active;
+        queue.appendCurrentTo(_unconfirmed);
+      } else {
+        queue.removeCurrent();
+        _metrics->add(Gauge::QUEUE_DEPTH, -1);
+      }
+      --_depth[_active];
+    } else if (_active == IN_FLIGHT) {
+      queue.next();
     } else {
-      if (packet.packetType() == ControlPacketType::PUBLISH) {
+      // Any later send of it is a retransmission
+      if (packet.packetType() == PacketType.PUBLISH) {
         packet.setDup();
       }
-      transmitBuffer.next();
+      queue.moveCurrentTo(_inFlight);
+      --_depth[_active];
+      ++_inFlightCount;
+    }
+    _transmitStatus.update(TransmitStatusUpdate::withBytesSent(0));
+    // Packet boundary: the next one may come from another class
+    _active = NO_CLASS;
+    return _hasUnsent();
+  }
+
+  return true;
+}
+
+bool Transmitter::_handleAck(uint16_t packetId,
+                             MQTTCore::MQTTPacketType ackType) {
+  MQTTPacketType expected;
+  if (ackType == PacketType.PUBACK || ackType == PacketType.PUBREC) {
+    expected = PacketType.PUBLISH;
+  } else if (ackType == PacketType.PUBCOMP) {
+    expected = PacketType.PUBREL;
+  } else if (ackType == PacketType.SUBACK) {
+    expected = PacketType.SUBSCRIBE;
+  } else if (ackType == PacketType.UNSUBACK) {
+    expected = PacketType.UNSUBSCRIBE;
+  } else {
+    return false;
+  }
+
+  MQTT_SEMAPHORE_TAKE();
+  // Only packets that went out completely can be acked, and those are all
+  // in flight
+  for (auto it = _inFlight.begin(); it != _inFlight.end(); ++it) {
+    if (it->packet.packetId() != packetId
+        || it->packet.packetType() != expected || it->acked) {
+      continue;
     }
-    transmitPacket = transmitBuffer.getCurrent();
-    if (!transmitPacket) {
+    if (ackType == PacketType.PUBREC
+        && !addPacket(TX_CLASS_CONTROL, packetId, PacketType.PUBREL)) {
+      // Stays in flight; its retransmission draws another PUBREC
+      MQTT_SEMAPHORE_GIVE();
       return false;
+    }
+    MessageTrace trace = it->trace;
+    bool journaled = it->journaled;
+    bool replayed = it->replayed;
+    it->replayed = false;
+    if (ackType == PacketType.PUBACK || ackType == PacketType.PUBCOMP) {
+      _metrics->recordAckLatency(MQTTPlatform::millis() - it->transmit_time);
+      trace.stamp(TraceStage::ACKED);
+      _client->_tracer.recordOutbound(trace, true);
+    }
+    if (_active == IN_FLIGHT && it.get() == _inFlight.getCurrent()
+        && _transmitStatus._bytesSent > 0) {
+      // Acked while a resend is half written: finish writing it so the
+      // stream stays intact, _advanceBuffer() drops it after
+      it->acked = true;
     } else {
-      packet = transmitPacket->packet;
+      _inFlight.remove(it);
+      --_inFlightCount;
+      _metrics->add(Gauge::QUEUE_DEPTH, -1);
     }
-    _transmitStatus.update(TransmitStatusUpdate::withBytesSent(0));
+
+    if (ackType == PacketType.PUBREC) {
+      // QoS 2 keeps the id reserved until PUBCOMP. The PUBREL carries the
+      // publish trace on, so its write/ack stages follow the second leg.
+      OutboundPacket *release = _queues[TX_CLASS_CONTROL].getTail();
+      release->trace = trace;
+      if (journaled) {
+        _session->released(packetId);
+        release->journaled = true;
+      }
+      // Stays in the offline store until the PUBCOMP
+      release->replayed = replayed;
+      replayed = false;
+    } else {
+      if (journaled) {
+        _session->completed(packetId);
+      }
+      releasePacketID(packetId);
+    }
+    if (journaled) {
+      _compactSession();
+    }
+    if (replayed) {
+      --_replayQueued;
+    }
+    MQTT_SEMAPHORE_GIVE();
+    return true;
+  }
+  MQTT_SEMAPHORE_GIVE();
+  _metrics->recordError(MQTTErrors::ACK_OF_UNKNOWN);
+  return false;
+}
+
+bool Transmitter::_publishMetrics(uint32_t now) {
+  const MetricsSettings &settings = _clientCfg.metrics_settings;
+  if (!settings.topic || !_metrics->reportDue(now, settings.interval_ms)) {
+    return false;
+  }
+
+  MetricsSnapshot snapshot;
+  _metrics->snapshot(snapshot, now);
+  size_t length
+      = settings.json
+            ? Metrics::encodeJson(snapshot,
+                                  reinterpret_cast<char *>(_metricsPayload),
+                                  sizeof(_metricsPayload))
+            : Metrics::encodeBinary(snapshot, _metricsPayload,
+                                    sizeof(_metricsPayload));
+  if (length == 0) {
+    return false;
+  }
+
+  MQTT_SEMAPHORE_TAKE();
+  bool queued = addPacket(_classify(settings.topic, 0),
+                          static_cast<uint16_t>(0), settings.topic,
+                          static_cast<const uint8_t *>(_metricsPayload),
+                          length, static_cast<uint8_t>(0), false);
+  MQTT_SEMAPHORE_GIVE();
+  return queued;
+}
+
+bool Transmitter::sendAck(uint16_t packetId, MQTTCore::MQTTPacketType type) {
+  MQTT_SEMAPHORE_TAKE();
+  bool result = addPacket(TX_CLASS_CONTROL, packetId, type);
+  MQTT_SEMAPHORE_GIVE();
+  return result;
+}
+
+uint16_t Transmitter::publish(const char *topic, uint8_t qos, bool retain,
+                              const uint8_t *payload, size_t length,
+                              uint32_t ttlMs, bool spill) {
+  MQTT_SEMAPHORE_TAKE();
+  uint16_t result;
+  if (!_shed(topic, qos, retain, payload, length, ttlMs, spill, result)) {
+    result = _queuePublish(topic, qos, retain, payload, length, ttlMs);
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return result;
+}
+
+uint16_t Transmitter::publish(const char *topic, uint8_t qos, bool retain,
+                              MQTTCore::onPayloadInternalCallback callback,
+                              size_t length, uint32_t ttlMs) {
+  MQTT_SEMAPHORE_TAKE();
+  // Produced only as it is written, so there is nothing to conflate or
+  // store
+  uint16_t result = _refuse(qos) ? 0
+                                 : _queuePublish(topic, qos, retain,
+                                                 callback, length, ttlMs);
+  MQTT_SEMAPHORE_GIVE();
+  return result;
+}
+
+TopicHandle Transmitter::registerConflated(const char *topic) {
+  MQTT_SEMAPHORE_TAKE();
+  TopicHandle handle{TopicHandle::NONE};
+  for (uint16_t i = 0; i < _conflatedCount && !handle.valid(); ++i) {
+    if (_conflated[i].topic == topic) {
+      handle.index = i;
+    }
+  }
+  if (!handle.valid() && _conflatedCount < MQTT_CONFLATED_TOPICS) {
+    handle.index = _conflatedCount++;
+    _conflated[handle.index] = ConflatedTopic{topic, nullptr};
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return handle;
+}
+
+uint16_t Transmitter::publish(TopicHandle topic, uint8_t qos, bool retain,
+                              const uint8_t *payload, size_t length,
+                              uint32_t ttlMs) {
+  MQTT_SEMAPHORE_TAKE();
+  if (topic.index >= _conflatedCount) {
+    MQTT_SEMAPHORE_GIVE();
+    return 0;
+  }
+  ConflatedTopic &entry = _conflated[topic.index];
+  OutboundPacket *pending = entry.pending;
+  if (!pending && _refuse(qos)) {
+    MQTT_SEMAPHORE_GIVE();
+    return 0;
+  }
+  if (!pending) {
+    uint16_t result = _queuePublish(entry.topic.c_str(), qos, retain,
+                                    payload, length, ttlMs);
+    if (result) {
+      entry.pending = _lastQueued;
+      _lastQueued->conflated = topic.index;
+    }
+    MQTT_SEMAPHORE_GIVE();
+    return result;
+  }
+
+  // Encode the new message aside, then trade contents with the queued one
+  // so the node keeps its place. A QoS 1/2 message keeps its packet id.
+  uint16_t replacedId = pending->packet.packetId();
+  uint16_t packetId = qos == 0 ? 0
+                      : replacedId ? replacedId
+                                   : generateUniquePacketID();
+  MQTTErrors error(MQTTErrors::SUCCESS);
+  Packet latest(error, packetId, entry.topic.c_str(), payload, length, qos,
+                retain);
+  if (error != MQTTErrors::SUCCESS) {
+    if (packetId && packetId != replacedId) {
+      releasePacketID(packetId);
+    }
+    _metrics->recordError(error);
+    MQTT_SEMAPHORE_GIVE();
+    return 0;
+  }
+  pending->packet.swapPublish(latest);
+  pending->trace = MessageTrace();
+  pending->trace.stamp(TraceStage::PUBLISH_CALL);
+  if (ttlMs) {
+    _expiry.schedule(pending->expiry, pending,
+                     MQTTPlatform::millis() + ttlMs);
+  } else {
+    _expiry.cancel(pending->expiry);
+  }
+  ++_conflations;
+  if (replacedId) {
+    // Whoever waits on the replaced message learns it never went out
+    _client->_completions.complete(replacedId, MQTTErrors::MESSAGE_DROPPED);
+    if (!packetId) {
+      releasePacketID(replacedId);
+    }
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return packetId ? packetId : 1;
+}
+
+bool Transmitter::store(const char *topic, uint8_t qos, bool retain,
+                        const uint8_t *payload, size_t length,
+                        uint32_t ttlMs) {
+  MQTT_SEMAPHORE_TAKE();
+  bool stored
+      = _store && _store->append(topic, payload, length, qos, retain, ttlMs);
+  MQTT_SEMAPHORE_GIVE();
+  return stored;
+}
+
+uint16_t Transmitter::subscribe(const Subscription &subscription) {
+  MQTT_SEMAPHORE_TAKE();
+  uint16_t packetId = generateUniquePacketID();
+  bool queued = addPacket(TX_CLASS_CONTROL, packetId, subscription,
+                          Subscription_task::SUBSCRIBE);
+  if (!queued) {
+    releasePacketID(packetId);
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return queued ? packetId : 0;
+}
+
+uint16_t Transmitter::unsubscribe(const Subscription &subscription) {
+  MQTT_SEMAPHORE_TAKE();
+  uint16_t packetId = generateUniquePacketID();
+  bool queued = addPacket(TX_CLASS_CONTROL, packetId, subscription,
+                          Subscription_task::UNSUBSCRIBE);
+  if (!queued) {
+    releasePacketID(packetId);
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return queued ? packetId : 0;
+}
+
+bool Transmitter::sendPing() {
+  MQTT_SEMAPHORE_TAKE();
+  bool queued = addPacket(TX_CLASS_CONTROL, PacketType.PINGREQ);
+  if (queued) {
+    _transmitStatus.update(TransmitStatusUpdate::withPingSent(true));
+    _pingSentUs = MQTTPlatform::micros();
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return queued;
+}
+
+bool Transmitter::sendDisconnect() {
+  MQTT_SEMAPHORE_TAKE();
+  bool queued = addPacket(TX_CLASS_CONTROL, PacketType.DISCONNECT);
+  MQTT_SEMAPHORE_GIVE();
+  return queued;
+}
+
+bool Transmitter::_checkKeepAlive(uint32_t now) {
+  const ConnectionSettings &settings = _clientCfg.connections_settings;
+  if (settings.disable_keepalive || settings._keepAlive == 0) {
+    return true;
+  }
+  uint32_t idle = now - _transmitStatus._lastClientActivity;
+  if (idle < settings._keepAlive) {
+    return true;
+  }
+  if (_transmitStatus._pingSent) {
+    return false;
+  }
+  return sendPing();
+}
+
+void Transmitter::_releaseHeld(uint32_t nowUs) {
+  MQTT_SEMAPHORE_TAKE();
+  for (uint8_t rule = 0; rule < Shaper::RULES && _heldCount > 0; ++rule) {
+    Buffer<OutboundPacket> &held = _held[rule];
+    for (OutboundPacket *next = held.getCurrent();
+         next && _shaper.take(rule, next->packet.size(), nowUs);
+         next = held.getCurrent()) {
+      uint8_t txClass = next->txClass;
+      held.appendCurrentTo(_queues[txClass]);
+      ++_depth[txClass];
+      --_heldCount;
+    }
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+void Transmitter::_expireQueued(uint32_t now) {
+  MQTT_SEMAPHORE_TAKE();
+  if (_expiry.advance(now, [this](void *packet) {
+        _expire(*static_cast<OutboundPacket *>(packet));
+      })) {
+    // Expired packets were never written, so none is under a cursor that
+    // has bytes out; one pass per queue removes them all
+    auto isExpired = [](const OutboundPacket &packet) {
+      return packet.expired;
+    };
+    size_t removed = 0;
+    for (uint8_t txClass = 0; txClass < MQTT_TX_CLASSES; ++txClass) {
+      size_t count = _queues[txClass].removeIf(isExpired);
+      _depth[txClass] -= count;
+      removed += count;
+    }
+    for (Buffer<OutboundPacket> &held : _held) {
+      size_t count = held.removeIf(isExpired);
+      _heldCount -= count;
+      removed += count;
+    }
+    _metrics->add(Gauge::QUEUE_DEPTH, -static_cast<int32_t>(removed));
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+void Transmitter::_replayStored() {
+  MQTT_SEMAPHORE_TAKE();
+  // Under memory pressure the messages stay on flash
+  if (_store && _replayQueued == 0
+      && _pressure.level() == PressureLevel::NORMAL) {
+    // The broker or the session journal has the last batch, so the log
+    // may forget it
+    _store->commit();
+    _store->replay(&Transmitter::_queueStored, this);
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+bool Transmitter::_checkPressure(uint32_t now) {
+  // Every loop pass, so getMetrics() has a low-water mark without reports
+  _metrics->observeHeap(MQTT_GET_FREE_MEMORY());
+  MQTT_SEMAPHORE_TAKE();
+  bool changed = _pressure.update(now);
+  if (changed && _pressure.level() != PressureLevel::NORMAL) {
+    // Pooled blocks are memory the heap could use
+    MQTTCore::MemoryPolicy::instance().trim();
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return changed;
+}
+
+bool Transmitter::_pressureApplies(uint8_t flags) {
+  MQTT_SEMAPHORE_TAKE();
+  bool applies = _pressure.applies(flags);
+  MQTT_SEMAPHORE_GIVE();
+  return applies;
+}
+
+uint32_t Transmitter::_msUntilExpiry(uint32_t now) {
+  MQTT_SEMAPHORE_TAKE();
+  uint32_t ms = _expiry.msUntilNext(now);
+  MQTT_SEMAPHORE_GIVE();
+  return ms;
+}
+
+void Transmitter::_checkRetransmit(uint32_t now) {
+  uint32_t timeout
+      = _clientCfg.connections_settings.message_retransmit_timeout;
+  if (timeout == 0) {
+    return;
+  }
+  MQTT_SEMAPHORE_TAKE();
+  // Oldest first, so the scan stops at the first packet not yet due
+  for (OutboundPacket *oldest = _inFlight.getHead();
+       oldest && oldest != _inFlight.getCurrent()
+       && now - oldest->transmit_time >= timeout;
+       oldest = _inFlight.getHead()) {
+    _inFlight.requeueHead();
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+uint32_t Transmitter::_msUntilNextTimer(uint32_t now) {
+  const ConnectionSettings &settings = _clientCfg.connections_settings;
+  uint32_t next = UINT32_MAX;
+  if (!settings.disable_keepalive && settings._keepAlive != 0) {
+    uint32_t idle = now - _transmitStatus._lastClientActivity;
+    next = idle < settings._keepAlive ? settings._keepAlive - idle : 0;
+  }
+  MQTT_SEMAPHORE_TAKE();
+  if (_heldCount > 0) {
+    uint32_t nowUs = MQTTPlatform::micros();
+    for (uint8_t rule = 0; rule < Shaper::RULES; ++rule) {
+      OutboundPacket *held = _held[rule].getCurrent();
+      if (held) {
+        // Rounded up, so the loop does not wake a moment too early
+        uint32_t us = _shaper.usUntil(rule, held->packet.size(), nowUs);
+        uint32_t ms = us / 1000 + (us % 1000 != 0);
+        next = ms < next ? ms : next;
+      }
+    }
+  }
+  uint32_t expiry = _expiry.msUntilNext(now);
+  next = expiry < next ? expiry : next;
+  uint32_t timeout = settings.message_retransmit_timeout;
+  OutboundPacket *oldest = _inFlight.getHead();
+  if (timeout != 0 && oldest && oldest != _inFlight.getCurrent()) {
+    uint32_t waited = now - oldest->transmit_time;
+    uint32_t due = waited < timeout ? timeout - waited : 0;
+    next = due < next ? due : next;
+  }
+  MQTT_SEMAPHORE_GIVE();
+  const MetricsSettings &metrics = _clientCfg.metrics_settings;
+  if (metrics.topic) {
+    uint32_t report = _metrics->msUntilReport(now, metrics.interval_ms);
+    next = report < next ? report : next;
+  }
+  return next;
+}
+
+bool Transmitter::_hasUnsent() {
+  MQTT_SEMAPHORE_TAKE();
+  bool unsent = _inFlight.getCurrent() != nullptr;
+  for (uint8_t txClass = 0; txClass < MQTT_TX_CLASSES && !unsent; ++txClass) {
+    unsent = _queues[txClass].getCurrent() != nullptr;
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return unsent;
+}
+
+bool Transmitter::_onPingResp(uint32_t nowUs, uint32_t &rttUs) {
+  MQTT_SEMAPHORE_TAKE();
+  bool expected = _transmitStatus._pingSent;
+  _transmitStatus.update(TransmitStatusUpdate::withPingSent(false));
+  rttUs = nowUs - _pingSentUs;
+  MQTT_SEMAPHORE_GIVE();
+  return expected;
+}
+
+bool Transmitter::_receivedQos2(uint16_t packetId) {
+  MQTT_SEMAPHORE_TAKE();
+  bool first = !_inbound.contains(packetId);
+  // With the window full the id goes untracked, and a resend of it would
+  // be delivered again
+  if (first && _inbound.insert(packetId) && _session) {
+    _session->received(packetId);
+    _compactSession();
+  }
+  MQTT_SEMAPHORE_GIVE();
+  return first;
+}
+
+void Transmitter::_releasedQos2(uint16_t packetId) {
+  MQTT_SEMAPHORE_TAKE();
+  if (_inbound.contains(packetId)) {
+    _inbound.erase(packetId);
+    if (_session) {
+      _session->releasedInbound(packetId);
+      _compactSession();
+    }
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+void Transmitter::_onSessionPresent(bool present) {
+  MQTT_SEMAPHORE_TAKE();
+  if (!present && _inbound.size() > 0) {
+    // The broker starts over and sends no PUBREL for what it had
+    _inbound.clear();
+    if (_session) {
+      _session->forgetInbound();
+      _compactSession();
+    }
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+void Transmitter::_onConnack(bool accepted) {
+  MQTT_SEMAPHORE_TAKE();
+  if (_pipelining) {
+    _pipelining = false;
+    if (accepted) {
+      _metrics->add(Gauge::QUEUE_DEPTH,
+                    -static_cast<int32_t>(_unconfirmed.getBufferSize()));
+      _unconfirmed.clear();
+    } else {
+      // A refusing broker closes the connection without reading on (MQTT
+      // 3.1.1 3.2.2.3), so none of it was processed
+      _rollBack();
+    }
+  }
+  MQTT_SEMAPHORE_GIVE();
+}
+
+void Transmitter::_rollBack() {
+  for (uint8_t txClass = 0; txClass < MQTT_TX_CLASSES; ++txClass) {
+    _queues[txClass].resetCurrent();
+  }
+  while (OutboundPacket *packet = _unconfirmed.getCurrent()) {
+    uint8_t txClass = packet->txClass;
+    // Each lands behind the one moved before it, ahead of newer work
+    _unconfirmed.moveCurrentTo(_queues[txClass]);
+    ++_depth[txClass];
+    ++_pipeline.rolledBack;
+  }
+}
+
+void Transmitter::_onConnectionClosed() {
+  MQTT_SEMAPHORE_TAKE();
+  if (_pipelining) {
+    // Lost before the CONNACK: the broker may or may not have taken them,
+    // and QoS 0 is at most once
+    _pipelining = false;
+    _pipeline.dropped += _unconfirmed.getBufferSize();
+    _metrics->add(Gauge::QUEUE_DEPTH,
+                  -static_cast<int32_t>(_unconfirmed.getBufferSize()));
+    _unconfirmed.clear();
+  }
+  for (uint8_t txClass = 0; txClass < MQTT_TX_CLASSES; ++txClass) {
+    _queues[txClass].resetCurrent();
+    _deficit[txClass] = 0;
+  }
+  // Control packets that belong to the closed connection. The broker
+  // resends what our acks answered; PUBREL has to go again itself.
+  size_t stale = _queues[TX_CLASS_CONTROL].removeIf(
+      [](const OutboundPacket &queued) {
+        MQTTPacketType type = queued.packet.packetType();
+        return type == PacketType.CONNECT || type == PacketType.DISCONNECT
+               || type == PacketType.PINGREQ || type == PacketType.PUBACK
+               || type == PacketType.PUBREC || type == PacketType.PUBCOMP;
+      });
+  _depth[TX_CLASS_CONTROL] -= stale;
+  _metrics->add(Gauge::QUEUE_DEPTH, -static_cast<int32_t>(stale));
+  OutboundPacket *current = _inFlight.getCurrent();
+  if (current && current->acked) {
+    _inFlight.removeCurrent();
+    --_inFlightCount;
+    _metrics->add(Gauge::QUEUE_DEPTH, -1);
+  }
+  // MQTT 3.1.1 4.4: unacked PUBLISH and PUBREL go again, in order
+  _inFlight.resetCurrent();
+  _active = NO_CLASS;
+  _granted = false;
+  _transmitStatus.update(TransmitStatusUpdate::withBytesSent(0));
+  _transmitStatus.update(TransmitStatusUpdate::withPingSent(false));
+  MQTT_SEMAPHORE_GIVE();
+}
+
+size_t Transmitter::queueDepth(uint8_t txClass) {
+  if (txClass >= MQTT_TX_CLASSES) {
+    return 0;
+  }
+  MQTT_SEMAPHORE_TAKE();
+  size_t depth = _depth[txClass];
+  MQTT_SEMAPHORE_GIVE();
+  return depth;
+}
+
+Shaper::Stats Transmitter::shapeStats(uint8_t rule) {
+  MQTT_SEMAPHORE_TAKE();
+  Shaper::Stats stats = _shaper.stats(rule);
+  MQTT_SEMAPHORE_GIVE();
+  return stats;
+}
+
+uint32_t Transmitter::expired() {
+  MQTT_SEMAPHORE_TAKE();
+  uint32_t count = _expired;
+  MQTT_SEMAPHORE_GIVE();
+  return count;
+}
+
+OfflineStore::Stats Transmitter::storeStats() {
+  MQTT_SEMAPHORE_TAKE();
+  OfflineStore::Stats stats = _store ? _store->stats() : OfflineStore::Stats{};
+  MQTT_SEMAPHORE_GIVE();
+  return stats;
+}
+
+SessionStore::Stats Transmitter::sessionStats() {
+  MQTT_SEMAPHORE_TAKE();
+  SessionStore::Stats stats
+      = _session ? _session->stats() : SessionStore::Stats{};
+  MQTT_SEMAPHORE_GIVE();
+  return stats;
+}
+
+Transmitter::PipelineStats Transmitter::pipelineStats() {
+  MQTT_SEMAPHORE_TAKE();
+  PipelineStats stats = _pipeline;
+  MQTT_SEMAPHORE_GIVE();
+  return stats;
+}
+
+PressureLevel Transmitter::pressureLevel() {
+  MQTT_SEMAPHORE_TAKE();
+  PressureLevel level = _pressure.level();
+  MQTT_SEMAPHORE_GIVE();
+  return level;
+}
+
+PressureMonitor::Stats Transmitter::pressureStats() {
+  MQTT_SEMAPHORE_TAKE();
+  PressureMonitor::Stats stats = _pressure.stats();
+  MQTT_SEMAPHORE_GIVE();
+  return stats;
+}
+
+uint32_t Transmitter::conflations() {
+  MQTT_SEMAPHORE_TAKE();
+  uint32_t count = _conflations;
+  MQTT_SEMAPHORE_GIVE();
+  return count;
+}
+
+size_t Transmitter::inFlight() {
+  MQTT_SEMAPHORE_TAKE();
+  size_t count = _inFlightCount;
+  MQTT_SEMAPHORE_GIVE();
+  return count;
+}
+
+uint8_t Transmitter::_classify(const char *topic, uint8_t qos) const {
+  const TransmitSettings &settings = _clientCfg.transmit_settings;
+  uint8_t txClass = qos > 0 ? TX_CLASS_ALARM : TX_CLASS_BULK;
+  if (settings.classify) {
+    txClass = settings.classify(topic, qos);
+  }
+  // Control is reserved for protocol traffic
+  if (txClass == TX_CLASS_CONTROL || txClass >= MQTT_TX_CLASSES) {
+    txClass = TX_CLASS_BULK;
   }
+  return txClass;
+}
 
+uint32_t Transmitter::_quantum(uint8_t txClass) const {
+  uint8_t weight = _clientCfg.transmit_settings.weights[txClass];
+  if (weight == 0) {
+    weight = txClass == TX_CLASS_ALARM ? 4 : 1;
+  }
+  return static_cast<uint32_t>(weight) * MQTT_TX_QUANTUM;
+}
+
+uint8_t Transmitter::_selectClass() {
+  if (_queues[TX_CLASS_CONTROL].getCurrent()) {
+    return TX_CLASS_CONTROL;
+  }
+  // Retransmissions go ahead of new publishes to keep their order
+  if (_inFlight.getCurrent()) {
+    return IN_FLIGHT;
+  }
+  // Deficit round robin: on its turn a class earns its quantum and sends
+  // while the packet at its cursor fits in what it has earned.
+  constexpr uint8_t PUBLISH_CLASSES = MQTT_TX_CLASSES - 1;
+  uint8_t idle = 0;
+  for (;;) {
+    OutboundPacket *next = _queues[_roundRobin].getCurrent();
+    if (next) {
+      idle = 0;
+      if (!_granted) {
+        _deficit[_roundRobin] += _quantum(_roundRobin);
+        _granted = true;
+      }
+      size_t size = next->packet.size();
+      if (_deficit[_roundRobin] >= size) {
+        _deficit[_roundRobin] -= size;
+        return _roundRobin;
+      }
+    } else {
+      // Nothing waiting: unused credit does not carry over
+      _deficit[_roundRobin] = 0;
+      if (++idle == PUBLISH_CLASSES) {
+        return NO_CLASS;
+      }
+    }
+    _roundRobin = _roundRobin + 1 < MQTT_TX_CLASSES ? _roundRobin + 1 : 1;
+    _granted = false;
+  }
+}
+
+void Transmitter::_expire(OutboundPacket &packet) {
+  uint16_t packetId = packet.packet.packetId();
+  _leaveQueue(packet);
+  _settleReplayed(packet);
+  packet.expired = true;
+  ++_expired;
+  _metrics->recordError(MQTTErrors::MESSAGE_EXPIRED);
+  if (packetId) {
+    _client->_completions.complete(packetId, MQTTErrors::MESSAGE_EXPIRED);
+    releasePacketID(packetId);
+  }
+}
+
+void Transmitter::_leaveQueue(OutboundPacket &packet) {
+  _expiry.cancel(packet.expiry);
+  _endConflation(packet);
+}
+
+void Transmitter::_settleReplayed(OutboundPacket &packet) {
+  if (packet.replayed) {
+    packet.replayed = false;
+    --_replayQueued;
+  }
+}
+
+bool Transmitter::_queueStored(const OfflineStore::Message &message,
+                               void *transmitter) {
+  Transmitter &self = *static_cast<Transmitter *>(transmitter);
+  if (!self._queuePublish(message.topic, message.qos, message.retain,
+                          message.payload, message.length, message.ttlMs)) {
+    return false;
+  }
+  self._lastQueued->replayed = true;
+  ++self._replayQueued;
   return true;
 }
 
+bool Transmitter::_shed(const char *topic, uint8_t qos, bool retain,
+                        const uint8_t *payload, size_t length,
+                        uint32_t ttlMs, bool spill, uint16_t &result) {
+  result = 0;
+  if (_refuse(qos)) {
+    return true;
+  }
+  if (qos == 0 && _pressure.applies(PRESSURE_CONFLATE)
+      && _conflateUnsent(topic, retain, payload, length, ttlMs)) {
+    _pressure.count(PressureMonitor::CONFLATED);
+    result = 1;
+    return true;
+  }
+  if (spill && _store && _pressure.applies(PRESSURE_SPILL)
+      && _store->append(topic, payload, length, qos, retain, ttlMs)) {
+    // Its packet id is assigned when the store replays it
+    _pressure.count(PressureMonitor::SPILLED);
+    result = 1;
+    return true;
+  }
+  return false;
+}
+
+bool Transmitter::_refuse(uint8_t qos) {
+  if (qos != 0 || !_pressure.applies(PRESSURE_REFUSE_QOS0)) {
+    return false;
+  }
+  _pressure.count(PressureMonitor::REFUSED);
+  _metrics->recordError(MQTTErrors::MESSAGE_DROPPED);
+  return true;
+}
+
+bool Transmitter::_conflateUnsent(const char *topic, bool retain,
+                                  const uint8_t *payload, size_t length,
+                                  uint32_t ttlMs) {
+  uint8_t txClass = _classify(topic, 0);
+  Buffer<OutboundPacket> &queue = _queues[txClass];
+  size_t topicLength = strlen(topic);
+  for (auto it = queue.begin(); it != queue.end(); ++it) {
+    const Packet &queued = it->packet;
+    if (queued.qos() != 0
+        || (_active == txClass && it.get() == queue.getCurrent()
+            && _transmitStatus._bytesSent > 0)) {
+      continue;
+    }
+    uint16_t queuedLength;
+    const char *queuedTopic = queued.topic(queuedLength);
+    if (queuedLength != topicLength
+        || memcmp(queuedTopic, topic, topicLength) != 0) {
+      continue;
+    }
+    MQTTErrors error(MQTTErrors::SUCCESS);
+    Packet latest(error, static_cast<uint16_t>(0), topic, payload, length,
+                  static_cast<uint8_t>(0), retain);
+    if (error != MQTTErrors::SUCCESS) {
+      _metrics->recordError(error);
+      return false;
+    }
+    it->packet.swapPublish(latest);
+    it->trace = MessageTrace();
+    it->trace.stamp(TraceStage::PUBLISH_CALL);
+    if (ttlMs) {
+      _expiry.schedule(it->expiry, it.get(), MQTTPlatform::millis() + ttlMs);
+    } else {
+      _expiry.cancel(it->expiry);
+    }
+    return true;
+  }
+  return false;
+}
+
+void Transmitter::_openSession() {
+  _session.reset(new (std::nothrow)
+                     SessionStore(_clientCfg.session_settings, _inbound));
+  if (_session && !_session->open()) {
+    MQTTPlatform::log(MQTTPlatform::LogLevel::WARNING,
+                      "Session store unavailable");
+    _session.reset();
+  }
+  if (_session && _clientCfg.connections_settings._cleanSession) {
+    // The broker drops its side too, so there is nothing to resume
+    _session->clear();
+    _session.reset();
+  }
+  if (!_session) {
+    return;
+  }
+  // In flight as they were, so they go again right after CONNECT
+  for (const SessionStore::Outbound &message : _session->restored()) {
+    auto it = message.released
+                  ? _enqueue(_inFlight, message.packetId, PacketType.PUBREL)
+                  : _enqueue(_inFlight, message.packet.data(),
+                             message.packet.size());
+    if (!it) {
+      continue;
+    }
+    it->packet.setDup();
+    it->journaled = true;
+    _registry.used_packet_ids.insert(message.packetId);
+    ++_inFlightCount;
+  }
+  _session->dropRestored();
+  _inFlight.resetCurrent();
+  _registry.pid_lfsr = _session->pidState();
+  _metrics->set(Gauge::PID_IN_USE, _registry.used_packet_ids.size());
+}
+
+void Transmitter::_compactSession() {
+  if (!_session->rewriteDue()
+      || !_session->beginRewrite(_registry.pid_lfsr)) {
+    return;
+  }
+  auto rewrite = [this](const OutboundPacket &queued) {
+    const Packet &packet = queued.packet;
+    if (!queued.journaled || queued.acked) {
+      return;
+    }
+    if (packet.packetType() == PacketType.PUBREL) {
+      _session->released(packet.packetId());
+    } else {
+      _session->sent(packet.packetId(), packet.data(0), packet.size(),
+                     _registry.pid_lfsr);
+    }
+  };
+  // Oldest first: in flight, then what is being written and the PUBRELs
+  // still queued
+  for (const OutboundPacket &queued : _inFlight) {
+    rewrite(queued);
+  }
+  for (Buffer<OutboundPacket> &queue : _queues) {
+    for (const OutboundPacket &queued : queue) {
+      rewrite(queued);
+    }
+  }
+  _session->endRewrite();
+}
+
+void Transmitter::_endConflation(OutboundPacket &packet) {
+  if (packet.conflated != TopicHandle::NONE) {
+    _conflated[packet.conflated].pending = nullptr;
+    packet.conflated = TopicHandle::NONE;
+  }
+}
+
+Buffer<Transmitter::OutboundPacket> &Transmitter::_queueOf(uint8_t source) {
+  return source == IN_FLIGHT ? _inFlight : _queues[source];
+}
+
 const uint16_t &Transmitter::generateUniquePacketID() {
   _registry.pid_lfsr = __transmit_next_pid(&_registry);
+  _registry.used_packet_ids.insert(_registry.pid_lfsr);
+  _metrics->set(Gauge::PID_IN_USE, _registry.used_packet_ids.size());
   return _registry.pid_lfsr;
 }
 
+void Transmitter::releasePacketID(uint16_t packetID) {
+  _registry.used_packet_ids.erase(packetID);
+  _metrics->set(Gauge::PID_IN_USE, _registry.used_packet_ids.size());
+}
+
 void Transmitter::updateLatestID(uint16_t packetID) { _packetID = packetID; }
 
 uint16_t Transmitter::getPacketID() { return _packetID; }
@@ -154,20 +1237,22 @@ ControlPacketType Transmitter::parseControlPacketType(unsigned int value) {
 
 // Definitions for TransmitStatusUpdate struct
 Transmitter::TransmitStatusUpdate::TransmitStatusUpdate()
-    : bytesSent(nullptr), pingSent(nullptr), lastClientActivity(nullptr),
-      lastServerActivity(nullptr), disconnectReason(nullptr) {}
+    : fields(0), bytesSent(0), pingSent(false), lastClientActivity(0),
+      lastServerActivity(0), disconnectReason(DisconnectReason::USER_OK) {}
 
 Transmitter::TransmitStatusUpdate
 Transmitter::TransmitStatusUpdate::withBytesSent(size_t bytesSent) {
   Transmitter::TransmitStatusUpdate update;
-  update.bytesSent = new size_t(bytesSent);
+  update.fields = BYTES_SENT;
+  update.bytesSent = bytesSent;
   return update;
 }
 
 Transmitter::TransmitStatusUpdate
 Transmitter::TransmitStatusUpdate::withPingSent(bool pingSent) {
   Transmitter::TransmitStatusUpdate update;
-  update.pingSent = new bool(pingSent);
+  update.fields = PING_SENT;
+  update.pingSent = pingSent;
   return update;
 }
 
@@ -175,7 +1260,8 @@ Transmitter::TransmitStatusUpdate
 Transmitter::TransmitStatusUpdate::withLastClientActivity(
     uint32_t lastClientActivity) {
   Transmitter::TransmitStatusUpdate update;
-  update.lastClientActivity = new uint32_t(lastClientActivity);
+  update.fields = LAST_CLIENT_ACTIVITY;
+  update.lastClientActivity = lastClientActivity;
   return update;
 }
 
@@ -183,7 +1269,8 @@ Transmitter::TransmitStatusUpdate
 Transmitter::TransmitStatusUpdate::withLastServerActivity(
     uint32_t lastServerActivity) {
   Transmitter::TransmitStatusUpdate update;
-  update.lastServerActivity = new uint32_t(lastServerActivity);
+  update.fields = LAST_SERVER_ACTIVITY;
+  update.lastServerActivity = lastServerActivity;
   return update;
 }
 
@@ -191,18 +1278,11 @@ Transmitter::TransmitStatusUpdate
 Transmitter::TransmitStatusUpdate::withDisconnectReason(
     DisconnectReason disconnectReason) {
   Transmitter::TransmitStatusUpdate update;
-  update.disconnectReason = new DisconnectReason(disconnectReason);
+  update.fields = DISCONNECT_REASON;
+  update.disconnectReason = disconnectReason;
   return update;
 }
 
-Transmitter::TransmitStatusUpdate::~TransmitStatusUpdate() {
-  delete bytesSent;
-  delete pingSent;
-  delete lastClientActivity;
-  delete lastServerActivity;
-  delete disconnectReason;
-}
-
 // Definitions for TransmitStatus struct
 Transmitter::TransmitStatus::TransmitStatus()
     : _bytesSent(0), _pingSent(false), _lastClientActivity(0),
@@ -210,16 +1290,16 @@ Transmitter::TransmitStatus::TransmitStatus()
 
 void Transmitter::TransmitStatus::update(
     const Transmitter::TransmitStatusUpdate &update) {
-  if (update.bytesSent)
-    _bytesSent = *update.bytesSent;
-  if (update.pingSent)
-    _pingSent = *update.pingSent;
-  if (update.lastClientActivity)
-    _lastClientActivity = *update.lastClientActivity;
-  if (update.lastServerActivity)
-    _lastServerActivity = *update.lastServerActivity;
-  if (update.disconnectReason)
-    _disconnectReason = *update.disconnectReason;
+  if (update.fields & TransmitStatusUpdate::BYTES_SENT)
+    _bytesSent = update.bytesSent;
+  if (update.fields & TransmitStatusUpdate::PING_SENT)
+    _pingSent = update.pingSent;
+  if (update.fields & TransmitStatusUpdate::LAST_CLIENT_ACTIVITY)
+    _lastClientActivity = update.lastClientActivity;
+  if (update.fields & TransmitStatusUpdate::LAST_SERVER_ACTIVITY)
+    _lastServerActivity = update.lastServerActivity;
+  if (update.fields & TransmitStatusUpdate::DISCONNECT_REASON)
+    _disconnectReason = update.disconnectReason;
 }
 
 // // Definitions for OutboundPacket struct
@@ -5,10 +5,20 @@
 #include "MQTTClientConfig.h"
 #include "MQTTCore.h"
 #include "MQTTError.h"
+#include "MQTTExpiry.h"
+#include "MQTTInboundIds.h"
+#include "MQTTMetrics.h"
+#include "MQTTOfflineStore.h"
 #include "MQTTPacket.h"
+#include "MQTTPressure.h"
+#include "MQTTSession.h"
+#include "MQTTShaper.h"
+#include "MQTTTrace.h"
 #include "MQTTTransmitRegistry.h"
 #include "MQTTTransport.h"
+#include <memory>
 #include <stdint.h>
+#include <string>
 
 using namespace MQTTCore;
 using namespace MQTTPacket;
@@ -19,10 +29,24 @@ class MqttClient;
 
 namespace MQTTTransport {
 
+// A topic registered for latest-value-wins publishing.
+struct TopicHandle {
+  static constexpr uint16_t NONE = 0xFFFF;
+  uint16_t index;
+  bool valid() const { return index != NONE; }
+};
+
 class Transmitter : public CfgObserver {
 public:
+  struct PipelineStats {
+    uint32_t connects;   // CONNECTs sent with pipelined_connect
+    uint32_t early;      // packets written behind one, before its CONNACK
+    uint32_t rolledBack; // QoS 0 publishes requeued after a refusal
+    uint32_t dropped;    // QoS 0 publishes lost with an unanswered CONNECT
+  };
+
   // Constructor
-  template <typename... Args> Transmitter(MqttClient *client, Args &&...args);
+  explicit Transmitter(MqttClient *client);
 
   // Destructor
   ~Transmitter() {}
@@ -34,12 +58,96 @@ public:
   // Public methods
   bool sendConnectionRequest();
   int _sendPacket();
-  template <typename... Args> bool addPacket(Args &&...args);
+  template <typename... Args>
+  bool addPacket(uint8_t txClass, Args &&...args);
   template <typename... Args> bool _addPacketFront(Args &&...args);
   void _checkBuffer();
   bool _advanceBuffer();
+  bool _handleAck(uint16_t packetId, MQTTCore::MQTTPacketType ackType);
+  bool _publishMetrics(uint32_t now);
+  bool sendAck(uint16_t packetId, MQTTCore::MQTTPacketType type);
+
+  // Queue requests on behalf of MqttClient. They return the packet id, 1
+  // for QoS 0 publishes, or 0 when nothing was queued. A publish with a
+  // ttlMs is dropped if it has not started going out by then. Under memory
+  // pressure a publish may be refused, or conflated or stored and return
+  // 1; spill false keeps it out of the store, for callers that wait on
+  // its packet id.
+  uint16_t publish(const char *topic, uint8_t qos, bool retain,
+                   const uint8_t *payload, size_t length, uint32_t ttlMs = 0,
+                   bool spill = true);
+  uint16_t publish(const char *topic, uint8_t qos, bool retain,
+                   MQTTCore::onPayloadInternalCallback callback, size_t length,
+                   uint32_t ttlMs = 0);
+  // A publish on a conflated topic replaces the topic's message that is
+  // still waiting to be sent, keeping its place in the queue, so each
+  // topic holds at most one unsent message.
+  TopicHandle registerConflated(const char *topic);
+  uint16_t publish(TopicHandle topic, uint8_t qos, bool retain,
+                   const uint8_t *payload, size_t length, uint32_t ttlMs = 0);
+  // Writes a publish to the offline store; false without one.
+  bool store(const char *topic, uint8_t qos, bool retain,
+             const uint8_t *payload, size_t length, uint32_t ttlMs);
+  uint16_t subscribe(const Subscription &subscription);
+  uint16_t unsubscribe(const Subscription &subscription);
+  bool sendPing();
+  bool sendDisconnect();
+  // Queues a PINGREQ once the link has been idle for the keep alive;
+  // false when the broker has let a PINGREQ go unanswered that long.
+  bool _checkKeepAlive(uint32_t now);
+  // Drops queued and held publishes whose time-to-live has run out.
+  void _expireQueued(uint32_t now);
+  uint32_t _msUntilExpiry(uint32_t now);
+  // Samples the heap when due; true when the pressure level changed.
+  bool _checkPressure(uint32_t now);
+  bool _pressureApplies(uint8_t flags);
+  // Queues the next batch from the offline store once the previous one
+  // is settled.
+  void _replayStored();
+  // Moves held publishes on to their class queues as the rate limits
+  // allow.
+  void _releaseHeld(uint32_t nowUs);
+  // Queues in-flight packets whose ack is overdue for another send; does
+  // nothing unless message_retransmit_timeout is set.
+  void _checkRetransmit(uint32_t now);
+  // Time until the keep alive, retransmit, shaping, expiry or metrics
+  // timer needs the loop again.
+  uint32_t _msUntilNextTimer(uint32_t now);
+  // True while a queued packet still has bytes to write.
+  bool _hasUnsent();
+  // False for a PINGRESP nothing asked for; otherwise rttUs is the time
+  // since the PINGREQ was queued.
+  bool _onPingResp(uint32_t nowUs, uint32_t &rttUs);
+  // Inbound QoS 2 ids between our PUBREC and the broker's PUBREL, saved
+  // with the session when there is one. _receivedQos2() is false for a
+  // PUBLISH received before and still awaiting its PUBREL, which must not
+  // be delivered twice.
+  bool _receivedQos2(uint16_t packetId);
+  void _releasedQos2(uint16_t packetId);
+  void _onSessionPresent(bool present);
+  // Settles what a pipelined connect wrote ahead of the CONNACK: kept when
+  // accepted, requeued when refused.
+  void _onConnack(bool accepted);
+  // Marks everything in flight for resending on the next connection.
+  void _onConnectionClosed();
+  // Packets of one transmit class that have not been sent yet.
+  size_t queueDepth(uint8_t txClass);
+  // Packets sent and waiting for their ack.
+  size_t inFlight();
+  // Outcomes of one shaping rule (MQTTClientDetails::ShapeSettings).
+  Shaper::Stats shapeStats(uint8_t rule);
+  // Unsent messages replaced by a newer one on their conflated topic.
+  uint32_t conflations();
+  // Publishes dropped because their time-to-live ran out.
+  uint32_t expired();
+  OfflineStore::Stats storeStats();
+  SessionStore::Stats sessionStats();
+  MQTTClientDetails::PressureLevel pressureLevel();
+  PressureMonitor::Stats pressureStats();
+  PipelineStats pipelineStats();
 
   const uint16_t &generateUniquePacketID();
+  void releasePacketID(uint16_t packetID);
   void updateLatestID(uint16_t packetID);
   uint16_t getPacketID();
 
@@ -49,13 +157,26 @@ private:
   MQTTClientDetails::MqttClientCfg _clientCfg;
   uint32_t _transmitTime;
   uint16_t _packetID;
+  MQTTCore::Metrics *_metrics;
+  uint8_t _metricsPayload[MQTTCore::Metrics::JSON_MAX_SIZE];
 
+  // Carries only the fields named in 'fields', by value: it is built on
+  // every write, so it must not allocate.
   struct TransmitStatusUpdate {
-    size_t *bytesSent;
-    bool *pingSent;
-    uint32_t *lastClientActivity;
-    uint32_t *lastServerActivity;
-    DisconnectReason *disconnectReason;
+    enum Field : uint8_t {
+      BYTES_SENT = 1,
+      PING_SENT = 2,
+      LAST_CLIENT_ACTIVITY = 4,
+      LAST_SERVER_ACTIVITY = 8,
+      DISCONNECT_REASON = 16
+    };
+
+    uint8_t fields;
+    size_t bytesSent;
+    bool pingSent;
+    uint32_t lastClientActivity;
+    uint32_t lastServerActivity;
+    DisconnectReason disconnectReason;
 
     TransmitStatusUpdate();
     static TransmitStatusUpdate withBytesSent(size_t bytesSent);
@@ -66,7 +187,6 @@ private:
     withLastServerActivity(uint32_t lastServerActivity);
     static TransmitStatusUpdate
     withDisconnectReason(DisconnectReason disconnectReason);
-    ~TransmitStatusUpdate();
   };
 
   struct TransmitStatus {
@@ -83,15 +203,112 @@ private:
   struct OutboundPacket {
     uint32_t transmit_time;
     Packet packet;
+    MQTTCore::MessageTrace trace;
+    bool acked;      // while a resend is still being written
+    uint8_t txClass; // where a held publish goes once released
+    uint16_t conflated; // topic index while it may still be replaced
+    bool expired;       // settled, waiting to be swept from its queue
+    bool replayed;      // from the offline store's uncommitted batch
+    bool journaled;     // in the session journal until its final ack
+    ExpiryLink expiry;  // in the wheel until the first write
 
     template <typename... Args>
     OutboundPacket(uint32_t t, MQTTCore::MQTTErrors &error, Args &&...args)
-        : transmit_time(t), packet(error, std::forward<Args>(args)...){};
+        : transmit_time(t), packet(error, std::forward<Args>(args)...),
+          acked(false), txClass(0), conflated(TopicHandle::NONE),
+          expired(false), replayed(false), journaled(false){};
   };
 
+  static constexpr uint8_t NO_CLASS = 0xFF;
+  // Stands in for a class in _active while a resend is being written
+  static constexpr uint8_t IN_FLIGHT = MQTT_TX_CLASSES;
+
+  template <typename... Args>
+  Buffer<OutboundPacket>::Iterator _enqueue(Buffer<OutboundPacket> &queue,
+                                            Args &&...args);
+  template <typename Payload>
+  uint16_t _queuePublish(const char *topic, uint8_t qos, bool retain,
+                         Payload payload, size_t length, uint32_t ttlMs);
+  // Settles a publish whose deadline passed: its completion and packet id
+  // are released and it is marked for removal.
+  void _expire(OutboundPacket &packet);
+  // Called before a packet is written or discarded unsent.
+  void _leaveQueue(OutboundPacket &packet);
+  // A replayed publish is settled once acked, journaled, written at QoS 0
+  // or given up on; until then the offline store keeps it.
+  void _settleReplayed(OutboundPacket &packet);
+  void _endConflation(OutboundPacket &packet);
+  static bool _queueStored(const OfflineStore::Message &message,
+                           void *transmitter);
+  // Applies the pressure level's policy to a new publish: true when it
+  // was refused, conflated or stored instead of queued, with what
+  // publish() returns in result.
+  bool _shed(const char *topic, uint8_t qos, bool retain,
+             const uint8_t *payload, size_t length, uint32_t ttlMs,
+             bool spill, uint16_t &result);
+  bool _refuse(uint8_t qos);
+  // Replaces the unsent QoS 0 message on topic with this one.
+  bool _conflateUnsent(const char *topic, bool retain, const uint8_t *payload,
+                       size_t length, uint32_t ttlMs);
+  // Puts the publishes in _unconfirmed back at the front of their class
+  // queues, in the order they were written.
+  void _rollBack();
+  // Recovers the journal and puts its unacked messages back in flight.
+  void _openSession();
+  // Once the journal is due, rewrites it from the journaled packets still
+  // queued.
+  void _compactSession();
+  // Holds, drops or conflates a publish its rule has no tokens for.
+  template <typename... Args>
+  bool _shape(uint8_t rule, uint8_t txClass, Args &&...args);
+  void _discardHeld(uint8_t rule, Buffer<OutboundPacket>::Iterator &it);
+  uint8_t _classify(const char *topic, uint8_t qos) const;
+  uint32_t _quantum(uint8_t txClass) const;
+  // Class whose next packet goes out: CONTROL first, then deficit round
+  // robin over the publish classes. NO_CLASS when nothing is unsent.
+  uint8_t _selectClass();
+  Buffer<OutboundPacket> &_queueOf(uint8_t source);
+
   Transport *_transport;
-  Buffer<OutboundPacket> transmitBuffer;
+  // Never-sent packets, one queue per class
+  Buffer<OutboundPacket> _queues[MQTT_TX_CLASSES];
+  size_t _depth[MQTT_TX_CLASSES];
+  // Sent and waiting for an ack, oldest first. Nodes ahead of the cursor
+  // wait; the cursor and everything after it are due to be sent again.
+  Buffer<OutboundPacket> _inFlight;
+  size_t _inFlightCount;
+  // Publishes waiting for their shaping rule's tokens, one queue per rule
+  Shaper _shaper;
+  Buffer<OutboundPacket> _held[Shaper::RULES];
+  size_t _heldCount;
+  struct ConflatedTopic {
+    std::string topic;
+    OutboundPacket *pending; // its unsent message, wherever it is queued
+  };
+  ConflatedTopic _conflated[MQTT_CONFLATED_TOPICS];
+  uint16_t _conflatedCount;
+  uint32_t _conflations;
+  OutboundPacket *_lastQueued; // set by _enqueue()
+  // Deadlines of unsent publishes with a time-to-live
+  ExpiryWheel _expiry;
+  uint32_t _expired;
+  std::unique_ptr<OfflineStore> _store;
+  size_t _replayQueued; // replayed packets not settled yet
+  std::unique_ptr<SessionStore> _session;
+  InboundIds _inbound;
+  PressureMonitor _pressure;
+  // A pipelined CONNECT is out and its CONNACK has not arrived
+  bool _pipelining;
+  // QoS 0 publishes written while _pipelining; txClass is where each goes
+  // back to
+  Buffer<OutboundPacket> _unconfirmed;
+  PipelineStats _pipeline;
+  uint32_t _deficit[MQTT_TX_CLASSES];
+  uint8_t _active; // class of the packet being written, or IN_FLIGHT
+  uint8_t _roundRobin;
+  bool _granted; // _roundRobin already got its quantum this turn
   TransmitStatus _transmitStatus;
+  uint32_t _pingSentUs;
   transmit_registry _registry;
 };
 
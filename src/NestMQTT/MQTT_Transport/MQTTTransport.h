@@ -1,20 +1,72 @@
 #ifndef MQTT_TRANSPORT_H_
 #define MQTT_TRANSPORT_H_
 
-#include <stddef.h> 
-#include <IPAddress.h>
+#include <stddef.h>
+#include "MQTTConfig.h"
+#include "MQTTPlatform.h"
+#include <stdint.h>
 
 namespace MQTTTransport{
 
+enum Readiness : uint8_t {
+  READY_NONE = 0,
+  READY_READ = 1 << 0,
+  READY_WRITE = 1 << 1,
+  READY_ERROR = 1 << 2,
+  READY_WAKE = 1 << 3 // the wakeup notification fired
+};
+
+// One address for Transport::connectAny().
+struct Endpoint {
+  const char* host;
+  uint16_t port;
+  bool failed; // set by connectAny() when the attempt failed or timed out
+};
+
 class Transport {
  public:
-  virtual bool connect(IPAddress ip, uint16_t port) = 0;
+  virtual ~Transport() = default;
+  virtual bool connect(MQTTPlatform::IPv4Address ip, uint16_t port) = 0;
   virtual bool connect(const char* host, uint16_t port) = 0;
   virtual size_t write(const uint8_t* buf, size_t size) = 0;
+  // Returns the bytes read, 0 when nothing is available, -1 on error
   virtual int read(uint8_t* buf, size_t size) = 0;
   virtual void stop() = 0;
   virtual bool connected() = 0;
   virtual bool disconnected() = 0;
+  // Opens a connection to one of count endpoints, preferring them in
+  // order, and returns its index or -1. Transports that can hold several
+  // attempts at once start each next one staggerMs after the previous
+  // unless that one already failed, and keep the first to complete; the
+  // others try the endpoints one after another.
+  virtual int connectAny(Endpoint* endpoints, size_t count,
+                         uint32_t staggerMs) {
+    (void)staggerMs;
+    for (size_t i = 0; i < count; ++i) {
+      if (connect(endpoints[i].host, endpoints[i].port)) {
+        return static_cast<int>(i);
+      }
+      endpoints[i].failed = true;
+    }
+    return -1;
+  }
+  // Waits up to timeoutMs for any of the READY_* conditions in interest, or
+  // for wakeup to be notified, and returns those that hold; READY_ERROR is
+  // reported regardless of interest.
+  // Transports without an event source report themselves always ready, so
+  // callers fall back to polling; with a wakeup they sleep on it for at most
+  // MQTT_POLL_INTERVAL_MS first.
+  virtual uint8_t waitReady(uint8_t interest, uint32_t timeoutMs,
+                            MQTTPlatform::Notification* wakeup = nullptr) {
+    uint8_t ready = interest & (READY_READ | READY_WRITE);
+    if (wakeup
+        && wakeup->wait(timeoutMs < MQTT_POLL_INTERVAL_MS
+                            ? timeoutMs
+                            : MQTT_POLL_INTERVAL_MS)) {
+      ready |= READY_WAKE;
+    }
+    return ready;
+  }
 };
 
 
@@ -24,4 +76,4 @@ class Transport {
 
 
 
-#endif
\ No newline at end of file
+#endif
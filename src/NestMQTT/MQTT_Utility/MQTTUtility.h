@@ -31,7 +31,7 @@ public:
     }
   }
 
-  const char *disconnectReasonToString(DisconnectReason reason) {
+  static const char *disconnectReasonToString(DisconnectReason reason) {
     switch (reason) {
       case DisconnectReason::USER_OK:
         return "No error";
@@ -54,7 +54,8 @@ public:
     }
   }
 
-  const char *subscribeReturncodeToString(SubscribeReturncode returnCode) {
+  static const char *subscribeReturncodeToString(
+      SubscribeReturncode returnCode) {
     switch (returnCode) {
       case SubscribeReturncode::QOS0:
         return "QoS 0";
@@ -106,6 +107,26 @@ public:
     return remainingLength;
   }
 
+  // Bounded variant for stream parsing: returns the number of length bytes
+  // consumed, 0 if more input is needed, -1 if the encoding is malformed.
+  static int decodeRemainingLength(const uint8_t *stream, size_t available,
+                                   uint32_t &remainingLength) {
+    uint32_t multiplier = 1;
+    remainingLength = 0;
+
+    for (size_t i = 0; i < 4; ++i) {
+      if (i >= available)
+        return 0;
+      uint8_t encodedByte = stream[i];
+      remainingLength += (encodedByte & 127) * multiplier;
+      if ((encodedByte & 128) == 0)
+        return static_cast<int>(i + 1);
+      multiplier *= 128;
+    }
+    mqtt_log(MQTTErrors::MALFORMED_REMAINING_LENGTH);
+    return -1;
+  }
+
   static uint8_t remainingLengthFieldSize(uint32_t remainingLength) {
     if (remainingLength < 128)
       return 1;
@@ -144,6 +165,83 @@ public:
     data[position++] = value & 0xFF;
   }
 
+  static uint16_t readTwoBytes(const uint8_t *data, size_t &position) {
+    uint16_t value = (static_cast<uint16_t>(data[position]) << 8)
+                     | data[position + 1];
+    position += 2;
+    return value;
+  }
+
+  // MQTT 3.1.1 topic filter matching ('+' one level, '#' trailing levels).
+  // Wildcards at the first level do not match topics starting with '$'.
+  static bool topicMatches(const char *filter, const char *topic) {
+    if ((*filter == '+' || *filter == '#') && *topic == '$')
+      return false;
+
+    while (*filter) {
+      if (*filter == '#')
+        return true;
+      if (*filter == '+') {
+        while (*topic && *topic != '/')
+          ++topic;
+        ++filter;
+      } else {
+        while (*filter && *filter != '/') {
+          if (*filter++ != *topic++)
+            return false;
+        }
+        if (*topic && *topic != '/')
+          return false;
+      }
+      if (!*filter)
+        return !*topic;
+      // filter is at '/'
+      if (!*topic) {
+        // "a/#" also matches the parent level "a"
+        return filter[1] == '#' && filter[2] == '\0';
+      }
+      ++filter;
+      ++topic;
+    }
+    return !*topic;
+  }
+
+  // CRC-32 (IEEE 802.3, as zlib). Pass the previous result as crc to
+  // continue over data that arrives in pieces.
+  static uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0) {
+    static const uint32_t nibbles[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+      crc ^= data[i];
+      crc = (crc >> 4) ^ nibbles[crc & 0x0F];
+      crc = (crc >> 4) ^ nibbles[crc & 0x0F];
+    }
+    return ~crc;
+  }
+
+  // Little-endian fields of the logs kept on the data partition.
+  static void putLE16(uint8_t *out, uint16_t value) {
+    out[0] = static_cast<uint8_t>(value);
+    out[1] = static_cast<uint8_t>(value >> 8);
+  }
+
+  static void putLE32(uint8_t *out, uint32_t value) {
+    putLE16(out, static_cast<uint16_t>(value));
+    putLE16(out + 2, static_cast<uint16_t>(value >> 16));
+  }
+
+  static uint16_t getLE16(const uint8_t *in) {
+    return static_cast<uint16_t>(in[0] | (in[1] << 8));
+  }
+
+  static uint32_t getLE32(const uint8_t *in) {
+    return getLE16(in) | (static_cast<uint32_t>(getLE16(in + 2)) << 16);
+  }
+
   static size_t fillRemainingLength(uint8_t *data, size_t length) {
     size_t index = 0;
     do {